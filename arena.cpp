@@ -0,0 +1,61 @@
+#include <cstdlib>
+#include <algorithm>
+#include "arena.h"
+
+Arena::Arena(size_t block_size) : current(0), offset(0), block_size(block_size), used_bytes(0), total_bytes(0), heap_blocks(0) {}
+
+Arena::~Arena() {
+    for (size_t b = 0; b < blocks.size(); b++) free(blocks[b].data);
+}
+
+void *Arena::allocate(size_t bytes, size_t align) {
+    for (;;) {
+        if (current < blocks.size()) {
+            const Block &block = blocks[current];
+            const uintptr_t base = reinterpret_cast<uintptr_t>(block.data);
+            const size_t start = ((base + offset + align - 1) & ~uintptr_t(align - 1)) - base;
+            if (start + bytes <= block.size) {
+                used_bytes += start + bytes - offset;
+                total_bytes += bytes;
+                offset = start + bytes;
+                return block.data + start;
+            }
+            if (current + 1 < blocks.size()) { // the next free block, or a new one
+                current++;
+                offset = 0;
+                continue;
+            }
+        }
+        const Block block = {static_cast<char *>(malloc(std::max(block_size, bytes + align))), std::max(block_size, bytes + align)};
+        if (!block.data) return nullptr;
+        heap_blocks++;
+        blocks.push_back(block);
+        current = blocks.size() - 1;
+        offset = 0;
+    }
+}
+
+void Arena::reset() {
+    if (blocks.size() > 1) { // one block as large as all of them, the next tiles fit in it
+        size_t size = 0;
+        for (size_t b = 0; b < blocks.size(); b++) {
+            size += blocks[b].size;
+            free(blocks[b].data);
+        }
+        blocks.clear();
+        const Block block = {static_cast<char *>(malloc(size)), size};
+        if (block.data) {
+            heap_blocks++;
+            blocks.push_back(block);
+        }
+    }
+    current = 0;
+    offset = 0;
+    used_bytes = 0;
+    total_bytes = 0;
+}
+
+Arena &thread_arena() {
+    static thread_local Arena arena;
+    return arena;
+}
@@ -0,0 +1,61 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Bump allocator for the transient data of the render loop. Memory is only given back all at once, by
+// reset() at the end of every tile (parallel_for_tiles does it) or by an ArenaScope. reset() merges the
+// blocks used by the tile into one, so after the first tiles the loop does not touch the heap any more.
+// Only for trivially destructible types: nothing is ever destroyed.
+class Arena {
+public:
+    explicit Arena(size_t block_size = 64 << 10);
+    ~Arena();
+
+    void *allocate(size_t bytes, size_t align = 16);
+    template<typename T> T *alloc(size_t n) { // uninitialized
+        return static_cast<T *>(allocate(n * sizeof(T), alignof(T) > 16 ? alignof(T) : 16));
+    }
+
+    void reset();
+
+    size_t used() const { return used_bytes; }       // live bytes since the last reset
+    size_t allocated() const { return total_bytes; } // bytes handed out since the last reset
+    uint64_t blocks_allocated() const { return heap_blocks; } // heap allocations since the arena was created
+
+private:
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+
+    struct Block {
+        char *data;
+        size_t size;
+    };
+    std::vector<Block> blocks; // blocks[current] is being filled, the ones after it are free
+    size_t current, offset;
+    size_t block_size;
+    size_t used_bytes, total_bytes;
+    uint64_t heap_blocks;
+
+    friend class ArenaScope;
+};
+
+Arena &thread_arena(); // one per thread
+
+// Gives back on destruction what was allocated from the arena during its lifetime.
+class ArenaScope {
+public:
+    explicit ArenaScope(Arena &arena) : arena(arena), current(arena.current), offset(arena.offset), used(arena.used_bytes) {}
+    ~ArenaScope() {
+        arena.current = current;
+        arena.offset = offset;
+        arena.used_bytes = used;
+    }
+
+private:
+    Arena &arena;
+    const size_t current, offset, used;
+};
+
+#endif //__ARENA_H__
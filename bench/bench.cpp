@@ -0,0 +1,299 @@
+// Benchmark harness: renders reproducible scenes and reports timings and rays/sec as JSON on stdout.
+//   bench [--scene snowman|spheres|mesh|primitives|crowd|lights|all] [--width W] [--height H] [--frames N] [--envmap path.jpg]
+//         [--light-samples N]    lights sampled per hit in many-light scenes, 0 loops over all of them
+//         [--fast-shading]       batched light vectors and fast pow
+//         [--wavefront]          queue-based integrator (wavefront.h) instead of the packet megakernel
+//         [--gpu]                offloaded back-end (gpu.h), for the scenes it supports
+//         [--grid]               uniform grids instead of BVHs over the spheres and the instanced objects
+//         [--qbvh]               4-wide quantized BVHs instead (qbvh.h)
+//         [--bvh sweep|binned|lbvh]  BVH builder (bvh.h), its time is reported apart as accel_build_ms
+//         [--golden DIR]         compares the image of every scene with DIR/<scene>_<W>x<H>.pfm
+//         [--baseline FILE]      and its total rays/sec with the ones of FILE, lines "<scene>_<W>x<H> <Mrays/s>"
+//         [--tolerance E]        largest RMSE over the colors clamped to [0, 1] (0.005 by default)
+//         [--slack F]            fraction of the baseline rays/sec that may be lost (0.1 by default)
+//         [--record]             writes the golden images and the baseline instead of checking them
+// The exit status is 1 if a check failed: the golden images and baselines of a machine turn the benchmark
+// into a regression test of optimizations that must not change the pictures, nor slow them down.
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "scene.h"
+#include "scenes.h"
+#include "render.h"
+#include "wavefront.h"
+#include "gpu.h"
+#include "envmap.h"
+#include "tonemap.h"
+#include "image_writer.h"
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    double ms_since(Clock::time_point t0) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    }
+
+    struct BenchOptions {
+        std::string scene;
+        int width, height, frames;
+        const char *envmap;
+        int light_samples;
+        bool fast_shading;
+        bool wavefront, gpu;
+        bool grid, qbvh;
+        BVHBuilder bvh_builder;
+        std::string golden, baseline; // directory, file; empty for no check
+        float tolerance, slack;
+        bool record;
+    };
+
+    // Mrays/s by "<scene>_<W>x<H>", what --baseline reads and --record writes
+    typedef std::map<std::string, double> Baselines;
+
+    Baselines read_baselines(const std::string &filename) {
+        Baselines baselines;
+        std::ifstream in(filename.c_str());
+        std::string key;
+        double mrays;
+        while (in >> key >> mrays) baselines[key] = mrays;
+        return baselines;
+    }
+
+    bool write_baselines(const std::string &filename, const Baselines &baselines) {
+        std::ofstream out(filename.c_str());
+        for (Baselines::const_iterator it = baselines.begin(); it != baselines.end(); ++it) out << it->first << " " << it->second << "\n";
+        return bool(out);
+    }
+
+    // root mean square of the differences of the displayed colors, and the largest one
+    void image_error(const std::vector<Vec3f> &a, const std::vector<Vec3f> &b, double &rmse, float &largest) {
+        double sum = 0;
+        largest = 0;
+        for (size_t p = 0; p < a.size(); p++) {
+            for (size_t c = 0; c < 3; c++) {
+                const float d = std::min(1.f, std::max(0.f, a[p][c])) - std::min(1.f, std::max(0.f, b[p][c]));
+                sum += d * d;
+                largest = std::max(largest, std::fabs(d));
+            }
+        }
+        rmse = a.empty() ? 0 : std::sqrt(sum / (3 * a.size()));
+    }
+
+    // fills the scene named `name`, returns false for an unknown name
+    bool make_scene(const std::string &name, Scene &scene) {
+        if (name == "snowman") {
+            build_snowman(scene);
+        } else if (name == "spheres") {
+            build_sphere_field(scene, 10000);
+        } else if (name == "primitives") {
+            build_dressed_snowman(scene);
+        } else if (name == "lights") {
+            build_snowman_crowd(scene, 100);
+            add_light_field(scene, 4000);
+        } else if (name == "crowd") {
+            build_snowman_crowd(scene, 10000);
+        } else if (name == "mesh") {
+            build_snowman(scene);
+            scene.meshes.push_back(make_torus(Vec3f(-3, 1, -14), 3, 1, 400, 250)); // 200k triangles
+            scene.mesh_materials.push_back(scene.add_material(Material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.4, 0.4, 0.3), 10.)));
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // returns false if a check of --golden or --baseline failed
+    bool bench_scene(const std::string &name, const BenchOptions &opt, const EnvironmentMap *envmap, Baselines &baselines, bool last) {
+        Clock::time_point t0 = Clock::now();
+        Scene scene;
+        scene.envmap = envmap;
+        make_scene(name, scene);
+        scene.light_samples = opt.light_samples;
+        scene.fast_shading = opt.fast_shading;
+        scene.sphere_accel = opt.grid ? ACCEL_GRID : opt.qbvh ? ACCEL_QBVH : ACCEL_BVH;
+        scene.bvh_builder = opt.bvh_builder;
+        for (size_t i = 0; i < scene.objects.size(); i++) scene.objects[i].accel = scene.sphere_accel;
+        const Clock::time_point build_start = Clock::now();
+        scene.build();
+        const double accel_build_ms = ms_since(build_start);
+        std::string unsupported;
+        std::unique_ptr<GpuRenderer> gpu;
+        if (opt.gpu && GpuRenderer::supports(scene, unsupported)) gpu.reset(new GpuRenderer(scene)); // the upload counts as build
+        const double build_ms = ms_since(t0);
+        const char *integrator = gpu ? "gpu" : opt.wavefront ? "wavefront" : "packet";
+
+        std::vector<Vec3f> framebuffer;
+        std::vector<unsigned char> pixmap;
+        double trace_ms = 0, post_ms = 0;
+        reset_ray_counters();
+        for (int f = 0; f < opt.frames; f++) {
+            t0 = Clock::now();
+            if (gpu) gpu->render(scene, opt.width, opt.height, framebuffer);
+            else if (opt.wavefront) render_wavefront(scene, opt.width, opt.height, framebuffer);
+            else render(scene, opt.width, opt.height, framebuffer);
+            trace_ms += ms_since(t0);
+            t0 = Clock::now();
+            tonemap(framebuffer, pixmap);
+            post_ms += ms_since(t0);
+        }
+        const RayCounters rays = total_ray_counters();
+        const double seconds = trace_ms * 1e-3;
+        const uint64_t total = rays.primary + rays.secondary + rays.shadow;
+
+        const std::string key = name + "_" + std::to_string(opt.width) + "x" + std::to_string(opt.height);
+        std::string checks; // JSON fields of the checks
+        bool passed = true;
+        if (!opt.golden.empty()) {
+            const std::string file = opt.golden + "/" + key + ".pfm";
+            std::vector<unsigned char> unused;
+            std::vector<Vec3f> golden;
+            std::string error;
+            if (opt.record) {
+                AsyncImageWriter writer(file, opt.width, opt.height, nullptr, framebuffer.data());
+                writer.all_done();
+                passed = writer.wait();
+                if (!passed) std::cerr << "Error: can not write " << file << std::endl;
+                checks += ", \"golden\": \"recorded\"";
+            } else if (!read_image(file, opt.width, opt.height, unused, golden, error)) {
+                std::cerr << "Error: " << error << std::endl;
+                passed = false;
+                checks += ", \"golden\": \"missing\"";
+            } else {
+                double rmse;
+                float largest;
+                image_error(framebuffer, golden, rmse, largest);
+                passed = rmse <= opt.tolerance;
+                if (!passed) std::cerr << "FAIL " << key << ": RMSE " << rmse << " above " << opt.tolerance << std::endl;
+                checks += ", \"golden\": {\"rmse\": " + std::to_string(rmse) + ", \"max_error\": " + std::to_string(largest) +
+                          ", \"ok\": " + (passed ? "true" : "false") + "}";
+            }
+        }
+        if (!opt.baseline.empty()) {
+            const double mrays = total / seconds * 1e-6;
+            if (opt.record) {
+                baselines[key] = mrays;
+                checks += ", \"baseline\": \"recorded\"";
+            } else if (!baselines.count(key)) {
+                std::cerr << "Error: no baseline for " << key << " in " << opt.baseline << std::endl;
+                passed = false;
+                checks += ", \"baseline\": \"missing\"";
+            } else {
+                const bool fast_enough = mrays >= baselines[key] * (1 - opt.slack);
+                if (!fast_enough)
+                    std::cerr << "FAIL " << key << ": " << mrays << " Mrays/s, baseline " << baselines[key] << std::endl;
+                passed &= fast_enough;
+                checks += ", \"baseline\": {\"mrays_per_sec\": " + std::to_string(baselines[key]) + ", \"ok\": " +
+                          (fast_enough ? "true" : "false") + "}";
+            }
+        }
+
+        std::cout << "    {\"scene\": \"" << name << "\", \"spheres\": " << scene.spheres.size()
+                  << ", \"instances\": " << scene.instances.size()
+                  << ", \"meshes\": " << scene.meshes.size() << ", \"lights\": " << scene.lights.size()
+                  << ", \"sampled_lights\": " << (scene.samples_lights() ? "true" : "false")
+                  << ", \"integrator\": \"" << integrator << "\", \"accel\": \"" << (opt.grid ? "grid" : opt.qbvh ? "qbvh" : "bvh")
+                  << "\", \"bvh_builder\": \"" << bvh_builder_name(opt.bvh_builder) << "\", \"frames\": " << opt.frames
+                  << ",\n     \"build_ms\": " << build_ms << ", \"accel_build_ms\": " << accel_build_ms << ", \"trace_ms_per_frame\": " << trace_ms / opt.frames
+                  << ", \"post_ms_per_frame\": " << post_ms / opt.frames
+                  << ",\n     \"rays\": {\"primary\": " << rays.primary << ", \"secondary\": " << rays.secondary
+                  << ", \"shadow\": " << rays.shadow << ", \"total\": " << total << "}"
+                  << ",\n     \"mrays_per_sec\": {\"primary\": " << rays.primary / seconds * 1e-6
+                  << ", \"secondary\": " << rays.secondary / seconds * 1e-6
+                  << ", \"shadow\": " << rays.shadow / seconds * 1e-6
+                  << ", \"total\": " << total / seconds * 1e-6 << "}" << checks << "}" << (last ? "" : ",") << std::endl;
+        return passed;
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opt = {"all", 640, 384, 3, "../envmap.jpg", 1, false, false, false, false, false, BVH_BINNED, "", "", .005f, .1f, false};
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--scene" && has_value) opt.scene = argv[++i];
+        else if (arg == "--width" && has_value) opt.width = atoi(argv[++i]);
+        else if (arg == "--height" && has_value) opt.height = atoi(argv[++i]);
+        else if (arg == "--frames" && has_value) opt.frames = atoi(argv[++i]);
+        else if (arg == "--envmap" && has_value) opt.envmap = argv[++i];
+        else if (arg == "--light-samples" && has_value) opt.light_samples = atoi(argv[++i]);
+        else if (arg == "--fast-shading") opt.fast_shading = true;
+        else if (arg == "--wavefront") opt.wavefront = true;
+        else if (arg == "--gpu") opt.gpu = true;
+        else if (arg == "--grid") opt.grid = true;
+        else if (arg == "--qbvh") opt.qbvh = true;
+        else if (arg == "--golden" && has_value) opt.golden = argv[++i];
+        else if (arg == "--baseline" && has_value) opt.baseline = argv[++i];
+        else if (arg == "--tolerance" && has_value) opt.tolerance = static_cast<float>(atof(argv[++i]));
+        else if (arg == "--slack" && has_value) opt.slack = static_cast<float>(atof(argv[++i]));
+        else if (arg == "--record") opt.record = true;
+        else if (arg == "--bvh" && has_value) {
+            if (!parse_bvh_builder(argv[++i], opt.bvh_builder)) {
+                std::cerr << "Error: --bvh sweep|binned|lbvh" << std::endl;
+                return -1;
+            }
+        }
+        else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--scene snowman|spheres|mesh|primitives|crowd|lights|all] [--width W] [--height H] [--frames N] [--envmap file|none]"
+                      << " [--light-samples N] [--fast-shading] [--wavefront] [--gpu] [--grid] [--qbvh] [--bvh sweep|binned|lbvh]"
+                      << " [--golden DIR] [--baseline FILE] [--tolerance E] [--slack F] [--record]" << std::endl;
+            return -1;
+        }
+    }
+    if (opt.width <= 0 || opt.height <= 0 || opt.frames <= 0) {
+        std::cerr << "Error: width, height and frames must be positive" << std::endl;
+        return -1;
+    }
+
+    std::vector<std::string> names;
+    if (opt.scene == "all") {
+        names.push_back("snowman");
+        names.push_back("spheres");
+        names.push_back("mesh");
+        names.push_back("primitives");
+        names.push_back("crowd");
+        names.push_back("lights");
+    } else {
+        Scene probe;
+        if (!make_scene(opt.scene, probe)) {
+            std::cerr << "Error: unknown scene " << opt.scene << std::endl;
+            return -1;
+        }
+        names.push_back(opt.scene);
+    }
+
+    EnvironmentMap envmap; // without an envmap the background is a plain color
+    double envmap_ms = 0;
+    if (strcmp(opt.envmap, "none")) {
+        Clock::time_point t0 = Clock::now();
+        std::string error;
+        if (!envmap.load(opt.envmap, TEXELS_FLOAT, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return -1;
+        }
+        envmap_ms = ms_since(t0);
+    }
+
+    std::cout << "{\"width\": " << opt.width << ", \"height\": " << opt.height
+              << ", \"sphere_kernel\": \"" << sphere_kernel_name() << "\", \"triangle_kernel\": \"" << triangle_kernel_name() << "\", \"envmap_ms\": " << envmap_ms
+              << ",\n  \"scenes\": [" << std::endl;
+    Baselines baselines;
+    if (!opt.baseline.empty()) baselines = read_baselines(opt.baseline); // kept by --record for the other sizes
+    bool passed = true;
+    for (size_t i = 0; i < names.size(); i++)
+        passed &= bench_scene(names[i], opt, envmap.empty() ? nullptr : &envmap, baselines, i + 1 == names.size());
+    std::cout << "]}" << std::endl;
+    if (opt.record && !opt.baseline.empty() && !write_baselines(opt.baseline, baselines)) {
+        std::cerr << "Error: can not write " << opt.baseline << std::endl;
+        return 1;
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+// Microbenchmarks of the kernels under the renderers, on synthetic batches of rays: every kernel is timed
+// alone on the same rays, without the traversal, the scheduling and the rest of the frame around it.
+// Results as JSON on stdout, in nanoseconds and millions per second of the operation of each kernel.
+//   microbench [--kernel NAME|all]  sphere, sphere_soa, triangle, checkerboard, reflect, refract, envmap, shading, fast_shading
+//              [--rays N]           rays of the batch (4096)
+//              [--coherence C]      1: every ray has the same direction, 0: uniform over the sphere (0.9)
+//              [--spheres N]        spheres, or triangles, tested by every ray (64)
+//              [--lights N]         point lights of the shading kernels (16)
+//              [--ms T]             shortest measurement of a kernel, in milliseconds (200)
+//              [--envmap path.jpg|none]
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "scene.h"
+#include "render.h"
+#include "envmap.h"
+#include "sphere_soa.h"
+#include "triangle_soa.h"
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    struct MicroOptions {
+        std::string kernel;
+        int rays;
+        float coherence;
+        int spheres, lights;
+        double ms;
+        const char *envmap;
+    };
+
+    // uniform in [0, 1), deterministic so that every run times the same batch
+    float uniform(uint32_t &state) {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (1.f / 16777216.f);
+    }
+
+    Vec3f random_direction(uint32_t &state) {
+        const float z = 2 * uniform(state) - 1, phi = float(2 * M_PI) * uniform(state);
+        const float r = std::sqrt(std::max(0.f, 1 - z * z));
+        return Vec3f(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    // the rays leave the camera towards -z, spread around it the less coherent they are
+    struct RayBatch {
+        std::vector<Vec3f> orig, dir;
+
+        RayBatch(const int n, const float coherence) : orig(n), dir(n) {
+            uint32_t state = 1;
+            for (int i = 0; i < n; i++) {
+                orig[i] = Vec3f(uniform(state) - .5f, uniform(state) - .5f, 0);
+                dir[i] = (Vec3f(0, 0, -1) * coherence + random_direction(state) * (1 - coherence)).normalize();
+            }
+        }
+    };
+
+    // Runs pass (one call per ray of the batch) until opt.ms have passed, returns the nanoseconds per call.
+    // The results are summed into sink, so that the compiler can not drop the work.
+    template<typename Pass> double time_kernel(const MicroOptions &opt, Pass pass, double &sink) {
+        sink += pass(); // warm up the caches and the kernel selection
+        size_t calls = 0;
+        const Clock::time_point t0 = Clock::now();
+        double elapsed = 0;
+        while (elapsed < opt.ms) {
+            sink += pass();
+            calls += opt.rays;
+            elapsed = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+        }
+        return elapsed * 1e6 / calls;
+    }
+
+    void report(const std::string &name, const char *unit, const double ns_per_ray, const double ops_per_ray, bool &first) {
+        std::cout << (first ? "" : ",\n") << "    {\"kernel\": \"" << name << "\", \"ns_per_ray\": " << ns_per_ray
+                  << ", \"m" << unit << "_per_sec\": " << ops_per_ray / ns_per_ray * 1e3 << "}";
+        first = false;
+    }
+
+    bool wanted(const MicroOptions &opt, const char *name) {
+        return opt.kernel == "all" || opt.kernel == name;
+    }
+}
+
+int main(int argc, char **argv) {
+    MicroOptions opt = {"all", 4096, .9f, 64, 16, 200, "../envmap.jpg"};
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--kernel" && has_value) opt.kernel = argv[++i];
+        else if (arg == "--rays" && has_value) opt.rays = atoi(argv[++i]);
+        else if (arg == "--coherence" && has_value) opt.coherence = std::max(0.f, std::min(1.f, float(atof(argv[++i]))));
+        else if (arg == "--spheres" && has_value) opt.spheres = atoi(argv[++i]);
+        else if (arg == "--lights" && has_value) opt.lights = atoi(argv[++i]);
+        else if (arg == "--ms" && has_value) opt.ms = atof(argv[++i]);
+        else if (arg == "--envmap" && has_value) opt.envmap = argv[++i];
+        else {
+            std::cerr << "usage: " << argv[0] << " [--kernel sphere|sphere_soa|triangle|checkerboard|reflect|refract|envmap|shading|"
+                      << "fast_shading|all] [--rays N] [--coherence C] [--spheres N] [--lights N] [--ms T] [--envmap file|none]"
+                      << std::endl;
+            return -1;
+        }
+    }
+    if (opt.rays <= 0 || opt.spheres <= 0 || opt.lights <= 0 || opt.ms <= 0) {
+        std::cerr << "Error: rays, spheres, lights and ms must be positive" << std::endl;
+        return -1;
+    }
+
+    const RayBatch batch(opt.rays, opt.coherence);
+    const int n = opt.rays;
+    double sink = 0;
+    bool first = true;
+    std::cout << "{\"rays\": " << n << ", \"coherence\": " << opt.coherence << ", \"spheres\": " << opt.spheres
+              << ", \"lights\": " << opt.lights << ", \"sphere_kernel\": \"" << sphere_kernel_name()
+              << "\", \"triangle_kernel\": \"" << triangle_kernel_name() << "\",\n  \"kernels\": [" << std::endl;
+
+    // spheres scattered in front of the camera, about the size of the snowman's
+    uint32_t state = 7;
+    std::vector<Sphere> spheres;
+    for (int s = 0; s < opt.spheres; s++)
+        spheres.push_back(Sphere(Vec3f(8 * uniform(state) - 4, 8 * uniform(state) - 4, -10 - 10 * uniform(state)),
+                                 .2f + uniform(state), 0));
+    if (wanted(opt, "sphere")) { // the scalar test, sphere after sphere
+        const double ns = time_kernel(opt, [&]() {
+            float closest = 0;
+            for (int r = 0; r < n; r++) {
+                float tmin = std::numeric_limits<float>::max(), t;
+                for (size_t s = 0; s < spheres.size(); s++)
+                    if (spheres[s].ray_intersect(batch.orig[r], batch.dir[r], t) && t < tmin) tmin = t;
+                closest += tmin < 1e30f;
+            }
+            return closest;
+        }, sink);
+        report("sphere", "tests", ns, opt.spheres, first);
+    }
+    if (wanted(opt, "sphere_soa")) { // the SIMD kernel of the BVH leaves, all the spheres in one range
+        SphereSoA soa;
+        for (size_t s = 0; s < spheres.size(); s++) soa.push_back(spheres[s].center, spheres[s].radius, 0, static_cast<int>(s));
+        soa.finalize();
+        const SphereKernel kernel = sphere_kernel();
+        const double ns = time_kernel(opt, [&]() {
+            float closest = 0;
+            for (int r = 0; r < n; r++) {
+                float tmax = std::numeric_limits<float>::max();
+                closest += kernel(soa, 0, opt.spheres, batch.orig[r], batch.dir[r], tmax) >= 0;
+            }
+            return closest;
+        }, sink);
+        report("sphere_soa", "tests", ns, opt.spheres, first);
+    }
+    if (wanted(opt, "triangle")) { // a triangle across every sphere, watertight kernel of the mesh leaves
+        std::vector<Vec3f> verts;
+        std::vector<Vec3i> faces;
+        std::vector<int> order;
+        for (size_t s = 0; s < spheres.size(); s++) {
+            const Vec3f &c = spheres[s].center;
+            const float r = spheres[s].radius;
+            verts.push_back(c + Vec3f(-r, -r, 0));
+            verts.push_back(c + Vec3f(r, -r, 0));
+            verts.push_back(c + Vec3f(0, r, r));
+            faces.push_back(Vec3i(3 * s, 3 * s + 1, 3 * s + 2));
+            order.push_back(static_cast<int>(s));
+        }
+        TriangleSoA tris;
+        tris.build(order, verts.data(), faces.data());
+        const TriangleKernel kernel = triangle_kernel();
+        const double ns = time_kernel(opt, [&]() {
+            float closest = 0;
+            for (int r = 0; r < n; r++) {
+                float tmax = std::numeric_limits<float>::max();
+                closest += kernel(tris, 0, opt.spheres, TriangleRay(batch.orig[r], batch.dir[r]), tmax) >= 0;
+            }
+            return closest;
+        }, sink);
+        report("triangle", "tests", ns, opt.spheres, first);
+    }
+    if (wanted(opt, "checkerboard")) { // the ground plane seen from the default camera
+        const Vec3f camera(3, 4, 8);
+        const double ns = time_kernel(opt, [&]() {
+            float sum = 0, d;
+            for (int r = 0; r < n; r++)
+                if (checkerboard_distance(camera, batch.dir[r], std::numeric_limits<float>::max(), d)) sum += d;
+            return sum;
+        }, sink);
+        report("checkerboard", "tests", ns, 1, first);
+    }
+    std::vector<Vec3f> normals(n);
+    for (int r = 0; r < n; r++) normals[r] = random_direction(state);
+    if (wanted(opt, "reflect")) {
+        const double ns = time_kernel(opt, [&]() {
+            float sum = 0;
+            for (int r = 0; r < n; r++) sum += reflect(batch.dir[r], normals[r]).x;
+            return sum;
+        }, sink);
+        report("reflect", "calls", ns, 1, first);
+    }
+    if (wanted(opt, "refract")) {
+        const double ns = time_kernel(opt, [&]() {
+            float sum = 0;
+            for (int r = 0; r < n; r++) sum += refract(batch.dir[r], normals[r], 1.5f).x;
+            return sum;
+        }, sink);
+        report("refract", "calls", ns, 1, first);
+    }
+    if (wanted(opt, "envmap") && strcmp(opt.envmap, "none")) {
+        EnvironmentMap envmap;
+        std::string error;
+        if (!envmap.load(opt.envmap, TEXELS_FLOAT, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return -1;
+        }
+        for (int pass = 0; pass < 2; pass++) { // the sharpest level, then the cones of the primary rays
+            const float spread = pass ? 1e-3f : 0.f;
+            const double ns = time_kernel(opt, [&]() {
+                float sum = 0;
+                for (int r = 0; r < n; r++) sum += envmap.lookup(batch.dir[r], spread).x;
+                return sum;
+            }, sink);
+            report(pass ? "envmap_filtered" : "envmap", "lookups", ns, 1, first);
+        }
+    }
+    for (int fast = 0; fast < 2; fast++) { // the lights of a hit, the shadow rays already traced
+        if (!wanted(opt, fast ? "fast_shading" : "shading")) continue;
+        Scene scene;
+        for (int l = 0; l < opt.lights; l++)
+            scene.lights.push_back(Light(Vec3f(40 * uniform(state) - 20, 20 + 10 * uniform(state), 30 * uniform(state) - 20),
+                                         1.5f / opt.lights));
+        scene.build_lights();
+        scene.fast_shading = fast != 0;
+        const Material material(1.0, Vec4f(0.75, 0.1, 0.0, 0.0), Vec3f(1.0, 1.0, 1.0), 50.);
+        const std::vector<char> shadowed(opt.lights, 0);
+        std::vector<Hit> hits(n);
+        for (int r = 0; r < n; r++) {
+            hits[r].point = batch.orig[r] + batch.dir[r] * 15;
+            hits[r].N = -batch.dir[r];
+            hits[r].material = 0;
+            hits[r].image = -1;
+            hits[r].time = 0;
+            hits[r].shadows = true;
+        }
+        const double ns = time_kernel(opt, [&]() {
+            float sum = 0;
+            for (int r = 0; r < n; r++) sum += direct_lighting(batch.dir[r], hits[r], material, scene, shadowed.data()).x;
+            return sum;
+        }, sink);
+        report(fast ? "fast_shading" : "shading", "lights", ns, opt.lights, first);
+    }
+    std::cout << "\n  ], \"checksum\": " << sink << "}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,423 @@
+#include <cstdint>
+#include <cstring>
+#include "bvh.h"
+
+namespace {
+    const char *const builder_names[] = {"sweep", "binned", "lbvh"};
+    const float traversal_cost = 1.f; // relative to one primitive test
+    const int sah_bins = 32;
+    const int task_prims = 4096;   // smaller subtrees are built by the task that reached them
+    const int chunk_prims = 65536; // larger nodes are binned by several tasks, each into its own bins
+
+    // From a node at depth with n primitives, median splits add ceil(log2(n)) levels at most: past this the
+    // SAH splits (which may peel off one primitive at a time) give way to them, so that no leaf gets deeper
+    // than bvh_stack_size - 1 and the traversal stacks can not overflow. The LBVH needs no check: its splits
+    // consume at least one of the 30 bits of the codes, then halve the equal codes.
+    bool median_from_here(const int depth, const int n) {
+        int levels = 0;
+        while ((1 << levels) < n && levels < 31) levels++;
+        return depth + levels >= bvh_stack_size - 1;
+    }
+
+    // appends the nodes of a subtree built in an array of its own: its interior offsets move with it
+    void append_subtree(std::vector<BVHNode> &nodes, const std::vector<BVHNode> &sub) {
+        const int shift = static_cast<int>(nodes.size());
+        for (size_t i = 0; i < sub.size(); i++) {
+            nodes.push_back(sub[i]);
+            if (!sub[i].count) nodes.back().offset += shift;
+        }
+    }
+
+    // Builds the two children of nodes[node_id], whose subtree spans n primitives: build_child(k, out) appends
+    // child k to out. Small subtrees go straight after the node, larger ones are built at the same time,
+    // the left child by a new task, each into an array of its own, and appended once both are done.
+    template<typename F> void build_children(std::vector<BVHNode> &nodes, const int node_id, const int n, F build_child) {
+        if (n < task_prims) {
+            build_child(0, nodes);
+            nodes[node_id].offset = static_cast<int>(nodes.size());
+            build_child(1, nodes);
+            return;
+        }
+        std::vector<BVHNode> left, right;
+#pragma omp task shared(left, build_child)
+        build_child(0, left);
+        build_child(1, right);
+#pragma omp taskwait
+        append_subtree(nodes, left);
+        nodes[node_id].offset = static_cast<int>(nodes.size());
+        append_subtree(nodes, right);
+    }
+
+    // the OpenMP team running the tasks of a build, for the builds large enough to have some
+    template<typename F> void run_build(const size_t n, F build) {
+#pragma omp parallel if (n >= size_t(task_prims))
+#pragma omp single
+        build();
+    }
+
+    void range_bounds(const std::vector<AABB> &bounds, const std::vector<Vec3f> &centroids, const std::vector<int> &prims,
+                      const int begin, const int end, AABB &box, AABB &centroid_box) {
+        box = centroid_box = AABB();
+        for (int i = begin; i < end; i++) {
+            box.expand(bounds[prims[i]]);
+            centroid_box.expand(centroids[prims[i]]);
+        }
+    }
+
+    struct Bin {
+        AABB bounds, centroids;
+        int count;
+
+        Bin() : count(0) {}
+
+        void add(const Bin &b) {
+            bounds.expand(b.bounds);
+            centroids.expand(b.centroids);
+            count += b.count;
+        }
+    };
+
+    // Binned SAH over prims, which it reorders: the leaves are ranges of it.
+    struct BinnedBuilder {
+        const std::vector<AABB> &bounds;
+        const std::vector<Vec3f> &centroids;
+        std::vector<int> &prims;
+        int max_leaf;
+
+        // bins[axis * sah_bins + b], the bin of a centroid along axis
+        int bin_of(const Vec3f &c, const int axis, const AABB &centroid_box, const float *scale) const {
+            return std::min(sah_bins - 1, static_cast<int>((c[axis] - centroid_box.min[axis]) * scale[axis]));
+        }
+
+        void bin_range(const int begin, const int end, const AABB &centroid_box, const float *scale, Bin *bins) const {
+            for (int i = begin; i < end; i++) {
+                const int p = prims[i];
+                for (int axis = 0; axis < 3; axis++) {
+                    if (scale[axis] <= 0) continue;
+                    Bin &b = bins[axis * sah_bins + bin_of(centroids[p], axis, centroid_box, scale)];
+                    b.bounds.expand(bounds[p]);
+                    b.centroids.expand(centroids[p]);
+                    b.count++;
+                }
+            }
+        }
+
+        // the subtree over prims[begin, end), bounded by box, their centroids by centroid_box
+        void build(const int begin, const int end, const AABB &box, const AABB &centroid_box, const int depth,
+                   std::vector<BVHNode> &nodes) const {
+            const int node_id = static_cast<int>(nodes.size());
+            nodes.push_back(BVHNode());
+            nodes[node_id].bounds = box;
+            const int n = end - begin;
+
+            float scale[3];
+            for (int axis = 0; axis < 3; axis++) {
+                const float extent = centroid_box.max[axis] - centroid_box.min[axis];
+                scale[axis] = extent > 0 ? sah_bins / extent : 0;
+            }
+            Bin bins[3 * sah_bins];
+            if (n < chunk_prims) {
+                bin_range(begin, end, centroid_box, scale, bins);
+            } else { // the bins of each chunk apart, then summed
+                const int chunks = (n + chunk_prims - 1) / chunk_prims;
+                std::vector<Bin> partial(size_t(chunks) * 3 * sah_bins);
+                for (int k = 0; k < chunks; k++) {
+#pragma omp task firstprivate(k) shared(partial, scale, centroid_box)
+                    bin_range(begin + k * chunk_prims, std::min(end, begin + (k + 1) * chunk_prims), centroid_box, scale,
+                              &partial[size_t(k) * 3 * sah_bins]);
+                }
+#pragma omp taskwait
+                for (int k = 0; k < chunks; k++)
+                    for (int b = 0; b < 3 * sah_bins; b++) bins[b].add(partial[size_t(k) * 3 * sah_bins + b]);
+            }
+
+            // split between bins s - 1 and s
+            float best_cost = std::numeric_limits<float>::max();
+            int best_axis = -1, best_split = -1;
+            for (int axis = 0; axis < 3; axis++) {
+                if (scale[axis] <= 0) continue;
+                const Bin *b = &bins[axis * sah_bins];
+                float right_cost[sah_bins];
+                AABB acc;
+                int count = 0;
+                for (int s = sah_bins - 1; s > 0; s--) {
+                    acc.expand(b[s].bounds);
+                    count += b[s].count;
+                    right_cost[s] = count ? acc.area() * count : -1;
+                }
+                acc = AABB();
+                count = 0;
+                for (int s = 1; s < sah_bins; s++) {
+                    acc.expand(b[s - 1].bounds);
+                    count += b[s - 1].count;
+                    if (!count || right_cost[s] < 0) continue;
+                    const float cost = acc.area() * count + right_cost[s];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = s;
+                    }
+                }
+            }
+
+            const float node_area = box.area();
+            if (node_area > 0) best_cost = traversal_cost + best_cost / node_area;
+            const bool make_leaf = best_axis < 0 || (n <= max_leaf && best_cost >= n);
+            if (make_leaf && n <= max_leaf) {
+                nodes[node_id].offset = begin;
+                nodes[node_id].count = static_cast<unsigned short>(n);
+                nodes[node_id].axis = 0;
+                return;
+            }
+
+            int mid;
+            AABB child_box[2], child_centroids[2];
+            if (make_leaf || median_from_here(depth, n)) { // all centroids coincide, or a degenerate distribution: the median
+                int axis = 0;
+                for (int a = 1; a < 3; a++)
+                    if (centroid_box.max[a] - centroid_box.min[a] > centroid_box.max[axis] - centroid_box.min[axis]) axis = a;
+                mid = begin + n / 2;
+                std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+                                 [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+                range_bounds(bounds, centroids, prims, begin, mid, child_box[0], child_centroids[0]);
+                range_bounds(bounds, centroids, prims, mid, end, child_box[1], child_centroids[1]);
+                best_axis = axis;
+            } else {
+                mid = static_cast<int>(std::partition(prims.begin() + begin, prims.begin() + end, [&](int p) {
+                    return bin_of(centroids[p], best_axis, centroid_box, scale) < best_split;
+                }) - prims.begin());
+                Bin side[2];
+                for (int b = 0; b < sah_bins; b++) side[b >= best_split].add(bins[best_axis * sah_bins + b]);
+                for (int k = 0; k < 2; k++) {
+                    child_box[k] = side[k].bounds;
+                    child_centroids[k] = side[k].centroids;
+                }
+            }
+            nodes[node_id].count = 0;
+            nodes[node_id].axis = static_cast<unsigned short>(best_axis);
+            build_children(nodes, node_id, n, [&](int k, std::vector<BVHNode> &out) {
+                build(k ? mid : begin, k ? end : mid, child_box[k], child_centroids[k], depth + 1, out);
+            });
+        }
+    };
+
+    inline int highest_bit(uint32_t x) { // of a non-zero x
+#if defined(__GNUC__)
+        return 31 - __builtin_clz(x);
+#else
+        int i = 0;
+        while (x >>= 1) i++;
+        return i;
+#endif
+    }
+
+    // the 10 bits of v spread to every third bit
+    inline uint32_t expand_bits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xff0000ffu;
+        v = (v * 0x00000101u) & 0x0f00f00fu;
+        v = (v * 0x00000011u) & 0xc30c30c3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // Linear BVH: the primitives sorted by the Morton codes of their centroids, a node split where the
+    // highest bit of its codes changes, which halves the node along the axis of that bit.
+    struct LBVHBuilder {
+        const std::vector<AABB> &bounds;
+        const std::vector<uint32_t> &codes; // of prims, sorted
+        const std::vector<int> &prims;
+        int max_leaf;
+
+        AABB build(const int begin, const int end, std::vector<BVHNode> &nodes) const {
+            const int node_id = static_cast<int>(nodes.size());
+            nodes.push_back(BVHNode());
+            const int n = end - begin;
+            if (n <= max_leaf) {
+                AABB box;
+                for (int i = begin; i < end; i++) box.expand(bounds[prims[i]]);
+                nodes[node_id].bounds = box;
+                nodes[node_id].offset = begin;
+                nodes[node_id].count = static_cast<unsigned short>(n);
+                nodes[node_id].axis = 0;
+                return box;
+            }
+            int mid = begin + n / 2, axis = 0; // equal codes are split in the middle
+            const uint32_t differ = codes[begin] ^ codes[end - 1];
+            if (differ) {
+                const int bit = highest_bit(differ);
+                axis = 2 - bit % 3; // x, y, z from the highest bit of a triple down
+                const uint32_t first = (codes[begin] >> bit | 1u) << bit; // the common prefix, then the bit set
+                mid = static_cast<int>(std::lower_bound(codes.begin() + begin, codes.begin() + end, first) - codes.begin());
+            }
+            AABB child_box[2];
+            nodes[node_id].count = 0;
+            nodes[node_id].axis = static_cast<unsigned short>(axis);
+            build_children(nodes, node_id, n, [&](int k, std::vector<BVHNode> &out) {
+                child_box[k] = build(k ? mid : begin, k ? end : mid, out);
+            });
+            AABB box = child_box[0];
+            box.expand(child_box[1]);
+            nodes[node_id].bounds = box;
+            return box;
+        }
+    };
+
+    // LSD radix sort of the 30 bit codes, 10 bits a pass, carrying the primitives along
+    void sort_codes(std::vector<uint32_t> &codes, std::vector<int> &prims) {
+        std::vector<uint32_t> codes_tmp(codes.size());
+        std::vector<int> prims_tmp(prims.size());
+        for (int shift = 0; shift < 30; shift += 10) {
+            std::vector<size_t> start(1025, 0);
+            for (size_t i = 0; i < codes.size(); i++) start[((codes[i] >> shift) & 1023) + 1]++;
+            for (size_t d = 0; d < 1024; d++) start[d + 1] += start[d];
+            for (size_t i = 0; i < codes.size(); i++) {
+                const size_t j = start[(codes[i] >> shift) & 1023]++;
+                codes_tmp[j] = codes[i];
+                prims_tmp[j] = prims[i];
+            }
+            codes.swap(codes_tmp);
+            prims.swap(prims_tmp);
+        }
+    }
+}
+
+bool parse_bvh_builder(const char *name, BVHBuilder &builder) {
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(name, builder_names[i])) {
+            builder = static_cast<BVHBuilder>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *bvh_builder_name(const BVHBuilder builder) {
+    return builder_names[builder];
+}
+
+void BVH::build(const std::vector<AABB> &prim_bounds, int max_leaf, const BVHBuilder builder) {
+    nodes.clear();
+    indices.clear();
+    if (prim_bounds.empty()) return;
+    max_leaf = std::max(1, std::min(max_leaf, 0xffff));
+
+    const int n = static_cast<int>(prim_bounds.size());
+    std::vector<Vec3f> centroids(n);
+    std::vector<int> prims(n);
+    AABB box, centroid_box;
+    for (int i = 0; i < n; i++) {
+        centroids[i] = prim_bounds[i].centroid();
+        prims[i] = i;
+        box.expand(prim_bounds[i]);
+        centroid_box.expand(centroids[i]);
+    }
+    nodes.reserve(2 * prim_bounds.size());
+    if (builder == BVH_SWEEP) {
+        indices.reserve(prim_bounds.size());
+        build_recursive(prims, 0, n, prim_bounds, centroids, max_leaf, 0);
+        return;
+    }
+
+    if (builder == BVH_BINNED) {
+        const BinnedBuilder binned = {prim_bounds, centroids, prims, max_leaf};
+        run_build(prims.size(), [&]() { binned.build(0, n, box, centroid_box, 0, nodes); });
+    } else {
+        std::vector<uint32_t> codes(n);
+        const Vec3f extent = centroid_box.max - centroid_box.min;
+#pragma omp parallel for if (n >= chunk_prims)
+        for (int i = 0; i < n; i++) {
+            uint32_t q[3];
+            for (size_t a = 0; a < 3; a++)
+                q[a] = extent[a] > 0 ? static_cast<uint32_t>(std::min(1023.f, (centroids[i][a] - centroid_box.min[a]) / extent[a] * 1024)) : 0;
+            codes[i] = expand_bits(q[0]) << 2 | expand_bits(q[1]) << 1 | expand_bits(q[2]);
+        }
+        sort_codes(codes, prims);
+        const LBVHBuilder lbvh = {prim_bounds, codes, prims, max_leaf};
+        run_build(prims.size(), [&]() { lbvh.build(0, n, nodes); });
+    }
+    indices.swap(prims);
+}
+
+void BVH::refit(const std::vector<AABB> &prim_bounds) {
+    // children are always stored after their parent, so a reverse sweep is bottom-up
+    for (size_t k = nodes.size(); k--;) {
+        BVHNode &node = nodes[k];
+        AABB bounds;
+        if (node.count) {
+            for (int i = 0; i < node.count; i++) bounds.expand(prim_bounds[indices[node.offset + i]]);
+        } else {
+            bounds = nodes[k + 1].bounds;
+            bounds.expand(nodes[node.offset].bounds);
+        }
+        node.bounds = bounds;
+    }
+}
+
+int BVH::build_recursive(std::vector<int> &prims, int begin, int end, const std::vector<AABB> &prim_bounds,
+                         const std::vector<Vec3f> &centroids, int max_leaf, int depth) {
+    const int node_id = static_cast<int>(nodes.size());
+    nodes.push_back(BVHNode());
+    const int n = end - begin;
+
+    AABB bounds, centroid_bounds;
+    for (int i = begin; i < end; i++) {
+        bounds.expand(prim_bounds[prims[i]]);
+        centroid_bounds.expand(centroids[prims[i]]);
+    }
+    nodes[node_id].bounds = bounds;
+
+    // full sweep SAH: for every axis sort by centroid and evaluate every split position
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1, best_split = -1;
+    std::vector<float> right_area(n);
+    for (int axis = 0; axis < 3; axis++) {
+        if (centroid_bounds.max[axis] - centroid_bounds.min[axis] <= 0) continue;
+        std::sort(prims.begin() + begin, prims.begin() + end,
+                  [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+        AABB acc;
+        for (int i = n - 1; i > 0; i--) {
+            acc.expand(prim_bounds[prims[begin + i]]);
+            right_area[i] = acc.area();
+        }
+        acc = AABB();
+        for (int i = 1; i < n; i++) {
+            acc.expand(prim_bounds[prims[begin + i - 1]]);
+            float cost = acc.area() * i + right_area[i] * (n - i);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i;
+            }
+        }
+    }
+
+    const float node_area = bounds.area();
+    if (node_area > 0) best_cost = traversal_cost + best_cost / node_area;
+    bool make_leaf = best_axis < 0 || (n <= max_leaf && best_cost >= n);
+
+    if (make_leaf && n > max_leaf) { // all centroids coincide: split the list in half
+        best_axis = 0;
+        best_split = n / 2;
+        make_leaf = false;
+    } else if (!make_leaf && median_from_here(depth, n)) { // degenerate distribution, keep the traversal stack bounded
+        best_split = n / 2;
+    }
+
+    if (make_leaf) {
+        nodes[node_id].offset = static_cast<int>(indices.size());
+        nodes[node_id].count = static_cast<unsigned short>(n);
+        nodes[node_id].axis = 0;
+        for (int i = begin; i < end; i++) indices.push_back(prims[i]);
+        return node_id;
+    }
+
+    std::sort(prims.begin() + begin, prims.begin() + end,
+              [&](int a, int b) { return centroids[a][best_axis] < centroids[b][best_axis]; });
+    const int mid = begin + best_split;
+    build_recursive(prims, begin, mid, prim_bounds, centroids, max_leaf, depth + 1);
+    const int right = build_recursive(prims, mid, end, prim_bounds, centroids, max_leaf, depth + 1);
+    nodes[node_id].offset = right;
+    nodes[node_id].count = 0;
+    nodes[node_id].axis = static_cast<unsigned short>(best_axis);
+    return node_id;
+}
@@ -0,0 +1,219 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include "geometry.h"
+#include "profile.h"
+
+// index of the lowest set bit of a non-zero lane mask
+inline int lowest_lane(uint64_t mask) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) { mask >>= 1; i++; }
+    return i;
+#endif
+}
+
+struct AABB {
+    Vec3f min, max;
+
+    AABB() : min( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max()),
+             max(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()) {}
+    AABB(const Vec3f &lo, const Vec3f &hi) : min(lo), max(hi) {}
+
+    void expand(const Vec3f &p) {
+        for (size_t i = 3; i--;) {
+            min[i] = std::min(min[i], p[i]);
+            max[i] = std::max(max[i], p[i]);
+        }
+    }
+
+    void expand(const AABB &b) {
+        expand(b.min);
+        expand(b.max);
+    }
+
+    Vec3f centroid() const { return (min + max) * .5f; }
+
+    float area() const { // half of the surface area, enough for the SAH ratios
+        Vec3f d = max - min;
+        if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    // slab test, inv_dir is 1/dir computed once per ray
+    bool ray_intersect(const Vec3f &orig, const Vec3f &inv_dir, const float tmax) const {
+        float t0 = 0, t1 = tmax;
+        for (size_t i = 0; i < 3; i++) {
+            float tnear = (min[i] - orig[i]) * inv_dir[i];
+            float tfar  = (max[i] - orig[i]) * inv_dir[i];
+            if (tnear > tfar) std::swap(tnear, tfar);
+            t0 = tnear > t0 ? tnear : t0;
+            t1 = tfar  < t1 ? tfar  : t1;
+            if (t0 > t1) return false;
+        }
+        return true;
+    }
+};
+
+// How BVH::build chooses the splits.
+enum BVHBuilder {
+    BVH_SWEEP,  // SAH at every split position of the centroids sorted along each axis: the best trees, O(n log^2 n)
+    BVH_BINNED, // SAH at the boundaries of 32 bins per axis, the large nodes binned and their subtrees built by
+                // parallel OpenMP tasks: trees nearly as good, several times faster to build
+    BVH_LBVH    // Morton order of the centroids, split at the highest bit that differs: the fastest build and the
+                // loosest trees, for geometry rebuilt at every frame
+};
+
+// "sweep", "binned" or "lbvh"; returns false for an unknown name
+bool parse_bvh_builder(const char *name, BVHBuilder &builder);
+const char *bvh_builder_name(BVHBuilder builder);
+
+// Entries of the traversal stacks: the builders keep every leaf shallower than that, see bvh.cpp.
+const int bvh_stack_size = 64;
+
+// Flattened node: the left child of an interior node immediately follows it in the array,
+// the right child is stored at `offset`. For leaves `offset` is the first entry in BVH::indices.
+struct BVHNode {
+    AABB bounds;
+    int offset;
+    unsigned short count; // number of primitives in a leaf, 0 for interior nodes
+    unsigned short axis;  // split axis of an interior node, used to visit the nearest child first
+};
+
+class BVH {
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<int> indices; // primitive ids in leaf order
+
+    // build over the primitive bounding boxes, leaves hold at most max_leaf primitives
+    void build(const std::vector<AABB> &prim_bounds, int max_leaf = 4, BVHBuilder builder = BVH_BINNED);
+
+    // Updates the node bounds for moved primitives, keeping the topology. Much cheaper than a rebuild,
+    // but the tree degrades if the primitives move far from where they were at build time.
+    void refit(const std::vector<AABB> &prim_bounds);
+
+    bool empty() const { return nodes.empty(); }
+    size_t bytes() const { return nodes.capacity() * sizeof(BVHNode) + indices.capacity() * sizeof(int); }
+
+    // Closest hit query: intersect(prim, tmax) must return true and shrink tmax when
+    // the primitive is hit closer than tmax.
+    template<typename F> bool intersect(const Vec3f &orig, const Vec3f &dir, float &tmax, F intersect_prim) const {
+        return intersect_leaves(orig, dir, tmax, [&](int offset, int count, float &t) {
+            bool hit = false;
+            for (int i = 0; i < count; i++)
+                hit |= intersect_prim(indices[offset + i], t);
+            return hit;
+        });
+    }
+
+    // Same traversal, but the whole leaf is handed over as the range [offset, offset+count) of `indices`,
+    // so that primitives stored in leaf order can be tested together.
+    template<typename F> bool intersect_leaves(const Vec3f &orig, const Vec3f &dir, float &tmax, F intersect_leaf) const {
+        if (nodes.empty()) return false;
+        Vec3f inv_dir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        bool dir_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+        bool hit = false;
+        int stack[bvh_stack_size];
+        int sp = 0;
+        int cur = 0;
+        for (;;) {
+            const BVHNode &node = nodes[cur];
+            PROFILE_COUNT(bvh_nodes, 1);
+            PROFILE_COUNT(box_tests, 1);
+            if (node.bounds.ray_intersect(orig, inv_dir, tmax)) {
+                if (node.count) {
+                    hit |= intersect_leaf(node.offset, node.count, tmax);
+                    if (!sp) break;
+                    cur = stack[--sp];
+                } else if (dir_neg[node.axis]) {
+                    stack[sp++] = cur + 1;
+                    cur = node.offset;
+                } else {
+                    stack[sp++] = node.offset;
+                    cur = cur + 1;
+                }
+            } else {
+                if (!sp) break;
+                cur = stack[--sp];
+            }
+        }
+        return hit;
+    }
+
+    // Any-hit query for shadow rays: stops at the first leaf for which occluded_leaf(offset, count, tmax)
+    // reports a blocker closer than tmax. No ordering work is needed since any blocker will do.
+    template<typename F> bool occluded_leaves(const Vec3f &orig, const Vec3f &dir, const float tmax, F occluded_leaf) const {
+        if (nodes.empty()) return false;
+        Vec3f inv_dir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        int stack[bvh_stack_size];
+        int sp = 0;
+        int cur = 0;
+        for (;;) {
+            const BVHNode &node = nodes[cur];
+            PROFILE_COUNT(bvh_nodes, 1);
+            PROFILE_COUNT(box_tests, 1);
+            if (node.bounds.ray_intersect(orig, inv_dir, tmax)) {
+                if (!node.count) {
+                    stack[sp++] = node.offset;
+                    cur = cur + 1;
+                    continue;
+                }
+                if (occluded_leaf(node.offset, node.count, tmax)) return true;
+            }
+            if (!sp) return false;
+            cur = stack[--sp];
+        }
+    }
+
+    // Packet traversal for n <= 64 rays: a node is visited once for the whole packet and entered if any
+    // active lane hits its box. intersect_leaf(offset, count, lanes) gets the mask of lanes reaching
+    // the leaf and must shrink tmax[lane] for every lane it hits. Children are ordered after the first ray.
+    template<typename F> void intersect_packet(const int n, const Vec3f *orig, const Vec3f *dir, float *tmax, F intersect_leaf) const {
+        if (nodes.empty() || n <= 0) return;
+        Vec3f inv_dir[64];
+        for (int l = 0; l < n; l++) inv_dir[l] = Vec3f(1.f / dir[l].x, 1.f / dir[l].y, 1.f / dir[l].z);
+        bool dir_neg[3] = {inv_dir[0].x < 0, inv_dir[0].y < 0, inv_dir[0].z < 0};
+        int stack[bvh_stack_size];
+        uint64_t stack_lanes[64]; // lanes that reached the parent of the stacked node
+        int sp = 0;
+        int cur = 0;
+        uint64_t active = n >= 64 ? ~uint64_t(0) : (uint64_t(1) << n) - 1;
+        for (;;) {
+            const BVHNode &node = nodes[cur];
+            PROFILE_COUNT(bvh_nodes, 1);
+            uint64_t lanes = 0;
+            for (uint64_t m = active; m; m &= m - 1) {
+                int l = lowest_lane(m);
+                PROFILE_COUNT(box_tests, 1);
+                if (node.bounds.ray_intersect(orig[l], inv_dir[l], tmax[l])) lanes |= uint64_t(1) << l;
+            }
+            if (lanes && !node.count) {
+                stack_lanes[sp] = lanes;
+                if (dir_neg[node.axis]) {
+                    stack[sp++] = cur + 1;
+                    cur = node.offset;
+                } else {
+                    stack[sp++] = node.offset;
+                    cur = cur + 1;
+                }
+                active = lanes;
+                continue;
+            }
+            if (lanes) intersect_leaf(node.offset, node.count, lanes);
+            if (!sp) break;
+            cur = stack[--sp];
+            active = stack_lanes[sp];
+        }
+    }
+
+private:
+    int build_recursive(std::vector<int> &prims, int begin, int end, const std::vector<AABB> &prim_bounds,
+                        const std::vector<Vec3f> &centroids, int max_leaf, int depth);
+};
+
+#endif //__BVH_H__
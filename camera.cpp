@@ -0,0 +1,77 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <algorithm>
+#include "camera.h"
+
+void Camera::look_at(const Vec3f &target, const Vec3f &world_up) {
+    forward = (target - position).normalize();
+    right = cross(forward, world_up).normalize();
+    up = cross(right, forward);
+}
+
+// dir_z once per image, in double: a float tan would move every primary ray by a rounding step
+ImagePlane::ImagePlane(const Camera &camera, const int width, const int height)
+    : position(camera.position), right(camera.right), up(camera.up), forward(camera.forward),
+      half_width(width / 2.f), half_height(height / 2.f), dir_z(static_cast<float>(height / (2 * std::tan(double(camera.fov) / 2)))),
+      lens_radius(camera.aperture), focus(camera.focus > 0 ? camera.focus : 1) {}
+
+bool ImagePlane::sees(const Vec3f &min, const Vec3f &max) const {
+    const Vec3f center = forward * dir_z, dx = right * half_width, dy = up * half_height;
+    const Vec3f normals[5] = { // pointing inside the view
+        forward, cross(center - dx, up), cross(up, center + dx), cross(center + dy, right), cross(right, center - dy)
+    };
+    for (size_t k = 0; k < (thin_lens() ? 1 : 5); k++) {
+        const Vec3f &n = normals[k];
+        // the corner of the box farthest along the normal
+        const Vec3f p(n.x > 0 ? max.x : min.x, n.y > 0 ? max.y : min.y, n.z > 0 ? max.z : min.z);
+        if ((p - position) * n < 0) return false;
+    }
+    return true;
+}
+
+namespace {
+    Vec3f catmull_rom(const Vec3f &p0, const Vec3f &p1, const Vec3f &p2, const Vec3f &p3, float u) {
+        const float u2 = u * u, u3 = u2 * u;
+        return (p1 * 2.f + (p2 - p0) * u + (p0 * 2.f - p1 * 5.f + p2 * 4.f - p3) * u2 + (p1 * 3.f - p0 - p2 * 3.f + p3) * u3) * .5f;
+    }
+}
+
+Camera CameraPath::at(float t, float fov) const {
+    Camera camera;
+    camera.fov = fov;
+    if (keys.empty()) return camera;
+    const int n = static_cast<int>(keys.size());
+    const int segments = loop ? n : n - 1;
+    if (segments < 1) {
+        camera.position = keys[0].position;
+        camera.look_at(keys[0].target);
+        return camera;
+    }
+    const float s = std::max(0.f, std::min(1.f, t)) * segments;
+    const int i = std::min(segments - 1, static_cast<int>(s));
+    const float u = s - i;
+    // neighbour keys wrap around on a loop, and are clamped at the ends of an open path
+    auto key = [&](int k) -> const CameraKey & {
+        return keys[loop ? ((k % n) + n) % n : std::max(0, std::min(n - 1, k))];
+    };
+    camera.position = catmull_rom(key(i - 1).position, key(i).position, key(i + 1).position, key(i + 2).position, u);
+    camera.look_at(catmull_rom(key(i - 1).target, key(i).target, key(i + 1).target, key(i + 2).target, u));
+    return camera;
+}
+
+CameraPath CameraPath::turntable(const Camera &start, const Vec3f &center, int nkeys) {
+    CameraPath path;
+    path.loop = true;
+    // the target keeps the framing of the start camera: its view axis, as far from it as the center
+    const Vec3f offset = start.position - center;
+    const float distance = std::sqrt(offset.x * offset.x + offset.z * offset.z);
+    const Vec3f target = start.position + start.forward * distance - center;
+    for (int k = 0; k < nkeys; k++) {
+        const float a = 2 * float(M_PI) * k / nkeys, c = cosf(a), s = sinf(a);
+        CameraKey key;
+        key.position = center + Vec3f(c * offset.x + s * offset.z, offset.y, -s * offset.x + c * offset.z);
+        key.target = center + Vec3f(c * target.x + s * target.z, target.y, -s * target.x + c * target.z);
+        path.keys.push_back(key);
+    }
+    return path;
+}
@@ -0,0 +1,84 @@
+#ifndef __CAMERA_H__
+#define __CAMERA_H__
+#include <vector>
+#include "geometry.h"
+
+// Pinhole camera, the image plane is spanned by right and up and the camera looks along forward.
+struct Camera {
+    Vec3f position, right, up, forward;
+    float fov; // vertical field of view, radians
+    float aperture, focus; // thin lens: radius of the lens and distance of the sharp plane along forward, 0: pinhole
+
+    Camera() : position(3, 4, 8), right(1, 0, 0), up(0, 1, 0), forward(0, 0, -1), fov(float(M_PI / 3)), aperture(0), focus(0) {} // position de la camera
+
+    void look_at(const Vec3f &target, const Vec3f &world_up = Vec3f(0, 1, 0));
+};
+
+// The primary rays of a width x height image seen from a camera. Built once per frame, so that the
+// per pixel work is a few multiply-adds and a normalize.
+struct ImagePlane {
+    Vec3f position, right, up, forward;
+    float half_width, half_height;
+    float dir_z; // distance of the image plane along forward, in pixels
+    float lens_radius, focus;
+
+    ImagePlane(const Camera &camera, const int width, const int height);
+
+    bool thin_lens() const { return lens_radius > 0; }
+
+    // primary ray through the point (x, y) of the image, in pixels
+    void ray(const float x, const float y, Vec3f &orig, Vec3f &dir) const {
+        const float dir_x = x - half_width;
+        const float dir_y = -y + half_height; // this flips the image at the same time
+        orig = position;
+        dir = (right * dir_x + up * dir_y + forward * dir_z).normalize();
+    }
+
+    // The same through the point (u, v) in [0, 1)^2 of the lens: the ray leaves the lens disk (concentric
+    // mapping of Shirley and Chiu, which keeps the strata of the samples) towards the point of the sharp
+    // plane that the pinhole ray reaches, so the image is blurred in proportion to the distance to that plane.
+    void ray(const float x, const float y, const float u, const float v, Vec3f &orig, Vec3f &dir) const {
+        if (!thin_lens()) return ray(x, y, orig, dir);
+        const float a = 2 * u - 1, b = 2 * v - 1;
+        float r = 0, phi = 0;
+        if (a * a > b * b) {
+            r = a;
+            phi = float(M_PI / 4) * (b / a);
+        } else if (b != 0) {
+            r = b;
+            phi = float(M_PI / 2) - float(M_PI / 4) * (a / b);
+        }
+        const Vec3f lens = right * (lens_radius * r * cosf(phi)) + up * (lens_radius * r * sinf(phi));
+        const Vec3f pinhole = right * (x - half_width) + up * (-y + half_height) + forward * dir_z;
+        orig = position + lens;
+        dir = (pinhole * (focus / dir_z) - lens).normalize();
+    }
+
+    float spread() const { return 1.f / dir_z; } // angle of a pixel at the center of the image
+
+    // false if the box lies entirely behind the camera or beyond an edge of the image, so that no ray()
+    // reaches it: the box is tested against the five planes through the position that bound the view.
+    // Through a lens only the plane of the lens is tested, the rays leave it at sideways offsets
+    bool sees(const Vec3f &min, const Vec3f &max) const;
+};
+
+struct CameraKey {
+    Vec3f position, target;
+};
+
+// Keyframed camera path, positions and targets interpolated with Catmull-Rom splines.
+class CameraPath {
+public:
+    std::vector<CameraKey> keys;
+    bool loop; // the last key connects back to the first one
+
+    CameraPath() : loop(false) {}
+
+    // t in [0, 1] covers the whole path
+    Camera at(float t, float fov = float(M_PI / 3)) const;
+
+    // nkeys keys on a full turn of the camera around a vertical axis through center
+    static CameraPath turntable(const Camera &start, const Vec3f &center, int nkeys = 8);
+};
+
+#endif //__CAMERA_H__
@@ -0,0 +1,126 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "denoise.h"
+#include "profile.h"
+
+namespace {
+    const float albedo_epsilon = .01f; // black diffuse surfaces still have their reflections to filter
+
+    inline float luminance(const Vec3f &c) {
+        return .2126f * c.x + .7152f * c.y + .0722f * c.z;
+    }
+
+    // B3 spline, by distance to the center in steps
+    const float kernel[3] = {3.f / 8, 1.f / 4, 1.f / 16};
+}
+
+void denoise(const std::vector<Vec3f> &color, const AOVs &guides, const int width, const int height,
+             std::vector<Vec3f> &denoised, const DenoiseSettings &settings) {
+    PROFILE_SCOPE("denoise");
+    const size_t npixels = size_t(width) * height;
+    const std::vector<float> &depth = guides.depth;
+    const std::vector<Vec3f> normal = guides.normal.to_vector(), albedo = guides.albedo.to_vector(); // decoded once
+    std::vector<Vec3f> irradiance(npixels), next(npixels);
+    std::vector<float> variance(npixels, 0.f), next_variance(npixels, 0.f), gradient(npixels, 0.f);
+
+    // the albedo is divided out so that only the lighting is blurred; the depth gradient of every pixel
+    // is taken on the side of its smallest difference, so that it does not jump at silhouettes
+#pragma omp parallel for
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            const size_t p = i + size_t(j) * width;
+            const Vec3f a = albedo[p] + Vec3f(albedo_epsilon, albedo_epsilon, albedo_epsilon);
+            irradiance[p] = Vec3f(color[p].x / a.x, color[p].y / a.y, color[p].z / a.z);
+            if (!std::isfinite(depth[p])) continue;
+            float dx = std::numeric_limits<float>::infinity(), dy = dx;
+            if (i > 0 && std::isfinite(depth[p - 1])) dx = std::fabs(depth[p] - depth[p - 1]);
+            if (i + 1 < width && std::isfinite(depth[p + 1])) dx = std::min(dx, std::fabs(depth[p + 1] - depth[p]));
+            if (j > 0 && std::isfinite(depth[p - width])) dy = std::fabs(depth[p] - depth[p - width]);
+            if (j + 1 < height && std::isfinite(depth[p + width])) dy = std::min(dy, std::fabs(depth[p + width] - depth[p]));
+            gradient[p] = std::max(std::isfinite(dx) ? dx : 0.f, std::isfinite(dy) ? dy : 0.f);
+        }
+    }
+
+    // without a history of samples, the noise is estimated from the luminance of the 3x3 neighbourhood
+#pragma omp parallel for
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            const size_t p = i + size_t(j) * width;
+            if (!std::isfinite(depth[p])) continue;
+            float sum = 0, sum2 = 0;
+            int n = 0;
+            for (int y = std::max(0, j - 1); y <= std::min(height - 1, j + 1); y++) {
+                for (int x = std::max(0, i - 1); x <= std::min(width - 1, i + 1); x++) {
+                    const size_t q = x + size_t(y) * width;
+                    if (!std::isfinite(depth[q])) continue;
+                    const float l = luminance(irradiance[q]);
+                    sum += l;
+                    sum2 += l * l;
+                    n++;
+                }
+            }
+            variance[p] = std::max(0.f, sum2 / n - (sum / n) * (sum / n));
+        }
+    }
+
+    const float inv_albedo2 = 1.f / (settings.sigma_albedo * settings.sigma_albedo);
+    for (int it = 0; it < settings.iterations; it++) {
+        const int step = 1 << it;
+#pragma omp parallel for schedule(dynamic, 4)
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                const size_t p = i + size_t(j) * width;
+                if (!std::isfinite(depth[p])) {
+                    next[p] = irradiance[p];
+                    continue;
+                }
+                const float lp = luminance(irradiance[p]);
+                const float sigma_l = settings.sigma_color * std::sqrt(variance[p]) + 1e-4f;
+                const float sigma_z = settings.sigma_depth * gradient[p] * step + 1e-4f * depth[p];
+                Vec3f sum;
+                float wsum = 0, vsum = 0;
+                for (int dy = -2; dy <= 2; dy++) {
+                    const int y = j + dy * step;
+                    if (y < 0 || y >= height) continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        const int x = i + dx * step;
+                        if (x < 0 || x >= width) continue;
+                        const size_t q = x + size_t(y) * width;
+                        if (!std::isfinite(depth[q])) continue;
+                        float w = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                        if (q != p) {
+                            const float cosine = std::max(0.f, normal[p] * normal[q]);
+                            const Vec3f da = albedo[p] - albedo[q];
+                            const float distance = std::sqrt(float(dx * dx + dy * dy));
+                            w *= std::pow(cosine, settings.sigma_normal) *
+                                 std::exp(-std::fabs(depth[p] - depth[q]) / (sigma_z * distance) - (da * da) * inv_albedo2 -
+                                          std::fabs(lp - luminance(irradiance[q])) / sigma_l);
+                        }
+                        sum = sum + irradiance[q] * w;
+                        wsum += w;
+                        vsum += w * w * variance[q];
+                    }
+                }
+                next[p] = sum * (1.f / wsum);
+                next_variance[p] = vsum / (wsum * wsum);
+            }
+        }
+        irradiance.swap(next);
+        variance.swap(next_variance);
+    }
+
+    denoised.resize(npixels);
+#pragma omp parallel for
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            const size_t p = i + size_t(j) * width;
+            if (!std::isfinite(depth[p])) {
+                denoised[p] = color[p];
+                continue;
+            }
+            const Vec3f a = albedo[p] + Vec3f(albedo_epsilon, albedo_epsilon, albedo_epsilon);
+            denoised[p] = Vec3f(irradiance[p].x * a.x, irradiance[p].y * a.y, irradiance[p].z * a.z);
+        }
+    }
+}
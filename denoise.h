@@ -0,0 +1,25 @@
+#ifndef __DENOISE_H__
+#define __DENOISE_H__
+#include <vector>
+#include "geometry.h"
+#include "render.h"
+
+struct DenoiseSettings {
+    int iterations;     // a-trous passes, the last one reaches 2^(iterations + 1) pixels away
+    float sigma_color;  // luminance edge stopping, in standard deviations of the noise
+    float sigma_normal; // exponent of the cosine between the normals
+    float sigma_depth;  // depth edge stopping, in depth gradients
+    float sigma_albedo; // albedo edge stopping, on the difference of the diffuse colors
+
+    DenoiseSettings() : iterations(5), sigma_color(4.f), sigma_normal(128.f), sigma_depth(1.f), sigma_albedo(.1f) {}
+};
+
+// Edge-aware a-trous wavelet filter of a width x height render, the spatial part of SVGF: the colors are
+// divided by the albedo, blurred by a 5x5 kernel spread wider at every pass but only across pixels of the
+// same surface (close normals, depths and albedos) and of similar luminance given the local noise, then
+// multiplied by the albedo again so that textures stay sharp. guides must hold the DEPTH, NORMAL and
+// ALBEDO outputs of the same render; the sky is left as it is. denoised may be color.
+void denoise(const std::vector<Vec3f> &color, const AOVs &guides, const int width, const int height,
+             std::vector<Vec3f> &denoised, const DenoiseSettings &settings = DenoiseSettings());
+
+#endif //__DENOISE_H__
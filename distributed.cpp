@@ -0,0 +1,414 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "distributed.h"
+#include "render.h"
+#include "scene_io.h"
+#include "mapped_file.h"
+
+namespace {
+    const int cluster_tile = 64;  // pixels per side of the tiles handed out
+    const int tiles_in_flight = 2; // per worker, so that it never waits for the next tile
+    const int max_copies = 2;     // a straggling tile is handed out once more at most
+    const uint32_t max_scene_bytes = 64 << 20;   // of a MSG_SCENE payload
+    const uint32_t max_envmap_bytes = 256 << 20; // of the image file of a MSG_ENVMAP
+
+    enum MessageType {
+        MSG_SCENE = 1, // SceneMessage, ground texture name and '\0', scene text
+        MSG_ENVMAP,    // bytes of the image file, none for the plain sky
+        MSG_FRAME,     // FrameMessage
+        MSG_TILE,      // TileMessage
+        MSG_RESULT,    // TileMessage, then the colors of the tile row by row
+        MSG_BYE        // end of the session
+    };
+
+    struct MessageHeader {
+        uint32_t type;
+        uint32_t size; // of the payload that follows
+    };
+
+    struct SceneMessage {
+        int32_t light_samples, fast_shading, single_branch, envmap_format, envmap_samples;
+        int32_t depths[4];
+    };
+
+    struct FrameMessage {
+        Camera camera;
+        int32_t frame, width, height;
+    };
+
+    struct TileMessage {
+        int32_t frame, id;
+        Tile tile;
+    };
+
+    bool send_all(const int fd, const void *data, size_t size) {
+        const char *p = static_cast<const char *>(data);
+        while (size) {
+            const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    bool recv_all(const int fd, void *data, size_t size) {
+        char *p = static_cast<char *>(data);
+        while (size) {
+            const ssize_t n = recv(fd, p, size, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // one message, its payload in up to two parts
+    bool send_message(const int fd, const MessageType type, const void *a, const size_t a_size,
+                      const void *b = nullptr, const size_t b_size = 0) {
+        const MessageHeader h = {static_cast<uint32_t>(type), static_cast<uint32_t>(a_size + b_size)};
+        return send_all(fd, &h, sizeof(h)) && send_all(fd, a, a_size) && (!b_size || send_all(fd, b, b_size));
+    }
+
+    // largest payload of a message of that type, the peer is dropped beyond it before anything is allocated
+    uint32_t max_payload(const uint32_t type) {
+        switch (type) {
+        case MSG_SCENE: return max_scene_bytes;
+        case MSG_ENVMAP: return max_envmap_bytes;
+        case MSG_FRAME: return sizeof(FrameMessage);
+        case MSG_TILE: return sizeof(TileMessage);
+        case MSG_RESULT: return sizeof(TileMessage) + sizeof(Vec3f) * cluster_tile * cluster_tile;
+        default: return 0;
+        }
+    }
+
+    bool recv_message(const int fd, MessageHeader &h, std::vector<char> &payload) {
+        if (!recv_all(fd, &h, sizeof(h)) || h.size > max_payload(h.type)) return false;
+        payload.resize(h.size);
+        return !h.size || recv_all(fd, &payload[0], h.size);
+    }
+
+    // a session of serve_worker, until the coordinator says bye or goes away
+    void serve_session(const int fd) {
+        Scene scene;
+        EnvironmentMap envmap;
+        FrameMessage frame = FrameMessage();
+        bool has_scene = false;
+        TexelFormat envmap_format = TEXELS_FLOAT;
+        MessageHeader h;
+        std::vector<char> payload;
+        std::vector<Vec3f> colors;
+        while (recv_message(fd, h, payload)) {
+            if (h.type == MSG_SCENE && h.size > sizeof(SceneMessage)) {
+                SceneMessage settings;
+                memcpy(&settings, &payload[0], sizeof(settings));
+                const char *ground = &payload[sizeof(settings)];
+                const char *end = static_cast<const char *>(memchr(ground, 0, h.size - sizeof(settings)));
+                std::string error;
+                scene = Scene();
+                if (!end || find_texture(ground) < 0 || settings.envmap_format < TEXELS_FLOAT || settings.envmap_format > TEXELS_BC1 || !parse_scene_text(std::string(end + 1, static_cast<const char *>(&payload[0]) + h.size), scene, error)) {
+                    std::cerr << "# worker: bad scene " << error << std::endl;
+                    return;
+                }
+                scene.build();
+                scene.surfaces[0] = TexturedSurface::builtin(ground, Scene::checker_white, Scene::checker_black);
+                scene.light_samples = settings.light_samples;
+                scene.fast_shading = settings.fast_shading != 0;
+                scene.single_branch = settings.single_branch != 0;
+                scene.envmap_samples = settings.envmap_samples;
+                scene.depth_limit = std::min<size_t>(max_depth, std::max(0, settings.depths[0]));
+                scene.reflect_depth = std::max(0, settings.depths[1]);
+                scene.refract_depth = std::max(0, settings.depths[2]);
+                scene.shadow_depth = std::max(0, settings.depths[3]);
+                envmap_format = static_cast<TexelFormat>(settings.envmap_format);
+                envmap = EnvironmentMap();
+                frame.camera = scene.camera;
+                has_scene = true;
+                std::cerr << "# worker: " << scene.spheres.size() << " spheres, " << scene.lights.size() << " lights" << std::endl;
+            } else if (h.type == MSG_ENVMAP && has_scene) {
+                if (h.size && !envmap.decode(&payload[0], h.size, envmap_format)) {
+                    std::cerr << "# worker: bad envmap" << std::endl;
+                    return;
+                }
+                scene.envmap = envmap.empty() ? nullptr : &envmap;
+            } else if (h.type == MSG_FRAME && h.size == sizeof(FrameMessage)) {
+                memcpy(&frame, &payload[0], sizeof(frame));
+                if (frame.width <= 0 || frame.height <= 0 || frame.width > max_image_side || frame.height > max_image_side) {
+                    std::cerr << "# worker: bad frame size " << frame.width << "x" << frame.height << std::endl;
+                    return;
+                }
+                scene.camera = frame.camera;
+            } else if (h.type == MSG_TILE && h.size == sizeof(TileMessage) && has_scene) {
+                TileMessage tile;
+                memcpy(&tile, &payload[0], sizeof(tile));
+                const Tile &t = tile.tile;
+                if (t.x0 < 0 || t.y0 < 0 || t.x1 > frame.width || t.y1 > frame.height || t.x0 >= t.x1 || t.y0 >= t.y1) return;
+                render_region(scene, frame.width, frame.height, t, colors);
+                if (!send_message(fd, MSG_RESULT, &tile, sizeof(tile), colors.data(), colors.size() * sizeof(Vec3f))) return;
+            } else {
+                return; // bye, or a message out of order
+            }
+        }
+    }
+
+    bool connect_to(const std::string &node, int &fd, std::string &error) {
+        const size_t colon = node.rfind(':');
+        if (colon == std::string::npos) {
+            error = node + ": host:port expected";
+            return false;
+        }
+        const std::string host = node.substr(0, colon), port = node.substr(colon + 1);
+        addrinfo hints, *res = nullptr;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) || !res) {
+            error = node + ": unknown host";
+            return false;
+        }
+        fd = -1;
+        for (addrinfo *a = res; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+        if (fd < 0) {
+            error = node + ": " + strerror(errno);
+            return false;
+        }
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return true;
+    }
+}
+
+bool serve_worker(const int port, std::string &error) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error = strerror(errno);
+        return false;
+    }
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(fd, 4)) {
+        error = "port " + std::to_string(port) + ": " + strerror(errno);
+        close(fd);
+        return false;
+    }
+    std::cerr << "# worker: listening on port " << port << std::endl;
+    for (;;) {
+        const int session = accept(fd, nullptr, nullptr);
+        if (session < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            error = strerror(errno);
+            close(fd);
+            return false;
+        }
+        setsockopt(session, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        serve_session(session);
+        close(session);
+    }
+}
+
+ClusterRenderer::ClusterRenderer() : frame(0) {}
+
+ClusterRenderer::~ClusterRenderer() {
+    for (size_t w = 0; w < nodes.size(); w++) {
+        if (nodes[w].fd < 0) continue;
+        send_message(nodes[w].fd, MSG_BYE, nullptr, 0);
+        close(nodes[w].fd);
+    }
+}
+
+void ClusterRenderer::print_worker_stats() const {
+    for (size_t w = 0; w < nodes.size(); w++)
+        std::cerr << "# cluster: " << nodes[w].name << ": " << nodes[w].tiles << " tiles" << (nodes[w].fd < 0 ? ", lost" : "") << std::endl;
+}
+
+int ClusterRenderer::workers() const {
+    int n = 0;
+    for (size_t w = 0; w < nodes.size(); w++) n += nodes[w].fd >= 0;
+    return n;
+}
+
+bool ClusterRenderer::connect(const std::vector<std::string> &workers, const Scene &scene, const ClusterSettings &settings,
+                              std::string &error) {
+    if (!scene.meshes.empty() || !scene.instances.empty()) {
+        error = "meshes and instances can not be shipped to the workers";
+        return false;
+    }
+    MappedFile envmap;
+    if (!settings.envmap.empty() && !envmap.open(settings.envmap)) {
+        error = "can not open " + settings.envmap;
+        return false;
+    }
+    const SceneMessage message = {settings.light_samples, settings.fast_shading, settings.single_branch,
+                                   settings.envmap_format, settings.envmap_samples,
+                                   {settings.depths[0], settings.depths[1], settings.depths[2], settings.depths[3]}};
+    std::string text = settings.ground;
+    text.push_back('\0');
+    text += scene_text(scene);
+    std::vector<char> payload(sizeof(message));
+    memcpy(&payload[0], &message, sizeof(message));
+    payload.insert(payload.end(), text.begin(), text.end());
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        Worker w;
+        w.name = workers[i];
+        w.tiles = 0;
+        w.stale = 0;
+        std::string why;
+        if (!connect_to(w.name, w.fd, why)) {
+            std::cerr << "# cluster: " << why << ", skipped" << std::endl;
+            continue;
+        }
+        if (!send_message(w.fd, MSG_SCENE, payload.data(), payload.size()) ||
+            !send_message(w.fd, MSG_ENVMAP, envmap.data(), envmap.size())) {
+            std::cerr << "# cluster: " << w.name << ": lost while sending the scene" << std::endl;
+            close(w.fd);
+            continue;
+        }
+        nodes.push_back(w);
+    }
+    if (nodes.empty()) {
+        error = "no worker could be reached";
+        return false;
+    }
+    return true;
+}
+
+bool ClusterRenderer::render(const Camera &camera, const int width, const int height, std::vector<Vec3f> &framebuffer,
+                             const std::function<void(const Tile &)> &tile_done, std::string &error) {
+    PROFILE_SCOPE("cluster render");
+    frame++;
+    framebuffer.resize(width * height);
+    const std::vector<Tile> tiles = make_tiles(width, height, cluster_tile);
+    std::vector<char> done(tiles.size(), 0);
+    std::vector<int> copies(tiles.size(), 0); // handed out and not returned
+    std::deque<int> pending;
+    for (size_t t = 0; t < tiles.size(); t++) pending.push_back(static_cast<int>(t));
+    size_t remaining = tiles.size();
+
+    // the tiles of a lost worker are handed out again, unless another copy is still out
+    auto lose = [&](Worker &w, const char *why) {
+        std::cerr << "# cluster: " << w.name << ": " << why << std::endl;
+        close(w.fd);
+        w.fd = -1;
+        for (size_t k = 0; k < w.in_flight.size(); k++) {
+            const int t = w.in_flight[k];
+            if (!--copies[t] && !done[t]) pending.push_front(t);
+        }
+        w.in_flight.clear();
+    };
+    FrameMessage message;
+    message.camera = camera;
+    message.frame = frame;
+    message.width = width;
+    message.height = height;
+    for (size_t w = 0; w < nodes.size(); w++) {
+        nodes[w].stale += static_cast<int>(nodes[w].in_flight.size());
+        nodes[w].in_flight.clear();
+        if (nodes[w].fd >= 0 && !send_message(nodes[w].fd, MSG_FRAME, &message, sizeof(message))) lose(nodes[w], "lost");
+    }
+
+    MessageHeader h;
+    std::vector<char> payload;
+    while (remaining) {
+        for (size_t w = 0; w < nodes.size(); w++) {
+            Worker &node = nodes[w];
+            while (node.fd >= 0 && static_cast<int>(node.in_flight.size()) + node.stale < tiles_in_flight) {
+                int t = -1;
+                if (!pending.empty()) {
+                    t = pending.front();
+                    pending.pop_front();
+                } else { // a straggler: the outstanding tile with the fewest copies, if not already on this worker
+                    for (size_t k = 0; k < tiles.size(); k++) {
+                        if (done[k] || copies[k] >= max_copies || (t >= 0 && copies[k] >= copies[t])) continue;
+                        if (std::find(node.in_flight.begin(), node.in_flight.end(), static_cast<int>(k)) != node.in_flight.end()) continue;
+                        t = static_cast<int>(k);
+                    }
+                }
+                if (t < 0) break;
+                const TileMessage tile = {frame, t, tiles[t]};
+                copies[t]++;
+                node.in_flight.push_back(t);
+                if (!send_message(node.fd, MSG_TILE, &tile, sizeof(tile))) lose(node, "lost");
+            }
+        }
+
+        std::vector<pollfd> fds;
+        std::vector<size_t> owner;
+        for (size_t w = 0; w < nodes.size(); w++) {
+            if (nodes[w].fd < 0 || (nodes[w].in_flight.empty() && !nodes[w].stale)) continue;
+            const pollfd p = {nodes[w].fd, POLLIN, 0};
+            fds.push_back(p);
+            owner.push_back(w);
+        }
+        if (fds.empty()) {
+            error = "all the workers were lost";
+            return false;
+        }
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            error = strerror(errno);
+            return false;
+        }
+        for (size_t k = 0; k < fds.size(); k++) {
+            if (!fds[k].revents) continue;
+            const size_t w = owner[k];
+            Worker &node = nodes[w];
+            TileMessage result;
+            if (!recv_message(node.fd, h, payload) || h.type != MSG_RESULT || h.size < sizeof(result)) {
+                lose(node, "lost");
+                continue;
+            }
+            memcpy(&result, &payload[0], sizeof(result));
+            if (result.frame != frame) { // a second copy from an earlier frame
+                node.stale = std::max(0, node.stale - 1);
+                continue;
+            }
+            std::vector<int>::iterator it = std::find(node.in_flight.begin(), node.in_flight.end(), result.id);
+            if (it == node.in_flight.end()) {
+                lose(node, "sent a tile it was not given");
+                continue;
+            }
+            const Tile &tile = tiles[result.id];
+            const int tw = tile.x1 - tile.x0;
+            if (h.size != sizeof(result) + sizeof(Vec3f) * tw * (tile.y1 - tile.y0)) {
+                lose(node, "sent a truncated tile");
+                continue;
+            }
+            node.in_flight.erase(it);
+            copies[result.id]--;
+            if (done[result.id]) continue; // another worker was faster
+            const char *colors = &payload[sizeof(result)];
+            for (int j = tile.y0; j < tile.y1; j++)
+                memcpy(&framebuffer[tile.x0 + j * width], colors + sizeof(Vec3f) * tw * (j - tile.y0), sizeof(Vec3f) * tw);
+            done[result.id] = 1;
+            remaining--;
+            node.tiles++;
+            if (tile_done) tile_done(tile);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+#include <vector>
+#include <string>
+#include <functional>
+#include "scene.h"
+#include "scheduler.h"
+
+// Rendering on a farm of worker processes over TCP. The coordinator ships the scene once per worker,
+// as the text format of scene_io.h together with the settings that are not part of it (ground texture,
+// light sampling, fast shading) and the bytes of the envmap image. It then only sends the camera of each
+// frame and hands out tiles: every worker has a few tiles in flight, and gets a new one as soon as it
+// returns one. Once every tile has been handed out, idle workers get a second copy of the tiles still
+// outstanding, so that a slow or dead node does not hold up the frame; the first copy back wins.
+// Both ends must run the same build: the messages are the in-memory layouts.
+
+const int max_image_side = 8192; // pixels, of the frames a worker accepts and of the command line
+
+struct ClusterSettings {
+    std::string ground;        // name of the ground texture
+    int light_samples;         // Scene::light_samples
+    bool fast_shading;         // Scene::fast_shading
+    bool single_branch;        // Scene::single_branch
+    int envmap_samples;        // Scene::envmap_samples
+    int depths[4];             // Scene::depth_limit, reflect_depth, refract_depth and shadow_depth
+    TexelFormat envmap_format; // of the envmap texels on the workers
+    std::string envmap;        // image file shipped as the envmap, empty for the plain sky
+};
+
+// Serves coordinators on port, one after the other, until the process is killed. Returns only on error.
+bool serve_worker(int port, std::string &error);
+
+class ClusterRenderer {
+public:
+    ClusterRenderer();
+    ~ClusterRenderer(); // tells the workers the session is over
+
+    // Connects to the workers ("host:port") and ships the scene to them. Only what the text format
+    // holds goes over: the scene must have no meshes and no instances. Workers that can not be reached
+    // are skipped, false only if none is left.
+    bool connect(const std::vector<std::string> &workers, const Scene &scene, const ClusterSettings &settings, std::string &error);
+
+    // Renders one frame seen from camera, tile by tile on the workers. tile_done is called on every tile
+    // as soon as its pixels are in the framebuffer. False if all the workers were lost before the end.
+    bool render(const Camera &camera, const int width, const int height, std::vector<Vec3f> &framebuffer,
+                const std::function<void(const Tile &)> &tile_done, std::string &error);
+
+    int workers() const; // connected workers
+    void print_worker_stats() const;
+
+private:
+    ClusterRenderer(const ClusterRenderer &);
+    ClusterRenderer &operator=(const ClusterRenderer &);
+
+    struct Worker {
+        int fd;               // -1 once lost
+        std::string name;
+        std::vector<int> in_flight; // tiles of the current frame sent and not returned yet
+        int stale;            // tiles of the previous frames still to come back
+        int tiles;            // tiles returned first during the session
+    };
+    std::vector<Worker> nodes;
+    int frame;
+};
+
+#endif //__DISTRIBUTED_H__
@@ -0,0 +1,252 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "envmap.h"
+#include "mapped_file.h"
+#include "profile.h"
+#include "stb_image.h"
+
+Vec2f octahedral_encode(const Vec3f &dir) {
+    float l1 = std::fabs(dir.x) + std::fabs(dir.y) + std::fabs(dir.z);
+    float x = dir.x / l1, z = dir.z / l1;
+    if (dir.y < 0) { // the lower hemisphere is folded over the diagonals
+        float fx = (1 - std::fabs(z)) * (x < 0 ? -1.f : 1.f);
+        float fz = (1 - std::fabs(x)) * (z < 0 ? -1.f : 1.f);
+        x = fx;
+        z = fz;
+    }
+    return Vec2f(x * .5f + .5f, z * .5f + .5f);
+}
+
+Vec3f octahedral_decode(float u, float v) {
+    float x = u * 2 - 1, z = v * 2 - 1;
+    float y = 1 - std::fabs(x) - std::fabs(z);
+    if (y < 0) {
+        float fx = (1 - std::fabs(z)) * (x < 0 ? -1.f : 1.f);
+        float fz = (1 - std::fabs(x)) * (z < 0 ? -1.f : 1.f);
+        x = fx;
+        z = fz;
+    }
+    return Vec3f(x, y, z).normalize();
+}
+
+namespace {
+    // the octahedral top level, n x n, of an equirectangular image whose channels are `scale` times the radiance
+    template<typename T> void resample(const T *rgb, int width, int height, float scale, int n, std::vector<Vec3f> &top) {
+        top.resize(size_t(n) * n);
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                Vec3f d = octahedral_decode((x + .5f) / n, (y + .5f) / n);
+                // bilinear fetch in the source, same angular mapping as the original lookup; at load time, in
+                // double as it always was, so that the cached maps stay those a fresh decode gives
+                float a = (double(atan2f(d.z, d.x)) / (2 * M_PI) + .5) * width - .5;
+                float b = double(acosf(std::max(-1.f, std::min(1.f, d.y)))) / M_PI * height - .5;
+                int a0 = static_cast<int>(std::floor(a)), b0 = static_cast<int>(std::floor(b));
+                float fa = a - a0, fb = b - b0;
+                Vec3f c;
+                for (int k = 0; k < 4; k++) {
+                    int ia = ((a0 + (k & 1)) % width + width) % width;                      // wraps around in longitude
+                    int ib = std::max(0, std::min(height - 1, b0 + (k >> 1)));              // clamps at the poles
+                    float w = ((k & 1) ? fa : 1 - fa) * ((k >> 1) ? fb : 1 - fb);
+                    const T *p = rgb + (ia + ib * size_t(width)) * 3;
+                    c = c + Vec3f(p[0], p[1], p[2]) * (w / scale);
+                }
+                top[x + size_t(y) * n] = c;
+            }
+        }
+    }
+
+    // the equator of the octahedron is ~2.83 N texels long, match the width of the source
+    int octahedral_size(int width) {
+        int n = 1;
+        while (n * 2.83f < width) n *= 2;
+        return n;
+    }
+
+    // L1 norm of a unit direction: a texel of the octahedral map spans 4 l1^3 / N^2 steradians around it
+    float l1_norm(const Vec3f &d) {
+        return std::fabs(d.x) + std::fabs(d.y) + std::fabs(d.z);
+    }
+
+    // the first entry of cdf[0, n) above u, cdf ends with 1
+    int search_cdf(const float *cdf, int n, float u) {
+        return std::min(n - 1, static_cast<int>(std::upper_bound(cdf, cdf + n, u) - cdf));
+    }
+}
+
+void EnvironmentMap::build(const unsigned char *rgb, int width, int height, TexelFormat texel_format) {
+    format = texel_format;
+    const int n = octahedral_size(width);
+    std::vector<Vec3f> top;
+    resample(rgb, width, height, 255.f, n, top);
+    texture.build(top.data(), n, n, ImageTexture::WRAP_OCTAHEDRAL, format);
+    build_distribution();
+}
+
+void EnvironmentMap::build(const float *rgb, int width, int height, TexelFormat texel_format) {
+    format = texel_format;
+    const int n = octahedral_size(width);
+    std::vector<Vec3f> top;
+    resample(rgb, width, height, 1.f, n, top);
+    texture.build(top.data(), n, n, ImageTexture::WRAP_OCTAHEDRAL, format);
+    build_distribution();
+}
+
+void EnvironmentMap::build_distribution() {
+    PROFILE_SCOPE("envmap distribution");
+    int level = 0;
+    while (level + 1 < texture.nlevels() && texture.width(level) > 512) level++;
+    const int m = cdf_size = texture.width(level);
+    row_cdf.assign(size_t(m) * m, 0.f);
+    marginal_cdf.assign(m, 0.f);
+    std::vector<double> row_weight(m, 0.);
+#pragma omp parallel for schedule(static)
+    for (int y = 0; y < m; y++) {
+        float *cdf = row_cdf.data() + size_t(y) * m;
+        double sum = 0;
+        for (int x = 0; x < m; x++) {
+            const Vec3f c = texture.texel(level, x, y);
+            const float l1 = l1_norm(octahedral_decode((x + .5f) / m, (y + .5f) / m));
+            sum += double(std::max(0.f, .2126f * c.x + .7152f * c.y + .0722f * c.z) * l1 * l1 * l1);
+            cdf[x] = static_cast<float>(sum);
+        }
+        row_weight[y] = sum;
+        for (int x = 0; x < m; x++) cdf[x] = sum > 0 ? static_cast<float>(double(cdf[x]) / sum) : (x + 1.f) / m;
+        cdf[m - 1] = 1;
+    }
+    double total = 0;
+    for (int y = 0; y < m; y++) total += row_weight[y];
+    double sum = 0;
+    for (int y = 0; y < m; y++) {
+        sum += total > 0 ? row_weight[y] : 1.;
+        marginal_cdf[y] = static_cast<float>(sum / (total > 0 ? total : m)); // uniform on a black map
+    }
+    marginal_cdf[m - 1] = 1;
+}
+
+Vec3f EnvironmentMap::sample_direction(float u, float v, float &pdf) const {
+    const int m = cdf_size;
+    const int y = search_cdf(marginal_cdf.data(), m, v);
+    const float *cdf = row_cdf.data() + size_t(y) * m;
+    const int x = search_cdf(cdf, m, u);
+    // reuse the remainders of u and v within the texel to place the direction inside it
+    const float v0 = y ? marginal_cdf[y - 1] : 0.f, u0 = x ? cdf[x - 1] : 0.f;
+    const float pv = marginal_cdf[y] - v0, pu = cdf[x] - u0;
+    const float fy = pv > 0 ? std::min(1.f, std::max(0.f, (v - v0) / pv)) : .5f;
+    const float fx = pu > 0 ? std::min(1.f, std::max(0.f, (u - u0) / pu)) : .5f;
+    const Vec3f dir = octahedral_decode((x + fx) / m, (y + fy) / m);
+    const float l1 = l1_norm(dir);
+    pdf = pu * pv * m * m / (4 * l1 * l1 * l1);
+    return dir;
+}
+
+float EnvironmentMap::pdf(const Vec3f &dir) const {
+    const int m = cdf_size;
+    const Vec2f uv = octahedral_encode(dir);
+    const int x = std::max(0, std::min(m - 1, static_cast<int>(uv.x * m)));
+    const int y = std::max(0, std::min(m - 1, static_cast<int>(uv.y * m)));
+    const float *cdf = row_cdf.data() + size_t(y) * m;
+    const float pv = marginal_cdf[y] - (y ? marginal_cdf[y - 1] : 0.f), pu = cdf[x] - (x ? cdf[x - 1] : 0.f);
+    const float l1 = l1_norm(dir) / dir.norm();
+    return pu * pv * m * m / (4 * l1 * l1 * l1);
+}
+
+Vec3f EnvironmentMap::lookup(const Vec3f &dir, float spread) const {
+    const Vec2f uv = octahedral_encode(dir);
+    // a texel of the top level spans ~2 pi / (2.83 N) radians, the square is 2.22 radians wide
+    return texture.sample(uv.x, uv.y, texture.lod(spread * .45f));
+}
+
+namespace {
+    uint64_t fnv1a(const char *data, size_t size) {
+        uint64_t h = 14695981039346656037ull;
+        for (size_t i = 0; i < size; i++) {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // cache layout: the header, then the levels of the texture (ImageTexture::write)
+    const char envmap_magic[8] = {'S', 'N', 'O', 'W', 'E', 'N', 'V', '3'};
+
+    struct EnvmapCacheHeader {
+        char magic[8];
+        uint64_t key;
+        uint32_t format, reserved; // TexelFormat
+    };
+}
+
+bool EnvironmentMap::decode(const char *data, size_t size, TexelFormat texel_format) {
+    int n = -1, width, height;
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    if (stbi_is_hdr_from_memory(bytes, static_cast<int>(size))) { // linear radiance, converted to RGB by stb
+        float *radiance = stbi_loadf_from_memory(bytes, static_cast<int>(size), &width, &height, &n, 3);
+        if (!radiance) return false;
+        build(radiance, width, height, texel_format);
+        stbi_image_free(radiance);
+        return true;
+    }
+    unsigned char *pixmap = stbi_load_from_memory(bytes, static_cast<int>(size), &width, &height, &n, 0);
+    if (!pixmap || 3 != n) {
+        if (pixmap) stbi_image_free(pixmap);
+        return false;
+    }
+    build(pixmap, width, height, texel_format);
+    stbi_image_free(pixmap);
+    return true;
+}
+
+bool EnvironmentMap::load(const std::string &filename, TexelFormat texel_format, std::string &error) {
+    PROFILE_SCOPE("envmap load");
+    MappedFile file;
+    if (!file.open(filename)) {
+        error = "can not open " + filename;
+        return false;
+    }
+    const uint64_t key = fnv1a(file.data(), file.size());
+    const char *suffix[] = {".cache", ".half.cache", ".bc1.cache"}; // by TexelFormat
+    const std::string cache = filename + suffix[texel_format];
+    if (load_cache(cache, key, texel_format)) return true;
+
+    if (!decode(file.data(), file.size(), texel_format)) {
+        error = "can not load the environment map " + filename;
+        return false;
+    }
+    if (!save_cache(cache, key)) fprintf(stderr, "# can not write the envmap cache %s\n", cache.c_str());
+    return true;
+}
+
+bool EnvironmentMap::save_cache(const std::string &filename, uint64_t key) const {
+    EnvmapCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, envmap_magic, sizeof(envmap_magic));
+    h.key = key;
+    h.format = format;
+    const std::string tmp = filename + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    bool ok = f && fwrite(&h, sizeof(h), 1, f) == 1 && texture.write(f);
+    if (f && fclose(f)) ok = false;
+    if (!ok || rename(tmp.c_str(), filename.c_str())) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool EnvironmentMap::load_cache(const std::string &filename, uint64_t key, TexelFormat texel_format) {
+    MappedFile file;
+    EnvmapCacheHeader h;
+    if (!file.open(filename) || file.size() < sizeof(h)) return false;
+    memcpy(&h, file.data(), sizeof(h));
+    if (memcmp(h.magic, envmap_magic, sizeof(envmap_magic)) || h.key != key || h.format != uint32_t(texel_format)) return false;
+
+    size_t pos = sizeof(h);
+    if (!texture.read(file.data(), file.size(), pos, ImageTexture::WRAP_OCTAHEDRAL, texel_format)) return false;
+    format = texel_format;
+    build_distribution();
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef __ENVMAP_H__
+#define __ENVMAP_H__
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "geometry.h"
+#include "image_texture.h"
+
+// Environment map resampled at load time into an octahedral layout with a mip chain.
+// A lookup is a handful of multiplies and a filtered fetch, instead of atan2/acos per miss.
+// Texels are stored as floats or, optionally, as half floats (6 bytes instead of 12) or BC1 blocks (half a byte).
+class EnvironmentMap {
+public:
+    EnvironmentMap() : format(TEXELS_FLOAT), cdf_size(0) {}
+
+    // rgb is an 8-bit equirectangular image, width x height x 3
+    void build(const unsigned char *rgb, int width, int height, TexelFormat format = TEXELS_FLOAT);
+    // the same for linear radiance, as decoded from a .hdr file
+    void build(const float *rgb, int width, int height, TexelFormat format = TEXELS_FLOAT);
+
+    // Decodes an equirectangular RGB image file (8-bit, or Radiance .hdr) and builds the map. The result is cached in filename + ".cache"
+    // (".half.cache", ".bc1.cache"), keyed by a hash of the image file, so that the next start only maps it.
+    bool load(const std::string &filename, TexelFormat format, std::string &error);
+    // builds the map from the bytes of an image file, without the cache
+    bool decode(const char *data, size_t size, TexelFormat format);
+
+    // Filtered radiance seen in the direction dir by a ray cone `spread` radians wide: the mip level
+    // whose texels are as wide as the cone, bilinear within the level and blended between two.
+    Vec3f lookup(const Vec3f &dir, float spread = 0) const;
+
+    // Importance sampling of the directions by the luminance of the map times the solid angle of its texels,
+    // on a level of at most 512x512 texels: (u, v) uniform in [0, 1)^2 maps to a direction, pdf is per steradian.
+    Vec3f sample_direction(float u, float v, float &pdf) const;
+    float pdf(const Vec3f &dir) const; // of sample_direction returning dir
+
+    bool empty() const { return texture.empty(); }
+    int nlevels() const { return texture.nlevels(); }
+    int size(int level = 0) const { return texture.width(level); }
+    size_t bytes() const { return texture.bytes(); } // texel memory of all the levels
+    void export_level(int level, std::vector<float> &rgb) const { texture.export_level(level, rgb); }
+
+private:
+    ImageTexture texture; // size x size texels on the top level
+    TexelFormat format;
+    int cdf_size;                   // texels on a side of the level of the distribution
+    std::vector<float> row_cdf;     // cdf_size x cdf_size, each row cumulated and normalized
+    std::vector<float> marginal_cdf; // cdf_size, the rows cumulated by their weight
+
+    void build_distribution();
+    bool save_cache(const std::string &filename, uint64_t key) const;
+    bool load_cache(const std::string &filename, uint64_t key, TexelFormat format);
+};
+
+// octahedral mapping of the unit sphere to [0,1]^2, y is the up axis
+Vec2f octahedral_encode(const Vec3f &dir);
+Vec3f octahedral_decode(float u, float v);
+
+#endif //__ENVMAP_H__
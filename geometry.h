@@ -4,6 +4,9 @@
 #include <vector>
 #include <cassert>
 #include <iostream>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 template <size_t DIM, typename T> struct vec {
     vec() { for (size_t i=DIM; i--; data_[i] = T()); }
@@ -18,32 +21,46 @@ typedef vec<3, float> Vec3f;
 typedef vec<3, int  > Vec3i;
 typedef vec<4, float> Vec4f;
 
+// The small vectors have named members; operator[] looks the member up in a table of member pointers rather
+// than indexing past &x, which C++ does not allow. It is a load and an add whatever i, without branches, and
+// the lookup folds away in the unrolled loops over the components, where i is a constant.
 template <typename T> struct vec<2,T> {
-    vec() : x(T()), y(T()) {}
-    vec(T X, T Y) : x(X), y(Y) {}
+    constexpr vec() : x(T()), y(T()) {}
+    constexpr vec(T X, T Y) : x(X), y(Y) {}
     template <class U> vec<2,T>(const vec<2,U> &v);
-          T& operator[](const size_t i)       { assert(i<2); return i<=0 ? x : y; }
-    const T& operator[](const size_t i) const { assert(i<2); return i<=0 ? x : y; }
+          T& operator[](const size_t i)       { assert(i<2); return this->*members[i]; }
+    const T& operator[](const size_t i) const { assert(i<2); return this->*members[i]; }
     T x,y;
+private:
+    static constexpr T vec<2,T>::* const members[2] = {&vec<2,T>::x, &vec<2,T>::y};
 };
+template <typename T> constexpr T vec<2,T>::* const vec<2,T>::members[2];
 
 template <typename T> struct vec<3,T> {
-    vec() : x(T()), y(T()), z(T()) {}
-    vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
-          T& operator[](const size_t i)       { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
-    const T& operator[](const size_t i) const { assert(i<3); return i<=0 ? x : (1==i ? y : z); }
-    float norm() { return std::sqrt(x*x+y*y+z*z); }
+    constexpr vec() : x(T()), y(T()), z(T()) {}
+    constexpr vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
+          T& operator[](const size_t i)       { assert(i<3); return this->*members[i]; }
+    const T& operator[](const size_t i) const { assert(i<3); return this->*members[i]; }
+    float norm() const { return std::sqrt(x*x+y*y+z*z); }
     vec<3,T> & normalize(T l=1) { *this = (*this)*(l/norm()); return *this; }
     T x,y,z;
+private:
+    static constexpr T vec<3,T>::* const members[3] = {&vec<3,T>::x, &vec<3,T>::y, &vec<3,T>::z};
 };
+template <typename T> constexpr T vec<3,T>::* const vec<3,T>::members[3];
 
 template <typename T> struct vec<4,T> {
-    vec() : x(T()), y(T()), z(T()), w(T()) {}
-    vec(T X, T Y, T Z, T W) : x(X), y(Y), z(Z), w(W) {}
-          T& operator[](const size_t i)       { assert(i<4); return i<=0 ? x : (1==i ? y : (2==i ? z : w)); }
-    const T& operator[](const size_t i) const { assert(i<4); return i<=0 ? x : (1==i ? y : (2==i ? z : w)); }
+    constexpr vec() : x(T()), y(T()), z(T()), w(T()) {}
+    constexpr vec(T X, T Y, T Z, T W) : x(X), y(Y), z(Z), w(W) {}
+          T& operator[](const size_t i)       { assert(i<4); return this->*members[i]; }
+    const T& operator[](const size_t i) const { assert(i<4); return this->*members[i]; }
     T x,y,z,w;
+private:
+    static constexpr T vec<4,T>::* const members[4] = {&vec<4,T>::x, &vec<4,T>::y, &vec<4,T>::z, &vec<4,T>::w};
 };
+template <typename T> constexpr T vec<4,T>::* const vec<4,T>::members[4];
+
+static_assert(sizeof(Vec3f) == 3 * sizeof(float) && sizeof(Vec4f) == 4 * sizeof(float), "vector members must be packed");
 
 template<size_t DIM,typename T> T operator*(const vec<DIM,T>& lhs, const vec<DIM,T>& rhs) {
     T ret = T();
@@ -71,10 +88,86 @@ template<size_t DIM,typename T> vec<DIM,T> operator-(const vec<DIM,T> &lhs) {
     return lhs*T(-1);
 }
 
-template <typename T> vec<3,T> cross(vec<3,T> v1, vec<3,T> v2) {
+// Unrolled constexpr versions for 3 components, preferred over the loops above. They round exactly
+// like the loops (the dot product still sums z, y then x), so results do not depend on which one is used.
+template <typename T> constexpr T operator*(const vec<3,T> &lhs, const vec<3,T> &rhs) {
+    return lhs.z*rhs.z + lhs.y*rhs.y + lhs.x*rhs.x;
+}
+
+template <typename T> constexpr vec<3,T> operator+(const vec<3,T> &lhs, const vec<3,T> &rhs) {
+    return vec<3,T>(lhs.x+rhs.x, lhs.y+rhs.y, lhs.z+rhs.z);
+}
+
+template <typename T> constexpr vec<3,T> operator-(const vec<3,T> &lhs, const vec<3,T> &rhs) {
+    return vec<3,T>(lhs.x-rhs.x, lhs.y-rhs.y, lhs.z-rhs.z);
+}
+
+template <typename T, typename U> constexpr vec<3,T> operator*(const vec<3,T> &lhs, const U& rhs) {
+    return vec<3,T>(lhs.x*rhs, lhs.y*rhs, lhs.z*rhs);
+}
+
+template <typename T> constexpr vec<3,T> operator-(const vec<3,T> &lhs) {
+    return vec<3,T>(-lhs.x, -lhs.y, -lhs.z);
+}
+
+template <typename T> constexpr vec<3,T> cross(const vec<3,T> &v1, const vec<3,T> &v2) {
     return vec<3,T>(v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x);
 }
 
+template <typename T> constexpr T dot(const vec<3,T> &a, const vec<3,T> &b) { return a * b; }
+template <typename T> constexpr T length_squared(const vec<3,T> &v) { return v * v; }
+
+// a * s + b, component by component
+template <typename T> constexpr vec<3,T> fma(const vec<3,T> &a, const T s, const vec<3,T> &b) {
+    return vec<3,T>(a.x*s + b.x, a.y*s + b.y, a.z*s + b.z);
+}
+
+// exact, same as v.normalize() without modifying v
+inline Vec3f normalized(Vec3f v) { return v.normalize(); }
+
+// 1/sqrt(x) from the hardware estimate and one Newton step, relative error below 2^-21
+inline float rsqrt(const float x) {
+#if defined(__SSE2__)
+    const float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return r * (1.5f - .5f * x * r * r);
+#else
+    return 1.f / std::sqrt(x);
+#endif
+}
+
+// normalize() with one rsqrt instead of a sqrt and a divide, for directions that tolerate 2^-21
+inline Vec3f fast_normalized(const Vec3f &v) { return v * rsqrt(length_squared(v)); }
+
+// sin and cos of a in [-pi, pi] by their Taylor polynomials on [-pi/2, pi/2], absolute error below 4e-6,
+// in single precision and without the range reduction of sinf and cosf
+inline void fast_sincos(float a, float &s, float &c) {
+    const float half_pi = 1.57079633f, pi = 3.14159265f;
+    float sign = 1;
+    if (a > half_pi) { // sin(pi - a) = sin(a), cos(pi - a) = -cos(a)
+        a = pi - a;
+        sign = -1;
+    } else if (a < -half_pi) {
+        a = -pi - a;
+        sign = -1;
+    }
+    const float a2 = a * a;
+    s = a * (1 + a2 * (-1 / 6.f + a2 * (1 / 120.f + a2 * (-1 / 5040.f + a2 * (1 / 362880.f)))));
+    c = sign * (1 + a2 * (-.5f + a2 * (1 / 24.f + a2 * (-1 / 720.f + a2 * (1 / 40320.f - a2 * (1 / 3628800.f))))));
+}
+
+// Vec3f padded to 16 bytes and aligned on them, for whole-register SIMD loads and stores (w is not used).
+struct alignas(16) Vec3fa {
+    float x, y, z, w;
+
+    Vec3fa() : x(0), y(0), z(0), w(0) {}
+    Vec3fa(const Vec3f &v) : x(v.x), y(v.y), z(v.z), w(0) {}
+    operator Vec3f() const { return Vec3f(x, y, z); }
+#if defined(__SSE2__)
+    __m128 load() const { return _mm_load_ps(&x); }
+    void store(__m128 v) { _mm_store_ps(&x, v); }
+#endif
+};
+
 template <size_t DIM, typename T> std::ostream& operator<<(std::ostream& out, const vec<DIM,T>& v) {
     for(unsigned int i=0; i<DIM; i++) {
         out << v[i] << " " ;
@@ -82,4 +175,3 @@ template <size_t DIM, typename T> std::ostream& operator<<(std::ostream& out, co
     return out ;
 }
 #endif //__GEOMETRY_H__
-
@@ -0,0 +1,535 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "gpu.h"
+#include "render.h"
+
+namespace {
+    const int material_stride = 9; // refractive index, albedo[4], diffuse color rgb, specular exponent
+    const int texture_rings = 0, texture_checker = 1;
+    static_assert(max_depth < 8, "the device path stack holds 2 * 8 + 1 rays");
+
+#pragma omp declare target
+    // The device code only uses this plain vector and the C math functions, so that it compiles for any
+    // offload target. The operations round like the ones of geometry.h.
+    struct V3 {
+        float x, y, z;
+    };
+
+    inline V3 v3(const float x, const float y, const float z) {
+        V3 v;
+        v.x = x;
+        v.y = y;
+        v.z = z;
+        return v;
+    }
+
+    inline V3 operator+(const V3 &a, const V3 &b) { return v3(a.x + b.x, a.y + b.y, a.z + b.z); }
+    inline V3 operator-(const V3 &a, const V3 &b) { return v3(a.x - b.x, a.y - b.y, a.z - b.z); }
+    inline V3 operator-(const V3 &a) { return v3(-a.x, -a.y, -a.z); }
+    inline V3 operator*(const V3 &a, const float s) { return v3(a.x * s, a.y * s, a.z * s); }
+    inline V3 operator*(const V3 &a, const double s) { return v3(a.x * s, a.y * s, a.z * s); }
+    inline float operator*(const V3 &a, const V3 &b) { return a.z * b.z + a.y * b.y + a.x * b.x; }
+    inline float norm(const V3 &v) { return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z); }
+    inline V3 normalized(const V3 &v) { return v * (1.f / norm(v)); }
+
+    inline float offset_coordinate(const float p, const float n) { // one coordinate of leave_surface (render.h)
+        if (fabsf(p) < 1.f / 32) return p + n * (1.f / 65536);
+        int32_t bits;
+        memcpy(&bits, &p, sizeof(bits));
+        const int32_t ulps = static_cast<int32_t>(256 * n);
+        bits += p < 0 ? -ulps : ulps;
+        float q;
+        memcpy(&q, &bits, sizeof(q));
+        return q;
+    }
+
+    inline V3 leave_surface(const V3 &point, const V3 &N, const V3 &dir) {
+        const V3 n = dir * N < 0 ? -N : N;
+        return v3(offset_coordinate(point.x, n.x), offset_coordinate(point.y, n.y), offset_coordinate(point.z, n.z));
+    }
+
+    // the arrays of GpuRenderer, as seen on the device
+    struct DeviceScene {
+        const float *node_bounds;
+        const int *node_offset, *node_count;
+        int nnodes;
+        const float *cx, *cy, *cz, *r2, *inv_r;
+        const int *sphere_mat;
+        const float *materials;
+        const float *lights;
+        int nlights;
+        const float *envmap;
+        int envmap_size, envmap_levels;
+        int ground_texture;
+        const float *ground_params;
+        int ground_a, ground_b;
+    };
+
+    struct DeviceCounters {
+        uint64_t primary, secondary, shadow;
+    };
+
+    inline float random_float(uint32_t &state) { // xorshift32, one stream per pixel
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1.f / 16777216.f);
+    }
+
+    inline bool box_hit(const float *b, const V3 &o, const V3 &inv_dir, const float tmax) { // AABB::ray_intersect
+        const float orig[3] = {o.x, o.y, o.z}, inv[3] = {inv_dir.x, inv_dir.y, inv_dir.z};
+        float t0 = 0, t1 = tmax;
+        for (int i = 0; i < 3; i++) {
+            float tnear = (b[i] - orig[i]) * inv[i];
+            float tfar = (b[3 + i] - orig[i]) * inv[i];
+            if (tnear > tfar) {
+                const float t = tnear;
+                tnear = tfar;
+                tfar = t;
+            }
+            t0 = tnear > t0 ? tnear : t0;
+            t1 = tfar < t1 ? tfar : t1;
+            if (t0 > t1) return false;
+        }
+        return true;
+    }
+
+    // Closest sphere closer than tmax (shrinks it), or -1. With any, returns at the first sphere found.
+    int trace_spheres(const DeviceScene &s, const V3 &o, const V3 &d, float &tmax, const bool any) {
+        if (!s.nnodes) return -1;
+        const V3 inv_dir = v3(1.f / d.x, 1.f / d.y, 1.f / d.z);
+        int stack[bvh_stack_size];
+        int sp = 0, cur = 0, best = -1;
+        for (;;) {
+            if (box_hit(&s.node_bounds[cur * 6], o, inv_dir, tmax)) {
+                if (!s.node_count[cur]) {
+                    stack[sp++] = s.node_offset[cur];
+                    cur = cur + 1;
+                    continue;
+                }
+                for (int i = s.node_offset[cur]; i < s.node_offset[cur] + s.node_count[cur]; i++) {
+                    const float lx = s.cx[i] - o.x, ly = s.cy[i] - o.y, lz = s.cz[i] - o.z;
+                    const float tca = lz * d.z + ly * d.y + lx * d.x;
+                    const float d2 = lz * lz + ly * ly + lx * lx - tca * tca;
+                    if (d2 > s.r2[i]) continue;
+                    const float thc = sqrtf(s.r2[i] - d2);
+                    float t = tca - thc;
+                    if (t < 0) t = tca + thc;
+                    if (t < 0 || t >= tmax) continue;
+                    tmax = t;
+                    best = i;
+                    if (any) return best;
+                }
+            }
+            if (!sp) return best;
+            cur = stack[--sp];
+        }
+    }
+
+    inline bool ground_distance(const V3 &o, const V3 &d, const float tmax, float &t) { // checkerboard_distance
+        const float height = o.y + 4;
+        if (height * d.y >= 0 || fabsf(d.y) <= 1e-3) return false;
+        t = -height / d.y;
+        if (t >= tmax) return false;
+        const float x = o.x + d.x * t, z = o.z + d.z * t;
+        return fabsf(x) < 10 && z < -10 && z > -30;
+    }
+
+    int ground_material(const DeviceScene &s, const V3 &p) { // the built-in textures of texture.cpp
+        const float *params = s.ground_params;
+        float value;
+        if (s.ground_texture == texture_rings) {
+            const V3 diff = p - v3(params[0], params[1], params[2]);
+            const float radius = norm(diff);
+            const float angle = atan2(diff.z, diff.x);
+            const bool distance_pattern = static_cast<int>(floor(radius / params[3])) % 2;
+            const bool angle_pattern = static_cast<int>(floor(angle / (M_PI / 20))) % 2;
+            value = (distance_pattern ^ angle_pattern) ? 1.f : 0.f;
+        } else {
+            const int i = static_cast<int>(floor(p.x / params[0])), k = static_cast<int>(floor(p.z / params[0]));
+            value = (i + k) & 1 ? 1.f : 0.f;
+        }
+        return value < .5f ? s.ground_a : s.ground_b;
+    }
+
+    // scene_intersect for the offloaded scenes, curvature as Hit::curvature
+    bool closest_hit(const DeviceScene &s, const V3 &o, const V3 &d, V3 &point, V3 &N, int &material, float &curvature) {
+        float t = FLT_MAX, g;
+        const int sphere = trace_spheres(s, o, d, t, false);
+        if (ground_distance(o, d, t, g)) {
+            point = o + d * g;
+            N = v3(0, 1, 0);
+            material = ground_material(s, point);
+            curvature = 0;
+            return g < 1000;
+        }
+        if (sphere < 0 || t >= 1000) return false;
+        const V3 center = v3(s.cx[sphere], s.cy[sphere], s.cz[sphere]);
+        N = normalized(o + d * t - center);
+        point = center + N * (1.f / s.inv_r[sphere]); // on the sphere, as surface_interaction
+        material = s.sphere_mat[sphere];
+        curvature = s.inv_r[sphere];
+        return true;
+    }
+
+    bool occluded(const DeviceScene &s, const V3 &o, const V3 &d, const float tmax) {
+        float t = tmax;
+        if (ground_distance(o, d, tmax, t)) return true;
+        t = tmax;
+        return trace_spheres(s, o, d, t, true) >= 0;
+    }
+
+    // texel x, y of a level of the envmap, the levels one after the other, with the octahedral wrap of ImageTexture::fetch
+    V3 envmap_texel(const DeviceScene &s, const int level, int x, int y) {
+        size_t offset = 0;
+        int n = s.envmap_size;
+        for (int l = 0; l < level; l++) {
+            offset += static_cast<size_t>(n) * n * 3;
+            n = n / 2 > 1 ? n / 2 : 1;
+        }
+        if (x < 0 || x >= n) {
+            x = x < 0 ? -1 - x : 2 * n - 1 - x;
+            y = n - 1 - y;
+        }
+        if (y < 0 || y >= n) {
+            y = y < 0 ? -1 - y : 2 * n - 1 - y;
+            x = n - 1 - x;
+        }
+        x = x < n - 1 ? x : n - 1;
+        y = y < n - 1 ? y : n - 1;
+        x = x > 0 ? x : 0;
+        y = y > 0 ? y : 0;
+        const float *c = &s.envmap[offset + (x + static_cast<size_t>(y) * n) * 3];
+        return v3(c[0], c[1], c[2]);
+    }
+
+    V3 envmap_bilinear(const DeviceScene &s, const int level, const float u, const float v) { // ImageTexture::bilinear
+        int n = s.envmap_size;
+        for (int l = 0; l < level; l++) n = n / 2 > 1 ? n / 2 : 1;
+        const float x = u * n - .5f, y = v * n - .5f;
+        const float fx = floorf(x), fy = floorf(y);
+        const int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+        const float a = x - fx, b = y - fy;
+        return (envmap_texel(s, level, x0, y0) * (1 - a) + envmap_texel(s, level, x0 + 1, y0) * a) * (1 - b) +
+               (envmap_texel(s, level, x0, y0 + 1) * (1 - a) + envmap_texel(s, level, x0 + 1, y0 + 1) * a) * b;
+    }
+
+    // EnvironmentMap::lookup: the levels of the mip chain blended by the spread of the ray cone
+    V3 background(const DeviceScene &s, const V3 &d, const float spread) {
+        if (!s.envmap_size) return v3(0.2, 0.7, 0.8);
+        const float l1 = fabsf(d.x) + fabsf(d.y) + fabsf(d.z);
+        float x = d.x / l1, z = d.z / l1;
+        if (d.y < 0) {
+            const float fx = (1 - fabsf(z)) * (x < 0 ? -1.f : 1.f);
+            const float fz = (1 - fabsf(x)) * (z < 0 ? -1.f : 1.f);
+            x = fx;
+            z = fz;
+        }
+        const float u = x * .5f + .5f, v = z * .5f + .5f;
+        const float lod = log2f(fmaxf(1e-8f, spread * .45f * s.envmap_size));
+        if (!(lod > 0)) return envmap_bilinear(s, 0, u, v);
+        if (lod >= s.envmap_levels - 1) return envmap_bilinear(s, s.envmap_levels - 1, u, v);
+        const int level = static_cast<int>(lod);
+        const float t = lod - level;
+        const V3 fine = envmap_bilinear(s, level, u, v);
+        return t > 0 ? fine * (1 - t) + envmap_bilinear(s, level + 1, u, v) * t : fine;
+    }
+
+    inline V3 reflect(const V3 &I, const V3 &N) { return I - N * 2.f * (I * N); }
+
+    V3 refract(const V3 &I, V3 N, float eta_t, float eta_i) {
+        float cosi = -fmaxf(-1.f, fminf(1.f, I * N));
+        if (cosi < 0) { // from the inside of the object: swap the air and the media
+            cosi = -cosi;
+            N = -N;
+            const float e = eta_t;
+            eta_t = eta_i;
+            eta_i = e;
+        }
+        const float eta = eta_i / eta_t;
+        const float k = 1 - eta * eta * (1 - cosi * cosi);
+        return k < 0 ? v3(1, 0, 0) : I * eta + N * (eta * cosi - sqrtf(k));
+    }
+
+    inline bool survives(float &weight, uint32_t &rng) { // render.cpp
+        const float rr_threshold = .1f;
+        if (weight <= 0) return false;
+        if (weight >= rr_threshold) return true;
+        if (random_float(rng) * rr_threshold >= weight) return false;
+        weight = rr_threshold;
+        return true;
+    }
+
+    V3 direct_lighting(const DeviceScene &s, const V3 &dir, const V3 &point, const V3 &N, const float *m, DeviceCounters &counters) {
+        float diffuse = 0, specular = 0;
+        for (int i = 0; i < s.nlights; i++) {
+            const float *light = &s.lights[i * 4];
+            const V3 to_light = v3(light[0], light[1], light[2]) - point;
+            const V3 light_dir = normalized(to_light);
+            const V3 shadow_orig = leave_surface(point, N, light_dir);
+            counters.shadow++;
+            if (occluded(s, shadow_orig, light_dir, norm(to_light))) continue;
+            diffuse += light[3] * fmaxf(0.f, light_dir * N);
+            specular += powf(fmaxf(0.f, -reflect(-light_dir, N) * dir), m[8]) * light[3];
+        }
+        return v3(m[5], m[6], m[7]) * diffuse * m[1] + v3(1., 1., 1.) * specular * m[2];
+    }
+
+    // The iterative integrator of cast_ray, with the same depth limit, Russian roulette and ray cones.
+    V3 integrate(const DeviceScene &s, const V3 &orig, const V3 &dir, const float spread, const int max_depth, uint32_t &rng,
+                 DeviceCounters &counters) {
+        struct Pending {
+            V3 orig, dir;
+            float weight;
+            int depth;
+            float width, spread; // PendingRay
+        };
+        Pending stack[2 * 8 + 1];
+        int sp = 0;
+        stack[sp].orig = orig;
+        stack[sp].dir = dir;
+        stack[sp].weight = 1;
+        stack[sp].width = 0;
+        stack[sp].spread = spread;
+        stack[sp++].depth = 0;
+        V3 color = v3(0, 0, 0);
+        while (sp) {
+            const Pending ray = stack[--sp];
+            V3 point, N;
+            int material;
+            float curvature;
+            if (ray.depth) counters.secondary++;
+            else counters.primary++;
+            if (ray.depth > max_depth || !closest_hit(s, ray.orig, ray.dir, point, N, material, curvature)) {
+                color = color + background(s, ray.dir, ray.spread) * ray.weight;
+                continue;
+            }
+            const float *m = &s.materials[material * material_stride];
+            const float width = ray.width + ray.spread * norm(point - ray.orig); // push_secondary
+            float reflect_weight = ray.weight * m[3];
+            if (survives(reflect_weight, rng)) {
+                const V3 d = normalized(reflect(ray.dir, N));
+                Pending &p = stack[sp++];
+                p.orig = leave_surface(point, N, d);
+                p.dir = d;
+                p.weight = reflect_weight;
+                p.depth = ray.depth + 1;
+                p.width = width;
+                p.spread = ray.spread + 2 * width * curvature;
+            }
+            float refract_weight = ray.weight * m[4];
+            if (survives(refract_weight, rng)) {
+                const V3 d = normalized(refract(ray.dir, N, m[0], 1.f));
+                Pending &p = stack[sp++];
+                p.orig = leave_surface(point, N, d);
+                p.dir = d;
+                p.weight = refract_weight;
+                p.depth = ray.depth + 1;
+                p.width = width;
+                p.spread = ray.spread;
+            }
+            if (m[1] > 0 || m[2] > 0) color = color + direct_lighting(s, ray.dir, point, N, m, counters) * ray.weight;
+        }
+        return color;
+    }
+#pragma omp end declare target
+
+    template<typename T> const T *data_or_null(const std::vector<T> &v) { return v.empty() ? nullptr : v.data(); }
+
+    // copies the array to the device, where it stays until release()
+    template<typename T> void upload(const std::vector<T> &v) {
+        const T *p = data_or_null(v);
+        const size_t n = v.size();
+#pragma omp target enter data map(to: p[0:n])
+    }
+
+    template<typename T> void release(const std::vector<T> &v) {
+        const T *p = data_or_null(v);
+        const size_t n = v.size();
+#pragma omp target exit data map(delete: p[0:n])
+    }
+}
+
+bool GpuRenderer::supports(const Scene &scene, std::string &reason) {
+    if (!scene.primitives.empty()) reason = "primitives";
+    else if (!scene.instances.empty()) reason = "instances";
+    else if (!scene.meshes.empty()) reason = "meshes";
+    else if (scene.area_lights) reason = "area lights";
+    else if (scene.camera.aperture > 0) reason = "depth of field";
+    else if (scene.envmap_samples > 0) reason = "envmap lighting";
+    else if (scene.single_branch) reason = "single branch paths";
+    else if (scene.samples_lights()) reason = "light sampling";
+    else if (scene.fast_shading) reason = "fast shading";
+    else if (std::min(scene.reflect_depth, std::min(scene.refract_depth, scene.shadow_depth)) < scene.depth_limit)
+        reason = "depth limits per ray type";
+    else if (scene.sphere_accel != ACCEL_BVH) reason = "sphere grid or quantized BVH";
+    else if (scene.surfaces[0].texture != find_texture("rings") && scene.surfaces[0].texture != find_texture("checker"))
+        reason = "ground texture other than rings or checker";
+    else if (std::find_if(scene.spheres.begin(), scene.spheres.end(), [](const Sphere &sp) { return sp.material & Scene::textured; })
+             != scene.spheres.end()) reason = "textured spheres";
+    else return true;
+    return false;
+}
+
+int GpuRenderer::devices() {
+#ifdef _OPENMP
+    return omp_get_num_devices();
+#else
+    return 0;
+#endif
+}
+
+GpuRenderer::GpuRenderer(const Scene &scene) : envmap_size(0), envmap_levels(0), ground_a(0), ground_b(0) {
+    const BVH &bvh = scene.sphere_bvh;
+    for (size_t i = 0; i < bvh.nodes.size(); i++) {
+        const BVHNode &node = bvh.nodes[i];
+        for (size_t k = 0; k < 3; k++) node_bounds.push_back(node.bounds.min[k]);
+        for (size_t k = 0; k < 3; k++) node_bounds.push_back(node.bounds.max[k]);
+        node_offset.push_back(node.offset);
+        node_count.push_back(node.count);
+    }
+    const SphereSoA &soa = scene.sphere_soa;
+    cx = soa.cx;
+    cy = soa.cy;
+    cz = soa.cz;
+    r2 = soa.r2;
+    inv_r.assign(soa.inv_r.begin(), soa.inv_r.end());
+    inv_r.resize(cx.size(), 0); // same length as the padded lanes
+    sphere_mat.assign(soa.mat.begin(), soa.mat.end());
+    for (size_t i = 0; i < scene.materials.size(); i++) {
+        const Material &m = scene.materials[i];
+        materials.push_back(m.refractive_index);
+        for (size_t k = 0; k < 4; k++) materials.push_back(m.albedo[k]);
+        for (size_t k = 0; k < 3; k++) materials.push_back(m.diffuse_color[k]);
+        materials.push_back(m.specular_exponent);
+    }
+    for (size_t i = 0; i < scene.lights.size(); i++) {
+        for (size_t k = 0; k < 3; k++) lights.push_back(scene.lights[i].position[k]);
+        lights.push_back(scene.lights[i].intensity);
+    }
+    if (scene.envmap && !scene.envmap->empty()) {
+        envmap_size = scene.envmap->size(0);
+        envmap_levels = scene.envmap->nlevels();
+        std::vector<float> level;
+        for (int l = 0; l < envmap_levels; l++) {
+            scene.envmap->export_level(l, level);
+            envmap.insert(envmap.end(), level.begin(), level.end());
+        }
+    }
+    const TexturedSurface &ground = scene.surfaces[0];
+    ground_texture = ground.texture == find_texture("rings") ? texture_rings : texture_checker;
+    for (int k = 0; k < max_texture_params; k++) ground_params[k] = ground.params[k];
+    ground_a = ground.material_a;
+    ground_b = ground.material_b;
+
+    // copied once, the render() target regions find them present
+    upload(node_bounds);
+    upload(node_offset);
+    upload(node_count);
+    upload(cx);
+    upload(cy);
+    upload(cz);
+    upload(r2);
+    upload(inv_r);
+    upload(sphere_mat);
+    upload(materials);
+    upload(lights);
+    upload(envmap);
+}
+
+GpuRenderer::~GpuRenderer() {
+    release(node_bounds);
+    release(node_offset);
+    release(node_count);
+    release(cx);
+    release(cy);
+    release(cz);
+    release(r2);
+    release(inv_r);
+    release(sphere_mat);
+    release(materials);
+    release(lights);
+    release(envmap);
+}
+
+void GpuRenderer::render(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer) {
+    PROFILE_SCOPE("gpu render");
+    framebuffer.resize(width * height);
+    float *fb = &framebuffer[0].x; // Vec3f is packed, see geometry.h
+    const size_t npixels = framebuffer.size();
+
+    const float *nb = data_or_null(node_bounds), *pcx = data_or_null(cx), *pcy = data_or_null(cy), *pcz = data_or_null(cz);
+    const float *pr2 = data_or_null(r2), *pinv = data_or_null(inv_r), *pm = data_or_null(materials), *pl = data_or_null(lights);
+    const float *pe = data_or_null(envmap);
+    const int *no = data_or_null(node_offset), *nc = data_or_null(node_count), *sm = data_or_null(sphere_mat);
+    const size_t nnodes = node_offset.size(), nlanes = cx.size();
+    const size_t nmat = materials.size(), nlight = lights.size(), nenv = envmap.size();
+    const float gp0 = ground_params[0], gp1 = ground_params[1], gp2 = ground_params[2], gp3 = ground_params[3];
+    const int texture = ground_texture, env_size = envmap_size, env_levels = envmap_levels, ga = ground_a, gb = ground_b, depth = static_cast<int>(scene.depth_limit);
+
+    // the image plane of the CPU renderers, once per frame
+    const ImagePlane plane(scene.camera, width, height);
+    const float dir_z = plane.dir_z, spread = plane.spread(), half_width = plane.half_width, half_height = plane.half_height;
+    const float px = plane.position.x, py = plane.position.y, pz = plane.position.z;
+    const float rx = plane.right.x, ry = plane.right.y, rz = plane.right.z;
+    const float ux = plane.up.x, uy = plane.up.y, uz = plane.up.z;
+    const float fx = plane.forward.x, fy = plane.forward.y, fz = plane.forward.z;
+
+    uint64_t primary = 0, secondary = 0, shadow = 0;
+#pragma omp target teams distribute parallel for collapse(2) reduction(+: primary, secondary, shadow) \
+        map(to: nb[0:nnodes * 6], no[0:nnodes], nc[0:nnodes], pcx[0:nlanes], pcy[0:nlanes], pcz[0:nlanes], \
+                pr2[0:nlanes], pinv[0:nlanes], sm[0:nlanes], pm[0:nmat], pl[0:nlight], pe[0:nenv]) \
+        map(from: fb[0:npixels * 3]) map(tofrom: primary, secondary, shadow)
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            const float gp[4] = {gp0, gp1, gp2, gp3};
+            DeviceScene s;
+            s.node_bounds = nb;
+            s.node_offset = no;
+            s.node_count = nc;
+            s.nnodes = static_cast<int>(nnodes);
+            s.cx = pcx;
+            s.cy = pcy;
+            s.cz = pcz;
+            s.r2 = pr2;
+            s.inv_r = pinv;
+            s.sphere_mat = sm;
+            s.materials = pm;
+            s.lights = pl;
+            s.nlights = static_cast<int>(nlight / 4);
+            s.envmap = pe;
+            s.envmap_size = env_size;
+            s.envmap_levels = env_levels;
+            s.ground_texture = texture;
+            s.ground_params = gp;
+            s.ground_a = ga;
+            s.ground_b = gb;
+
+            const float dir_x = (i + .5f) - half_width;
+            const float dir_y = -(j + .5f) + half_height;
+            const V3 dir = normalized(v3(rx, ry, rz) * dir_x + v3(ux, uy, uz) * dir_y + v3(fx, fy, fz) * dir_z);
+            uint32_t rng = 2463534242u ^ (static_cast<uint32_t>(i + j * width) * 2654435761u);
+            if (!rng) rng = 2463534242u;
+            DeviceCounters counters = {0, 0, 0};
+            const V3 c = integrate(s, v3(px, py, pz), dir, spread, depth, rng, counters);
+            float *out = &fb[(i + static_cast<size_t>(j) * width) * 3];
+            out[0] = c.x;
+            out[1] = c.y;
+            out[2] = c.z;
+            primary += counters.primary;
+            secondary += counters.secondary;
+            shadow += counters.shadow;
+        }
+    }
+    RayCounters &counters = thread_ray_counters();
+    counters.primary += primary;
+    counters.secondary += secondary;
+    counters.shadow += shadow;
+}
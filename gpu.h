@@ -0,0 +1,46 @@
+#ifndef __GPU_H__
+#define __GPU_H__
+#include <vector>
+#include <string>
+#include "geometry.h"
+#include "scene.h"
+
+// Offloaded back-end: the same shading model as cast_ray, one pixel per device thread, through OpenMP
+// target regions. The scene is flattened into plain arrays (sphere BVH nodes, sphere lanes, materials,
+// lights, the envmap levels) that are copied to the device once, when the renderer is created.
+// Built with -foffload (see CMakeLists.txt) the kernel runs on the GPU; otherwise, or without a device
+// at runtime, OpenMP runs it on the host, so the cast_ray path stays the reference to compare against.
+//
+// Only the spheres and the ground (rings or checker texture) are offloaded, and every light is
+// shaded: light sampling, fast shading, envmap lighting, single branch paths, primitives, instances
+// and meshes stay on the CPU.
+class GpuRenderer {
+public:
+    // false, with the reason, if the scene uses something the device kernel does not handle
+    static bool supports(const Scene &scene, std::string &reason);
+    static int devices(); // offload devices available, 0 means the kernel runs on the host
+
+    explicit GpuRenderer(const Scene &scene); // uploads the scene, which must be supported
+    ~GpuRenderer();
+
+    // the camera is read from the scene again, the geometry uploaded by the constructor is not
+    void render(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer);
+
+private:
+    GpuRenderer(const GpuRenderer &);
+    GpuRenderer &operator=(const GpuRenderer &);
+
+    std::vector<float> node_bounds; // min x, y, z, max x, y, z per node
+    std::vector<int> node_offset, node_count;
+    std::vector<float> cx, cy, cz, r2, inv_r;
+    std::vector<int> sphere_mat;
+    std::vector<float> materials; // material_stride floats per material
+    std::vector<float> lights;    // x, y, z, intensity
+    std::vector<float> envmap;    // rgb of the levels, envmap_size x envmap_size first, empty for the plain sky
+    int envmap_size, envmap_levels;
+    int ground_texture;           // 0 rings, 1 checker
+    float ground_params[max_texture_params];
+    int ground_a, ground_b;       // materials of the ground texture
+};
+
+#endif //__GPU_H__
@@ -0,0 +1,72 @@
+#include "grid.h"
+
+void SphereGrid::build(const std::vector<Vec3f> &centers, const std::vector<float> &radii, const float density) {
+    cells.clear();
+    indices.clear();
+    bounds = AABB();
+    if (centers.empty()) return;
+    for (size_t i = 0; i < centers.size(); i++) {
+        const Vec3f r(radii[i], radii[i], radii[i]);
+        bounds.expand(AABB(centers[i] - r, centers[i] + r));
+    }
+
+    // cubic cells, as many as the spheres over the density but at least two diameters wide: smaller ones
+    // list most spheres in 8 cells (a million small spheres: 3.3 lanes per sphere, 6.7 at one diameter,
+    // and a third slower); flat or thin sets get larger cells, so that their axis of one cell does not
+    // multiply the count of the others
+    double diameters = 0;
+    for (size_t i = 0; i < radii.size(); i++) diameters += 2 * double(radii[i]);
+    const Vec3f extent = bounds.max - bounds.min;
+    const float volume = std::max(1e-30f, extent.x * extent.y * extent.z);
+    const size_t max_cells = static_cast<size_t>(4 * centers.size() / density) + 64;
+    for (float side = std::max(std::cbrt(volume * density / centers.size()), float(2 * diameters / radii.size()));; side *= 1.25f) {
+        size_t ncells = 1;
+        for (size_t i = 0; i < 3; i++) {
+            res[i] = std::max(1, std::min(1024, static_cast<int>(std::ceil(extent[i] / side))));
+            ncells *= res[i];
+        }
+        if (ncells <= max_cells) break;
+    }
+    for (size_t i = 0; i < 3; i++) {
+        cell_size[i] = std::max(1e-30f, extent[i] / res[i]);
+        inv_cell[i] = 1.f / cell_size[i];
+    }
+
+    // the cells of a sphere: those its box overlaps, less the corners it does not reach
+    std::vector<int> overlapped;
+    auto cells_of = [&](const size_t s) -> const std::vector<int> & {
+        overlapped.clear();
+        int lo[3], hi[3];
+        for (size_t i = 0; i < 3; i++) {
+            lo[i] = std::max(0, std::min(res[i] - 1, static_cast<int>((centers[s][i] - radii[s] - bounds.min[i]) * inv_cell[i])));
+            hi[i] = std::max(0, std::min(res[i] - 1, static_cast<int>((centers[s][i] + radii[s] - bounds.min[i]) * inv_cell[i])));
+        }
+        const float r2 = radii[s] * radii[s];
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    const int c[3] = {x, y, z};
+                    float d2 = 0; // from the center to the box of the cell, with some slack for rounding
+                    for (size_t i = 0; i < 3; i++) {
+                        const float cmin = bounds.min[i] + c[i] * cell_size[i], cmax = cmin + cell_size[i];
+                        const float d = centers[s][i] < cmin ? cmin - centers[s][i] : centers[s][i] > cmax ? centers[s][i] - cmax : 0;
+                        d2 += d * d;
+                    }
+                    if (d2 <= r2 * 1.0001f) overlapped.push_back((z * res[1] + y) * res[0] + x);
+                }
+            }
+        }
+        return overlapped;
+    };
+
+    const size_t ncells = size_t(res[0]) * res[1] * res[2];
+    std::vector<int> count(ncells, 0);
+    for (size_t s = 0; s < centers.size(); s++)
+        for (int c : cells_of(s)) count[c]++;
+    cells.assign(ncells + 1, 0);
+    for (size_t c = 0; c < ncells; c++) cells[c + 1] = cells[c] + count[c];
+    indices.resize(cells[ncells]);
+    std::vector<int> fill(cells.begin(), cells.end() - 1);
+    for (size_t s = 0; s < centers.size(); s++)
+        for (int c : cells_of(s)) indices[fill[c]++] = static_cast<int>(s);
+}
@@ -0,0 +1,100 @@
+#ifndef __GRID_H__
+#define __GRID_H__
+#include <vector>
+#include <cmath>
+#include <limits>
+#include "bvh.h"
+
+// Uniform grid over spheres, the alternative to the BVH for many spheres of about the same size (long
+// chains of small spheres, particles): the build is one counting pass and one filling pass, and a ray
+// walks the cells it crosses in order with a 3D-DDA, so that it stops at the first cell holding its hit.
+// A sphere is listed in every cell its box overlaps and its sphere touches; a cell is the range
+// [cells[c], cells[c + 1]) of `indices`, so that spheres stored in cell order are a lane range per cell.
+class SphereGrid {
+public:
+    AABB bounds;
+    int res[3];                // cells along each axis
+    Vec3f cell_size, inv_cell; // in world units, and its inverse
+    std::vector<int> cells;    // first entry in indices of each cell, x fastest, plus the end
+    std::vector<int> indices;  // sphere ids in cell order, a sphere in several cells appears once in each
+
+    SphereGrid() : res{0, 0, 0} {}
+
+    // about `density` spheres per cell on average, for centers and radii given sphere by sphere
+    void build(const std::vector<Vec3f> &centers, const std::vector<float> &radii, float density = 2);
+
+    bool empty() const { return cells.empty(); }
+    size_t bytes() const { return (cells.capacity() + indices.capacity()) * sizeof(int); }
+
+    // Closest hit query, same contract as BVH::intersect_leaves: intersect_cell(offset, count, tmax) tests the
+    // range [offset, offset+count) of indices and shrinks tmax on a hit. The walk ends at the first cell
+    // the current tmax does not go past, since every surface the ray meets before it lies in a cell visited.
+    template<typename F> bool intersect_cells(const Vec3f &orig, const Vec3f &dir, float &tmax, F intersect_cell) const {
+        bool hit = false;
+        walk(orig, dir, tmax, [&](int cell, float t_exit) {
+            const int offset = cells[cell], count = cells[cell + 1] - offset;
+            if (count) hit |= intersect_cell(offset, count, tmax);
+            return tmax > t_exit;
+        });
+        return hit;
+    }
+
+    // Any-hit query for shadow rays, same contract as BVH::occluded_leaves.
+    template<typename F> bool occluded_cells(const Vec3f &orig, const Vec3f &dir, const float tmax, F occluded_cell) const {
+        bool occluded = false;
+        walk(orig, dir, tmax, [&](int cell, float) {
+            const int offset = cells[cell], count = cells[cell + 1] - offset;
+            occluded = count && occluded_cell(offset, count, tmax);
+            return !occluded;
+        });
+        return occluded;
+    }
+
+private:
+    // Visits the cells pierced by the ray before tmax, in order: visit(cell, t_exit) gets the distance at
+    // which the ray leaves the cell and returns false to stop. tmax is read again after every cell.
+    template<typename F> void walk(const Vec3f &orig, const Vec3f &dir, const float &tmax, F visit) const {
+        if (cells.empty()) return;
+        float t0 = 0, t1 = tmax;
+        const Vec3f inv_dir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        for (size_t i = 0; i < 3; i++) { // the slab test of AABB, keeping the interval
+            float tnear = (bounds.min[i] - orig[i]) * inv_dir[i];
+            float tfar = (bounds.max[i] - orig[i]) * inv_dir[i];
+            if (tnear > tfar) std::swap(tnear, tfar);
+            t0 = tnear > t0 ? tnear : t0;
+            t1 = tfar < t1 ? tfar : t1;
+            if (t0 > t1) return;
+        }
+        const Vec3f entry = orig + dir * t0;
+        int cell[3], step[3], out[3];
+        float next[3], delta[3];
+        for (size_t i = 0; i < 3; i++) {
+            const int c = static_cast<int>((entry[i] - bounds.min[i]) * inv_cell[i]);
+            cell[i] = std::max(0, std::min(res[i] - 1, c));
+            if (dir[i] == 0) { // never leaves the slab of its cell along this axis
+                step[i] = 0;
+                out[i] = -1;
+                next[i] = delta[i] = std::numeric_limits<float>::infinity();
+                continue;
+            }
+            step[i] = dir[i] > 0 ? 1 : -1;
+            out[i] = dir[i] > 0 ? res[i] : -1;
+            const float boundary = bounds.min[i] + (cell[i] + (dir[i] > 0)) * cell_size[i];
+            next[i] = t0 + std::max(0.f, (boundary - entry[i]) * inv_dir[i]);
+            delta[i] = cell_size[i] * std::fabs(inv_dir[i]);
+        }
+        for (;;) {
+            PROFILE_COUNT(bvh_nodes, 1);
+            // the axis whose cell boundary comes first
+            const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            const float t_exit = next[axis];
+            if (!visit((cell[2] * res[1] + cell[1]) * res[0] + cell[0], t_exit)) return;
+            if (t_exit > tmax || t_exit > t1) return;
+            cell[axis] += step[axis];
+            if (cell[axis] == out[axis]) return;
+            next[axis] += delta[axis];
+        }
+    }
+};
+
+#endif //__GRID_H__
@@ -0,0 +1,51 @@
+#ifndef __HALF_H__
+#define __HALF_H__
+#include <cstdint>
+#include <cstring>
+
+// IEEE 754 binary16 conversions, round to nearest even. Plain bit manipulation so that no F16C
+// support is required; only used at load time and on texel fetches.
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const uint32_t absx = x & 0x7fffffff;
+    if (absx >= 0x7f800000) return static_cast<uint16_t>(sign | (absx > 0x7f800000 ? 0x7e00 : 0x7c00)); // NaN, Inf
+    if (absx >= 0x477ff000) return static_cast<uint16_t>(sign | 0x7c00);                                  // overflow
+    if (absx < 0x38800000) { // subnormal half, or zero
+        if (absx < 0x33000000) return static_cast<uint16_t>(sign);
+        const uint32_t mant = (absx & 0x7fffff) | 0x800000;
+        const int shift = 126 - static_cast<int>(absx >> 23); // 14..24
+        uint32_t h = mant >> shift;
+        const uint32_t rem = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1))) h++;
+        return static_cast<uint16_t>(sign | h);
+    }
+    uint32_t h = ((absx - 0x38000000) >> 13);
+    const uint32_t rem = absx & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+    return static_cast<uint16_t>(sign | h);
+}
+
+inline float half_to_float(uint16_t h) {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    const uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0x1f) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else if (exp) {
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant) { // subnormal: normalize
+        int e = 113;
+        while (!(mant & 0x400)) { mant <<= 1; e--; }
+        x = sign | (static_cast<uint32_t>(e) << 23) | ((mant & 0x3ff) << 13);
+    } else {
+        x = sign;
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+#endif //__HALF_H__
@@ -0,0 +1,239 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "image_texture.h"
+#include "half.h"
+#include "stb_image.h"
+#include "stb_image_resize.h"
+#include "stb_dxt.h"
+
+void ImageTexture::allocate(Level &l, int width, int height) const {
+    l.width = width;
+    l.height = height;
+    l.tiles_x = (width + 3) / 4;
+    const size_t tiles = size_t(l.tiles_x) * ((height + 3) / 4);
+    l.rgb.clear();
+    l.rgb16.clear();
+    l.bc1.clear();
+    if (format == TEXELS_FLOAT) l.rgb.assign(tiles * 16, Vec3f());
+    else if (format == TEXELS_HALF) l.rgb16.assign(tiles * 16 * 3, 0);
+    else l.bc1.assign(tiles * 8, 0);
+}
+
+void ImageTexture::store(Level &l, const float *rgb) {
+    if (format != TEXELS_BC1) {
+#pragma omp parallel for schedule(static)
+        for (int y = 0; y < l.height; y++) {
+            for (int x = 0; x < l.width; x++) {
+                const float *p = &rgb[(x + size_t(y) * l.width) * 3];
+                const size_t i = index(l, x, y);
+                if (format == TEXELS_FLOAT) l.rgb[i] = Vec3f(p[0], p[1], p[2]);
+                else for (size_t k = 0; k < 3; k++) l.rgb16[i * 3 + k] = float_to_half(p[k]);
+            }
+        }
+        return;
+    }
+    unsigned char warmup[8], black[64] = {0};
+    stb_compress_dxt_block(warmup, black, 0, STB_DXT_HIGHQUAL); // builds its tables, which is not thread safe
+    const int tiles_y = (l.height + 3) / 4;
+#pragma omp parallel for schedule(dynamic, 4)
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < l.tiles_x; tx++) {
+            unsigned char block[64]; // RGBA, the texels past the edges repeat the last ones
+            for (int k = 0; k < 16; k++) {
+                const int x = std::min(l.width - 1, tx * 4 + (k & 3)), y = std::min(l.height - 1, ty * 4 + (k >> 2));
+                const float *p = &rgb[(x + size_t(y) * l.width) * 3];
+                for (int c = 0; c < 3; c++) block[k * 4 + c] = static_cast<unsigned char>(std::max(0.f, std::min(1.f, p[c])) * 255 + .5f);
+                block[k * 4 + 3] = 255;
+            }
+            stb_compress_dxt_block(&l.bc1[(size_t(ty) * l.tiles_x + tx) * 8], block, 0, STB_DXT_HIGHQUAL);
+        }
+    }
+}
+
+Vec3f ImageTexture::decode(const Level &l, int x, int y) const {
+    const size_t i = index(l, x, y);
+    if (format == TEXELS_FLOAT) return l.rgb[i];
+    if (format == TEXELS_HALF) {
+        const uint16_t *p = &l.rgb16[i * 3];
+        return Vec3f(half_to_float(p[0]), half_to_float(p[1]), half_to_float(p[2]));
+    }
+    // the tile is the block, i & 15 the texel in it: its 2 bit index picks an endpoint or a blend of the two
+    const uint8_t *b = &l.bc1[(i >> 4) * 8];
+    const unsigned c0 = b[0] | (b[1] << 8), c1 = b[2] | (b[3] << 8);
+    const unsigned bits = b[4] | (b[5] << 8) | (b[6] << 16) | (unsigned(b[7]) << 24);
+    const unsigned code = (bits >> ((i & 15) * 2)) & 3;
+    const Vec3f e0((c0 >> 11) * (1.f / 31), ((c0 >> 5) & 63) * (1.f / 63), (c0 & 31) * (1.f / 31));
+    const Vec3f e1((c1 >> 11) * (1.f / 31), ((c1 >> 5) & 63) * (1.f / 63), (c1 & 31) * (1.f / 31));
+    if (code == 0) return e0;
+    if (code == 1) return e1;
+    if (c0 > c1) return code == 2 ? e0 * (2.f / 3) + e1 * (1.f / 3) : e0 * (1.f / 3) + e1 * (2.f / 3);
+    return code == 2 ? (e0 + e1) * .5f : Vec3f(); // 3 color mode, for blocks without alpha code 3 is black
+}
+
+Vec3f ImageTexture::texel(int level, int x, int y) const {
+    return decode(levels[level], x, y);
+}
+
+Vec3f ImageTexture::fetch(const Level &l, int x, int y) const {
+    const int w = l.width, h = l.height;
+    switch (wrap) {
+    case WRAP_REPEAT:
+        x %= w;
+        y %= h;
+        if (x < 0) x += w;
+        if (y < 0) y += h;
+        break;
+    case WRAP_CLAMP:
+        x = std::max(0, std::min(w - 1, x));
+        y = std::max(0, std::min(h - 1, y));
+        break;
+    case WRAP_OCTAHEDRAL: // crossing an edge of the square comes back mirrored across its middle
+        if (x < 0 || x >= w) {
+            x = x < 0 ? -1 - x : 2 * w - 1 - x;
+            y = h - 1 - y;
+        }
+        if (y < 0 || y >= h) {
+            y = y < 0 ? -1 - y : 2 * h - 1 - y;
+            x = w - 1 - x;
+        }
+        x = std::max(0, std::min(w - 1, x));
+        y = std::max(0, std::min(h - 1, y));
+        break;
+    }
+    return decode(l, x, y);
+}
+
+void ImageTexture::build(const Vec3f *rgb, int width, int height, Wrap wrap_mode, TexelFormat texel_format) {
+    wrap = wrap_mode;
+    format = texel_format;
+    levels.clear();
+    std::vector<float> src(rgb ? &rgb[0].x : nullptr, rgb ? &rgb[0].x + size_t(width) * height * 3 : nullptr), dst;
+    for (;;) {
+        levels.push_back(Level());
+        Level &l = levels.back();
+        allocate(l, width, height);
+        store(l, src.data());
+        if (width == 1 && height == 1) break;
+
+        // box filter, the average of 2x2 texels: by rows on the threads for the even sizes, summed in the order
+        // of stb so that the levels do not depend on the path, stb for the odd sizes
+        const int w = std::max(1, width / 2), h = std::max(1, height / 2);
+        dst.resize(size_t(w) * h * 3);
+        if (width % 2 == 0 && height % 2 == 0) {
+            const float *in = src.data();
+            float *out = dst.data();
+            const size_t stride = size_t(width) * 3;
+#pragma omp parallel for schedule(static)
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) {
+                    const float *p = in + 2 * y * stride + 6 * x;
+                    for (size_t k = 0; k < 3; k++)
+                        out[(x + size_t(y) * w) * 3 + k] = (p[k] * .5f + p[k + 3] * .5f) * .5f + (p[stride + k] * .5f + p[stride + k + 3] * .5f) * .5f;
+                }
+            }
+        } else {
+            const stbir_edge edge = wrap == WRAP_REPEAT ? STBIR_EDGE_WRAP : STBIR_EDGE_CLAMP;
+            stbir_resize_float_generic(src.data(), width, height, 0, dst.data(), w, h, 0, 3, STBIR_ALPHA_CHANNEL_NONE, 0,
+                                       edge, STBIR_FILTER_BOX, STBIR_COLORSPACE_LINEAR, nullptr);
+        }
+        src.swap(dst);
+        width = w;
+        height = h;
+    }
+}
+
+bool ImageTexture::load(const char *filename, Wrap wrap_mode, TexelFormat texel_format) {
+    int width, height, n;
+    float *pixels = stbi_loadf(filename, &width, &height, &n, 3);
+    if (!pixels) return false;
+    build(reinterpret_cast<const Vec3f *>(pixels), width, height, wrap_mode, texel_format);
+    stbi_image_free(pixels);
+    return true;
+}
+
+Vec3f ImageTexture::bilinear(int level, float u, float v) const {
+    const Level &l = levels[std::max(0, std::min(nlevels() - 1, level))];
+    const float x = u * l.width - .5f, y = v * l.height - .5f;
+    const float fx = std::floor(x), fy = std::floor(y);
+    const int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+    const float a = x - fx, b = y - fy;
+    return (fetch(l, x0, y0) * (1 - a) + fetch(l, x0 + 1, y0) * a) * (1 - b) +
+           (fetch(l, x0, y0 + 1) * (1 - a) + fetch(l, x0 + 1, y0 + 1) * a) * b;
+}
+
+Vec3f ImageTexture::sample(float u, float v, float lod) const {
+    if (!(lod > 0)) return bilinear(0, u, v);
+    if (lod >= nlevels() - 1) return bilinear(nlevels() - 1, u, v);
+    const int level = static_cast<int>(lod);
+    const float t = lod - level;
+    const Vec3f fine = bilinear(level, u, v);
+    return t > 0 ? fine * (1 - t) + bilinear(level + 1, u, v) * t : fine;
+}
+
+float ImageTexture::lod(float footprint) const {
+    return std::log2(std::max(1e-8f, footprint * std::max(levels[0].width, levels[0].height)));
+}
+
+void ImageTexture::export_level(int level, std::vector<float> &rgb) const {
+    const Level &l = levels[level];
+    rgb.resize(size_t(l.width) * l.height * 3);
+    for (int y = 0; y < l.height; y++) {
+        for (int x = 0; x < l.width; x++) {
+            const Vec3f c = texel(level, x, y);
+            for (size_t k = 0; k < 3; k++) rgb[(x + size_t(y) * l.width) * 3 + k] = c[k];
+        }
+    }
+}
+
+size_t ImageTexture::bytes() const {
+    size_t total = 0;
+    for (size_t i = 0; i < levels.size(); i++)
+        total += levels[i].rgb.size() * sizeof(Vec3f) + levels[i].rgb16.size() * sizeof(uint16_t) + levels[i].bc1.size();
+    return total;
+}
+
+// layout: the number of levels, then for each level its size and its tiles
+bool ImageTexture::write(FILE *f) const {
+    const uint32_t n = static_cast<uint32_t>(levels.size());
+    bool ok = fwrite(&n, sizeof(n), 1, f) == 1;
+    for (size_t i = 0; ok && i < levels.size(); i++) {
+        const Level &l = levels[i];
+        const uint32_t size[2] = {uint32_t(l.width), uint32_t(l.height)};
+        ok = fwrite(size, sizeof(size), 1, f) == 1;
+        // two of the three are empty, their data() may be null
+        if (ok) ok = l.rgb.empty() || fwrite(l.rgb.data(), sizeof(Vec3f), l.rgb.size(), f) == l.rgb.size();
+        if (ok) ok = l.rgb16.empty() || fwrite(l.rgb16.data(), sizeof(uint16_t), l.rgb16.size(), f) == l.rgb16.size();
+        if (ok) ok = l.bc1.empty() || fwrite(l.bc1.data(), 1, l.bc1.size(), f) == l.bc1.size();
+    }
+    return ok;
+}
+
+bool ImageTexture::read(const char *data, size_t size, size_t &pos, Wrap wrap_mode, TexelFormat texel_format) {
+    uint32_t n;
+    if (pos + sizeof(n) > size) return false;
+    memcpy(&n, data + pos, sizeof(n));
+    pos += sizeof(n);
+    ImageTexture loaded;
+    loaded.wrap = wrap_mode;
+    loaded.format = texel_format;
+    loaded.levels.resize(n);
+    for (size_t i = 0; i < loaded.levels.size(); i++) {
+        uint32_t dims[2];
+        if (pos + sizeof(dims) > size) return false;
+        memcpy(dims, data + pos, sizeof(dims));
+        pos += sizeof(dims);
+        if (!dims[0] || !dims[1] || dims[0] > 1u << 16 || dims[1] > 1u << 16) return false;
+        Level &l = loaded.levels[i];
+        loaded.allocate(l, static_cast<int>(dims[0]), static_cast<int>(dims[1]));
+        const size_t bytes = l.rgb.size() * sizeof(Vec3f) + l.rgb16.size() * sizeof(uint16_t) + l.bc1.size();
+        if (pos + bytes > size) return false;
+        if (texel_format == TEXELS_FLOAT) memcpy(&l.rgb[0], data + pos, bytes);
+        else if (texel_format == TEXELS_HALF) memcpy(l.rgb16.data(), data + pos, bytes);
+        else memcpy(l.bc1.data(), data + pos, bytes);
+        pos += bytes;
+    }
+    if (loaded.levels.empty()) return false;
+    *this = loaded;
+    return true;
+}
@@ -0,0 +1,74 @@
+#ifndef __IMAGE_TEXTURE_H__
+#define __IMAGE_TEXTURE_H__
+#include <cstdio>
+#include <vector>
+#include <cstdint>
+#include "geometry.h"
+
+// Storage of the texels: 12, 6 or 0.5 bytes each. BC1 (DXT1) compresses every 4x4 tile to two 565 colors
+// and 2 bit weights with stb_dxt, and clamps the colors to [0, 1]; a fetch decodes its texel from the block.
+enum TexelFormat {
+    TEXELS_FLOAT,
+    TEXELS_HALF,
+    TEXELS_BC1
+};
+
+// RGB texture with a mip pyramid and filtered lookups, for the environment map and the mesh textures.
+// The texels of every level are stored in 4x4 tiles, so that the four texels of a bilinear fetch, and
+// the fetches of neighbouring rays, mostly fall in the same cache lines, and so that a tile is a BC1 block.
+// The levels below the top one are resampled with stb_image_resize.
+class ImageTexture {
+public:
+    enum Wrap {
+        WRAP_REPEAT,
+        WRAP_CLAMP,
+        WRAP_OCTAHEDRAL // the edges of an octahedral map fold onto themselves (envmap.h)
+    };
+
+    ImageTexture() : wrap(WRAP_REPEAT), format(TEXELS_FLOAT) {}
+
+    // rgb holds width x height texels, row by row
+    void build(const Vec3f *rgb, int width, int height, Wrap wrap, TexelFormat format = TEXELS_FLOAT);
+    // decodes an image file; 8-bit files are taken as sRGB and linearized
+    bool load(const char *filename, Wrap wrap, TexelFormat format = TEXELS_FLOAT);
+
+    // u, v in [0, 1] across the texture, wrapped; lod 0 is the top level, fractions blend two levels
+    Vec3f sample(float u, float v, float lod) const;
+    Vec3f bilinear(int level, float u, float v) const;
+    // the level of detail at which a texel is `footprint` wide, in texture units
+    float lod(float footprint) const;
+
+    bool empty() const { return levels.empty(); }
+    int nlevels() const { return static_cast<int>(levels.size()); }
+    int width(int level = 0) const { return levels[level].width; }
+    int height(int level = 0) const { return levels[level].height; }
+    size_t bytes() const; // texel memory of all the levels
+    Vec3f texel(int level, int x, int y) const; // x, y in the level
+    void export_level(int level, std::vector<float> &rgb) const; // the texels of a level as floats, row by row
+
+    // the levels as stored, for the caches of the callers
+    bool write(FILE *f) const;
+    bool read(const char *data, size_t size, size_t &pos, Wrap wrap, TexelFormat format);
+
+private:
+    struct Level {
+        int width, height;
+        int tiles_x; // tiles in a row, the last tiles of a row or a column are padded
+        std::vector<Vec3f> rgb;      // float storage
+        std::vector<uint16_t> rgb16; // half storage, 3 values per texel
+        std::vector<uint8_t> bc1;    // BC1 storage, 8 bytes per tile
+    };
+    std::vector<Level> levels;
+    Wrap wrap;
+    TexelFormat format;
+
+    static size_t index(const Level &l, int x, int y) {
+        return ((size_t(y >> 2) * l.tiles_x + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+    }
+    void allocate(Level &l, int width, int height) const;
+    void store(Level &l, const float *rgb); // the level as rows of width x height texels
+    Vec3f decode(const Level &l, int x, int y) const;
+    Vec3f fetch(const Level &l, int x, int y) const; // wrapped
+};
+
+#endif //__IMAGE_TEXTURE_H__
@@ -0,0 +1,222 @@
+#include <cstdio>
+#include <cctype>
+#include <algorithm>
+#include "image_writer.h"
+#include "stb_image_write.h"
+#include "stb_image.h"
+#include "profile.h"
+
+bool image_format(const std::string &filename, ImageFormat &format) {
+    const size_t dot = filename.rfind('.');
+    std::string ext = dot == std::string::npos ? std::string() : filename.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == "jpg" || ext == "jpeg") format = FORMAT_JPG;
+    else if (ext == "png") format = FORMAT_PNG;
+    else if (ext == "ppm") format = FORMAT_PPM;
+    else if (ext == "pfm") format = FORMAT_PFM;
+    else return false;
+    return true;
+}
+
+namespace {
+    // PPM and PFM: fixed-size header, then every row can be written at its own offset in any order
+    int raw_header(ImageFormat format, int width, int height, char *header, size_t size) {
+        if (format == FORMAT_PPM) return snprintf(header, size, "P6\n%d %d\n255\n", width, height);
+        return snprintf(header, size, "PF\n%d %d\n-1.0\n", width, height); // host floats, little endian
+    }
+
+    // writes row j from rgb (PPM) or hdr (PFM), row holds 3 floats per pixel of scratch space
+    bool write_raw_row(FILE *f, ImageFormat format, int header_size, int width, int height, int j,
+                       const unsigned char *rgb, const Vec3f *hdr, std::vector<float> &row) {
+        const size_t row_bytes = format == FORMAT_PPM ? size_t(width) * 3 : size_t(width) * 3 * sizeof(float);
+        const void *data = rgb;
+        long offset = header_size + long(j) * row_bytes;
+        if (format == FORMAT_PFM) {
+            row.resize(size_t(width) * 3);
+            for (int i = 0; i < width; i++)
+                for (int c = 0; c < 3; c++) row[i * 3 + c] = hdr[i][c];
+            data = row.data();
+            offset = header_size + long(height - 1 - j) * row_bytes; // PFM rows go from the bottom up
+        }
+        return fseek(f, offset, SEEK_SET) == 0 && fwrite(data, 1, row_bytes, f) == row_bytes;
+    }
+}
+
+bool encode_image(const ImageFormat format, const int width, const int height, const unsigned char *rgb, const Vec3f *hdr,
+                  std::vector<char> &bytes) {
+    bytes.clear();
+    auto append = [](void *context, void *data, int size) {
+        std::vector<char> &out = *static_cast<std::vector<char> *>(context);
+        out.insert(out.end(), static_cast<char *>(data), static_cast<char *>(data) + size);
+    };
+    if (format == FORMAT_JPG) return stbi_write_jpg_to_func(append, &bytes, width, height, 3, rgb, 100) != 0;
+    if (format == FORMAT_PNG) return stbi_write_png_to_func(append, &bytes, width, height, 3, rgb, width * 3) != 0;
+
+    char header[64];
+    const int header_size = raw_header(format, width, height, header, sizeof(header));
+    bytes.assign(header, header + header_size);
+    if (format == FORMAT_PPM) {
+        bytes.insert(bytes.end(), rgb, rgb + size_t(width) * height * 3);
+        return true;
+    }
+    std::vector<float> row(size_t(width) * 3);
+    for (int j = height - 1; j >= 0; j--) { // PFM rows go from the bottom up
+        for (int i = 0; i < width; i++)
+            for (int c = 0; c < 3; c++) row[i * 3 + c] = hdr[i + size_t(j) * width][c];
+        const char *data = reinterpret_cast<const char *>(row.data());
+        bytes.insert(bytes.end(), data, data + row.size() * sizeof(float));
+    }
+    return true;
+}
+
+bool read_image(const std::string &filename, int width, int height, std::vector<unsigned char> &rgb,
+                std::vector<Vec3f> &hdr, std::string &error) {
+    ImageFormat format;
+    if (!image_format(filename, format)) {
+        error = "unknown image format " + filename;
+        return false;
+    }
+    if (format != FORMAT_PFM) { // stb reads the binary PPM too
+        int w, h, channels;
+        unsigned char *pixmap = stbi_load(filename.c_str(), &w, &h, &channels, 3);
+        if (!pixmap || w != width || h != height) {
+            error = pixmap ? filename + " is not a " + std::to_string(width) + "x" + std::to_string(height) + " image"
+                           : "can not read " + filename;
+            if (pixmap) stbi_image_free(pixmap);
+            return false;
+        }
+        rgb.assign(pixmap, pixmap + size_t(width) * height * 3);
+        stbi_image_free(pixmap);
+        return true;
+    }
+
+    FILE *f = fopen(filename.c_str(), "rb");
+    int w = 0, h = 0;
+    float scale = 0;
+    const bool good = f && fscanf(f, "PF %d %d %f", &w, &h, &scale) == 3 && fgetc(f) == '\n';
+    if (!good || w != width || h != height || scale >= 0) { // only the little endian files that we write
+        error = good ? filename + " is not a " + std::to_string(width) + "x" + std::to_string(height) + " little endian PFM"
+                     : "can not read " + filename;
+        if (f) fclose(f);
+        return false;
+    }
+    std::vector<float> row(size_t(width) * 3);
+    hdr.resize(size_t(width) * height);
+    for (int j = height - 1; j >= 0; j--) { // from the bottom up
+        if (fread(row.data(), sizeof(float), row.size(), f) != row.size()) {
+            error = filename + " is truncated";
+            fclose(f);
+            return false;
+        }
+        for (int i = 0; i < width; i++) hdr[i + size_t(j) * width] = Vec3f(row[i * 3], row[i * 3 + 1], row[i * 3 + 2]);
+    }
+    fclose(f);
+    return true;
+}
+
+ImageStream::ImageStream(const std::string &filename, int width, int height)
+        : width(width), height(height), format(FORMAT_PPM), file(nullptr), header_size(0), good(false) {
+    if (!image_format(filename, format) || (format != FORMAT_PPM && format != FORMAT_PFM)) return;
+    file = fopen(filename.c_str(), "wb");
+    if (!file) return;
+    char header[64];
+    header_size = raw_header(format, width, height, header, sizeof(header));
+    good = fwrite(header, 1, header_size, file) == size_t(header_size);
+}
+
+ImageStream::~ImageStream() {
+    close();
+}
+
+bool ImageStream::write_rows(int y0, int rows, const unsigned char *rgb, const Vec3f *hdr) {
+    for (int j = 0; j < rows && good; j++)
+        good = write_raw_row(file, format, header_size, width, height, y0 + j, rgb ? rgb + size_t(j) * width * 3 : nullptr,
+                             hdr ? hdr + size_t(j) * width : nullptr, row);
+    return good;
+}
+
+bool ImageStream::close() {
+    if (file && fclose(file)) good = false;
+    file = nullptr;
+    return good;
+}
+
+AsyncImageWriter::AsyncImageWriter(const std::string &filename, int width, int height, const unsigned char *rgb, const Vec3f *hdr)
+        : filename(filename), width(width), height(height), rgb(rgb), hdr(hdr), format(FORMAT_JPG),
+          row_pixels(height, 0), nready(0), ok(image_format(filename, format)) {
+    if (ok) thread = std::thread(&AsyncImageWriter::run, this);
+}
+
+AsyncImageWriter::~AsyncImageWriter() {
+    wait();
+}
+
+void AsyncImageWriter::tile_done(const Tile &tile) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int j = tile.y0; j < tile.y1; j++) {
+        row_pixels[j] += tile.x1 - tile.x0;
+        if (row_pixels[j] == width) {
+            ready.push_back(j);
+            nready++;
+        }
+    }
+    cv.notify_one();
+}
+
+void AsyncImageWriter::all_done() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int j = 0; j < height; j++) {
+        if (row_pixels[j] == width) continue;
+        row_pixels[j] = width;
+        ready.push_back(j);
+        nready++;
+    }
+    cv.notify_one();
+}
+
+bool AsyncImageWriter::wait() {
+    if (thread.joinable()) thread.join();
+    return ok;
+}
+
+void AsyncImageWriter::run() {
+    PROFILE_SCOPE("encode");
+    if (format == FORMAT_JPG || format == FORMAT_PNG) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return nready == height; });
+        }
+        if (format == FORMAT_JPG) ok = stbi_write_jpg(filename.c_str(), width, height, 3, rgb, 100) != 0;
+        else ok = stbi_write_png(filename.c_str(), width, height, 3, rgb, width * 3) != 0;
+        return;
+    }
+
+    // raw formats: every row lands at its own offset in whatever order it completes
+    FILE *f = fopen(filename.c_str(), "wb");
+    bool good = f != nullptr;
+    char header[64];
+    int header_size = 0;
+    if (good) {
+        header_size = raw_header(format, width, height, header, sizeof(header));
+        good = fwrite(header, 1, header_size, f) == size_t(header_size);
+    }
+    std::vector<float> row;
+    std::vector<int> rows;
+    int written = 0;
+    while (written < height) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return !ready.empty(); });
+            rows.swap(ready);
+        }
+        for (size_t k = 0; k < rows.size(); k++, written++) {
+            const int j = rows[k];
+            if (!good) continue;
+            good = write_raw_row(f, format, header_size, width, height, j, rgb ? rgb + size_t(j) * width * 3 : nullptr,
+                                 hdr ? hdr + size_t(j) * width : nullptr, row);
+        }
+        rows.clear();
+    }
+    if (f && fclose(f)) good = false;
+    ok = good;
+}
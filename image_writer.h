@@ -0,0 +1,87 @@
+#ifndef __IMAGE_WRITER_H__
+#define __IMAGE_WRITER_H__
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "geometry.h"
+#include "scheduler.h"
+
+enum ImageFormat {
+    FORMAT_JPG, // quality 100
+    FORMAT_PNG,
+    FORMAT_PPM, // binary P6, 8 bits
+    FORMAT_PFM  // portable float map, the linear framebuffer before tone mapping
+};
+
+// From the extension of filename (.jpg/.jpeg, .png, .ppm, .pfm); returns false for an unknown one.
+bool image_format(const std::string &filename, ImageFormat &format);
+
+// Reads back a width x height image written by AsyncImageWriter: a PFM goes to hdr, the other
+// formats to rgb. False, with the reason in error, if the file can not be read or has another size.
+bool read_image(const std::string &filename, int width, int height, std::vector<unsigned char> &rgb,
+                std::vector<Vec3f> &hdr, std::string &error);
+
+// Encodes a width x height image in memory, in the layout the file would have: rgb for JPG, PNG and PPM,
+// hdr for PFM (the other may be null).
+bool encode_image(ImageFormat format, int width, int height, const unsigned char *rgb, const Vec3f *hdr,
+                  std::vector<char> &bytes);
+
+// Writes a PPM or PFM image band by band, for images too large to be kept in memory: only the band being
+// written is needed. rgb holds 3 bytes per pixel (PPM), hdr the linear colors (PFM) of rows y0 .. y0 + rows - 1.
+class ImageStream {
+public:
+    ImageStream(const std::string &filename, int width, int height);
+    ~ImageStream();
+
+    bool ok() const { return good; } // false if the file can not be written, or is not a .ppm or .pfm
+    bool write_rows(int y0, int rows, const unsigned char *rgb, const Vec3f *hdr);
+    bool close();
+
+private:
+    ImageStream(const ImageStream &);
+    ImageStream &operator=(const ImageStream &);
+
+    const int width, height;
+    ImageFormat format;
+    FILE *file;
+    int header_size;
+    bool good;
+    std::vector<float> row;
+};
+
+// Writes an image from a background thread. rgb (3 bytes per pixel) and hdr (the framebuffer) are
+// read in place: a row must be final when it is announced, and both buffers must outlive wait().
+// rgb may be null for a PFM, hdr for the other formats.
+// PPM and PFM rows are written as soon as their tiles are done, JPG and PNG are encoded once the
+// whole image is.
+class AsyncImageWriter {
+public:
+    AsyncImageWriter(const std::string &filename, int width, int height, const unsigned char *rgb, const Vec3f *hdr);
+    ~AsyncImageWriter(); // waits for the writer thread
+
+    void tile_done(const Tile &tile); // thread safe
+    void all_done();                  // every row is final
+    bool wait();                      // false if the file could not be written
+
+private:
+    const std::string filename;
+    const int width, height;
+    const unsigned char *rgb;
+    const Vec3f *hdr;
+    ImageFormat format;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<int> row_pixels; // pixels of every row already final
+    std::vector<int> ready;      // rows final but not written yet
+    int nready;                  // rows final so far
+    bool ok;
+    std::thread thread;
+
+    void run();
+};
+
+#endif //__IMAGE_WRITER_H__
@@ -0,0 +1,152 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "irradiance_cache.h"
+#include "camera.h"
+#include "render.h"
+
+namespace {
+    const int max_cells = 4; // along an axis of a record, the larger ones only reach that far
+
+    uint32_t record_seed(const int stride, const int x, const int y) { // the same gather whatever the thread
+        return (uint32_t(stride) * 73856093u) ^ (uint32_t(x) * 19349663u) ^ (uint32_t(y) * 83492791u) ^ 0x9e3779b9u;
+    }
+}
+
+uint64_t IrradianceCache::key(const int x, const int y, const int z) const {
+    const uint64_t mask = (uint64_t(1) << 21) - 1;
+    return ((uint64_t(x) & mask) << 42) | ((uint64_t(y) & mask) << 21) | (uint64_t(z) & mask);
+}
+
+void IrradianceCache::insert(const int r) {
+    const Record &record = records[r];
+    const float radius = std::min(error * record.R, max_cells * cell * .5f);
+    int lo[3], hi[3];
+    for (size_t k = 0; k < 3; k++) {
+        lo[k] = static_cast<int>(std::floor((record.p[k] - radius) / cell));
+        hi[k] = static_cast<int>(std::floor((record.p[k] + radius) / cell));
+    }
+    for (int x = lo[0]; x <= hi[0]; x++)
+        for (int y = lo[1]; y <= hi[1]; y++)
+            for (int z = lo[2]; z <= hi[2]; z++) cells[key(x, y, z)].push_back(r);
+}
+
+Vec3f IrradianceCache::lookup(const Vec3f &p, const Vec3f &N) const {
+    const std::unordered_map<uint64_t, std::vector<int> >::const_iterator found =
+        cells.find(key(static_cast<int>(std::floor(p.x / cell)), static_cast<int>(std::floor(p.y / cell)),
+                       static_cast<int>(std::floor(p.z / cell))));
+    if (found == cells.end()) return Vec3f(0, 0, 0);
+    const std::vector<int> &list = found->second;
+    Vec3f sum(0, 0, 0);
+    float total = 0, nearest = 0;
+    int fallback = -1;
+    for (size_t i = 0; i < list.size(); i++) {
+        const Record &r = records[list[i]];
+        const float cosine = N * r.N;
+        if (cosine <= .5f) continue;
+        const Vec3f d = p - r.p;
+        if (d * (N + r.N) < -.1f * r.R) continue; // the record lies in front of p, in a crease p does not see
+        const float inverse = d.norm() / r.R + std::sqrt(std::max(0.f, 1 - cosine));
+        const float w = 1 / std::max(inverse, 1e-6f);
+        if (inverse < error) {
+            sum = sum + r.radiance * w;
+            total += w;
+        } else if (w > nearest) {
+            nearest = w;
+            fallback = list[i];
+        }
+    }
+    if (total > 0) return sum * (1 / total);
+    return fallback >= 0 ? records[fallback].radiance : Vec3f(0, 0, 0);
+}
+
+size_t IrradianceCache::bytes() const {
+    if (records.empty()) return 0;
+    size_t total = records.capacity() * sizeof(Record);
+    for (std::unordered_map<uint64_t, std::vector<int> >::const_iterator c = cells.begin(); c != cells.end(); ++c)
+        total += sizeof(*c) + 2 * sizeof(void *) + c->second.capacity() * sizeof(int); // and the node of the map
+    return total + cells.bucket_count() * sizeof(void *);
+}
+
+void IrradianceCache::build(const Scene &scene, const int width, const int height, const int rays, const float max_error) {
+    records.clear();
+    cells.clear();
+    error = max_error;
+    const ImagePlane plane(scene.camera, width, height);
+    int nu = std::max(1, static_cast<int>(std::sqrt(float(rays)))); // strata of the hemisphere, as Light::strata
+    while (rays % nu) nu--;
+    const int nv = std::max(1, rays / nu), count = nu * nv;
+
+    for (int stride = 16; stride >= 2; stride /= 2) {
+        std::vector<std::pair<int, int> > points;
+        for (int y = stride / 2; y < height; y += stride)
+            for (int x = stride / 2; x < width; x += stride) points.push_back(std::make_pair(x, y));
+        std::vector<Record> made(points.size());
+        std::vector<char> valid(points.size(), 0);
+#pragma omp parallel for schedule(dynamic, 16)
+        for (long i = 0; i < static_cast<long>(points.size()); i++) {
+            Vec3f orig, dir;
+            plane.ray(points[i].first + .5f, points[i].second + .5f, orig, dir);
+            HitRecord rec;
+            Hit hit;
+            if (!scene_closest_hit(orig, dir, scene, rec)) continue;
+            surface_interaction(orig, dir, scene, rec, hit);
+            if (!(scene.materials[hit.material].lobes & LOBE_DIFFUSE)) continue;
+            if (hit.N * dir > 0) hit.N = -hit.N; // seen from inside
+            if (!records.empty()) { // can the records of the coarser lattices be interpolated here?
+                bool covered = false;
+                const std::unordered_map<uint64_t, std::vector<int> >::const_iterator c = cells.find(key(
+                        static_cast<int>(std::floor(hit.point.x / cell)), static_cast<int>(std::floor(hit.point.y / cell)),
+                        static_cast<int>(std::floor(hit.point.z / cell))));
+                for (size_t k = 0; c != cells.end() && k < c->second.size() && !covered; k++) {
+                    const Record &r = records[c->second[k]];
+                    const float cosine = hit.N * r.N;
+                    covered = cosine > .5f && (hit.point - r.p).norm() / r.R + std::sqrt(std::max(0.f, 1 - cosine)) < error;
+                }
+                if (covered) continue;
+            }
+
+            seed_random(record_seed(stride, points[i].first, points[i].second));
+            const Vec3f &N = hit.N;
+            const Vec3f t = std::fabs(N.x) > .9f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0);
+            const Vec3f e1 = cross(N, t).normalize(), e2 = cross(N, e1);
+            Vec3f sum(0, 0, 0);
+            float inverse_distances = 0;
+            for (int a = 0; a < nu; a++) {
+                for (int b = 0; b < nv; b++) { // cosine weighted, one direction per stratum
+                    const float u = (a + random_float()) / nu, v = (b + random_float()) / nv;
+                    const float r = std::sqrt(u), phi = 2 * float(M_PI) * v;
+                    const Vec3f gather = e1 * (r * std::cos(phi)) + e2 * (r * std::sin(phi)) + N * std::sqrt(std::max(0.f, 1 - u));
+                    const Vec3f from = leave_surface(hit.point, N, gather);
+                    HitRecord g;
+                    if (!scene_closest_hit(from, gather, scene, g, hit.time)) {
+                        if (scene.envmap_samples <= 0) sum = sum + background(scene, gather);
+                        continue;
+                    }
+                    inverse_distances += 1 / std::max(g.t, 1e-4f);
+                    Hit seen;
+                    surface_interaction(from, gather, scene, g, seen, 0, hit.time);
+                    const Material &material = scene.materials[seen.material];
+                    if (has_direct_lighting(material)) sum = sum + direct_lighting(gather, seen, material, scene);
+                }
+            }
+            // the valid radius error * R between 1.5 and 48 pixels at the distance of the hit
+            const float pixel = rec.t / plane.dir_z;
+            const float R = inverse_distances > 0 ? count / inverse_distances : std::numeric_limits<float>::max();
+            made[i] = Record{hit.point, N, sum * (1.f / count), std::max(1.5f * pixel, std::min(48 * pixel, error * R)) / error};
+            valid[i] = 1;
+        }
+
+        const size_t first = records.size();
+        for (size_t i = 0; i < points.size(); i++)
+            if (valid[i]) records.push_back(made[i]);
+        if (!first && !records.empty()) { // the grid cells are about the median valid radius of the coarsest records
+            std::vector<float> radii;
+            for (size_t r = 0; r < records.size(); r++) radii.push_back(error * records[r].R);
+            std::nth_element(radii.begin(), radii.begin() + radii.size() / 2, radii.end());
+            cell = std::max(1e-3f, 2 * radii[radii.size() / 2]);
+        }
+        for (size_t r = first; r < records.size(); r++) insert(static_cast<int>(r));
+    }
+}
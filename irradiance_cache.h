@@ -0,0 +1,47 @@
+#ifndef __IRRADIANCE_CACHE_H__
+#define __IRRADIANCE_CACHE_H__
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include "geometry.h"
+#include "scene.h"
+
+// Indirect diffuse lighting, one bounce, by irradiance caching (Ward, Rubinstein and Clear, 1988). A
+// pre-pass traces the primary rays of the image on lattices of 16, 8, 4 and 2 pixels and, where no record
+// is valid yet, gathers the light reaching the diffuse hit: `rays` cosine weighted rays, shaded with the
+// direct lighting of what they hit (and the background when Scene::envmap_samples does not already light
+// the surfaces with the envmap). A record keeps that mean radiance and the harmonic mean R of the gather
+// distances; at shading time, the records whose weight 1 / (d / R + sqrt(1 - N.Ni)) passes 1 / error are
+// blended, so that the interpolation is coarse on open surfaces and dense near contacts and corners.
+// Lookups away from the view (reflections, refractions) fall back on the nearest record that faces the same way.
+class IrradianceCache {
+public:
+    IrradianceCache() : cell(1), error(.3f) {}
+
+    // The records of the image seen by scene.camera at width x height; the scene must not point to a cache.
+    void build(const Scene &scene, int width, int height, int rays, float error = .3f);
+
+    // mean radiance over the hemisphere of N at p, weighted by the cosine: the diffuse term is
+    // diffuse color * albedo * lookup(); zero if the cache holds nothing near p
+    Vec3f lookup(const Vec3f &p, const Vec3f &N) const;
+
+    bool empty() const { return records.empty(); }
+    size_t size() const { return records.size(); }
+    size_t bytes() const;
+
+private:
+    struct Record {
+        Vec3f p, N;
+        Vec3f radiance;
+        float R; // harmonic mean distance of the gather rays, clamped to the pixel footprint
+    };
+    std::vector<Record> records;
+    float cell; // of the hash grid, in world units
+    float error;
+    std::unordered_map<uint64_t, std::vector<int> > cells; // records whose valid sphere error * R overlaps the cell
+
+    uint64_t key(int x, int y, int z) const;
+    void insert(int r);
+};
+
+#endif //__IRRADIANCE_CACHE_H__
@@ -0,0 +1,53 @@
+#include <chrono>
+#include "jobs.h"
+
+JobGraph::~JobGraph() {
+    std::string error;
+    wait(error);
+}
+
+int JobGraph::add(const std::string &name, const Work &work, const std::vector<int> &after) {
+    jobs.push_back(Job{name, work, after, PENDING, std::string(), 0.});
+    return static_cast<int>(jobs.size()) - 1;
+}
+
+void JobGraph::run(const int job) {
+    Job &j = jobs[job];
+    bool ready = true;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (size_t k = 0; k < j.after.size(); k++) {
+            done.wait(lock, [&]() { return jobs[j.after[k]].state != PENDING; });
+            if (jobs[j.after[k]].state == FAILED) ready = false;
+        }
+    }
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string error;
+    const bool ok = ready && j.work(error);
+    std::lock_guard<std::mutex> lock(mutex);
+    j.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    j.state = ok ? SUCCEEDED : FAILED;
+    j.error = ready ? error : j.name + " skipped after a failed job";
+    done.notify_all();
+}
+
+void JobGraph::start(const bool use_threads) {
+    if (started) return;
+    started = true;
+    for (size_t k = 0; k < jobs.size(); k++) { // the jobs only come after earlier ones: in order, the serial run never waits
+        if (use_threads) threads.push_back(std::thread(&JobGraph::run, this, static_cast<int>(k)));
+        else run(static_cast<int>(k));
+    }
+}
+
+bool JobGraph::wait(std::string &error) {
+    start();
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+    threads.clear();
+    for (size_t k = 0; k < jobs.size(); k++) {
+        if (jobs[k].state != FAILED) continue;
+        error = jobs[k].error;
+        return false;
+    }
+    return true;
+}
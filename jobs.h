@@ -0,0 +1,49 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+#include <vector>
+#include <string>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// Graph of jobs, each on its own thread: a job starts as soon as the jobs it comes after have succeeded,
+// and is skipped if one of them failed. main() loads the envmap, the mesh texture and the meshes this way
+// while it builds the scene. A job that uses OpenMP gets its own team of threads.
+class JobGraph {
+public:
+    typedef std::function<bool(std::string &error)> Work;
+
+    JobGraph() : started(false) {}
+    ~JobGraph(); // waits for the jobs
+
+    // returns the index of the job, for the `after` lists of the jobs added later: a job comes after earlier jobs only
+    int add(const std::string &name, const Work &work, const std::vector<int> &after = std::vector<int>());
+    // starts every job, one after the other on the calling thread if `threads` is false (then returns once done)
+    void start(bool threads = true);
+    // waits for every job (starts them if needed); false with the error of the first job that failed
+    bool wait(std::string &error);
+    double ms(int job) const { return jobs[job].ms; } // wall time of the job once done
+    const std::string &name(int job) const { return jobs[job].name; }
+    int size() const { return static_cast<int>(jobs.size()); }
+
+private:
+    enum State { PENDING, SUCCEEDED, FAILED };
+    struct Job {
+        std::string name;
+        Work work;
+        std::vector<int> after;
+        State state;
+        std::string error;
+        double ms;
+    };
+    std::vector<Job> jobs;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable done;
+    bool started;
+
+    void run(int job);
+};
+
+#endif //__JOBS_H__
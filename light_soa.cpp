@@ -0,0 +1,54 @@
+#include <cmath>
+#include "light_soa.h"
+#include "scene.h"
+
+#if defined(__SSE2__)
+#define LIGHT_SOA_SSE
+#include <emmintrin.h>
+#endif
+
+void LightSoA::build(const std::vector<Light> &lights) {
+    count = lights.size();
+    const size_t padded = (count + padding - 1) / padding * padding;
+    x.assign(padded, 0.f);
+    y.assign(padded, 0.f);
+    z.assign(padded, 0.f);
+    intensity.assign(padded, 0.f);
+    for (size_t i = 0; i < count; i++) {
+        x[i] = lights[i].position.x;
+        y[i] = lights[i].position.y;
+        z[i] = lights[i].position.z;
+        intensity[i] = lights[i].intensity;
+    }
+}
+
+void light_vectors(const LightSoA &lights, const Vec3f &p, int begin, int n, float *dx, float *dy, float *dz, float *dist) {
+    int k = 0;
+#ifdef LIGHT_SOA_SSE
+    // the padding lets the last group of 4 read past the last light, its extra lanes are never used
+    const __m128 px = _mm_set1_ps(p.x), py = _mm_set1_ps(p.y), pz = _mm_set1_ps(p.z);
+    const __m128 half = _mm_set1_ps(.5f), three = _mm_set1_ps(3.f);
+    for (; k < n; k += 4) {
+        const __m128 x = _mm_sub_ps(_mm_loadu_ps(&lights.x[begin + k]), px);
+        const __m128 y = _mm_sub_ps(_mm_loadu_ps(&lights.y[begin + k]), py);
+        const __m128 z = _mm_sub_ps(_mm_loadu_ps(&lights.z[begin + k]), pz);
+        const __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        __m128 inv = _mm_rsqrt_ps(d2);
+        inv = _mm_mul_ps(_mm_mul_ps(half, inv), _mm_sub_ps(three, _mm_mul_ps(d2, _mm_mul_ps(inv, inv)))); // Newton step
+        _mm_storeu_ps(dx + k, _mm_mul_ps(x, inv));
+        _mm_storeu_ps(dy + k, _mm_mul_ps(y, inv));
+        _mm_storeu_ps(dz + k, _mm_mul_ps(z, inv));
+        _mm_storeu_ps(dist + k, _mm_mul_ps(d2, inv));
+    }
+#endif
+    for (; k < n; k++) {
+        const int i = begin + k;
+        const float x = lights.x[i] - p.x, y = lights.y[i] - p.y, z = lights.z[i] - p.z;
+        const float d2 = x * x + y * y + z * z;
+        const float inv = 1.f / sqrtf(d2);
+        dx[k] = x * inv;
+        dy[k] = y * inv;
+        dz[k] = z * inv;
+        dist[k] = d2 * inv;
+    }
+}
@@ -0,0 +1,93 @@
+#include <cmath>
+#include <algorithm>
+#include "light_tree.h"
+#include "scene.h"
+
+void LightTree::build(const std::vector<Light> &lights) {
+    std::vector<AABB> bounds(lights.size());
+    const Vec3f pad(1e-2f, 1e-2f, 1e-2f); // points have no area, the SAH needs some
+    for (size_t i = 0; i < lights.size(); i++)
+        bounds[i] = AABB(lights[i].position - pad, lights[i].position + pad);
+    bvh.build(bounds);
+    positions.resize(lights.size());
+    intensity.resize(lights.size());
+    for (size_t i = 0; i < bvh.indices.size(); i++) {
+        positions[i] = lights[bvh.indices[i]].position;
+        intensity[i] = lights[bvh.indices[i]].intensity;
+    }
+    // children come after their parent, a reverse sweep sees them first
+    power.assign(bvh.nodes.size(), 0.f);
+    for (size_t n = bvh.nodes.size(); n--;) {
+        const BVHNode &node = bvh.nodes[n];
+        if (node.count) {
+            for (int k = 0; k < node.count; k++) power[n] += intensity[node.offset + k];
+        } else {
+            power[n] = power[n + 1] + power[node.offset];
+        }
+    }
+}
+
+void LightTree::clear() {
+    bvh = BVH();
+    power.clear();
+    positions.clear();
+    intensity.clear();
+}
+
+namespace {
+    const float min_cosine = .05f; // floor of the cosine bound
+
+    inline float cosine(const Vec3f &d, const Vec3f &N) {
+        const float len2 = d * d;
+        return len2 > 0 ? std::max(min_cosine, std::min(1.f, (d * N) / sqrtf(len2))) : 1.f;
+    }
+}
+
+float LightTree::importance(int node, const Vec3f &p, const Vec3f &N) const {
+    const AABB &b = bvh.nodes[node].bounds;
+    bool inside = true;
+    for (size_t i = 0; i < 3; i++) inside = inside && p[i] >= b.min[i] && p[i] <= b.max[i];
+    if (inside) return power[node];
+    float c = min_cosine; // the most favourable corner, close enough to a bound over the box
+    for (int k = 0; k < 8; k++)
+        c = std::max(c, cosine(Vec3f(k & 1 ? b.max.x : b.min.x, k & 2 ? b.max.y : b.min.y, k & 4 ? b.max.z : b.min.z) - p, N));
+    return power[node] * c;
+}
+
+int LightTree::sample(const Vec3f &p, const Vec3f &N, float u, float &pdf) const {
+    pdf = 1;
+    int cur = 0;
+    while (!bvh.nodes[cur].count) {
+        const int left = cur + 1, right = bvh.nodes[cur].offset;
+        const float wl = importance(left, p, N), wr = importance(right, p, N);
+        const float pl = wl + wr > 0 ? wl / (wl + wr) : .5f;
+        if (u < pl) { // u is rescaled so that it stays uniform for the next choice
+            u /= pl;
+            pdf *= pl;
+            cur = left;
+        } else {
+            u = (u - pl) / (1 - pl);
+            pdf *= 1 - pl;
+            cur = right;
+        }
+        u = std::min(u, .99999994f);
+    }
+
+    const BVHNode &leaf = bvh.nodes[cur];
+    float weights[64], total = 0; // leaves hold at most a few lights
+    const int count = std::min<int>(leaf.count, 64);
+    for (int k = 0; k < count; k++) {
+        weights[k] = intensity[leaf.offset + k] * cosine(positions[leaf.offset + k] - p, N);
+        total += weights[k];
+    }
+    int k = 0;
+    if (total > 0) {
+        float acc = weights[0];
+        for (u *= total; k + 1 < count && u >= acc; acc += weights[++k]) {}
+        pdf *= weights[k] / total;
+    } else {
+        k = std::min(count - 1, static_cast<int>(u * count));
+        pdf /= count;
+    }
+    return bvh.indices[leaf.offset + k];
+}
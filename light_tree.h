@@ -0,0 +1,37 @@
+#ifndef __LIGHT_TREE_H__
+#define __LIGHT_TREE_H__
+#include <vector>
+#include "geometry.h"
+#include "bvh.h"
+
+struct Light;
+
+// Light hierarchy for scenes with many point lights: a BVH over the light positions, every node
+// knowing the total intensity below it. A shading point picks one light by walking down the tree,
+// each child chosen in proportion to its estimated contribution, so the cost of a light sample grows
+// with the depth of the tree and not with the number of lights. The point lights of this renderer
+// do not fall off with distance: the estimate is the intensity times a bound of the cosine with the
+// normal, floored so that lights behind the surface keep a small chance (the estimate stays unbiased).
+class LightTree {
+public:
+    void build(const std::vector<Light> &lights);
+    void clear();
+    bool empty() const { return bvh.empty(); }
+    size_t bytes() const {
+        return bvh.bytes() + (power.capacity() + intensity.capacity()) * sizeof(float) + positions.capacity() * sizeof(Vec3f);
+    }
+
+    // Index of a light picked for the shading point p of normal N, u uniform in [0, 1). pdf is the probability
+    // of that pick: the light's contribution divided by pdf is an unbiased estimate of the sum over all lights.
+    int sample(const Vec3f &p, const Vec3f &N, float u, float &pdf) const;
+
+private:
+    BVH bvh;
+    std::vector<float> power;     // per node, sum of the intensities of its lights
+    std::vector<Vec3f> positions; // per light, in bvh.indices order
+    std::vector<float> intensity; // same order
+
+    float importance(int node, const Vec3f &p, const Vec3f &N) const;
+};
+
+#endif //__LIGHT_TREE_H__
@@ -1,342 +1,997 @@
-#define _USE_MATH_DEFINES
-
-#include <cmath>
-#include <limits>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <fstream>
+#include <memory>
 #include <vector>
-#include <algorithm>
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-
-#include "stb_image_write.h"
-
-#define STB_IMAGE_IMPLEMENTATION
-
-#include "stb_image.h"
-
-#include "model.h"
-#include "geometry.h"
-
-int envmap_width, envmap_height;
-std::vector<Vec3f> envmap;
-
-struct Light {
-    Light(const Vec3f &p, const float i) : position(p), intensity(i) {}
-
-    Vec3f position;
-    float intensity;
-};
-
-struct Material {
-    Material(const float r, const Vec4f &a, const Vec3f &color, const float spec) : refractive_index(r), albedo(a),
-                                                                                    diffuse_color(color),
-                                                                                    specular_exponent(spec) {}
-
-    Material() : refractive_index(1), albedo(1, 0, 0, 0), diffuse_color(), specular_exponent() {}
+#include <string>
+#include <sstream>
+#include <sys/stat.h>
+
+#include "scene.h"
+#include "scenes.h"
+#include "render.h"
+#include "wavefront.h"
+#include "gpu.h"
+#include "distributed.h"
+#include "server.h"
+#include "render_cache.h"
+#include "denoise.h"
+#include "profile.h"
+#include "envmap.h"
+#include "tonemap.h"
+#include "image_writer.h"
+#include "scene_io.h"
+#include "scene_compile.h"
+#include "memory_report.h"
+#include "irradiance_cache.h"
+#include "numa.h"
+#include "jobs.h"
+
+// out.jpg -> out_0007.jpg
+std::string frame_name(const std::string &output, int frame) {
+    char index[16];
+    snprintf(index, sizeof(index), "_%04d", frame);
+    const size_t dot = output.rfind('.');
+    return output.substr(0, dot) + index + output.substr(dot);
+}
 
-    float refractive_index;
-    Vec4f albedo;
-    Vec3f diffuse_color;
-    float specular_exponent;
-};
+// "a,b,c" -> a, b, c
+std::vector<std::string> split_list(const std::string &list) {
+    std::vector<std::string> items;
+    for (size_t begin = 0; begin <= list.size();) {
+        const size_t comma = std::min(list.find(',', begin), list.size());
+        if (comma > begin) items.push_back(list.substr(begin, comma - begin));
+        begin = comma + 1;
+    }
+    return items;
+}
 
-struct Sphere {
-    Vec3f center;
-    float radius;
-    Material material;
-
-    Sphere(const Vec3f &c, const float r, const Material &m) : center(c), radius(r), material(m) {}
-
-    bool ray_intersect(const Vec3f &orig, const Vec3f &dir, float &t0) const {
-        Vec3f L = center - orig;
-        float tca = L * dir;
-        float d2 = L * L - tca * tca;
-        if (d2 > radius * radius) return false;
-        float thc = sqrtf(radius * radius - d2);
-        t0 = tca - thc;
-        float t1 = tca + thc;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
+// A --quality preset: the depth budgets (bounces, reflections, refractions and the deepest bounce that
+// traces shadow rays; it takes two refractions to see through a glass sphere), and whether the shading
+// uses the approximate math of Scene::fast_shading.
+bool quality_preset(const std::string &name, int depths[4], bool &fast_math) {
+    static const struct { const char *name; int depths[4]; bool fast_math; } presets[] = {
+        {"draft", {2, 1, 2, 0}, true}, {"preview", {3, 2, 2, 1}, true},
+        {"final", {int(max_depth), int(max_depth), int(max_depth), int(max_depth)}, false}
+    };
+    for (size_t p = 0; p < sizeof(presets) / sizeof(presets[0]); p++) {
+        if (name != presets[p].name) continue;
+        std::copy(presets[p].depths, presets[p].depths + 4, depths);
+        fast_math = presets[p].fast_math;
         return true;
     }
-};
-
-Vec3f reflect(const Vec3f &I, const Vec3f &N) {
-    return I - N * 2.f * (I * N);
+    return false;
 }
 
-Vec3f refract(const Vec3f &I, const Vec3f &N, const float eta_t, const float eta_i = 1.f) { // Snell's law
-    float cosi = -std::max(-1.f, std::min(1.f, I * N));
-    if (cosi < 0)
-        return refract(I, -N, eta_i, eta_t); // if the ray comes from the inside the object, swap the air and the media
-    float eta = eta_i / eta_t;
-    float k = 1 - eta * eta * (1 - cosi * cosi);
-    return k < 0 ? Vec3f(1, 0, 0) : I * eta + N * (eta * cosi -
-                                                   sqrtf(k)); // k<0 = total reflection, no ray to refract. I refract it anyways, this has no physical meaning
+void print_compile_stats(const CompileStats &stats) {
+    std::cerr << "# compile: " << stats.spheres_before << " -> " << stats.spheres_after << " spheres, " << stats.materials_before
+              << " -> " << stats.materials_after << " materials, " << stats.bytes_before << " -> " << stats.bytes_after
+              << " bytes" << std::endl;
 }
 
-bool scene_intersect(const Vec3f &orig, const Vec3f &dir, const std::vector<Sphere> &spheres, Vec3f &hit, Vec3f &N, Material &material) {
-    float spheres_dist = std::numeric_limits<float>::max();
-    for (size_t i = 0; i < spheres.size(); i++) {
-        float dist_i;
-        if (spheres[i].ray_intersect(orig, dir, dist_i) && dist_i < spheres_dist) {
-            spheres_dist = dist_i;
-            hit = orig + dir * dist_i;
-            N = (hit - spheres[i].center).normalize();
-            material = spheres[i].material;
-        }
-    }
-
-    float checkerboard_dist = std::numeric_limits<float>::max();
-    if (fabs(dir.y) > 1e-3) {
-        float d = -(orig.y + 4) / dir.y; // the checkerboard plane has equation y = -4
-        Vec3f pt = orig + dir * d;
-        if (d > 0 && fabs(pt.x) < 10 && pt.z < -10 && pt.z > -30 && d < spheres_dist) {
-            checkerboard_dist = d;
-            hit = pt;
-            N = Vec3f(0, 1, 0);
-
-            // Ajustez ces valeurs pour modifier la densité et la complexité du motif.
-            Vec3f center(0, -4, -18); // centre
-            float pattern_width = 1; // Bandes plus étroites pour une alternance plus fréquente
-            Vec3f diff = hit - center;
-            float radius = diff.norm(); // Distance du centre
-            float angle = atan2(diff.z, diff.x); // Position angulaire autour du centre
-
-            // Déterminez la couleur de la bague en fonction de la distance et de l'angle
-            bool distance_pattern = static_cast<int>(floor(radius / pattern_width)) % 2;
-            bool angle_pattern = static_cast<int>(floor(angle / (M_PI / 20))) % 2; // Divise le cercle en 40 segments
-
-            //Combinez les motifs pour plus de variété
-            if (distance_pattern ^ angle_pattern) { // Opération XOR pour un mélange de motifs intéressant
-                material.diffuse_color = Vec3f(0.0, 0.0, 0.0); // Black
-            } else {
-                material.diffuse_color = Vec3f(1.0, 1.0, 1.0); // White
-            }
-        }
-    }
-    return std::min(spheres_dist, checkerboard_dist) < 1000;
+// out.jpg, "depth" -> out_depth.pfm
+std::string aov_name(const std::string &output, const std::string &aov) {
+    return output.substr(0, output.rfind('.')) + "_" + aov + ".pfm";
 }
 
+// An output variable as a PFM, scalars in the 3 channels.
+bool write_aov(const std::string &filename, const int width, const int height, const std::vector<Vec3f> &values) {
+    AsyncImageWriter writer(filename, width, height, nullptr, values.data());
+    writer.all_done();
+    if (writer.wait()) return true;
+    std::cerr << "Error: can not write " << filename << std::endl;
+    return false;
+}
 
-Vec3f
-cast_ray(const Vec3f &orig, const Vec3f &dir, const std::vector<Sphere> &spheres, const std::vector<Light> &lights,
-         size_t depth = 0) {
-    Vec3f point, N;
-    Material material;
-
-    if (depth > 4 || !scene_intersect(orig, dir, spheres, point, N, material)) {
-
-        int a = std::max(0, std::min(envmap_width -1, static_cast<int>((atan2(dir.z, dir.x)/(2*M_PI) + .5)*envmap_width)));
-        int b = std::max(0, std::min(envmap_height-1, static_cast<int>(acos(dir.y)/M_PI*envmap_height)));
-        return envmap[a+b*envmap_width]; // background color
+bool write_aov(const std::string &filename, const int width, const int height, const std::vector<float> &values) {
+    std::vector<Vec3f> gray(values.size());
+    for (size_t p = 0; p < values.size(); p++) gray[p] = Vec3f(values[p], values[p], values[p]);
+    return write_aov(filename, width, height, gray);
+}
 
+// Streaming output: the image is rendered and written band by band, the memory needed does not
+// depend on its height. Only PPM and PFM can be written that way.
+int render_streamed(const Scene &scene, const int width, const int height, const std::string &output, ToneMap tonemap_op) {
+    const int band = 64; // rows, 4 rows of render tiles
+    ImageStream stream(output, width, height);
+    if (!stream.ok()) {
+        std::cerr << "Error: can not stream " << output << " (only .ppm and .pfm)" << std::endl;
+        return -1;
     }
-
-    Vec3f reflect_dir = reflect(dir, N).normalize();
-    Vec3f refract_dir = refract(dir, N, material.refractive_index).normalize();
-    Vec3f reflect_orig = reflect_dir * N < 0 ? point - N * 1e-3 : point + N *
-                                                                          1e-3; // offset the original point to avoid occlusion by the object itself
-    Vec3f refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-    Vec3f reflect_color = cast_ray(reflect_orig, reflect_dir, spheres, lights, depth + 1);
-    Vec3f refract_color = cast_ray(refract_orig, refract_dir, spheres, lights, depth + 1);
-
-    float diffuse_light_intensity = 0, specular_light_intensity = 0;
-    for (size_t i = 0; i < lights.size(); i++) {
-        Vec3f light_dir = (lights[i].position - point).normalize();
-        float light_distance = (lights[i].position - point).norm();
-
-        Vec3f shadow_orig = light_dir * N < 0 ? point - N * 1e-3 : point + N *
-                                                                           1e-3; // checking if the point lies in the shadow of the lights[i]
-        Vec3f shadow_pt, shadow_N;
-        Material tmpmaterial;
-        if (scene_intersect(shadow_orig, light_dir, spheres, shadow_pt, shadow_N, tmpmaterial) &&
-            (shadow_pt - shadow_orig).norm() < light_distance)
-            continue;
-
-        diffuse_light_intensity += lights[i].intensity * std::max(0.f, light_dir * N);
-        specular_light_intensity +=
-                powf(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * lights[i].intensity;
+    std::vector<Vec3f> colors;
+    std::vector<unsigned char> rgb;
+    std::vector<ThreadStats> stats;
+    for (int y0 = 0; y0 < height; y0 += band) {
+        const Tile region = {0, y0, width, std::min(height, y0 + band)};
+        merge_thread_stats(stats, render_region(scene, width, height, region, colors));
+        rgb.resize(colors.size() * 3);
+        tonemap_pixels(colors.data(), rgb.data(), colors.size(), tonemap_op);
+        if (!stream.write_rows(y0, region.y1 - y0, rgb.data(), colors.data())) break;
     }
-    return material.diffuse_color * diffuse_light_intensity * material.albedo[0] +
-           Vec3f(1., 1., 1.) * specular_light_intensity * material.albedo[1] + reflect_color * material.albedo[2] +
-           refract_color * material.albedo[3];
+    print_thread_stats(stats);
+    std::cerr << "# stream: " << band << " rows, " << (colors.capacity() * sizeof(Vec3f) + rgb.capacity()) / 1024
+              << " KB of image buffers" << std::endl;
+    if (!stream.close()) {
+        std::cerr << "Error: can not write " << output << std::endl;
+        return -1;
+    }
+    return 0;
 }
 
-void render(const std::vector<Sphere> &spheres, const std::vector<Light> &lights) {
-    const int width = 1500;
-    const int height = 900;
-
-    const float fov = M_PI / 3.;
-
-    Vec3f camera_position(3, 4, 8); // position de la camera
-
-    std::vector<Vec3f> framebuffer(width * height);
-
-#pragma omp parallel for
-    for (size_t j = 0; j < height; j++) { // actual rendering loop
-        for (size_t i = 0; i < width; i++) {
-            float dir_x = (i + 0.5) - width / 2.;
-            float dir_y = -(j + 0.5) + height / 2.;    // this flips the image at the same time
-            float dir_z = -height / (2. * tan(fov / 2.));
-        framebuffer[i + j * width] = cast_ray(camera_position, Vec3f(dir_x, dir_y, dir_z).normalize(), spheres, lights);
-
+// Turntable: the scene, its BVH, the envmap and the OpenMP team stay alive from one frame to the next,
+// the moving spheres only refit the BVH. Frame f is encoded while frame f + 1 renders.
+// With a cluster, the frames are rendered by its workers, which only get the new camera.
+// With a shutter, the head is an instance that moves over the fraction shutter of the time to the next
+// frame: every sample sees it at its own instant, the head is blurred, the more with aa samples per pixel.
+int render_frames(Scene &scene, const int width, const int height, const int frames, const std::string &output, ToneMap tonemap_op,
+                  bool sway, const int aa, const float shutter, ClusterRenderer *cluster) {
+    const CameraPath path = CameraPath::turntable(scene.camera, Vec3f(0, 0, -16));
+    const int head = sway && shutter > 0 ? instance_snowman_head(scene) : -1;
+    if (head >= 0) scene.build();
+    const std::vector<Sphere> rest = scene.spheres;
+    std::vector<Vec3f> framebuffer[2];
+    std::vector<unsigned char> image[2];
+    std::unique_ptr<AsyncImageWriter> writer[2];
+    bool ok = true;
+    for (int f = 0; f < frames; f++) {
+        const int b = f & 1;
+        if (writer[b] && !writer[b]->wait()) ok = false; // frame f - 2 is done with the buffers
+        const float t = float(f) / frames;
+        const float aperture = scene.camera.aperture, focus = scene.camera.focus;
+        scene.camera = path.at(t, scene.camera.fov);
+        scene.camera.aperture = aperture;
+        scene.camera.focus = focus;
+        if (head >= 0) {
+            Instance &inst = scene.instances[head];
+            inst.xf = snowman_head_sway(t);
+            inst.xf_end = snowman_head_sway(t + shutter / frames);
+            inst.moving = true;
+            scene.build_instances();
+        } else if (sway) {
+            animate_snowman(scene, rest, t);
+            scene.refit();
         }
-    }
 
-    std::vector<unsigned char> pixmap(width * height * 3);
-    for (size_t i = 0; i < height * width; ++i) {
-        Vec3f &c = framebuffer[i];
-        float max = std::max(c[0], std::max(c[1], c[2]));
-        if (max > 1) c = c * (1. / max);
-        for (size_t j = 0; j < 3; j++) {
-            pixmap[i * 3 + j] = (unsigned char) (255 * std::max(0.f, std::min(1.f, framebuffer[i][j])));
+        image[b].resize(width * height * 3);
+        framebuffer[b].resize(width * height);
+        AsyncImageWriter *w = new AsyncImageWriter(frame_name(output, f), width, height, image[b].data(), framebuffer[b].data());
+        writer[b].reset(w);
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const std::function<void(const Tile &)> tile_done = [&](const Tile &tile) {
+            tonemap_tile(framebuffer[b], width, tile, image[b], tonemap_op);
+            w->tile_done(tile);
+        };
+        std::string error;
+        if (!cluster && aa > 1) { // the refined pixels are spread over the frame, it is final at the end only
+            render_adaptive(scene, width, height, framebuffer[b], aa);
+            tile_done(Tile{0, 0, width, height});
+        } else if (!cluster) {
+            render(scene, width, height, framebuffer[b], tile_done);
+        } else if (!cluster->render(scene.camera, width, height, framebuffer[b], tile_done, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            w->all_done();
+            writer[b]->wait();
+            return -1;
         }
+        std::cerr << "# frame " << f << ": " << std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    }
+    for (int b = 0; b < 2; b++)
+        if (writer[b] && !writer[b]->wait()) ok = false;
+    if (!ok) {
+        std::cerr << "Error: can not write the frames" << std::endl;
+        return -1;
     }
-    stbi_write_jpg("out.jpg", width, height, 3, pixmap.data(), 100);
+    return 0;
 }
 
+// Writes the profile when main returns, whatever the way out.
+struct ProfileWriter {
+    std::string filename;
 
-    // Fonction lerp pour les flottants
-    float lerp(float a, float b, float t) {
-        return a + t * (b - a);
+    ~ProfileWriter() {
+        if (!filename.empty() && !profile_write(filename)) std::cerr << "Error: can not write " << filename << std::endl;
     }
+};
 
-    // Fonction lerp pour les vecteurs
-    Vec3f lerp(const Vec3f &a, const Vec3f &b, float t) {
-        return Vec3f(lerp(a.x, b.x, t),
-                    lerp(a.y, b.y, t),
-                    lerp(a.z, b.z, t));
+int main(int argc, char **argv) {
+    TexelFormat envmap_format = TEXELS_FLOAT; // --half-envmap, --bc1-envmap : texels de l'envmap et des textures en half float ou en blocs BC1
+    bool progressive = false; // --progressive : apercus puis raffinement, l'image ecrite au fil de l'eau
+    PixelFormat accumulation = PIXELS_FLOAT; // --accumulation float|half|rgb9e5 : format de la moyenne de --progressive
+    int spp = 1;              // --spp N : echantillons par pixel en mode progressif
+    double flush_ms = 250;    // --flush-ms T : intervalle minimal entre deux ecritures de l'image
+    double budget_ms = 0;     // --budget T : la meilleure image possible en T millisecondes (resolution et profondeur adaptees)
+    int frames = 0;           // --frames N : tour complet de la camera autour du bonhomme en N images
+    int aa = 1;               // --aa N : jusqu'a N echantillons par pixel sur les contours
+    float shutter = 0;        // --shutter S : flou de bouge de la tete, obturateur ouvert S fois l'intervalle entre deux images
+    ToneMap tonemap_op = TONEMAP_NORMALIZE; // --tonemap normalize|clamp|reinhard|aces
+    std::string output = "out.jpg"; // -o fichier : .jpg, .png, .ppm ou .pfm (flottants, avant tone mapping)
+    std::string scene_file;         // --scene fichier : description de la scene au lieu du bonhomme
+    std::string ground = "rings";   // --ground rings|checker|perlin : texture du sol
+    bool dressed = false;           // --dressed : nez en cone, chapeau et boite, des primitives
+    bool compile = false;           // --compile : spheres cachees retirees, materiaux fusionnes, tri spatial (scene_compile.h)
+    int crowd = 0;                  // --crowd N : N bonshommes instancies au lieu d'un seul
+    bool grid = false;              // --grid : grille uniforme au lieu du BVH pour les spheres (et l'objet de --crowd)
+    bool qbvh = false;              // --qbvh : BVH a 4 fils quantifies sur 8 bits pour les spheres (voir qbvh.h)
+    float lod = 0;                  // --lod N : objets et maillages de moins de N pixels de rayon remplaces par une version simplifiee
+    BVHBuilder bvh_builder = BVH_BINNED; // --bvh sweep|binned|lbvh : construction des BVH (voir bvh.h)
+    int extra_lights = 0;           // --lights N : N lumieres ponctuelles aleatoires en plus
+    float area_radius = 0;          // --area-lights R : lumieres spheriques de rayon R, ombres douces
+    int shadow_samples = 16;        // --shadow-samples N : rayons d'ombre par lumiere spherique (penombre seulement)
+    int light_samples = 1;          // --light-samples N : lumieres tirees par point avec beaucoup de lumieres, 0 = toutes
+    int envmap_samples = 0;         // --envmap-samples N : directions de l'envmap tirees par point diffus (eclairage par l'envmap)
+    int gi_rays = 0;                // --gi N : eclairage indirect diffus, cache d'eclairement de N rayons par point (voir irradiance_cache.h)
+    bool fast_shading = false;      // --fast-shading : vecteurs des lumieres par lots et pow rapide (voir light_soa.h)
+    bool single_branch = false;     // --single-branch : le verre ne suit que le reflet ou la refraction, tire au hasard
+    std::string quality;            // --quality draft|preview|final : profondeurs preregles, les options suivantes les remplacent
+    int depth_options[4] = {-1, -1, -1, -1}; // --depth N, --reflect-depth N, --refract-depth N, --shadow-depth N : rebonds,
+                                    // reflets et refractions au plus par chemin, rebond le plus profond qui trace des ombres
+    bool wavefront = false;         // --wavefront : integrateur par vagues (files de rayons triees par etape)
+    bool gpu = false;               // --gpu : rendu par OpenMP target sur le GPU (voir gpu.h), sinon sur le CPU
+    int serve_port = 0;             // --serve PORT : noeud de calcul, rend les tuiles que lui envoie un coordinateur
+    std::string nodes;              // --nodes h:p,h:p : rendu reparti sur ces noeuds (lances avec --serve)
+    int http_port = 0;              // --http PORT : service de rendu, les scenes restent chargees entre les requetes (voir server.h)
+    int renderers = 1;              // --renderers N : requetes rendues en meme temps par --http, chacune sur tous les coeurs
+    int width = 1500, height = 900; // --width W, --height H : taille de l'image, en pixels
+    float fov = 0;                  // --fov DEG : champ de vision vertical, sinon celui de la scene
+    std::string camera;             // --camera px,py,pz,tx,ty,tz : position et point vise, sinon la camera de la scene
+    float aperture = 0;             // --aperture R : rayon de l'objectif, profondeur de champ
+    float focus = 0;                // --focus D : distance de mise au point, sinon celle de l'objet au centre de l'image
+    std::string crop_window;        // --crop x0,y0,x1,y1 : ne rend que ce rectangle de pixels
+    std::string base_image;         // --base fichier : image deja rendue dans laquelle le rectangle est recopie
+    bool stream = false;            // --stream : ecrit l'image par bandes au fil du rendu, sans l'image entiere en memoire
+    double memory_budget = 0;       // --memory-budget MB : au-dela, modes compacts (bandes, half, rgb9e5, bc1) ou refus
+    bool numa = false;              // --numa : threads epingles sur les noeuds NUMA, une copie de la scene par noeud (voir numa.h)
+    std::string cache_file;         // --cache fichier : rendu incremental, ne retrace que les pixels touches par les modifications
+    bool denoise_image = false;     // --denoise : filtre guide par la profondeur, les normales et l'albedo apres le rendu
+    std::string aov_list;           // --aov depth,normal,albedo,id : variables ecrites en .pfm a cote de l'image (normal:half, albedo:rgb9e5 : tampons compacts)
+    std::string heatmap_file;       // --heatmap fichier : image en fausses couleurs du cout de chaque pixel
+    CostMetric heatmap_metric = COST_TIME; // --heatmap-metric time|tests : temps de calcul ou tests d'intersection
+    ProfileWriter profile;          // --profile fichier.json : compteurs et trace au format Chrome (cmake -DPROFILE=ON)
+    std::string batch_file;         // --batch fichier : variantes de la scene (camera, materiaux) rendues ensemble, voir scene_io.h
+    std::string dump_file;          // --dump-scene fichier : ecrit la scene au format texte et s'arrete
+    std::string mesh_texture;       // --mesh-texture image : texture diffuse des maillages .obj qui ont des coordonnees vt
+    std::string envmap_file = "../envmap.jpg"; // --envmap image : envmap equirectangulaire, 8 bits ou .hdr
+    std::vector<const char *> mesh_files;
+    const std::string usage = std::string("usage: ") + argv[0] + " [options] [mesh.obj...], the options are listed in README.md";
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--half-envmap") envmap_format = TEXELS_HALF;
+        else if (arg == "--bc1-envmap") envmap_format = TEXELS_BC1;
+        else if (arg == "--progressive") progressive = true;
+        else if (arg == "--accumulation" && i + 1 < argc) {
+            if (!parse_pixel_format(argv[++i], accumulation)) {
+                std::cerr << "Error: --accumulation float|half|rgb9e5" << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--spp" && i + 1 < argc) spp = std::max(1, atoi(argv[++i]));
+        else if (arg == "--flush-ms" && i + 1 < argc) flush_ms = atof(argv[++i]);
+        else if (arg == "--budget" && i + 1 < argc) budget_ms = std::max(0., atof(argv[++i]));
+        else if (arg == "--mesh-texture" && i + 1 < argc) mesh_texture = argv[++i];
+        else if (arg == "--envmap" && i + 1 < argc) envmap_file = argv[++i];
+        else if (arg == "--tonemap" && i + 1 < argc) {
+            if (!parse_tonemap(argv[++i], tonemap_op)) {
+                std::cerr << "Error: unknown tone mapping operator " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--frames" && i + 1 < argc) frames = std::max(0, atoi(argv[++i]));
+        else if (arg == "--shutter" && i + 1 < argc) shutter = std::max(0.f, float(atof(argv[++i])));
+        else if (arg == "--scene" && i + 1 < argc) scene_file = argv[++i];
+        else if (arg == "--ground" && i + 1 < argc) ground = argv[++i];
+        else if (arg == "--dressed") dressed = true;
+        else if (arg == "--compile") compile = true;
+        else if (arg == "--grid") grid = true;
+        else if (arg == "--qbvh") qbvh = true;
+        else if (arg == "--lod" && i + 1 < argc) lod = std::max(0.f, float(atof(argv[++i])));
+        else if (arg == "--bvh" && i + 1 < argc) {
+            if (!parse_bvh_builder(argv[++i], bvh_builder)) {
+                std::cerr << "Error: --bvh sweep|binned|lbvh" << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--crowd" && i + 1 < argc) crowd = std::max(0, atoi(argv[++i]));
+        else if (arg == "--lights" && i + 1 < argc) extra_lights = std::max(0, atoi(argv[++i]));
+        else if (arg == "--area-lights" && i + 1 < argc) area_radius = std::max(0.f, float(atof(argv[++i])));
+        else if (arg == "--shadow-samples" && i + 1 < argc) shadow_samples = std::max(1, atoi(argv[++i]));
+        else if (arg == "--light-samples" && i + 1 < argc) light_samples = std::max(0, atoi(argv[++i]));
+        else if (arg == "--gi" && i + 1 < argc) gi_rays = std::max(0, atoi(argv[++i]));
+        else if (arg == "--envmap-samples" && i + 1 < argc) envmap_samples = std::max(0, atoi(argv[++i]));
+        else if (arg == "--quality" && i + 1 < argc) quality = argv[++i];
+        else if (arg == "--depth" && i + 1 < argc) depth_options[0] = std::max(0, atoi(argv[++i]));
+        else if (arg == "--reflect-depth" && i + 1 < argc) depth_options[1] = std::max(0, atoi(argv[++i]));
+        else if (arg == "--refract-depth" && i + 1 < argc) depth_options[2] = std::max(0, atoi(argv[++i]));
+        else if (arg == "--shadow-depth" && i + 1 < argc) depth_options[3] = std::max(0, atoi(argv[++i]));
+        else if (arg == "--fast-shading") fast_shading = true;
+        else if (arg == "--single-branch") single_branch = true;
+        else if (arg == "--wavefront") wavefront = true;
+        else if (arg == "--gpu") gpu = true;
+        else if (arg == "--serve" && i + 1 < argc) serve_port = atoi(argv[++i]);
+        else if (arg == "--nodes" && i + 1 < argc) nodes = argv[++i];
+        else if (arg == "--http" && i + 1 < argc) http_port = atoi(argv[++i]);
+        else if (arg == "--renderers" && i + 1 < argc) renderers = std::max(1, atoi(argv[++i]));
+        else if (arg == "--width" && i + 1 < argc) width = atoi(argv[++i]);
+        else if (arg == "--height" && i + 1 < argc) height = atoi(argv[++i]);
+        else if (arg == "--fov" && i + 1 < argc) {
+            fov = atof(argv[++i]); // 0 by default stands for the field of view of the scene, not a value of --fov
+            if (fov <= 0 || fov >= 180) {
+                std::cerr << "Error: the field of view must be in ]0, 180[" << std::endl;
+                return -1;
+            }
+        }
+        else if (arg == "--camera" && i + 1 < argc) camera = argv[++i];
+        else if (arg == "--aperture" && i + 1 < argc) aperture = std::max(0.f, float(atof(argv[++i])));
+        else if (arg == "--focus" && i + 1 < argc) focus = std::max(0.f, float(atof(argv[++i])));
+        else if (arg == "--crop" && i + 1 < argc) crop_window = argv[++i];
+        else if (arg == "--base" && i + 1 < argc) base_image = argv[++i];
+        else if (arg == "--stream") stream = true;
+        else if (arg == "--memory-budget" && i + 1 < argc) memory_budget = std::max(0., atof(argv[++i]));
+        else if (arg == "--profile" && i + 1 < argc) profile.filename = argv[++i];
+        else if (arg == "--aov" && i + 1 < argc) aov_list = argv[++i];
+        else if (arg == "--denoise") denoise_image = true;
+        else if (arg == "--heatmap" && i + 1 < argc) heatmap_file = argv[++i];
+        else if (arg == "--heatmap-metric" && i + 1 < argc) {
+            const std::string metric = argv[++i];
+            if (metric != "time" && metric != "tests") {
+                std::cerr << "Error: --heatmap-metric time|tests" << std::endl;
+                return -1;
+            }
+            heatmap_metric = metric == "time" ? COST_TIME : COST_TESTS;
+        }
+        else if (arg == "--cache" && i + 1 < argc) cache_file = argv[++i];
+        else if (arg == "--numa") numa = true;
+        else if (arg == "--dump-scene" && i + 1 < argc) dump_file = argv[++i];
+        else if (arg == "--batch" && i + 1 < argc) batch_file = argv[++i];
+        else if (arg == "-o" && i + 1 < argc) output = argv[++i];
+        else if (arg == "--aa" && i + 1 < argc) aa = std::max(1, std::min(max_packet, atoi(argv[++i])));
+        else if (arg == "--help" || arg == "-h") {
+            std::cerr << usage << std::endl;
+            return 0;
+        }
+        else if (arg.size() > 1 && arg[0] == '-') { // a typo, or the last option without its value
+            std::cerr << "Error: unknown option " << arg << ", or its value is missing" << std::endl
+                      << usage << std::endl;
+            return -1;
+        }
+        else mesh_files.push_back(argv[i]);
     }
-
-
-int main() {
-    int n = -1;
-    unsigned char *pixmap = stbi_load("../envmap.jpg", &envmap_width, &envmap_height, &n, 0);
-    if (!pixmap || 3 != n) {
-        std::cerr << "Error: can not load the environment map" << std::endl;
+    if (!profile.filename.empty() && !profile_enabled()) {
+        std::cerr << "Error: --profile needs a build with cmake -DPROFILE=ON" << std::endl;
+        profile.filename.clear();
+        return -1;
+    }
+    NumaTopology topology;
+    if (numa) { // before any allocation, the main thread is pinned on node 0 with the scene
+        topology = numa_topology();
+        if (pin_threads(topology)) std::cerr << "# numa: " << topology.cpus.size() << " nodes, threads pinned" << std::endl;
+        else std::cerr << "# numa: threads can not be pinned on this host" << std::endl;
+    }
+    if (serve_port > 0) { // everything else comes from the coordinator
+        std::string error;
+        serve_worker(serve_port, error);
+        std::cerr << "Error: " << error << std::endl;
+        return -1;
+    }
+    if (width <= 0 || height <= 0 || width > max_image_side || height > max_image_side) {
+        std::cerr << "Error: the sides of the image must be in [1, " << max_image_side << "]" << std::endl;
+        return -1;
+    }
+    ImageFormat format;
+    if (!image_format(output, format)) {
+        std::cerr << "Error: unknown image format " << output << std::endl;
         return -1;
     }
-    envmap = std::vector<Vec3f>(envmap_width * envmap_height);
-    for (int j = envmap_height - 1; j >= 0; j--) {
-        for (int i = 0; i < envmap_width; i++) {
-            envmap[i + j * envmap_width] =
-                    Vec3f(pixmap[(i + j * envmap_width) * 3 + 0], pixmap[(i + j * envmap_width) * 3 + 1],
-                          pixmap[(i + j * envmap_width) * 3 + 2]) * (1 / 255.);
+    Tile crop = {0, 0, width, height};
+    if (!crop_window.empty()) {
+        if (sscanf(crop_window.c_str(), "%d,%d,%d,%d", &crop.x0, &crop.y0, &crop.x1, &crop.y1) != 4) {
+            std::cerr << "Error: --crop x0,y0,x1,y1" << std::endl;
+            return -1;
+        }
+        crop = Tile{std::max(0, crop.x0), std::max(0, crop.y0), std::min(width, crop.x1), std::min(height, crop.y1)};
+        if (crop.x0 >= crop.x1 || crop.y0 >= crop.y1) {
+            std::cerr << "Error: the crop window is outside the image" << std::endl;
+            return -1;
         }
     }
-    stbi_image_free(pixmap);
-
-
-
-
-
-    //affichage des spheres represent le corps du snowman
-    std::vector<Sphere> spheres;
-    Material snow_body(1.0, Vec4f(0.75, 0.1, 0.0, 0.0), Vec3f(1.0, 1.0, 1.0), 50.);
-
-    //affichage du corps
-    spheres.push_back(Sphere(Vec3f(0, 2.4, -16), 1.3, snow_body));
-    spheres.push_back(Sphere(Vec3f(0, 0, -16), 1.5, snow_body));
-    spheres.push_back(Sphere(Vec3f(0, -2, -16), 1.7, snow_body));
-
-    //affichage des yeux
-    Material snow_eyes(1.0, Vec4f(0.75, 0.1, 0.0, 0.0), Vec3f(0.0, 0.0, 0.0), 50.);
-    spheres.push_back(Sphere(Vec3f(-0.45, 3, -15), 0.2, snow_eyes));
-    spheres.push_back(Sphere(Vec3f(0.45, 3, -15), 0.2, snow_eyes));
-
-    //affichage des boutons sur le ventre
-    Material snow_button(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.8, 0.0, 0.0), 50.);
-    spheres.push_back(Sphere(Vec3f(0, 1, -15), 0.2, snow_button));
-    spheres.push_back(Sphere(Vec3f(0, 0.5, -14.65), 0.2, snow_button));
-    spheres.push_back(Sphere(Vec3f(0, 0, -14.6), 0.2, snow_button));
-
-    
-    // façon 1
-    // Define the material for the orange nose
-   // Material snow_nose(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(1.0, 0.5, 0.0), 10.);
-    // Add the nose to the snowman
-    //spheres.push_back(Sphere(Vec3f(0, 2.6, -14.7), 0.3, snow_nose));
-
-    // le nez pointé et decaler 
-    Material snow_nose(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(1.0, 0.5, 0.0), 10.);
-    Vec3f nose_tip_position = Vec3f(0, 2.6, -14.7); // La pointe du nez est plus proche de la caméra
-    float nose_length = 1; // Longueur du nez
-    float nose_base_radius = 0.2; // Rayon à la base
-    int nose_pieces = 6; // Nombre de sphères pour former le nez
+    int depths[4] = {int(max_depth), int(max_depth), int(max_depth), int(max_depth)};
+    bool fast_math = false;
+    if (!quality.empty() && !quality_preset(quality, depths, fast_math)) {
+        std::cerr << "Error: unknown quality " << quality << " (draft, preview or final)" << std::endl;
+        return -1;
+    }
+    fast_shading = fast_shading || fast_math;
+    for (int k = 0; k < 4; k++) {
+        if (depth_options[k] >= 0) depths[k] = depth_options[k];
+        depths[k] = std::min(depths[k], int(max_depth));
+    }
+    if (wavefront && (depths[1] < depths[0] || depths[2] < depths[0] || depths[3] < depths[0])) {
+        std::cerr << "Error: --wavefront only limits the bounces (--depth)" << std::endl;
+        return -1;
+    }
+    if (compile && !batch_file.empty()) {
+        std::cerr << "Error: --compile renumbers the materials of --batch" << std::endl;
+        return -1;
+    }
+    if (gi_rays > 0 && (wavefront || gpu || !nodes.empty() || frames > 0 || http_port > 0 || !batch_file.empty() || !cache_file.empty())) {
+        std::cerr << "Error: --gi not with --wavefront, --gpu, --nodes, --frames, --http, --batch nor --cache" << std::endl;
+        return -1;
+    }
+    if (aperture > 0 && (wavefront || !cache_file.empty() || !batch_file.empty() || http_port > 0)) {
+        std::cerr << "Error: --aperture not with --wavefront, --cache, --batch nor --http" << std::endl;
+        return -1;
+    }
+    if ((!crop_window.empty() || !cache_file.empty() || stream) && (progressive || frames > 0 || aa > 1 || wavefront || gpu || !nodes.empty())) {
+        std::cerr << "Error: --crop, --cache and --stream only with the default renderer" << std::endl;
+        return -1;
+    }
+    AOVs aovs = AOVs();
+    aovs.cost_metric = heatmap_metric;
+    const std::vector<std::string> aov_names = split_list(aov_list);
+    for (size_t a = 0; a < aov_names.size(); a++) {
+        static const char *names[] = {"depth", "normal", "albedo", "id"};
+        const size_t colon = aov_names[a].find(':'); // normal:half, albedo:rgb9e5... : format du tampon
+        const std::string name = aov_names[a].substr(0, colon);
+        int k = 0;
+        while (k < 4 && name != names[k]) k++;
+        if (k == 4) {
+            std::cerr << "Error: unknown output variable " << name << " (depth, normal, albedo or id)" << std::endl;
+            return -1;
+        }
+        aovs.enabled |= 1u << k;
+        if (colon == std::string::npos) continue;
+        PixelFormat format;
+        // la profondeur et les identifiants restent en float, les normales ont des composantes negatives
+        if ((k != 1 && k != 2) || !parse_pixel_format(aov_names[a].c_str() + colon + 1, format) || (k == 1 && format == PIXELS_RGB9E5)) {
+            std::cerr << "Error: " << aov_names[a] << " : normal:float|half or albedo:float|half|rgb9e5" << std::endl;
+            return -1;
+        }
+        (k == 1 ? aovs.normal : aovs.albedo) = PixelBuffer(format);
+    }
+    if (!heatmap_file.empty()) aovs.enabled |= AOVs::COST;
+    const uint32_t written_aovs = aovs.enabled; // the denoiser guides are only written if asked for
+    if (denoise_image) aovs.enabled |= AOVs::DEPTH | AOVs::NORMAL | AOVs::ALBEDO;
+    if (denoise_image && (frames > 0 || aa > 1 || wavefront || gpu || !nodes.empty() || !cache_file.empty() || stream ||
+                          !crop_window.empty())) {
+        std::cerr << "Error: --denoise only with the default and progressive renderers, without --crop" << std::endl;
+        return -1;
+    }
+    if (written_aovs && (progressive || frames > 0 || aa > 1 || wavefront || gpu || !nodes.empty() || !cache_file.empty() || stream)) {
+        std::cerr << "Error: --aov and --heatmap only with the default renderer" << std::endl;
+        return -1;
+    }
+    if (budget_ms > 0 && (progressive || frames > 0 || aa > 1 || wavefront || gpu || !nodes.empty() || !cache_file.empty() ||
+                          stream || !crop_window.empty() || denoise_image || aovs.enabled)) {
+        std::cerr << "Error: --budget only with the default renderer, without outputs besides the image" << std::endl;
+        return -1;
+    }
+    if (!batch_file.empty() && (progressive || frames > 0 || aa > 1 || wavefront || gpu || !nodes.empty() || !cache_file.empty() ||
+                                stream || !crop_window.empty() || denoise_image || aovs.enabled || budget_ms > 0 || http_port > 0)) {
+        std::cerr << "Error: --batch only with the default renderer, without outputs besides the images" << std::endl;
+        return -1;
+    }
+    if (http_port > 0 && (progressive || frames > 0 || aa > 1 || wavefront || gpu || !nodes.empty() || !cache_file.empty() ||
+                          stream || !crop_window.empty() || denoise_image || aovs.enabled || budget_ms > 0)) {
+        std::cerr << "Error: --http takes the renderer and the quality from each request" << std::endl;
+        return -1;
+    }
+    ImageFormat heatmap_format;
+    if (!heatmap_file.empty() && !image_format(heatmap_file, heatmap_format)) {
+        std::cerr << "Error: unknown image format " << heatmap_file << std::endl;
+        return -1;
+    }
+    if (heatmap_metric == COST_TESTS && !profile_enabled()) {
+        std::cerr << "Error: --heatmap-metric tests needs a build with cmake -DPROFILE=ON" << std::endl;
+        return -1;
+    }
+    if (!crop_window.empty() + !cache_file.empty() + stream > 1) {
+        std::cerr << "Error: --crop, --cache and --stream can not be combined" << std::endl;
+        return -1;
+    }
 
-    for (int i = 0; i < nose_pieces; i++) {
-        float progress = (float)i / (nose_pieces - 1);
-        float radius = lerp(nose_base_radius, 0.05, progress); // Lerp est une fonction linéaire pour interpoler entre deux valeurs
-        Vec3f position = lerp(nose_tip_position, nose_tip_position + Vec3f(0, 0, nose_length), progress); // La position s'éloigne de la pointe
-        if (progress > 0.5) { // decaler apres la moitié du nez
-        float offset_progress = (progress - 0.5f) * 2.0f; // 0 au milieu, jusqu'à 1 à la pointe
-        position.x += offset_progress * 0.2; // Decaler de plus en plus vers la pointe
+    // the envmap, the mesh texture and the meshes are loaded by jobs while the scene is built
+    EnvironmentMap envmap;
+    ImageTexture mesh_image;
+    std::vector<std::unique_ptr<Model> > loaded_meshes(mesh_files.size());
+    JobGraph loading;
+    int envmap_job = -1;
+    const std::chrono::steady_clock::time_point loading_start = std::chrono::steady_clock::now();
+    if (dump_file.empty()) {
+        envmap_job = loading.add("envmap", [&](std::string &error) { return envmap.load(envmap_file, envmap_format, error); });
+        if (!mesh_texture.empty()) {
+            loading.add(mesh_texture, [&](std::string &error) {
+                if (mesh_image.load(mesh_texture.c_str(), ImageTexture::WRAP_REPEAT, envmap_format)) return true;
+                error = "can not load the texture " + mesh_texture;
+                return false;
+            });
         }
+        std::vector<int> mesh_jobs;
+        for (size_t i = 0; i < mesh_files.size(); i++) {
+            std::vector<int> after; // a file given twice writes its cache once
+            for (size_t k = 0; k < i && after.empty(); k++)
+                if (!strcmp(mesh_files[k], mesh_files[i])) after.push_back(mesh_jobs[k]);
+            mesh_jobs.push_back(loading.add(mesh_files[i], [&, i](std::string &error) {
+                loaded_meshes[i].reset(new Model(mesh_files[i]));
+                if (loaded_meshes[i]->ok()) return true;
+                error = "can not load " + std::string(mesh_files[i]);
+                return false;
+            }, after));
+        }
+        loading.start(!numa_pinned()); // pinned, the threads of the jobs would share the cpu of the main thread
+    }
 
+    Scene scene;
+    const SphereAccel sphere_accel = grid ? ACCEL_GRID : qbvh ? ACCEL_QBVH : ACCEL_BVH;
+    if (!scene_file.empty()) {
+        std::string error;
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!load_scene(scene_file, scene, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return -1;
+        }
+        if (compile) { // the scene cache holds the lists as the file gives them
+            print_compile_stats(compile_scene(scene));
+            scene.sphere_accel = sphere_accel;
+            scene.build();
+        } else if (sphere_accel != ACCEL_BVH) { // the scene cache holds the BVH
+            scene.sphere_accel = sphere_accel;
+            scene.build_spheres();
+        }
+        std::cerr << "# scene: " << scene.spheres.size() << " spheres, " << scene.meshes.size() << " meshes, loaded in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    } else {
+        if (crowd > 0) build_snowman_crowd(scene, crowd);
+        else if (dressed) build_dressed_snowman(scene);
+        else build_snowman(scene);
+        scene.sphere_accel = sphere_accel;
+        scene.bvh_builder = bvh_builder;
+        for (size_t i = 0; i < scene.objects.size(); i++) scene.objects[i].accel = sphere_accel;
+        if (compile) print_compile_stats(compile_scene(scene));
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        scene.build();
+        std::cerr << "# build: " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                  << " ms" << std::endl;
+    }
+    if (extra_lights > 0) {
+        add_light_field(scene, extra_lights);
+        scene.build_lights();
+    }
+    if (area_radius > 0) {
+        for (size_t i = 0; i < scene.lights.size(); i++)
+            scene.lights[i] = Light::sphere(scene.lights[i].position, area_radius, scene.lights[i].intensity, shadow_samples);
+        scene.build_lights();
+    }
+    if (!camera.empty()) {
+        Vec3f position, target;
+        if (sscanf(camera.c_str(), "%f,%f,%f,%f,%f,%f", &position.x, &position.y, &position.z, &target.x, &target.y, &target.z) != 6 ||
+            !std::isfinite((target - position).norm()) || (target - position).norm() == 0) { // no axes to look along
+            std::cerr << "Error: --camera px,py,pz,tx,ty,tz, the target away from the position" << std::endl;
+            return -1;
+        }
+        scene.camera.position = position;
+        scene.camera.look_at(target);
+    }
+    if (fov > 0) scene.camera.fov = fov * M_PI / 180;
+    scene.camera.aperture = aperture;
+    scene.camera.focus = focus;
+    scene.light_samples = light_samples;
+    scene.envmap_samples = envmap_samples;
+    scene.depth_limit = depths[0];
+    scene.reflect_depth = depths[1];
+    scene.refract_depth = depths[2];
+    scene.shadow_depth = depths[3];
+    scene.fast_shading = fast_shading;
+    scene.single_branch = single_branch;
+    if (find_texture(ground) < 0) {
+        std::cerr << "Error: unknown texture " << ground << std::endl;
+        return -1;
+    }
+    scene.surfaces[0] = TexturedSurface::builtin(ground, Scene::checker_white, Scene::checker_black);
+    if (!dump_file.empty()) {
+        if (!save_scene_text(dump_file, scene)) {
+            std::cerr << "Error: can not write " << dump_file << std::endl;
+            return -1;
+        }
+        return 0;
+    }
 
-        spheres.push_back(Sphere(position, radius, snow_nose));
+    std::string loading_error;
+    if (!loading.wait(loading_error)) {
+        std::cerr << "Error: " << loading_error << std::endl;
+        return -1;
+    }
+    std::cerr << "# envmap: octahedral " << envmap.size() << "x" << envmap.size() << ", " << envmap.nlevels()
+              << " levels, " << envmap.bytes() / (1 << 20) << " MB, " << loading.ms(envmap_job) << " ms" << std::endl;
+    if (loading.size() > 1) {
+        std::cerr << "# loading:";
+        for (int j = 0; j < loading.size(); j++) std::cerr << (j ? ", " : " ") << loading.name(j) << " " << loading.ms(j) << " ms";
+        std::cerr << ", all in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loading_start).count()
+                  << " ms" << std::endl;
     }
 
+    scene.envmap = &envmap;
+
+    // les maillages .obj passes en argument sont ajoutes tels quels a la scene, en verre ou, avec une texture, diffus
+    if (!mesh_texture.empty()) scene.images.push_back(std::move(mesh_image));
+    const uint16_t mesh_material = mesh_texture.empty()
+        ? scene.add_material(Material(1.5, Vec4f(0.0, 0.5, 0.1, 0.8), Vec3f(0.6, 0.7, 0.8), 125.))
+        : scene.add_material(Material(1, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(1, 1, 1), 10.));
+    for (size_t i = 0; i < mesh_files.size(); i++) {
+        scene.meshes.push_back(std::move(*loaded_meshes[i]));
+        scene.mesh_materials.push_back(mesh_material);
+        scene.mesh_images.push_back(mesh_texture.empty() ? -1 : 0);
+    }
+    if (lod > 0) { // N pixels au centre de l'image, vus depuis la camera
+        scene.build_lod(lod * 2 * std::tan(scene.camera.fov / 2) / height);
+        size_t proxies = 0;
+        for (size_t i = 0; i < scene.object_proxies.size(); i++) proxies += !scene.object_proxies[i].spheres.empty();
+        for (size_t i = 0; i < scene.mesh_proxies.size(); i++) proxies += scene.mesh_proxies[i].nfaces() > 0;
+        std::cerr << "# lod: " << proxies << " proxies, below " << lod << " pixels" << std::endl;
+    }
 
-    Material stick_material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.35, 0.16, 0.08), 10.); 
-    Vec3f left_arm_start = Vec3f(-1.5, 0.5, -16); // Point de départ du bras gauche
-    Vec3f left_branch = Vec3f(-1.5, 0.27, -16);
-    Vec3f right_arm_start = Vec3f(1.5, 0.5, -16); // Point de départ du bras droit
-    Vec3f right_branch = Vec3f(1.5, 0.27, -16);
-    float arm_radius = 0.08; // Rayon des sphères pour les bras
+    if (aperture > 0 && focus <= 0) { // sharp on what the center of the image shows
+        Hit hit;
+        scene.camera.focus = scene_intersect(scene.camera.position, scene.camera.forward, scene, hit)
+                           ? (hit.point - scene.camera.position) * scene.camera.forward : 10.f;
+        std::cerr << "# focus: " << scene.camera.focus << std::endl;
+    }
 
-    // Créer le bras gauche
-    for (int i = 0; i < 20; i++) {
-        if(i > 10){
+    IrradianceCache irradiance;
+    if (gi_rays > 0) { // on what the camera sees, before the memory budget counts it
+        const auto gi_start = std::chrono::steady_clock::now();
+        irradiance.build(scene, width, height, gi_rays);
+        scene.irradiance = &irradiance;
+        std::cerr << "# gi: " << irradiance.size() << " records of " << gi_rays << " rays, "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - gi_start).count() << " ms" << std::endl;
+    }
 
-            Vec3f arm_position = left_branch + Vec3f(-0.06 * i, 0.06 * i, 0);
-            spheres.push_back(Sphere(arm_position, arm_radius, stick_material));
+    std::cerr << "# sphere kernel: " << sphere_kernel_name() << ", triangle kernel: " << triangle_kernel_name() << std::endl;
+
+    // what the renderer chosen by the options keeps besides the scene and the envmap, for width x height images
+    const size_t pixels = size_t(width) * height, image_bytes = sizeof(Vec3f) + 3; // framebuffer and 8-bit image, per pixel
+    auto account_images = [&](MemoryReport &report) {
+        if (http_port > 0) report.add("framebuffer", renderers * pixels * image_bytes);
+        else if (!batch_file.empty()) { // render_batch renders 4 variants of the scene while 4 images are written
+            report.add("framebuffer", 4 * pixels * (image_bytes + sizeof(Vec3f)));
+            report.add("variant materials", 4 * scene.materials.size() * sizeof(Material));
+        } else if (frames > 0) report.add("framebuffer", 2 * pixels * image_bytes); // one frame written, one rendered
+        else if (stream) report.add("framebuffer", size_t(64) * width * image_bytes); // the bands of render_streamed
+        else {
+            report.add("framebuffer", (progressive ? 2 : 1) * pixels * image_bytes); // and the copy of the last flush
+            if (progressive) report.add("accumulation", pixels * (pixel_format_bytes(accumulation) + 1));
+            if (aovs.enabled & AOVs::DEPTH) report.add("aovs", pixels * sizeof(float));
+            if (aovs.enabled & AOVs::NORMAL) report.add("aovs", pixels * pixel_format_bytes(aovs.normal.format()));
+            if (aovs.enabled & AOVs::ALBEDO) report.add("aovs", pixels * pixel_format_bytes(aovs.albedo.format()));
+            if (aovs.enabled & AOVs::ID) report.add("aovs", pixels * pixel_format_bytes(aovs.id.format()));
+            if (aovs.enabled & AOVs::COST) report.add("aovs", pixels * sizeof(float));
+        }
+    };
+    MemoryReport memory;
+    auto account = [&]() {
+        memory = MemoryReport();
+        account_scene(scene, memory);
+        memory.add("envmap", envmap.bytes());
+        memory.add("irradiance cache", irradiance.bytes());
+        account_images(memory);
+    };
+    account();
+    if (memory_budget > 0) { // the compact modes, the lossless and the cheapest losses first
+        const size_t budget = static_cast<size_t>(memory_budget * (1 << 20));
+        const bool streamable = !progressive && frames == 0 && aa == 1 && !wavefront && !gpu && nodes.empty() && cache_file.empty() &&
+                                crop_window.empty() && !aovs.enabled && budget_ms == 0 && batch_file.empty() && http_port == 0 &&
+                                (format == FORMAT_PPM || format == FORMAT_PFM);
+        while (memory.total() > budget) {
+            if (streamable && !stream) {
+                stream = true;
+                std::cerr << "# memory: image streamed by bands" << std::endl;
+            } else if (progressive && accumulation == PIXELS_FLOAT) {
+                accumulation = PIXELS_HALF;
+                std::cerr << "# memory: accumulation in half floats" << std::endl;
+            } else if (envmap_format != TEXELS_BC1) {
+                envmap_format = envmap_format == TEXELS_FLOAT ? TEXELS_HALF : TEXELS_BC1;
+                std::string error;
+                if (!envmap.load(envmap_file, envmap_format, error)) {
+                    std::cerr << "Error: " << error << std::endl;
+                    return -1;
+                }
+                std::cerr << "# memory: envmap in " << (envmap_format == TEXELS_HALF ? "half floats" : "BC1 blocks") << ", "
+                          << memory_size(envmap.bytes()) << std::endl;
+            } else if (progressive && accumulation == PIXELS_HALF) {
+                accumulation = PIXELS_RGB9E5;
+                std::cerr << "# memory: accumulation in rgb9e5" << std::endl;
+            } else {
+                memory.print();
+                std::cerr << "Error: the render needs " << memory_size(memory.total()) << ", over the budget of "
+                          << memory_size(budget) << std::endl;
+                return -1;
+            }
+            account();
         }
-        Vec3f arm_position = left_arm_start + Vec3f(-0.06 * i, 0.03 * i, 0); // Chaque sphère est decalé un peu plus loin et un peu plus haut
-        spheres.push_back(Sphere(arm_position, arm_radius, stick_material));
     }
 
-    // Créer le bras droit
-    for (int i = 0; i < 20; i++) {
-        if(i > 10){
-            
-            Vec3f arm_position = right_branch + Vec3f(0.06 * i, 0.06 * i, 0); 
-            spheres.push_back(Sphere(arm_position, arm_radius, stick_material));
+    if (http_port > 0) { // the scene of the command line, and the built-in snowmen with the same settings
+        Scene snowman, dressed;
+        build_snowman(snowman);
+        build_dressed_snowman(dressed);
+        Scene *builtin[] = {&snowman, &dressed};
+        for (Scene *s : builtin) {
+            s->sphere_accel = scene.sphere_accel;
+            s->bvh_builder = scene.bvh_builder;
+            s->build();
+            s->surfaces[0] = scene.surfaces[0];
+            s->light_samples = scene.light_samples;
+            s->envmap_samples = scene.envmap_samples;
+            s->depth_limit = scene.depth_limit;
+            s->reflect_depth = scene.reflect_depth;
+            s->refract_depth = scene.refract_depth;
+            s->shadow_depth = scene.shadow_depth;
+            s->fast_shading = scene.fast_shading;
+            s->single_branch = scene.single_branch;
+            s->envmap = &envmap;
         }
-        Vec3f arm_position = right_arm_start + Vec3f(0.06 * i, 0.03 * i, 0); // Chaque sphère est decalé un peu plus loin et un peu plus haut
-        spheres.push_back(Sphere(arm_position, arm_radius, stick_material));
+        memory.print(); // at the size of the command line, the requests choose their own
+        const ServerSettings settings = {http_port, renderers, 64, tonemap_op};
+        RenderServer server(settings);
+        server.add_scene("default", scene);
+        server.add_scene("snowman", snowman);
+        server.add_scene("dressed", dressed);
+        std::string error;
+        server.serve(error);
+        std::cerr << "Error: " << error << std::endl;
+        return -1;
     }
 
+    if (!batch_file.empty()) {
+        std::vector<SceneVariant> variants;
+        std::string error;
+        if (!load_variants(batch_file, scene, variants, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return -1;
+        }
+        for (size_t v = 0; v < variants.size(); v++) {
+            if (!image_format(variants[v].output, format)) {
+                std::cerr << "Error: unknown image format " << variants[v].output << std::endl;
+                return -1;
+            }
+        }
+        // the images of a group are written while the next group renders
+        const int group = 4;
+        std::vector<std::vector<Vec3f> > hdr(group);
+        std::vector<std::vector<unsigned char> > rgb(group);
+        std::vector<std::unique_ptr<AsyncImageWriter> > writers(group);
+        std::vector<size_t> written(group);
+        bool ok = true;
+        auto finish = [&](const size_t k) {
+            if (writers[k] && !writers[k]->wait()) {
+                std::cerr << "Error: can not write " << variants[written[k]].output << std::endl;
+                ok = false;
+            }
+            writers[k].reset();
+        };
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        print_thread_stats(render_batch(scene, width, height, variants, group, [&](size_t v, const std::vector<Vec3f> &framebuffer) {
+            const size_t k = v % group;
+            finish(k);
+            hdr[k] = framebuffer;
+            tonemap(hdr[k], rgb[k], tonemap_op);
+            written[k] = v;
+            writers[k].reset(new AsyncImageWriter(variants[v].output, width, height, rgb[k].data(), hdr[k].data()));
+            writers[k]->all_done();
+        }));
+        for (int k = 0; k < group; k++) finish(k);
+        memory.print();
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "# batch: " << variants.size() << " variants, " << ms << " ms, " << ms / variants.size() << " ms per variant" << std::endl;
+        return ok ? 0 : -1;
+    }
 
-
-    Material mouth_material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.0, 0.0, 0.0), 10.); 
-    Vec3f mouth_center = Vec3f(0.25, 2.3, -13); //  le centre de la bouche sur le visage
-    float mouth_width = 0.6; 
-    float mouth_radius = 0.05; 
-    int mouth_pieces = 9; 
-
-    
-    for (int i = 0; i < mouth_pieces; ++i) {
-        float x_offset = lerp(-mouth_width / 2, mouth_width / 2, static_cast<float>(i) / (mouth_pieces - 1));
-        float y_offset = -sqrt(mouth_width * mouth_width / 4 - x_offset * x_offset) / 2;
-        Vec3f sphere_position = mouth_center + Vec3f(x_offset, y_offset, 0);
-        spheres.push_back(Sphere(sphere_position, mouth_radius, mouth_material));
+    std::unique_ptr<ClusterRenderer> cluster;
+    if (!nodes.empty()) {
+        const ClusterSettings settings = {ground, light_samples, fast_shading, single_branch, envmap_samples,
+                                           {depths[0], depths[1], depths[2], depths[3]}, envmap_format, envmap_file};
+        std::string error;
+        cluster.reset(new ClusterRenderer());
+        if (!cluster->connect(split_list(nodes), scene, settings, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return -1;
+        }
+        std::cerr << "# cluster: " << cluster->workers() << " workers" << std::endl;
     }
 
+    if (stream) {
+        const int status = render_streamed(scene, width, height, output, tonemap_op);
+        memory.print();
+        return status;
+    }
 
+    std::vector<Vec3f> framebuffer;
+    std::vector<unsigned char> image;
+    if (frames > 0) {
+        const bool sway = scene_file.empty() && !crowd && !dressed && !cluster; // the workers only get the camera
+        const int status = render_frames(scene, width, height, frames, output, tonemap_op, sway, aa, shutter, cluster.get());
+        if (cluster) cluster->print_worker_stats();
+        memory.print();
+        return status;
+    }
 
+    std::string gpu_unsupported;
+    if (gpu && !GpuRenderer::supports(scene, gpu_unsupported)) {
+        std::cerr << "# gpu: not for this scene (" << gpu_unsupported << "), rendering on the CPU" << std::endl;
+        gpu = false;
+    }
 
-    //affichages des lumieres
-    std::vector<Light> lights;
-    lights.push_back(Light(Vec3f(-20, 20, 20), 1.5));
-    lights.push_back(Light(Vec3f(30, 50, -25), 1.8));
-    lights.push_back(Light(Vec3f(30, 20, 30), 1.7));
+    if (budget_ms > 0) {
+        const BudgetResult budget = render_budget(scene, width, height, budget_ms, framebuffer);
+        print_thread_stats(budget.stats);
+        std::cerr << "# budget: " << budget.ms << " ms of " << budget_ms << ", depth " << budget.depth << ", 1/" << budget.stride
+                  << " resolution, " << budget.samples << " spp" << std::endl;
+        image.resize(width * height * 3);
+        tonemap(framebuffer, image, tonemap_op);
+        AsyncImageWriter writer(output, width, height, image.data(), framebuffer.data());
+        writer.all_done();
+        if (!writer.wait()) {
+            std::cerr << "Error: can not write " << output << std::endl;
+            return -1;
+        }
+        memory.print();
+        return 0;
+    }
 
+    SceneReplicas replicas; // the single image renderers below leave the scene as it is
+    if (numa_pinned() && topology.cpus.size() > 1) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        replicas.build(scene, topology);
+        scene.replicas = &replicas;
+        std::cerr << "# numa: scene copied to " << replicas.size() - 1 << " nodes, " << std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    }
 
-    render(spheres, lights);
+    if (!progressive) {
+        image.resize(width * height * 3);
+        framebuffer.resize(width * height);
+        if (!base_image.empty()) { // the pixels outside the crop window come from the previous render
+            std::vector<Vec3f> hdr;
+            std::string error;
+            if (!read_image(base_image, width, height, image, hdr, error)) {
+                std::cerr << "Error: " << error << std::endl;
+                return -1;
+            }
+            if (!hdr.empty()) {
+                framebuffer.swap(hdr);
+                tonemap(framebuffer, image, tonemap_op);
+            } else if (format == FORMAT_PFM) {
+                std::cerr << "Error: a PFM output needs a PFM base image" << std::endl;
+                return -1;
+            }
+        }
+        AsyncImageWriter writer(output, width, height, image.data(), framebuffer.data());
+        if (cluster) {
+            std::string error;
+            if (!cluster->render(scene.camera, width, height, framebuffer, [&](const Tile &tile) {
+                tonemap_tile(framebuffer, width, tile, image, tonemap_op);
+                writer.tile_done(tile);
+            }, error)) {
+                std::cerr << "Error: " << error << std::endl;
+                writer.all_done();
+                writer.wait();
+                return -1;
+            }
+            cluster->print_worker_stats();
+        } else if (gpu) {
+            std::cerr << "# gpu: " << GpuRenderer::devices() << " offload devices" << std::endl;
+            GpuRenderer renderer(scene);
+            renderer.render(scene, width, height, framebuffer);
+            tonemap(framebuffer, image, tonemap_op);
+            writer.all_done();
+        } else if (aa > 1) {
+            print_thread_stats(render_adaptive(scene, width, height, framebuffer, aa));
+            tonemap(framebuffer, image, tonemap_op);
+            writer.all_done();
+        } else if (!cache_file.empty()) {
+            if (!RenderCache::supports(scene)) std::cerr << "# cache: not for scenes with instances or meshes" << std::endl;
+            std::ostringstream settings; // what changes the image besides the scene arrays
+            settings << "ground " << ground << " light-samples " << light_samples << " envmap-samples " << envmap_samples
+                     << " depths " << depths[0] << "," << depths[1] << "," << depths[2] << "," << depths[3]
+                     << " fast-shading " << fast_shading
+                     << " single-branch " << single_branch << " envmap-format " << envmap_format << " envmap " << envmap_file;
+            struct stat envmap_stat; // a new image under the same name changes the background too
+            if (!stat(envmap_file.c_str(), &envmap_stat)) settings << " " << envmap_stat.st_size << " " << envmap_stat.st_mtime;
+            RenderCache cache;
+            cache.load(cache_file, width, height, settings.str());
+            print_thread_stats(cache.render(scene, width, height, framebuffer));
+            std::cerr << "# cache: " << cache.retraced() << " pixels traced (" << 100. * cache.retraced() / (width * height)
+                      << "%)" << std::endl;
+            if (RenderCache::supports(scene) && !cache.save(cache_file))
+                std::cerr << "Error: can not write " << cache_file << std::endl;
+            tonemap(framebuffer, image, tonemap_op);
+            writer.all_done();
+        } else { // each tile is tone-mapped right after it is traced, the writer starts on the completed rows
+            const std::function<void(const Tile &)> tile_done = [&](const Tile &tile) {
+                if (denoise_image) return; // the pixels change once the whole image is traced
+                tonemap_tile(framebuffer, width, tile, image, tonemap_op);
+                writer.tile_done(tile);
+            };
+            print_thread_stats(wavefront ? render_wavefront(scene, width, height, framebuffer, tile_done)
+                                         : render_crop(scene, width, height, crop, framebuffer, tile_done,
+                                                       aovs.enabled ? &aovs : nullptr));
+            if (denoise_image) {
+                const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                denoise(framebuffer, aovs, width, height, framebuffer);
+                std::cerr << "# denoise: " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+                          << " ms" << std::endl;
+                tonemap(framebuffer, image, tonemap_op);
+            }
+            writer.all_done(); // the rows outside the crop window
+            aovs.enabled = written_aovs;
+            if (((aovs.enabled & AOVs::DEPTH) && !write_aov(aov_name(output, "depth"), width, height, aovs.depth)) ||
+                ((aovs.enabled & AOVs::NORMAL) && !write_aov(aov_name(output, "normal"), width, height, aovs.normal.to_vector())) ||
+                ((aovs.enabled & AOVs::ALBEDO) && !write_aov(aov_name(output, "albedo"), width, height, aovs.albedo.to_vector())) ||
+                ((aovs.enabled & AOVs::ID) && !write_aov(aov_name(output, "id"), width, height, aovs.id.to_vector())))
+                return -1;
+            if (!heatmap_file.empty()) {
+                std::vector<unsigned char> heat;
+                const float top = heatmap(aovs.cost, heat);
+                std::vector<Vec3f> values(aovs.cost.size()); // the raw costs in a .pfm
+                for (size_t p = 0; p < values.size(); p++) values[p] = Vec3f(aovs.cost[p], aovs.cost[p], aovs.cost[p]);
+                AsyncImageWriter heat_writer(heatmap_file, width, height, heat.data(), values.data());
+                heat_writer.all_done();
+                double sum = 0;
+                for (size_t p = 0; p < aovs.cost.size(); p++) sum += aovs.cost[p];
+                std::cerr << "# heatmap: " << sum / ((crop.x1 - crop.x0) * (crop.y1 - crop.y0))
+                          << (heatmap_metric == COST_TIME ? " ns" : " tests") << " per pixel on average, " << top
+                          << " at the 99th percentile (brightest color)" << std::endl;
+                if (!heat_writer.wait()) {
+                    std::cerr << "Error: can not write " << heatmap_file << std::endl;
+                    return -1;
+                }
+            }
+        }
+        const int traced = cache_file.empty() ? (crop.x1 - crop.x0) * (crop.y1 - crop.y0) : width * height;
+        if (!cluster) // the rays of the workers are not counted here
+            std::cerr << "# primary rays: " << double(total_ray_counters().primary) / traced << " per pixel" << std::endl;
+        if (!writer.wait()) {
+            std::cerr << "Error: can not write " << output << std::endl;
+            return -1;
+        }
+        memory.print();
+        return 0;
+    }
 
+    // the previous flush is still being encoded from its own copy while the next passes render
+    std::vector<unsigned char> flushed_image;
+    std::vector<Vec3f> flushed_framebuffer;
+    std::unique_ptr<AsyncImageWriter> writer;
+
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    Clock::time_point last_flush = start;
+    ProgressiveRenderer renderer(scene, width, height, 8, aovs, accumulation);
+    while (renderer.previewing() || renderer.samples() < spp) {
+        renderer.pass();
+        const Clock::time_point now = Clock::now();
+        const bool last = !renderer.previewing() && renderer.samples() >= spp;
+        if (last || std::chrono::duration<double, std::milli>(now - last_flush).count() >= flush_ms || renderer.passes() == 1) {
+            renderer.resolve(framebuffer);
+            if (denoise_image && !renderer.previewing()) denoise(framebuffer, renderer.outputs(), width, height, framebuffer);
+            tonemap(framebuffer, image, tonemap_op);
+            if (writer && !writer->wait()) std::cerr << "Error: can not write " << output << std::endl;
+            flushed_image = image;
+            flushed_framebuffer = framebuffer;
+            writer.reset(new AsyncImageWriter(output, width, height, flushed_image.data(), flushed_framebuffer.data()));
+            writer->all_done();
+            last_flush = Clock::now();
+            std::cerr << "# pass " << renderer.passes() << (renderer.previewing() ? " (preview)" : "") << ", "
+                      << renderer.samples() << " spp, "
+                      << std::chrono::duration<double, std::milli>(last_flush - start).count() << " ms" << std::endl;
+        }
+    }
+    if (writer && !writer->wait()) {
+        std::cerr << "Error: can not write " << output << std::endl;
+        return -1;
+    }
+    memory.print();
     return 0;
 }
-
@@ -0,0 +1,44 @@
+#include <fstream>
+#include <iterator>
+#include "mapped_file.h"
+#if defined(__unix__) || defined(__APPLE__)
+#define MAPPED_FILE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const std::string &filename) {
+    close();
+#ifdef MAPPED_FILE_MMAP
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+    void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return false;
+    map = static_cast<const char *>(p);
+    length = static_cast<size_t>(st.st_size);
+    return true;
+#else
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in) return false;
+    buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    length = buffer.size();
+    return length > 0;
+#endif
+}
+
+void MappedFile::close() {
+#ifdef MAPPED_FILE_MMAP
+    if (map) munmap(const_cast<char *>(map), length);
+#endif
+    map = nullptr;
+    buffer.clear();
+    length = 0;
+}
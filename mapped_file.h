@@ -0,0 +1,55 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file: mmap'ed where available, read into memory otherwise.
+class MappedFile {
+public:
+    MappedFile() : map(nullptr), length(0) {}
+    ~MappedFile() { close(); }
+
+    bool open(const std::string &filename);
+    void close();
+
+    const char *data() const { return map ? map : buffer.data(); }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const char *map;
+    std::vector<char> buffer; // fallback without mmap
+    size_t length;
+};
+
+// Array owned, or read in place from a MappedFile that its owner keeps open.
+template<typename T> class MappedArray {
+public:
+    MappedArray() : mapped(nullptr), n(0) {}
+
+    void own(std::vector<T> &v) { // takes the content of v
+        owned.swap(v);
+        mapped = nullptr;
+        n = owned.size();
+    }
+    void map(const T *first, size_t count) {
+        owned.clear();
+        mapped = first;
+        n = count;
+    }
+    void clear() { map(nullptr, 0); }
+
+    const T *data() const { return mapped ? mapped : owned.data(); }
+    const T &operator[](size_t i) const { return data()[i]; }
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+
+private:
+    std::vector<T> owned;
+    const T *mapped; // in the file
+    size_t n;
+};
+
+#endif //__MAPPED_FILE_H__
@@ -0,0 +1,65 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include "memory_report.h"
+
+namespace {
+    template<typename T> size_t vector_bytes(const std::vector<T> &v) { return v.capacity() * sizeof(T); }
+}
+
+void MemoryReport::add(const std::string &part, const size_t bytes) {
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (parts[i].first != part) continue;
+        parts[i].second += bytes;
+        return;
+    }
+    parts.push_back(std::make_pair(part, bytes));
+}
+
+size_t MemoryReport::total() const {
+    size_t sum = 0;
+    for (size_t i = 0; i < parts.size(); i++) sum += parts[i].second;
+    return sum;
+}
+
+void MemoryReport::print() const {
+    std::vector<std::pair<std::string, size_t> > sorted;
+    for (size_t i = 0; i < parts.size(); i++)
+        if (parts[i].second) sorted.push_back(parts[i]);
+    std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, size_t> &a, const std::pair<std::string, size_t> &b) {
+        return a.second > b.second;
+    });
+    std::cerr << "# memory:";
+    for (size_t i = 0; i < sorted.size(); i++) std::cerr << (i ? ", " : " ") << sorted[i].first << " " << memory_size(sorted[i].second);
+    std::cerr << (sorted.empty() ? " " : ", ") << memory_size(total()) << " in all" << std::endl;
+}
+
+void account_scene(const Scene &scene, MemoryReport &report) {
+    report.add("spheres", vector_bytes(scene.spheres) + scene.sphere_soa.bytes());
+    report.add("sphere accelerator", scene.sphere_bvh.bytes() + scene.sphere_grid.bytes() + scene.sphere_qbvh.bytes());
+    report.add("primitives", vector_bytes(scene.primitives) + scene.primitive_bvh.bytes());
+    size_t instanced = vector_bytes(scene.instances) + scene.instance_bvh.bytes();
+    for (size_t i = 0; i < scene.instance_slices.size(); i++) instanced += scene.instance_slices[i].bytes();
+    for (size_t o = 0; o < scene.objects.size(); o++) instanced += scene.objects[o].bytes();
+    for (size_t o = 0; o < scene.object_proxies.size(); o++) instanced += scene.object_proxies[o].bytes();
+    report.add("instances", instanced);
+    size_t meshes = 0;
+    for (size_t m = 0; m < scene.meshes.size(); m++) meshes += scene.meshes[m].bytes();
+    for (size_t m = 0; m < scene.mesh_proxies.size(); m++) meshes += scene.mesh_proxies[m].bytes();
+    report.add("meshes", meshes);
+    size_t textures = 0;
+    for (size_t i = 0; i < scene.images.size(); i++) textures += scene.images[i].bytes();
+    report.add("textures", textures);
+    const LightSoA &soa = scene.light_soa;
+    report.add("lights", vector_bytes(scene.lights) + scene.light_tree.bytes() +
+                         vector_bytes(soa.x) + vector_bytes(soa.y) + vector_bytes(soa.z) + vector_bytes(soa.intensity));
+    report.add("materials", vector_bytes(scene.materials) + vector_bytes(scene.surfaces) + vector_bytes(scene.mesh_materials));
+}
+
+std::string memory_size(const size_t bytes) {
+    std::ostringstream out;
+    if (bytes >= size_t(10) << 20) out << (bytes >> 20) << " MB";
+    else if (bytes >= size_t(1) << 20) out << double(bytes * 10 >> 20) / 10 << " MB";
+    else out << (bytes + 1023) / 1024 << " KB";
+    return out.str();
+}
@@ -0,0 +1,30 @@
+#ifndef __MEMORY_REPORT_H__
+#define __MEMORY_REPORT_H__
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "scene.h"
+
+// Memory accounting: the bytes held by each subsystem of a render (envmap, spheres, BVHs, framebuffer...),
+// printed at the end of the render and checked against --memory-budget before it. Counted from the sizes
+// of the arrays, mapped files included, without the allocator overhead, the stacks and the small members.
+class MemoryReport {
+public:
+    void add(const std::string &part, size_t bytes); // adds to the part of that name, if any
+    size_t total() const;
+
+    // "# memory: envmap 21 MB, framebuffer 15 MB, ..., 38 MB in all", the largest parts first
+    void print() const;
+
+private:
+    std::vector<std::pair<std::string, size_t> > parts;
+};
+
+// The arrays of the scene: spheres, their accelerator and lanes, primitives, instanced objects and their
+// BVHs, meshes, textures, lights and materials. The envmap is owned by the caller.
+void account_scene(const Scene &scene, MemoryReport &report);
+
+// "512 KB", "21 MB"
+std::string memory_size(size_t bytes);
+
+#endif //__MEMORY_REPORT_H__
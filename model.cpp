@@ -0,0 +1,389 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <sys/stat.h>
+#include "model.h"
+
+namespace {
+    // Mesh cache layout: the header then the arrays, each on a 64 byte boundary.
+    const char mesh_cache_magic[8] = {'S', 'N', 'O', 'W', 'M', 'S', 'H', '2'};
+
+    struct MeshCacheHeader {
+        char magic[8];
+        uint64_t source_size; // of the OBJ file
+        int64_t source_mtime;
+        uint32_t nverts, nfaces, ntexcoords, nface_texcoords;
+        uint32_t nnodes, nlanes; // nlanes includes the padding of the triangle lanes
+    };
+
+    size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+
+    bool file_stamp(const char *filename, uint64_t &size, int64_t &mtime) {
+        struct stat st;
+        if (stat(filename, &st)) return false;
+        size = static_cast<uint64_t>(st.st_size);
+        mtime = static_cast<int64_t>(st.st_mtime);
+        return true;
+    }
+
+    // the next section of the mapped file, pos goes past the end of the file if it is too short
+    template<typename T> const T *mapped_section(const MappedFile &file, size_t &pos, size_t n) {
+        pos = align64(pos);
+        const T *first = pos + n * sizeof(T) <= file.size() ? reinterpret_cast<const T *>(file.data() + pos) : nullptr;
+        pos += n * sizeof(T);
+        return first;
+    }
+
+    bool write_section(FILE *f, size_t &pos, const void *data, size_t bytes) {
+        const char zeros[64] = {0};
+        const size_t pad = align64(pos) - pos;
+        if (pad && fwrite(zeros, 1, pad, f) != pad) return false;
+        pos += pad + bytes;
+        return !bytes || fwrite(data, 1, bytes, f) == bytes;
+    }
+
+    inline const char *skip_blanks(const char *p, const char *end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        return p;
+    }
+
+    inline const char *next_line(const char *p, const char *end) {
+        const char *nl = static_cast<const char *>(memchr(p, '\n', end - p));
+        return nl ? nl + 1 : end;
+    }
+
+    // parses one face corner "v", "v/vt", "v//vn" or "v/vt/vn" and returns the 0-based vertex and texture
+    // coordinate indices, uv is -1 without a valid vt
+    inline bool parse_corner(const char *&p, const char *end, int nverts, int ntexcoords, int &idx, int &uv) {
+        char *stop;
+        long v = strtol(p, &stop, 10);
+        if (stop == p) return false;
+        p = stop;
+        uv = -1;
+        if (p < end && *p == '/' && p + 1 < end && p[1] != '/') {
+            long t = strtol(p + 1, &stop, 10);
+            if (stop != p + 1) {
+                uv = t < 0 ? ntexcoords + static_cast<int>(t) : static_cast<int>(t) - 1;
+                if (uv >= ntexcoords) uv = -1;
+                p = stop;
+            }
+        }
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++; // normal indices are unused
+        idx = v < 0 ? nverts + static_cast<int>(v) : static_cast<int>(v) - 1;
+        return idx >= 0 && idx < nverts;
+    }
+}
+
+Model::Model(const char *filename) : loaded(false) {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    const std::string cache_file = std::string(filename) + ".cache";
+    const bool stamped = file_stamp(filename, size, mtime);
+    const bool cached = stamped && load_cache(cache_file, size, mtime);
+    if (!cached) {
+        if (!parse(filename)) return;
+        build_bvh();
+        if (stamped && !save_cache(cache_file, size, mtime))
+            std::cerr << "# can not write the mesh cache " << cache_file << std::endl;
+    }
+    loaded = true;
+    get_bbox(box.min, box.max);
+    std::cerr << "# v# " << verts.size() << " f# " << faces.size() << (face_texcoords.empty() ? "" : " textured")
+              << (cached ? " (cache)" : "") << std::endl;
+}
+
+// The whole file is read into a single buffer and parsed in place: no per-line strings or streams,
+// so the cost is dominated by the number conversions.
+bool Model::parse(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return false; // ok() says so, the caller reports it
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    std::vector<char> buffer(size > 0 ? size + 1 : 1, '\0');
+    size_t nread = size > 0 ? fread(buffer.data(), 1, size, f) : 0;
+    fclose(f);
+    const char *p = buffer.data();
+    const char *end = p + nread;
+    bool textured = true;
+    std::vector<Vec3f> verts;
+    std::vector<Vec3i> faces;
+    std::vector<Vec2f> texcoords;
+    std::vector<Vec3i> face_texcoords;
+    while (p < end) {
+        p = skip_blanks(p, end);
+        if (end - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            char *stop;
+            Vec3f v;
+            const char *q = p + 2;
+            for (size_t i = 0; i < 3; i++) {
+                v[i] = strtof(q, &stop);
+                q = stop;
+            }
+            verts.push_back(v);
+        } else if (end - p > 3 && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+            char *stop;
+            Vec2f t;
+            t.x = strtof(p + 3, &stop);
+            t.y = strtof(stop, &stop);
+            texcoords.push_back(t);
+        } else if (end - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            const char *q = p + 2;
+            const int nv = static_cast<int>(verts.size()), nt = static_cast<int>(texcoords.size());
+            int first = 0, prev = 0, cur = 0, n = 0;
+            int first_uv = 0, prev_uv = 0, cur_uv = 0;
+            for (;;) { // polygons are triangulated as fans around their first vertex
+                q = skip_blanks(q, end);
+                if (q >= end || *q == '\n' || !parse_corner(q, end, nv, nt, cur, cur_uv)) break;
+                if (n == 0) {
+                    first = cur;
+                    first_uv = cur_uv;
+                } else if (n >= 2) {
+                    faces.push_back(Vec3i(first, prev, cur));
+                    face_texcoords.push_back(Vec3i(first_uv, prev_uv, cur_uv));
+                    if (first_uv < 0 || prev_uv < 0 || cur_uv < 0) textured = false;
+                }
+                prev = cur;
+                prev_uv = cur_uv;
+                n++;
+            }
+        }
+        p = next_line(p, end);
+    }
+    if (!textured || texcoords.empty()) face_texcoords.clear();
+    this->verts.own(verts);
+    this->faces.own(faces);
+    this->texcoords.own(texcoords);
+    this->face_texcoords.own(face_texcoords);
+    return true;
+}
+
+bool Model::load_cache(const std::string &filename, const uint64_t source_size, const int64_t source_mtime) {
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(filename) || file->size() < sizeof(MeshCacheHeader)) return false;
+    MeshCacheHeader h;
+    memcpy(&h, file->data(), sizeof(h));
+    if (memcmp(h.magic, mesh_cache_magic, sizeof(mesh_cache_magic)) || h.source_size != source_size || h.source_mtime != source_mtime)
+        return false;
+    size_t pos = sizeof(h);
+    const Vec3f *v = mapped_section<Vec3f>(*file, pos, h.nverts);
+    const Vec3i *f = mapped_section<Vec3i>(*file, pos, h.nfaces);
+    const Vec2f *t = mapped_section<Vec2f>(*file, pos, h.ntexcoords);
+    const Vec3i *ft = mapped_section<Vec3i>(*file, pos, h.nface_texcoords);
+    const BVHNode *nodes = mapped_section<BVHNode>(*file, pos, h.nnodes);
+    const float *lanes[3][3];
+    for (size_t i = 0; i < 3; i++)
+        for (size_t k = 0; k < 3; k++) lanes[i][k] = mapped_section<float>(*file, pos, h.nlanes);
+    const int *lane_faces = mapped_section<int>(*file, pos, h.nfaces);
+    if (pos > file->size() || h.nlanes != h.nfaces + TriangleSoA::padding) return false;
+    verts.map(v, h.nverts);
+    faces.map(f, h.nfaces);
+    texcoords.map(t, h.ntexcoords);
+    face_texcoords.map(ft, h.nface_texcoords);
+    bvh = BVH();
+    bvh.nodes.assign(nodes, nodes + h.nnodes); // BVH owns its nodes, a copy at memory speed
+    for (size_t i = 0; i < 3; i++)
+        for (size_t k = 0; k < 3; k++) tris.p[i][k].map(lanes[i][k], h.nlanes);
+    tris.face.map(lane_faces, h.nfaces);
+    cache = file;
+    return true;
+}
+
+// written next to the final name and renamed, as the scene cache
+bool Model::save_cache(const std::string &filename, const uint64_t source_size, const int64_t source_mtime) const {
+    MeshCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, mesh_cache_magic, sizeof(mesh_cache_magic));
+    h.source_size = source_size;
+    h.source_mtime = source_mtime;
+    h.nverts = static_cast<uint32_t>(verts.size());
+    h.nfaces = static_cast<uint32_t>(faces.size());
+    h.ntexcoords = static_cast<uint32_t>(texcoords.size());
+    h.nface_texcoords = static_cast<uint32_t>(face_texcoords.size());
+    h.nnodes = static_cast<uint32_t>(bvh.nodes.size());
+    h.nlanes = static_cast<uint32_t>(tris.p[0][0].size());
+    const std::string tmp = filename + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    size_t pos = 0;
+    bool ok = write_section(f, pos, &h, sizeof(h));
+    ok = ok && write_section(f, pos, verts.data(), verts.size() * sizeof(Vec3f));
+    ok = ok && write_section(f, pos, faces.data(), faces.size() * sizeof(Vec3i));
+    ok = ok && write_section(f, pos, texcoords.data(), texcoords.size() * sizeof(Vec2f));
+    ok = ok && write_section(f, pos, face_texcoords.data(), face_texcoords.size() * sizeof(Vec3i));
+    ok = ok && write_section(f, pos, bvh.nodes.data(), bvh.nodes.size() * sizeof(BVHNode));
+    for (size_t i = 0; i < 3; i++)
+        for (size_t k = 0; k < 3; k++) ok = ok && write_section(f, pos, tris.p[i][k].data(), tris.p[i][k].size() * sizeof(float));
+    ok = ok && write_section(f, pos, tris.face.data(), tris.face.size() * sizeof(int));
+    if (fclose(f)) ok = false;
+    if (!ok || rename(tmp.c_str(), filename.c_str())) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+Model::Model(const std::vector<Vec3f> &v, const std::vector<Vec3i> &f) : loaded(true) {
+    std::vector<Vec3f> vc(v);
+    std::vector<Vec3i> fc(f);
+    verts.own(vc);
+    faces.own(fc);
+    build_bvh();
+    get_bbox(box.min, box.max);
+}
+
+void Model::build_bvh() {
+    std::vector<AABB> bounds(faces.size());
+    for (size_t i = 0; i < faces.size(); i++)
+        for (size_t j = 0; j < 3; j++)
+            bounds[i].expand(verts[faces[i][j]]);
+    bvh.build(bounds, 8); // up to one AVX2 pass per leaf
+    tris.build(bvh.indices, verts.data(), faces.data());
+    bvh.indices.clear(); // tris.face has them
+}
+
+int Model::nverts() const {
+    return static_cast<int>(verts.size());
+}
+
+int Model::nfaces() const {
+    return static_cast<int>(faces.size());
+}
+
+size_t Model::bytes() const {
+    return verts.size() * sizeof(Vec3f) + faces.size() * sizeof(Vec3i) + texcoords.size() * sizeof(Vec2f) +
+           face_texcoords.size() * sizeof(Vec3i) + bvh.bytes() + tris.bytes();
+}
+
+bool Model::ray_triangle_intersect(const int &fi, const Vec3f &orig, const Vec3f &dir, float &tnear) const {
+    return intersect_triangle(TriangleRay(orig, dir), point(vert(fi, 0)), point(vert(fi, 1)), point(vert(fi, 2)), tnear);
+}
+
+bool Model::ray_intersect(const Vec3f &orig, const Vec3f &dir, float &tnear, int &fi) const {
+    const TriangleKernel kernel = triangle_kernel();
+    const TriangleRay ray(orig, dir);
+    return bvh.intersect_leaves(orig, dir, tnear, [&](int offset, int count, float &tmax) {
+        const int lane = kernel(tris, offset, count, ray, tmax);
+        if (lane < 0) return false;
+        fi = tris.face[offset + lane];
+        return true;
+    });
+}
+
+bool Model::occluded(const Vec3f &orig, const Vec3f &dir, float tmax) const {
+    const TriangleKernel kernel = triangle_kernel();
+    const TriangleRay ray(orig, dir);
+    return bvh.occluded_leaves(orig, dir, tmax, [&](int offset, int count, float t_max) {
+        return kernel(tris, offset, count, ray, t_max) >= 0;
+    });
+}
+
+uint64_t Model::ray_intersect_packet(int n, const Vec3f *orig, const Vec3f *dir, float *tnear, int *fi) const {
+    const TriangleKernel kernel = triangle_kernel();
+    TriangleRay rays[64]; // at most 64 lanes, the bits of the masks
+    for (int l = 0; l < n; l++) rays[l] = TriangleRay(orig[l], dir[l]);
+    uint64_t hit = 0;
+    bvh.intersect_packet(n, orig, dir, tnear, [&](int offset, int count, uint64_t lanes) {
+        for (; lanes; lanes &= lanes - 1) {
+            int l = lowest_lane(lanes);
+            const int lane = kernel(tris, offset, count, rays[l], tnear[l]);
+            if (lane < 0) continue;
+            fi[l] = tris.face[offset + lane];
+            hit |= uint64_t(1) << l;
+        }
+    });
+    return hit;
+}
+
+Vec3f Model::normal(int fi) const {
+    const Vec3f &v0 = point(vert(fi, 0));
+    return cross(point(vert(fi, 1)) - v0, point(vert(fi, 2)) - v0).normalize();
+}
+
+Vec2f Model::barycentric(int fi, const Vec3f &p) const {
+    const Vec3f &v0 = point(vert(fi, 0));
+    const Vec3f e1 = point(vert(fi, 1)) - v0, e2 = point(vert(fi, 2)) - v0, d = p - v0;
+    const float d11 = e1 * e1, d12 = e1 * e2, d22 = e2 * e2, d1 = d * e1, d2 = d * e2;
+    const float det = d11 * d22 - d12 * d12;
+    if (det == 0) return Vec2f();
+    return Vec2f((d22 * d1 - d12 * d2) / det, (d11 * d2 - d12 * d1) / det);
+}
+
+Vec2f Model::texcoord(int fi, const Vec2f &bary) const {
+    const Vec3i &t = face_texcoords[fi];
+    const Vec2f &t0 = texcoords[t[0]], &t1 = texcoords[t[1]], &t2 = texcoords[t[2]];
+    const float w = 1 - bary.x - bary.y;
+    return Vec2f(t0.x * w + t1.x * bary.x + t2.x * bary.y, t0.y * w + t1.y * bary.x + t2.y * bary.y);
+}
+
+// square root of the ratio of the areas of the triangle in texture space and in world space
+float Model::texel_scale(int fi) const {
+    const Vec3i &t = face_texcoords[fi];
+    const Vec2f &t0 = texcoords[t[0]], &t1 = texcoords[t[1]], &t2 = texcoords[t[2]];
+    const float uv_area = std::fabs((t1.x - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (t1.y - t0.y));
+    const Vec3f &v0 = point(vert(fi, 0));
+    const float area = cross(point(vert(fi, 1)) - v0, point(vert(fi, 2)) - v0).norm();
+    return area > 0 ? std::sqrt(uv_area / area) : 0.f;
+}
+
+const Vec3f &Model::point(int i) const {
+    assert(i >= 0 && i < nverts());
+    return verts[i];
+}
+
+int Model::vert(int fi, int li) const {
+    assert(fi >= 0 && fi < nfaces() && li >= 0 && li < 3);
+    return faces[fi][li];
+}
+
+void Model::get_bbox(Vec3f &min, Vec3f &max) const {
+    AABB box;
+    for (size_t i = 0; i < verts.size(); i++) box.expand(verts[i]);
+    min = box.min;
+    max = box.max;
+}
+
+Model Model::simplified(const int cells) const {
+    const Vec3f extent = box.max - box.min;
+    const float side = std::max(extent.x, std::max(extent.y, extent.z)) / std::max(1, cells);
+    const float inv = side > 0 ? 1.f / side : 0.f;
+    std::unordered_map<int64_t, int> cell_ids;
+    std::vector<Vec3f> sum;
+    std::vector<int> count, remap(verts.size());
+    for (size_t i = 0; i < verts.size(); i++) {
+        int64_t key = 0;
+        for (size_t k = 0; k < 3; k++)
+            key = key * (cells + 1) + std::max(0, std::min(cells, static_cast<int>((verts[i][k] - box.min[k]) * inv)));
+        const auto found = cell_ids.insert(std::make_pair(key, static_cast<int>(sum.size())));
+        if (found.second) {
+            sum.push_back(Vec3f(0, 0, 0));
+            count.push_back(0);
+        }
+        remap[i] = found.first->second;
+        sum[remap[i]] = sum[remap[i]] + verts[i];
+        count[remap[i]]++;
+    }
+    for (size_t c = 0; c < sum.size(); c++) sum[c] = sum[c] * (1.f / count[c]);
+    std::vector<Vec3i> kept;
+    for (size_t f = 0; f < faces.size(); f++) {
+        const Vec3i t(remap[faces[f][0]], remap[faces[f][1]], remap[faces[f][2]]);
+        if (t[0] != t[1] && t[1] != t[2] && t[2] != t[0]) kept.push_back(t);
+    }
+    return Model(sum, kept);
+}
+
+std::ostream &operator<<(std::ostream &out, const Model &m) {
+    for (int i = 0; i < m.nverts(); i++) {
+        out << "v " << m.point(i) << std::endl;
+    }
+    for (int i = 0; i < m.nfaces(); i++) {
+        out << "f ";
+        for (int k = 0; k < 3; k++) {
+            out << (m.vert(i, k) + 1) << " ";
+        }
+        out << std::endl;
+    }
+    return out;
+}
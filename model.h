@@ -2,27 +2,58 @@
 #define __MODEL_H__
 #include <vector>
 #include <string>
+#include <memory>
 #include "geometry.h"
+#include "bvh.h"
+#include "mapped_file.h"
+#include "triangle_soa.h"
 
+// Triangle mesh. An OBJ file is parsed once: the model is then written next to it as filename.cache
+// (arrays, BVH and the triangle lanes, 64 byte aligned sections, stamped with the size and date of the
+// OBJ), and later loads map that file and read the vertices and triangles in place.
 class Model {
 private:
-    std::vector<Vec3f> verts;
-    std::vector<Vec3i> faces;
+    MappedArray<Vec3f> verts;
+    MappedArray<Vec3i> faces;
+    MappedArray<Vec2f> texcoords;      // the vt of the file
+    MappedArray<Vec3i> face_texcoords; // by face, in texcoords; empty unless every corner has a vt
+    BVH bvh;          // over the triangles, built by the constructor; its leaves are lane ranges of tris
+    TriangleSoA tris; // the vertices of the triangles in leaf order, for the kernels
+    AABB box;         // of get_bbox
+    std::shared_ptr<const MappedFile> cache; // holds the mapped arrays, shared by the copies of the model
+    bool loaded;      // false if the file could not be read, the model is then empty
+    void build_bvh();
+    bool parse(const char *filename);
+    bool load_cache(const std::string &filename, uint64_t source_size, int64_t source_mtime);
+    bool save_cache(const std::string &filename, uint64_t source_size, int64_t source_mtime) const;
 public:
     Model(const char *filename);
+    Model(const std::vector<Vec3f> &verts, const std::vector<Vec3i> &faces); // generated meshes, faces index verts
+    bool ok() const { return loaded; }
 
     int nverts() const;                          // number of vertices
     int nfaces() const;                          // number of triangles
 
-    bool ray_triangle_intersect(const int &fi, const Vec3f &orig, const Vec3f &dir, float &tnear);
+    bool ray_triangle_intersect(const int &fi, const Vec3f &orig, const Vec3f &dir, float &tnear) const; // watertight, both facings
+    bool ray_intersect(const Vec3f &orig, const Vec3f &dir, float &tnear, int &fi) const; // closest triangle closer than tnear
+    bool occluded(const Vec3f &orig, const Vec3f &dir, float tmax) const; // any triangle closer than tmax
+    uint64_t ray_intersect_packet(int n, const Vec3f *orig, const Vec3f *dir, float *tnear, int *fi) const; // mask of the lanes hit
+    Vec3f normal(int fi) const;                  // geometric normal of the triangle fi
+    Vec2f barycentric(int fi, const Vec3f &p) const; // coordinates (u, v) of p on the triangle fi, weights of vertices 1 and 2
+    bool has_texcoords() const { return !face_texcoords.empty(); }
+    Vec2f texcoord(int fi, const Vec2f &bary) const; // texture coordinates at the barycentric coordinates bary of fi
+    float texel_scale(int fi) const;                 // texture units per world unit across the triangle fi
 
-    const Vec3f &point(int i) const;                   // coordinates of the vertex i
-    Vec3f &point(int i);                   // coordinates of the vertex i
+    const Vec3f &point(int i) const;             // coordinates of the vertex i
     int vert(int fi, int li) const;              // index of the vertex for the triangle fi and local index li
-    void get_bbox(Vec3f &min, Vec3f &max); // bounding box for all the vertices, including isolated ones
+    void get_bbox(Vec3f &min, Vec3f &max) const; // bounding box for all the vertices, including isolated ones
+    const AABB &bounds() const { return box; }   // the same box, computed once, for the scene to cull the mesh
+    size_t bytes() const;                        // of the arrays, the BVH and the lanes, owned or mapped
+    // decimated copy for the distant views: the vertices in each of the cubic cells of a grid of `cells`
+    // along the longest side are merged at their mean, and the triangles that collapse are dropped
+    Model simplified(int cells) const;
 };
 
-std::ostream& operator<<(std::ostream& out, Model &m);
+std::ostream& operator<<(std::ostream& out, const Model &m);
 
 #endif //__MODEL_H__
-
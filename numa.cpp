@@ -0,0 +1,139 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "numa.h"
+#ifdef __linux__
+#define NUMA_LINUX
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    thread_local int current_node = 0;
+    bool pinned = false;
+
+    // "0-3,8-11" to 0 1 2 3 8 9 10 11
+    std::vector<int> parse_cpu_list(const std::string &list) {
+        std::vector<int> cpus;
+        std::stringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            int first, last;
+            const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (n < 1) continue;
+            if (n == 1) last = first;
+            for (int c = first; c <= last; c++) cpus.push_back(c);
+        }
+        return cpus;
+    }
+
+    int thread_count() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    int thread_index() {
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+}
+
+NumaTopology numa_topology() {
+    NumaTopology topology;
+    for (int node = 0;; node++) {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!in || !std::getline(in, list)) break;
+        const std::vector<int> cpus = parse_cpu_list(list);
+        if (!cpus.empty()) topology.cpus.push_back(cpus); // nodes with memory only are skipped
+    }
+    if (topology.cpus.empty()) {
+        std::vector<int> cpus;
+#ifdef NUMA_LINUX
+        const long n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int c = 0; c < n; c++) cpus.push_back(c);
+#endif
+        if (cpus.empty()) cpus.push_back(0);
+        topology.cpus.push_back(cpus);
+    }
+    return topology;
+}
+
+bool pin_threads(const NumaTopology &topology) {
+#ifdef NUMA_LINUX
+    const int nodes = static_cast<int>(topology.cpus.size());
+    bool ok = true;
+#pragma omp parallel num_threads(thread_count()) reduction(&&:ok)
+    {
+        const int t = thread_index();
+        const std::vector<int> &cpus = topology.cpus[t % nodes];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[(t / nodes) % cpus.size()], &set);
+        ok = sched_setaffinity(0, sizeof(set), &set) == 0;
+        current_node = t % nodes;
+    }
+    pinned = ok;
+    return ok;
+#else
+    (void)topology;
+    return false;
+#endif
+}
+
+bool numa_pinned() {
+    return pinned;
+}
+
+int thread_node() {
+    return current_node;
+}
+
+void release_pages(void *data, size_t bytes) {
+#ifdef NUMA_LINUX
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + page - 1) / page * page;
+    const uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes) / page * page;
+    if (end > begin) madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+#else
+    (void)data;
+    (void)bytes;
+#endif
+}
+
+void SceneReplicas::build(const Scene &scene, const NumaTopology &topology) {
+    const int nodes = static_cast<int>(topology.cpus.size());
+    scenes.clear();
+    envmaps.clear();
+    scenes.resize(nodes);
+    envmaps.resize(nodes);
+#pragma omp parallel num_threads(thread_count())
+    {
+        const int node = thread_node();
+        if (numa_pinned() && node > 0 && thread_index() == node) { // the first thread of every other node
+            Scene *copy = new Scene(scene);
+            if (scene.envmap) {
+                envmaps[node].reset(new EnvironmentMap(*scene.envmap));
+                copy->envmap = envmaps[node].get();
+            }
+            copy->replicas = nullptr;
+            scenes[node].reset(copy);
+        }
+    }
+}
+
+const Scene &SceneReplicas::local(const Scene &scene) const {
+    const size_t node = thread_node();
+    return node < scenes.size() && scenes[node] ? *scenes[node] : scene;
+}
@@ -0,0 +1,47 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+#include <vector>
+#include <memory>
+#include "scene.h"
+
+// NUMA placement for the multi-socket hosts, from /sys/devices/system/node (Linux). With --numa the threads
+// of the OpenMP team are pinned spread over the nodes, every node gets its own copy of the scene and of its
+// envmap, and the framebuffer pages are placed by the first render thread that writes them.
+
+struct NumaTopology {
+    std::vector<std::vector<int> > cpus; // by node; one node with every cpu when the host does not tell
+};
+
+NumaTopology numa_topology();
+
+// Pins thread t of the OpenMP team to a cpu of node t % nodes, round robin over the cpus of the node, and
+// records the node in the thread. The team must keep its size afterwards. Returns false if the host does not
+// support pinning.
+bool pin_threads(const NumaTopology &topology);
+bool numa_pinned(); // pin_threads succeeded
+int thread_node();  // of the calling thread, 0 if not pinned
+
+// Gives the whole pages within [data, data + bytes) back to the kernel: they read as zeros again, and are
+// allocated on the node of the thread that touches them first. Only for memory that is rewritten entirely.
+void release_pages(void *data, size_t bytes);
+
+// Copies of a scene and of its envmap on the other nodes, each made by a thread pinned on its node so that
+// first touch places it there; node 0 uses the original. Arrays mapped from the mesh caches stay shared.
+// The copies are not updated: the scene must not change while it points to them.
+class SceneReplicas {
+public:
+    void build(const Scene &scene, const NumaTopology &topology);
+    const Scene &local(const Scene &scene) const; // the copy of the node of the calling thread
+    size_t size() const { return scenes.size(); } // nodes, 0 before build
+
+private:
+    std::vector<std::unique_ptr<Scene> > scenes; // by node, null on node 0
+    std::vector<std::unique_ptr<EnvironmentMap> > envmaps;
+};
+
+// the scene to read from the calling thread: its copy on the node of the thread, if the scene has replicas
+inline const Scene &local_scene(const Scene &scene) {
+    return scene.replicas ? scene.replicas->local(scene) : scene;
+}
+
+#endif //__NUMA_H__
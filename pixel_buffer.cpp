@@ -0,0 +1,39 @@
+#include <cstring>
+#include "pixel_buffer.h"
+
+namespace {
+    const char *format_names[] = {"float", "half", "rgb9e5"};
+}
+
+bool parse_pixel_format(const char *name, PixelFormat &format) {
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(name, format_names[i])) {
+            format = static_cast<PixelFormat>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *pixel_format_name(const PixelFormat format) {
+    return format_names[format];
+}
+
+void PixelBuffer::reset(const size_t npixels) {
+    n = npixels;
+    rgb.assign(fmt == PIXELS_FLOAT ? n : 0, Vec3f(0, 0, 0));
+    halves.assign(fmt == PIXELS_HALF ? 3 * n : 0, 0);
+    packed.assign(fmt == PIXELS_RGB9E5 ? n : 0, 0);
+}
+
+size_t PixelBuffer::bytes() const {
+    return rgb.size() * sizeof(Vec3f) + halves.size() * sizeof(uint16_t) + packed.size() * sizeof(uint32_t);
+}
+
+std::vector<Vec3f> PixelBuffer::to_vector() const {
+    if (fmt == PIXELS_FLOAT) return rgb;
+    std::vector<Vec3f> values(n);
+#pragma omp parallel for
+    for (long p = 0; p < static_cast<long>(n); p++) values[p] = (*this)[p];
+    return values;
+}
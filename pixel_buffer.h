@@ -0,0 +1,89 @@
+#ifndef __PIXEL_BUFFER_H__
+#define __PIXEL_BUFFER_H__
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include "geometry.h"
+#include "half.h"
+
+enum PixelFormat {
+    PIXELS_FLOAT,  // 3 floats, 12 bytes per pixel
+    PIXELS_HALF,   // 3 halves, 6 bytes: 11 bits of mantissa, signed, up to 65504
+    PIXELS_RGB9E5  // 9 bits of mantissa per channel and a shared 5-bit exponent, 4 bytes: no negative values
+};
+
+// "float", "half" or "rgb9e5"; returns false for an unknown name
+bool parse_pixel_format(const char *name, PixelFormat &format);
+const char *pixel_format_name(PixelFormat format);
+inline size_t pixel_format_bytes(const PixelFormat format) { return format == PIXELS_FLOAT ? 12 : format == PIXELS_HALF ? 6 : 4; }
+
+// Shared exponent packing of EXT_texture_shared_exponent: the exponent of the largest channel, the
+// others lose their low bits. Negative channels are stored as 0, larger ones than 65408 as 65408.
+inline uint32_t float3_to_rgb9e5(const Vec3f &c) {
+    const float max_value = 65408.f; // (511 / 512) * 2^16
+    float rgb[3];
+    for (size_t k = 0; k < 3; k++) rgb[k] = c[k] > 0 ? std::min(c[k], max_value) : 0.f; // NaN to 0 as well
+    const float largest = std::max(rgb[0], std::max(rgb[1], rgb[2]));
+    if (largest < std::ldexp(1.f, -24)) return 0; // below the smallest step
+    int e;
+    std::frexp(largest, &e); // largest in [2^(e-1), 2^e)
+    int shared = std::max(-16, e - 1) + 16;
+    float step = std::ldexp(1.f, shared - 24);
+    if (static_cast<uint32_t>(largest / step + .5f) == 512) {
+        step *= 2;
+        shared++;
+    }
+    uint32_t packed = static_cast<uint32_t>(shared) << 27;
+    for (size_t k = 0; k < 3; k++) packed |= std::min(511u, static_cast<uint32_t>(rgb[k] / step + .5f)) << (9 * k);
+    return packed;
+}
+
+inline Vec3f rgb9e5_to_float3(const uint32_t packed) {
+    const float step = std::ldexp(1.f, static_cast<int>(packed >> 27) - 24);
+    return Vec3f((packed & 511) * step, ((packed >> 9) & 511) * step, ((packed >> 18) & 511) * step);
+}
+
+// Image of Vec3f pixels stored in one of the formats above: the accumulation of the progressive renderer
+// and the color AOVs, which are read and written once per sample. The compact formats halve or third the
+// memory and the bandwidth of large images; the pixels are encoded by set() and decoded by operator[].
+// Distinct pixels can be set from distinct threads.
+class PixelBuffer {
+public:
+    explicit PixelBuffer(PixelFormat format = PIXELS_FLOAT) : fmt(format), n(0) {}
+
+    void reset(size_t npixels); // npixels zeros, in the same format
+    size_t size() const { return n; }
+    bool empty() const { return !n; }
+    PixelFormat format() const { return fmt; }
+    size_t bytes() const;
+
+    Vec3f operator[](const size_t p) const {
+        switch (fmt) {
+        case PIXELS_HALF: return Vec3f(half_to_float(halves[3 * p]), half_to_float(halves[3 * p + 1]), half_to_float(halves[3 * p + 2]));
+        case PIXELS_RGB9E5: return rgb9e5_to_float3(packed[p]);
+        default: return rgb[p];
+        }
+    }
+
+    void set(const size_t p, const Vec3f &c) {
+        switch (fmt) {
+        case PIXELS_HALF:
+            for (size_t k = 0; k < 3; k++) halves[3 * p + k] = float_to_half(c[k]);
+            break;
+        case PIXELS_RGB9E5: packed[p] = float3_to_rgb9e5(c); break;
+        default: rgb[p] = c;
+        }
+    }
+
+    std::vector<Vec3f> to_vector() const; // decoded, for the image writers
+
+private:
+    PixelFormat fmt;
+    size_t n;
+    std::vector<Vec3f> rgb;        // PIXELS_FLOAT
+    std::vector<uint16_t> halves;  // PIXELS_HALF, 3 per pixel
+    std::vector<uint32_t> packed;  // PIXELS_RGB9E5
+};
+
+#endif //__PIXEL_BUFFER_H__
@@ -0,0 +1,188 @@
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "primitive.h"
+
+Primitive Primitive::rect(const Vec3f &center, const Vec3f &half_u, const Vec3f &half_v, uint16_t material) {
+    Primitive p;
+    p.type = PRIMITIVE_RECT;
+    p.material = material;
+    p.a = center;
+    p.u = half_u;
+    p.v = half_v;
+    p.axis = cross(half_u, half_v).normalize();
+    return p;
+}
+
+Primitive Primitive::box(const Vec3f &min, const Vec3f &max, uint16_t material) {
+    Primitive p;
+    p.type = PRIMITIVE_BOX;
+    p.material = material;
+    for (size_t i = 0; i < 3; i++) {
+        p.a[i] = std::min(min[i], max[i]);
+        p.b[i] = std::max(min[i], max[i]);
+    }
+    return p;
+}
+
+Primitive Primitive::cylinder(const Vec3f &bottom, const Vec3f &top, float radius, uint16_t material) {
+    Primitive p;
+    p.type = PRIMITIVE_CYLINDER;
+    p.material = material;
+    p.a = bottom;
+    p.b = top;
+    p.radius = radius;
+    p.height = (top - bottom).norm();
+    p.axis = (top - bottom) * (1.f / p.height);
+    return p;
+}
+
+Primitive Primitive::cone(const Vec3f &base, const Vec3f &apex, float radius, uint16_t material) {
+    Primitive p = cylinder(base, apex, radius, material);
+    p.type = PRIMITIVE_CONE;
+    return p;
+}
+
+namespace {
+    // keeps the smallest positive candidate
+    inline void nearest(float t, float &best) {
+        if (t > 0 && t < best) best = t;
+    }
+
+    // the roots of A t^2 + B t + C whose height y0 + t dy along the axis is within [0, h]
+    void quadric_roots(float A, float B, float C, float y0, float dy, float h, float &best) {
+        if (std::fabs(A) < 1e-12f) return; // the ray runs along the surface
+        const float disc = B * B - 4 * A * C;
+        if (disc < 0) return;
+        const float s = sqrtf(disc);
+        const float roots[2] = {(-B - s) / (2 * A), (-B + s) / (2 * A)};
+        for (int k = 0; k < 2; k++) {
+            const float y = y0 + roots[k] * dy;
+            if (y >= 0 && y <= h) nearest(roots[k], best);
+        }
+    }
+
+    // disk of the given radius in the plane at height y along the axis
+    void cap(const Vec3f &oc, const Vec3f &dir, const Vec3f &axis, float y0, float dy, float y, float radius, float &best) {
+        if (std::fabs(dy) < 1e-12f) return;
+        const float t = (y - y0) / dy;
+        if (t <= 0 || t >= best) return;
+        const Vec3f q = oc + dir * t - axis * y;
+        if (q * q <= radius * radius) best = t;
+    }
+}
+
+bool Primitive::ray_intersect(const Vec3f &orig, const Vec3f &dir, float &t0) const {
+    float best = std::numeric_limits<float>::max();
+    switch (type) {
+    case PRIMITIVE_RECT: {
+        const float denom = dir * axis;
+        if (std::fabs(denom) < 1e-12f) return false;
+        const float t = ((a - orig) * axis) / denom;
+        if (t <= 0) return false;
+        const Vec3f d = orig + dir * t - a;
+        if (std::fabs(d * u) > u * u || std::fabs(d * v) > v * v) return false;
+        best = t;
+        break;
+    }
+    case PRIMITIVE_BOX: {
+        float tnear = -std::numeric_limits<float>::max(), tfar = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < 3; i++) {
+            if (std::fabs(dir[i]) < 1e-12f) {
+                if (orig[i] < a[i] || orig[i] > b[i]) return false;
+                continue;
+            }
+            float t1 = (a[i] - orig[i]) / dir[i], t2 = (b[i] - orig[i]) / dir[i];
+            if (t1 > t2) std::swap(t1, t2);
+            tnear = std::max(tnear, t1);
+            tfar = std::min(tfar, t2);
+            if (tnear > tfar) return false;
+        }
+        nearest(tnear, best);
+        if (best == std::numeric_limits<float>::max()) nearest(tfar, best); // from the inside
+        break;
+    }
+    case PRIMITIVE_CYLINDER:
+    case PRIMITIVE_CONE: {
+        const float h = height;
+        const Vec3f oc = orig - a;
+        const float y0 = oc * axis, dy = dir * axis;
+        if (type == PRIMITIVE_CYLINDER) { // |q - axis (q.axis)|^2 = r^2
+            quadric_roots(dir * dir - dy * dy, 2 * (oc * dir - y0 * dy), oc * oc - y0 * y0 - radius * radius, y0, dy, h, best);
+            cap(oc, dir, axis, y0, dy, h, radius, best);
+        } else { // the radius shrinks linearly to 0 at the apex: |q_perp|^2 = k^2 (h - y)^2
+            const float k2 = (radius / h) * (radius / h), m = h - y0;
+            quadric_roots(dir * dir - dy * dy - k2 * dy * dy, 2 * (oc * dir - y0 * dy + k2 * m * dy),
+                          oc * oc - y0 * y0 - k2 * m * m, y0, dy, h, best);
+        }
+        cap(oc, dir, axis, y0, dy, 0, radius, best);
+        break;
+    }
+    default:
+        return false;
+    }
+    if (best == std::numeric_limits<float>::max()) return false;
+    t0 = best;
+    return true;
+}
+
+Vec3f Primitive::normal(const Vec3f &p) const {
+    switch (type) {
+    case PRIMITIVE_RECT:
+        return axis;
+    case PRIMITIVE_BOX: { // the face the point is the closest to
+        size_t axis = 0;
+        float closest = std::numeric_limits<float>::max(), sign = 1;
+        for (size_t i = 0; i < 3; i++) {
+            const float lo = std::fabs(p[i] - a[i]), hi = std::fabs(p[i] - b[i]);
+            if (lo < closest) { closest = lo; axis = i; sign = -1; }
+            if (hi < closest) { closest = hi; axis = i; sign = 1; }
+        }
+        Vec3f N(0, 0, 0);
+        N[axis] = sign;
+        return N;
+    }
+    default: {
+        const float h = height;
+        const float y = (p - a) * axis;
+        Vec3f radial = p - a - axis * y;
+        const float rho = radial.norm();
+        if (rho > 0) radial = radial * (1.f / rho);
+        if (type == PRIMITIVE_CYLINDER) {
+            const float side = std::fabs(rho - radius);
+            if (std::fabs(y) < side && std::fabs(y) <= std::fabs(h - y)) return -axis;
+            if (std::fabs(h - y) < side) return axis;
+            return radial;
+        }
+        // cone: the side normal leans towards the apex by the slope radius / h
+        const float slant = sqrtf(h * h + radius * radius);
+        const float side = std::fabs(rho - radius * (h - y) / h) * h / slant;
+        if (std::fabs(y) < side) return -axis;
+        return (radial * h + axis * radius).normalize();
+    }
+    }
+}
+
+AABB Primitive::bbox() const {
+    const float pad = 1e-4f; // rects and caps are flat, keep the slab test away from 0 * inf
+    AABB box;
+    switch (type) {
+    case PRIMITIVE_RECT: {
+        const Vec3f e(std::fabs(u.x) + std::fabs(v.x) + pad, std::fabs(u.y) + std::fabs(v.y) + pad,
+                      std::fabs(u.z) + std::fabs(v.z) + pad);
+        return AABB(a - e, a + e);
+    }
+    case PRIMITIVE_BOX:
+        return AABB(a, b);
+    default: {
+        // a disk of normal axis spans radius * sqrt(1 - axis_i^2) along axis i
+        const Vec3f e(radius * sqrtf(std::max(0.f, 1 - axis.x * axis.x)) + pad,
+                      radius * sqrtf(std::max(0.f, 1 - axis.y * axis.y)) + pad,
+                      radius * sqrtf(std::max(0.f, 1 - axis.z * axis.z)) + pad);
+        box.expand(AABB(a - e, a + e));
+        if (type == PRIMITIVE_CYLINDER) box.expand(AABB(b - e, b + e));
+        else box.expand(b);
+        return box;
+    }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef __PRIMITIVE_H__
+#define __PRIMITIVE_H__
+#include <cstdint>
+#include "geometry.h"
+#include "bvh.h"
+
+enum PrimitiveType {
+    PRIMITIVE_RECT,     // a: center, u and v: half edges, perpendicular to each other; two-sided
+    PRIMITIVE_BOX,      // a: min corner, b: max corner, axis aligned
+    PRIMITIVE_CYLINDER, // a: center of the bottom cap, b: center of the top cap, radius; capped
+    PRIMITIVE_CONE      // a: center of the base, b: apex, radius of the base; capped at the base
+};
+
+// The analytic shapes other than spheres. They all live in Scene::primitive_bvh, whatever their type,
+// so that a new kind of primitive is one more case in the kernels below and not one more pass per ray.
+// An unbounded plane has no place in a BVH: a large rect does the same job.
+struct Primitive {
+    uint16_t type;     // PrimitiveType
+    uint16_t material; // index in Scene::materials
+    Vec3f a, b, u, v;
+    float radius;
+    // derived by the constructors, so that the kernels do not normalize anything:
+    Vec3f axis;   // rect: unit normal; cylinder, cone: unit vector from a to b
+    float height; // cylinder, cone: |b - a|
+
+    Primitive() : type(PRIMITIVE_BOX), material(0), radius(0), height(0) {}
+
+    static Primitive rect(const Vec3f &center, const Vec3f &half_u, const Vec3f &half_v, uint16_t material);
+    static Primitive box(const Vec3f &min, const Vec3f &max, uint16_t material);
+    static Primitive cylinder(const Vec3f &bottom, const Vec3f &top, float radius, uint16_t material);
+    static Primitive cone(const Vec3f &base, const Vec3f &apex, float radius, uint16_t material);
+
+    // same contract as Sphere::ray_intersect: t0 is the nearest positive distance along the normalized dir
+    bool ray_intersect(const Vec3f &orig, const Vec3f &dir, float &t0) const;
+
+    // outward normal at a point of the surface, only computed for the final hit
+    Vec3f normal(const Vec3f &p) const;
+
+    AABB bbox() const;
+};
+
+#endif //__PRIMITIVE_H__
@@ -0,0 +1,157 @@
+#include <cstdio>
+#include <iostream>
+#include "profile.h"
+
+#ifdef SNOWMAN_PROFILE
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point epoch = Clock::now();
+
+    struct TraceEvent {
+        const char *name;
+        double ts_us, dur_us;
+        int tid;
+    };
+
+    struct ThreadProfile {
+        ProfileCounters counters;
+        std::vector<TraceEvent> events;
+        int tid;
+        int phase; // running phase, -1 if none
+        Clock::time_point phase_start;
+    };
+
+    // every thread's profile, like the ray counters of render.cpp: the threads never synchronize while counting
+    std::mutex profiles_mutex;
+    std::vector<ThreadProfile *> live_profiles;
+    ProfileCounters retired_counters = ProfileCounters();
+    std::vector<TraceEvent> retired_events;
+    int next_tid = 0;
+
+    struct RegisteredProfile {
+        ThreadProfile profile;
+
+        RegisteredProfile() {
+            profile.counters = ProfileCounters();
+            profile.phase = -1;
+            std::lock_guard<std::mutex> lock(profiles_mutex);
+            profile.tid = next_tid++;
+            live_profiles.push_back(&profile);
+        }
+
+        ~RegisteredProfile() {
+            std::lock_guard<std::mutex> lock(profiles_mutex);
+            add(retired_counters, profile.counters);
+            retired_events.insert(retired_events.end(), profile.events.begin(), profile.events.end());
+            live_profiles.erase(std::find(live_profiles.begin(), live_profiles.end(), &profile));
+        }
+
+        static void add(ProfileCounters &a, const ProfileCounters &b) {
+            for (int d = 0; d < profile_depths; d++) a.rays[d] += b.rays[d];
+            a.shadow_rays += b.shadow_rays;
+            a.shadow_occluded += b.shadow_occluded;
+            a.bvh_nodes += b.bvh_nodes;
+            a.box_tests += b.box_tests;
+            a.sphere_tests += b.sphere_tests;
+            a.primitive_tests += b.primitive_tests;
+            a.envmap_lookups += b.envmap_lookups;
+            for (int p = 0; p < PHASE_COUNT; p++) a.phase_ns[p] += b.phase_ns[p];
+        }
+    };
+
+    ThreadProfile &thread_profile() {
+        static thread_local RegisteredProfile local;
+        return local.profile;
+    }
+
+    const char *phase_names[PHASE_COUNT] = {"trace", "shadow", "shade", "secondary"};
+}
+
+ProfileCounters &profile_counters() {
+    return thread_profile().counters;
+}
+
+ProfilePhaseTimer::ProfilePhaseTimer(ProfilePhase phase) : previous(thread_profile().phase) {
+    ThreadProfile &p = thread_profile();
+    const Clock::time_point now = Clock::now();
+    if (previous >= 0) p.counters.phase_ns[previous] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - p.phase_start).count();
+    p.phase = phase;
+    p.phase_start = now;
+}
+
+ProfilePhaseTimer::~ProfilePhaseTimer() {
+    ThreadProfile &p = thread_profile();
+    const Clock::time_point now = Clock::now();
+    p.counters.phase_ns[p.phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - p.phase_start).count();
+    p.phase = previous;
+    p.phase_start = now;
+}
+
+ProfileScope::~ProfileScope() {
+    const Clock::time_point end = Clock::now();
+    ThreadProfile &p = thread_profile();
+    p.events.push_back(TraceEvent{name, std::chrono::duration<double, std::micro>(start - epoch).count(),
+                                  std::chrono::duration<double, std::micro>(end - start).count(), p.tid});
+}
+
+bool profile_enabled() {
+    return true;
+}
+
+bool profile_write(const std::string &filename) {
+    ProfileCounters c;
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(profiles_mutex);
+        c = retired_counters;
+        events = retired_events;
+        for (size_t t = 0; t < live_profiles.size(); t++) {
+            RegisteredProfile::add(c, live_profiles[t]->counters);
+            events.insert(events.end(), live_profiles[t]->events.begin(), live_profiles[t]->events.end());
+        }
+    }
+    uint64_t rays = 0;
+    for (int d = 0; d < profile_depths; d++) rays += c.rays[d];
+    const uint64_t queries = std::max<uint64_t>(1, rays + c.shadow_rays); // every ray and shadow ray traverses
+    const double occlusion = c.shadow_rays ? double(c.shadow_occluded) / c.shadow_rays : 0;
+
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f) return false;
+    fprintf(f, "{\"traceEvents\": [\n");
+    for (size_t i = 0; i < events.size(); i++)
+        fprintf(f, "  {\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, \"tid\": %d}%s\n", events[i].name,
+                events[i].ts_us, events[i].dur_us, events[i].tid, i + 1 < events.size() ? "," : "");
+    fprintf(f, "],\n\"displayTimeUnit\": \"ms\",\n\"counters\": {\n  \"rays_by_depth\": [");
+    for (int d = 0; d < profile_depths; d++) fprintf(f, "%s%llu", d ? ", " : "", (unsigned long long) c.rays[d]);
+    fprintf(f, "],\n  \"shadow_rays\": %llu,\n  \"shadow_occluded\": %llu,\n  \"shadow_occlusion_rate\": %.4f,\n",
+            (unsigned long long) c.shadow_rays, (unsigned long long) c.shadow_occluded, occlusion);
+    fprintf(f, "  \"bvh_nodes\": %llu,\n  \"box_tests\": %llu,\n  \"sphere_tests\": %llu,\n  \"primitive_tests\": %llu,\n",
+            (unsigned long long) c.bvh_nodes, (unsigned long long) c.box_tests, (unsigned long long) c.sphere_tests,
+            (unsigned long long) c.primitive_tests);
+    fprintf(f, "  \"box_tests_per_ray\": %.2f,\n  \"sphere_tests_per_ray\": %.2f,\n  \"envmap_lookups\": %llu,\n",
+            double(c.box_tests) / queries, double(c.sphere_tests) / queries, (unsigned long long) c.envmap_lookups);
+    fprintf(f, "  \"phase_ms\": {");
+    for (int p = 0; p < PHASE_COUNT; p++) fprintf(f, "%s\"%s\": %.3f", p ? ", " : "", phase_names[p], c.phase_ns[p] * 1e-6);
+    fprintf(f, "}\n}}\n");
+    const bool ok = fclose(f) == 0;
+
+    std::cerr << "# profile: " << rays << " rays, " << c.shadow_rays << " shadow rays (" << 100 * occlusion << "% occluded), "
+              << double(c.box_tests) / queries << " box and " << double(c.sphere_tests) / queries << " sphere tests per ray" << std::endl;
+    std::cerr << "# profile:";
+    for (int p = 0; p < PHASE_COUNT; p++) std::cerr << " " << phase_names[p] << " " << c.phase_ns[p] * 1e-6 << " ms";
+    std::cerr << std::endl;
+    return ok;
+}
+#else
+bool profile_enabled() {
+    return false;
+}
+
+bool profile_write(const std::string &) {
+    return false;
+}
+#endif
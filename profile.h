@@ -0,0 +1,73 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+#include <string>
+#include <cstdint>
+
+// Built-in profiler, compiled in with cmake -DPROFILE=ON (which defines SNOWMAN_PROFILE) and out otherwise:
+// the macros below then expand to nothing. Every thread has its own counters and trace, summed when written.
+//   PROFILE_COUNT(field, n)  adds n to a field of ProfileCounters
+//   PROFILE_PHASE(phase)     times the enclosing block into ProfileCounters::phase_ns, nested phases pause their parent
+//   PROFILE_SCOPE("name")    one complete event of the Chrome trace for the enclosing block
+
+enum ProfilePhase {
+    PHASE_TRACE,     // closest hits
+    PHASE_SHADOW,    // shadow rays
+    PHASE_SHADE,     // direct lighting, background, surface interactions
+    PHASE_SECONDARY, // the reflected and refracted paths of the packets, traced and shaded ray by ray
+    PHASE_COUNT
+};
+
+const int profile_depths = 8; // rays deeper than that are counted with the last depth
+
+struct ProfileCounters {
+    uint64_t rays[profile_depths]; // camera and secondary rays by depth
+    uint64_t shadow_rays, shadow_occluded;
+    uint64_t bvh_nodes;       // nodes fetched by the traversals, once per node for a whole packet
+    uint64_t box_tests;       // ray-box tests
+    uint64_t sphere_tests;    // ray-sphere tests, one per SoA lane handed to a kernel
+    uint64_t primitive_tests; // ray-primitive tests
+    uint64_t envmap_lookups;
+    uint64_t phase_ns[PHASE_COUNT];
+};
+
+// Writes the trace events of every thread and the summed counters, in the Chrome trace format
+// (chrome://tracing, Perfetto), and prints a summary. False if the profiler is compiled out or on a write error.
+bool profile_write(const std::string &filename);
+bool profile_enabled();
+
+#ifdef SNOWMAN_PROFILE
+#include <chrono>
+
+ProfileCounters &profile_counters(); // of the calling thread
+
+class ProfilePhaseTimer {
+public:
+    explicit ProfilePhaseTimer(ProfilePhase phase);
+    ~ProfilePhaseTimer();
+
+private:
+    const int previous; // phase paused by this one, -1 if none
+};
+
+class ProfileScope {
+public:
+    explicit ProfileScope(const char *name) : name(name), start(std::chrono::steady_clock::now()) {}
+    ~ProfileScope();
+
+private:
+    const char *name;
+    const std::chrono::steady_clock::time_point start;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_COUNT(field, n) (profile_counters().field += (n))
+#define PROFILE_PHASE(phase) ProfilePhaseTimer PROFILE_CONCAT(profile_phase_, __LINE__)(phase)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#else
+#define PROFILE_COUNT(field, n) ((void)0)
+#define PROFILE_PHASE(phase) ((void)0)
+#define PROFILE_SCOPE(name) ((void)0)
+#endif
+
+#endif //__PROFILE_H__
@@ -0,0 +1,68 @@
+#include <cmath>
+#include <algorithm>
+#include "qbvh.h"
+
+void QBVH::build(const BVH &bvh) {
+    nodes.clear();
+    if (bvh.empty()) return;
+    nodes.reserve(bvh.nodes.size() / 3 + 1);
+    collapse(bvh, 0);
+}
+
+// The node of the binary node `node` gets its children, grandchildren... up to four: the largest interior
+// child is opened until there are four or only leaves. A binary leaf for a root becomes the only child.
+int QBVH::collapse(const BVH &bvh, const int node) {
+    int kids[4], nkids = 0;
+    if (bvh.nodes[node].count) kids[nkids++] = node;
+    else {
+        kids[nkids++] = node + 1;
+        kids[nkids++] = bvh.nodes[node].offset;
+    }
+    while (nkids < 4) {
+        int widest = -1;
+        for (int k = 0; k < nkids; k++) {
+            const BVHNode &n = bvh.nodes[kids[k]];
+            if (!n.count && (widest < 0 || n.bounds.area() > bvh.nodes[kids[widest]].bounds.area())) widest = k;
+        }
+        if (widest < 0) break;
+        const int opened = kids[widest];
+        kids[widest] = opened + 1;
+        kids[nkids++] = bvh.nodes[opened].offset;
+    }
+
+    const int id = static_cast<int>(nodes.size());
+    nodes.push_back(QBVHNode());
+    QBVHNode q;
+    memset(&q, 0, sizeof(q));
+    const AABB &box = bvh.nodes[node].bounds;
+    for (int a = 0; a < 3; a++) {
+        // the smallest power of 2 for which 255 steps cover the box
+        const float extent = box.max[a] - box.min[a];
+        int e = extent > 0 ? static_cast<int>(std::ceil(std::log2(extent / 255))) : -126;
+        while (e < 127 && std::ldexp(255.f, e) < extent) e++;
+        e = std::max(-126, std::min(127, e));
+        q.origin[a] = box.min[a];
+        q.exponent[a] = static_cast<int8_t>(e);
+        const float scale = scale_of(q.exponent[a]);
+        for (int k = 0; k < nkids; k++) {
+            const AABB &b = bvh.nodes[kids[k]].bounds;
+            // rounded outwards, then widened until the dequantized box holds the exact one
+            int lo = std::max(0, std::min(255, static_cast<int>(std::floor((b.min[a] - q.origin[a]) / scale))));
+            int hi = std::max(0, std::min(255, static_cast<int>(std::ceil((b.max[a] - q.origin[a]) / scale))));
+            while (lo > 0 && q.origin[a] + lo * scale > b.min[a]) lo--;
+            while (hi < 255 && q.origin[a] + hi * scale < b.max[a]) hi++;
+            q.lo[a][k] = static_cast<uint8_t>(lo);
+            q.hi[a][k] = static_cast<uint8_t>(hi);
+        }
+    }
+    q.nchildren = static_cast<uint8_t>(nkids);
+    for (int k = 0; k < nkids; k++) {
+        const BVHNode &n = bvh.nodes[kids[k]];
+        q.count[k] = n.count;
+        q.child[k] = n.count ? n.offset : -1;
+    }
+    nodes[id] = q;
+    for (int k = 0; k < nkids; k++) // the subtrees after the node, depth first
+        if (!q.count[k]) nodes[id].child[k] = collapse(bvh, kids[k]);
+    return id;
+}
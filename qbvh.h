@@ -0,0 +1,148 @@
+#ifndef __QBVH_H__
+#define __QBVH_H__
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include "bvh.h"
+
+#if defined(__SSE2__)
+#define QBVH_SSE
+#include <emmintrin.h>
+#endif
+
+// Node of four children whose boxes are stored on 8 bits per coordinate, relative to the box of the node:
+// the bounds of a child along an axis are origin + q * 2^exponent, q in [0, 255], rounded outwards.
+// 64 bytes, one cache line, for the three interior and up to four leaf binary nodes of 32 bytes it replaces.
+// child[k] is a node index, or with count[k] > 0 the first lane of a leaf of count[k] primitives.
+struct alignas(64) QBVHNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t nchildren;
+    uint8_t lo[3][4], hi[3][4]; // [axis][child]
+    int child[4];
+    uint16_t count[4];
+};
+
+// 4-wide BVH with quantized child bounds, collapsed from a binary BVH: about half the node memory,
+// so that the nodes of scenes with millions of primitives stay in the caches, for a few more box tests
+// per ray. Same queries as BVH for single rays, the leaves are the same ranges of BVH::indices.
+class QBVH {
+public:
+    std::vector<QBVHNode> nodes;
+
+    // collapses bvh; its indices stay the leaf ranges, the binary nodes can be dropped afterwards
+    void build(const BVH &bvh);
+
+    bool empty() const { return nodes.empty(); }
+    size_t bytes() const { return nodes.size() * sizeof(QBVHNode); }
+
+    // same contract as BVH::intersect_leaves, near children first
+    template<typename F> bool intersect_leaves(const Vec3f &orig, const Vec3f &dir, float &tmax, F intersect_leaf) const {
+        if (nodes.empty()) return false;
+        const Vec3f inv_dir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        struct Entry {
+            float t;
+            int child, count; // count > 0 for a leaf
+        };
+        Entry stack[256]; // 3 entries per level at most
+        int sp = 0;
+        stack[sp++] = Entry{0, 0, 0};
+        bool hit = false;
+        while (sp) {
+            const Entry e = stack[--sp];
+            if (e.t > tmax) continue; // tmax shrank since the entry was pushed
+            if (e.count) {
+                hit |= intersect_leaf(e.child, e.count, tmax);
+                continue;
+            }
+            const QBVHNode &node = nodes[e.child];
+            PROFILE_COUNT(bvh_nodes, 1);
+            float tnear[4];
+            const unsigned mask = intersect_children(node, orig, inv_dir, tmax, tnear);
+            // pushed farthest first, so that the nearest child is popped first
+            Entry hits[4];
+            int nhits = 0;
+            for (int k = 0; k < node.nchildren; k++) {
+                if (!(mask & (1u << k))) continue;
+                Entry c = {tnear[k], node.child[k], node.count[k]};
+                int j = nhits++;
+                for (; j > 0 && hits[j - 1].t < c.t; j--) hits[j] = hits[j - 1];
+                hits[j] = c;
+            }
+            for (int j = 0; j < nhits; j++) stack[sp++] = hits[j];
+        }
+        return hit;
+    }
+
+    // same contract as BVH::occluded_leaves
+    template<typename F> bool occluded_leaves(const Vec3f &orig, const Vec3f &dir, const float tmax, F occluded_leaf) const {
+        if (nodes.empty()) return false;
+        const Vec3f inv_dir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        int stack[256];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp) {
+            const QBVHNode &node = nodes[stack[--sp]];
+            PROFILE_COUNT(bvh_nodes, 1);
+            float tnear[4];
+            const unsigned mask = intersect_children(node, orig, inv_dir, tmax, tnear);
+            for (int k = 0; k < node.nchildren; k++) {
+                if (!(mask & (1u << k))) continue;
+                if (!node.count[k]) stack[sp++] = node.child[k];
+                else if (occluded_leaf(node.child[k], node.count[k], tmax)) return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    int collapse(const BVH &bvh, int node);
+
+    static float scale_of(const int8_t exponent) { // 2^exponent, the exponents are kept normal
+        const uint32_t bits = uint32_t(exponent + 127) << 23;
+        float scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        return scale;
+    }
+
+    // slab tests of the four children, the bit of a child is set if the ray meets its box before tmax
+    static unsigned intersect_children(const QBVHNode &node, const Vec3f &orig, const Vec3f &inv_dir, const float tmax,
+                                       float *tnear) {
+#ifdef QBVH_SSE
+        __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tmax);
+        const __m128i zero = _mm_setzero_si128();
+        for (int a = 0; a < 3; a++) {
+            const float scale = scale_of(node.exponent[a]);
+            const __m128 base = _mm_set1_ps((node.origin[a] - orig[a]) * inv_dir[a]), step = _mm_set1_ps(scale * inv_dir[a]);
+            int lo, hi;
+            memcpy(&lo, node.lo[a], 4);
+            memcpy(&hi, node.hi[a], 4);
+            const __m128 qlo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo), zero), zero));
+            const __m128 qhi = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi), zero), zero));
+            const __m128 ta = _mm_add_ps(base, _mm_mul_ps(qlo, step)), tb = _mm_add_ps(base, _mm_mul_ps(qhi, step));
+            t0 = _mm_max_ps(t0, _mm_min_ps(ta, tb));
+            t1 = _mm_min_ps(t1, _mm_max_ps(ta, tb));
+        }
+        _mm_storeu_ps(tnear, t0);
+        return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1u << node.nchildren) - 1);
+#else
+        unsigned mask = 0;
+        for (int k = 0; k < node.nchildren; k++) {
+            float t0 = 0, t1 = tmax;
+            for (int a = 0; a < 3; a++) {
+                const float scale = scale_of(node.exponent[a]);
+                float ta = (node.origin[a] + node.lo[a][k] * scale - orig[a]) * inv_dir[a];
+                float tb = (node.origin[a] + node.hi[a][k] * scale - orig[a]) * inv_dir[a];
+                if (ta > tb) std::swap(ta, tb);
+                t0 = ta > t0 ? ta : t0;
+                t1 = tb < t1 ? tb : t1;
+            }
+            tnear[k] = t0;
+            if (t0 <= t1) mask |= 1u << k;
+        }
+        return mask;
+#endif
+    }
+};
+
+#endif //__QBVH_H__
@@ -0,0 +1,887 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include "render.h"
+#include "numa.h"
+#include "irradiance_cache.h"
+
+namespace {
+    // every thread's counters, so that they can be summed without synchronizing the increments
+    std::mutex counters_mutex;
+    std::vector<RayCounters *> live_counters;
+    RayCounters retired_counters = {0, 0, 0};
+
+    struct RegisteredCounters {
+        RayCounters counters;
+
+        RegisteredCounters() : counters{0, 0, 0} {
+            std::lock_guard<std::mutex> lock(counters_mutex);
+            live_counters.push_back(&counters);
+        }
+
+        ~RegisteredCounters() {
+            std::lock_guard<std::mutex> lock(counters_mutex);
+            retired_counters += counters;
+            live_counters.erase(std::find(live_counters.begin(), live_counters.end(), &counters));
+        }
+    };
+}
+
+RayCounters &RayCounters::operator+=(const RayCounters &o) {
+    primary += o.primary;
+    secondary += o.secondary;
+    shadow += o.shadow;
+    return *this;
+}
+
+RayCounters &thread_ray_counters() {
+    static thread_local RegisteredCounters local;
+    return local.counters;
+}
+
+RayCounters total_ray_counters() {
+    std::lock_guard<std::mutex> lock(counters_mutex);
+    RayCounters total = retired_counters;
+    for (size_t i = 0; i < live_counters.size(); i++) total += *live_counters[i];
+    return total;
+}
+
+void reset_ray_counters() {
+    std::lock_guard<std::mutex> lock(counters_mutex);
+    retired_counters = RayCounters{0, 0, 0};
+    for (size_t i = 0; i < live_counters.size(); i++) *live_counters[i] = RayCounters{0, 0, 0};
+}
+
+Vec3f background(const Scene &scene, const Vec3f &dir, const float spread) { // plain sky when there is no envmap
+    PROFILE_COUNT(envmap_lookups, scene.envmap ? 1 : 0);
+    return scene.envmap ? scene.envmap->lookup(dir, spread) : Vec3f(.2f, .7f, .8f);
+}
+
+Vec3f leave_surface(const Vec3f &point, const Vec3f &N, const Vec3f &dir) {
+    const float origin = 1.f / 32, float_scale = 1.f / 65536, int_scale = 256;
+    const Vec3f n = dir * N < 0 ? -N : N;
+    Vec3f p;
+    for (size_t k = 0; k < 3; k++) {
+        if (std::fabs(point[k]) < origin) { // near 0 the ulps vanish, a fixed offset is used instead
+            p[k] = point[k] + float_scale * n[k];
+            continue;
+        }
+        int32_t bits;
+        memcpy(&bits, &point[k], sizeof(bits));
+        const int32_t ulps = static_cast<int32_t>(int_scale * n[k]);
+        bits += point[k] < 0 ? -ulps : ulps;
+        memcpy(&p[k], &bits, sizeof(bits));
+    }
+    return p;
+}
+
+Vec3f reflect(const Vec3f &I, const Vec3f &N) {
+    return I - N * 2.f * (I * N);
+}
+
+Vec3f refract(const Vec3f &I, const Vec3f &N, const float eta_t, const float eta_i) { // Snell's law
+    float cosi = -std::max(-1.f, std::min(1.f, I * N));
+    if (cosi < 0)
+        return refract(I, -N, eta_i, eta_t); // if the ray comes from the inside the object, swap the air and the media
+    float eta = eta_i / eta_t;
+    float k = 1 - eta * eta * (1 - cosi * cosi);
+    return k < 0 ? Vec3f(1, 0, 0) : I * eta + N * (eta * cosi -
+                                                   sqrtf(k)); // k<0 = total reflection, no ray to refract. I refract it anyways, this has no physical meaning
+}
+
+namespace {
+    thread_local uint32_t random_state = 2463534242u;
+}
+
+// xorshift32, one stream per thread
+float random_float() {
+    uint32_t &state = random_state;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.f / 16777216.f);
+}
+
+void seed_random(const uint32_t seed) {
+    random_state = seed ? seed : 2463534242u; // xorshift never leaves 0
+}
+
+const float rr_threshold = .1f; // paths carrying less than this weight are continued by Russian roulette
+
+// Returns false if the branch does not contribute: zero weight, or killed by Russian roulette.
+// Surviving low-weight branches are boosted so that the estimate stays unbiased.
+bool survives(float &weight) {
+    if (weight <= 0) return false;
+    if (weight >= rr_threshold) return true;
+    if (random_float() * rr_threshold >= weight) return false;
+    weight = rr_threshold;
+    return true;
+}
+
+const int max_pending = 2 * (max_depth + 1) + 1; // depth first: at most two rays pushed per level
+
+void push_secondary(const Scene &scene, const PendingRay &ray, const Hit &hit, const Material &material,
+                    PendingRay *stack, int &sp) {
+    const Vec3f &point = hit.point, &N = hit.N;
+    const float width = ray.width + ray.spread * (point - ray.orig).norm(); // the cones continue from the footprint
+    if (!(material.lobes & (LOBE_REFLECT | LOBE_REFRACT))) return;
+    float reflect_weight = ray.weight * material.albedo[2];
+    float refract_weight = ray.weight * material.albedo[3];
+    if (scene.single_branch && reflect_weight > 0 && refract_weight > 0) {
+        // the branch taken with probability w / (w_reflect + w_refract) carries w / probability
+        const float total = reflect_weight + refract_weight;
+        if (random_float() * total < reflect_weight) {
+            reflect_weight = total;
+            refract_weight = 0;
+        } else {
+            reflect_weight = 0;
+            refract_weight = total;
+        }
+    }
+    if (survives(reflect_weight)) {
+        Vec3f reflect_dir = reflect(ray.dir, N).normalize();
+        Vec3f reflect_orig = leave_surface(point, N, reflect_dir); // offset the original point to avoid occlusion by the object itself
+        // a convex mirror spreads the cone by twice the angle its footprint subtends from the center of curvature
+        stack[sp++] = PendingRay{reflect_orig, reflect_dir, reflect_weight, ray.depth + 1, width, ray.spread + 2 * width * hit.curvature,
+                                 ray.time, uint8_t(ray.reflections + 1), ray.refractions};
+    }
+    if (survives(refract_weight)) {
+        Vec3f refract_dir = refract(ray.dir, N, material.refractive_index).normalize();
+        Vec3f refract_orig = leave_surface(point, N, refract_dir);
+        stack[sp++] = PendingRay{refract_orig, refract_dir, refract_weight, ray.depth + 1, width, ray.spread, ray.time,
+                                 ray.reflections, uint8_t(ray.refractions + 1)};
+    }
+}
+
+bool has_direct_lighting(const Material &material) {
+    return (material.lobes & (LOBE_DIFFUSE | LOBE_SPECULAR)) != 0;
+}
+
+// The shading kernels below are specialized on the lobes of the material (MaterialLobe flags): a kernel
+// leaves out the terms its material has no albedo for, the specular pow() of the diffuse-only surfaces
+// above all, instead of testing for them at every light. direct_lighting picks the kernel.
+
+// Adds the diffuse and specular intensities of a light at position, times intensity, unless it is shadowed.
+// `shadowed` is the flag of the light when its shadow ray was already traced (packet mode). Returns false if shadowed.
+template<unsigned Lobes>
+bool shade_light_sample(const Vec3f &position, const float intensity, const Vec3f &dir, const Hit &hit, const Material &material,
+                        const Scene &scene, const char *shadowed, float &diffuse_light_intensity, float &specular_light_intensity) {
+    const Vec3f &point = hit.point, &N = hit.N;
+    Vec3f light_dir = (position - point).normalize();
+
+    if (shadowed) {
+        if (*shadowed) return false;
+    } else if (hit.shadows) {
+        float light_distance = (position - point).norm();
+        Vec3f shadow_orig = leave_surface(point, N, light_dir); // checking if the point lies in the shadow of the light
+        thread_ray_counters().shadow++;
+        if (scene_occluded(shadow_orig, light_dir, light_distance, scene, hit.time))
+            return false;
+    }
+
+    if (Lobes & LOBE_DIFFUSE) diffuse_light_intensity += intensity * std::max(0.f, light_dir * N);
+    if (Lobes & LOBE_SPECULAR)
+        specular_light_intensity +=
+                powf(std::max(0.f, -reflect(-light_dir, N) * dir), material.specular_exponent) * intensity;
+    return true;
+}
+
+// Adds the diffuse and specular intensities of one light, times weight, unless it is shadowed; `shadowed`
+// as above, for point lights only. An area light first traces the corners of its grid of strata: if they
+// agree, the point is taken as wholly lit or in the umbra and the other strata are skipped, so only the
+// penumbrae pay for all the samples (an occluder small enough to fall between the corners is missed).
+template<unsigned Lobes>
+void shade_light(const Light &light, const float weight, const Vec3f &dir, const Hit &hit, const Material &material,
+                 const Scene &scene, const char *shadowed, float &diffuse_light_intensity, float &specular_light_intensity) {
+    if (!light.area()) {
+        shade_light_sample<Lobes>(light.position, light.intensity * weight, dir, hit, material, scene, shadowed,
+                           diffuse_light_intensity, specular_light_intensity);
+        return;
+    }
+    int nx, ny;
+    light.strata(nx, ny);
+    int probes[4], nprobes = 0;
+    const int corners[4] = {0, nx - 1, (ny - 1) * nx, nx * ny - 1};
+    for (int c = 0; c < 4; c++)
+        if (std::find(probes, probes + nprobes, corners[c]) == probes + nprobes) probes[nprobes++] = corners[c];
+
+    float diffuse = 0, specular = 0;
+    int visible = 0, traced = nprobes;
+    for (int k = 0; k < nprobes; k++) {
+        const Vec3f position = light.sample(hit.point, probes[k], random_float(), random_float(), scene.fast_shading);
+        visible += shade_light_sample<Lobes>(position, 1.f, dir, hit, material, scene, nullptr, diffuse, specular);
+    }
+    if (visible > 0 && visible < nprobes) { // penumbra
+        for (int s = 0; s < light.samples; s++) {
+            if (std::find(probes, probes + nprobes, s) != probes + nprobes) continue;
+            const Vec3f position = light.sample(hit.point, s, random_float(), random_float(), scene.fast_shading);
+            shade_light_sample<Lobes>(position, 1.f, dir, hit, material, scene, nullptr, diffuse, specular);
+            traced++;
+        }
+    }
+    const float intensity = light.intensity * weight / traced;
+    diffuse_light_intensity += diffuse * intensity;
+    specular_light_intensity += specular * intensity;
+}
+
+// Fast shading over all the lights: the light vectors of a batch are computed together with one
+// reciprocal square root each, the specular lobe uses fast_pow and reflect() is folded into two dot products.
+template<unsigned Lobes>
+void fast_direct_lighting(const Vec3f &dir, const Hit &hit, const Material &material, const Scene &scene,
+                          const char *shadowed, float &diffuse_light_intensity, float &specular_light_intensity) {
+    const Vec3f &point = hit.point, &N = hit.N;
+    const LightSoA &soa = scene.light_soa;
+    const float n_dot_dir = N * dir;
+    float dx[max_light_batch], dy[max_light_batch], dz[max_light_batch], dist[max_light_batch];
+    for (size_t begin = 0; begin < soa.size(); begin += max_light_batch) {
+        const int n = static_cast<int>(std::min<size_t>(max_light_batch, soa.size() - begin));
+        light_vectors(soa, point, static_cast<int>(begin), n, dx, dy, dz, dist);
+        for (int k = 0; k < n; k++) {
+            const size_t i = begin + k;
+            const Vec3f light_dir(dx[k], dy[k], dz[k]);
+            const float cosine = light_dir * N;
+            if (shadowed) {
+                if (shadowed[i]) continue;
+            } else if (hit.shadows) {
+                Vec3f shadow_orig = leave_surface(point, N, light_dir);
+                thread_ray_counters().shadow++;
+                if (scene_occluded(shadow_orig, light_dir, dist[k], scene, hit.time)) continue;
+            }
+            if (Lobes & LOBE_DIFFUSE) diffuse_light_intensity += soa.intensity[i] * std::max(0.f, cosine);
+            if (Lobes & LOBE_SPECULAR) {
+                // -reflect(-light_dir, N) * dir
+                const float lobe = light_dir * dir - 2 * cosine * n_dot_dir;
+                specular_light_intensity += fast_pow(std::max(0.f, lobe), material.specular_exponent) * soa.intensity[i];
+            }
+        }
+    }
+}
+
+// The light intensities of direct_lighting, with the kernels of the lobes
+template<unsigned Lobes>
+void light_intensities(const Vec3f &dir, const Hit &hit, const Material &material, const Scene &scene, const char *shadowed,
+                       const PixelSampler *sampler, float &diffuse_light_intensity, float &specular_light_intensity) {
+    const std::vector<Light> &lights = scene.lights;
+    if (scene.samples_lights()) {
+        for (int k = 0; k < scene.light_samples; k++) {
+            float pdf;
+            const float u = sampler ? sampler->get1d(DIM_LIGHT + k) : random_float();
+            const int i = scene.light_tree.sample(hit.point, hit.N, u, pdf);
+            shade_light<Lobes>(lights[i], 1.f / (pdf * scene.light_samples), dir, hit, material, scene, nullptr,
+                        diffuse_light_intensity, specular_light_intensity);
+        }
+    } else if (scene.fast_shading && !scene.area_lights) {
+        fast_direct_lighting<Lobes>(dir, hit, material, scene, shadowed, diffuse_light_intensity, specular_light_intensity);
+    } else {
+        for (size_t i = 0; i < lights.size(); i++)
+            shade_light<Lobes>(lights[i], 1.f, dir, hit, material, scene, shadowed && !lights[i].area() ? &shadowed[i] : nullptr,
+                        diffuse_light_intensity, specular_light_intensity);
+    }
+}
+
+Vec3f direct_lighting(const Vec3f &dir, const Hit &hit, const Material &material, const Scene &scene,
+                      const char *shadowed, const PixelSampler *sampler) {
+    float diffuse_light_intensity = 0, specular_light_intensity = 0;
+    switch (material.lobes & (LOBE_DIFFUSE | LOBE_SPECULAR)) {
+    case LOBE_DIFFUSE:
+        light_intensities<LOBE_DIFFUSE>(dir, hit, material, scene, shadowed, sampler, diffuse_light_intensity, specular_light_intensity);
+        break;
+    case LOBE_SPECULAR:
+        light_intensities<LOBE_SPECULAR>(dir, hit, material, scene, shadowed, sampler, diffuse_light_intensity, specular_light_intensity);
+        break;
+    case LOBE_DIFFUSE | LOBE_SPECULAR:
+        light_intensities<LOBE_DIFFUSE | LOBE_SPECULAR>(dir, hit, material, scene, shadowed, sampler, diffuse_light_intensity,
+                                                        specular_light_intensity);
+        break;
+    default: // no light reaches the eye from the surface
+        return Vec3f(0, 0, 0);
+    }
+    return diffuse_color(scene, hit, material) * diffuse_light_intensity * material.albedo[0] +
+           Vec3f(1., 1., 1.) * specular_light_intensity * material.albedo[1] + envmap_lighting(hit, material, scene, sampler) +
+           indirect_lighting(hit, material, scene);
+}
+
+Vec3f indirect_lighting(const Hit &hit, const Material &material, const Scene &scene) {
+    if (!scene.irradiance || !(material.lobes & LOBE_DIFFUSE)) return Vec3f(0, 0, 0);
+    const Vec3f color = diffuse_color(scene, hit, material), E = scene.irradiance->lookup(hit.point, hit.N);
+    return Vec3f(color.x * E.x, color.y * E.y, color.z * E.z) * material.albedo[0];
+}
+
+Vec3f envmap_lighting(const Hit &hit, const Material &material, const Scene &scene, const PixelSampler *sampler) {
+    if (!scene.envmap || scene.envmap_samples <= 0 || !(material.lobes & LOBE_DIFFUSE)) return Vec3f(0, 0, 0);
+    const Vec3f &point = hit.point, &N = hit.N;
+    Vec3f radiance;
+    for (int k = 0; k < scene.envmap_samples; k++) {
+        float u, v, pdf;
+        if (sampler) sampler->get2d(DIM_LIGHT + scene.light_samples + 2 * k, u, v);
+        else {
+            u = random_float();
+            v = random_float();
+        }
+        const Vec3f light_dir = scene.envmap->sample_direction(u, v, pdf);
+        const float cosine = light_dir * N;
+        if (cosine <= 0 || pdf <= 0) continue; // below the surface, the draw is wasted
+        if (hit.shadows) {
+            thread_ray_counters().shadow++;
+            if (scene_occluded(leave_surface(point, N, light_dir), light_dir, std::numeric_limits<float>::max(), scene, hit.time)) continue;
+        }
+        radiance = radiance + scene.envmap->lookup(light_dir) * (cosine / pdf);
+    }
+    const Vec3f color = diffuse_color(scene, hit, material);
+    const float weight = material.albedo[0] / (float(M_PI) * scene.envmap_samples);
+    return Vec3f(color.x * radiance.x, color.y * radiance.y, color.z * radiance.z) * weight;
+}
+
+void AOVs::reset(const size_t npixels) {
+    depth.assign(enabled & DEPTH ? npixels : 0, 0.f);
+    normal.reset(enabled & NORMAL ? npixels : 0);
+    albedo.reset(enabled & ALBEDO ? npixels : 0);
+    id.reset(enabled & ID ? npixels : 0);
+    cost.assign(enabled & COST ? npixels : 0, 0.f);
+}
+
+int hit_object(const Scene &scene, const HitRecord &rec) {
+    return rec.kind == HIT_SPHERE ? scene.sphere_soa.id[rec.prim] : rec.kind == HIT_PRIMITIVE ? rec.prim
+         : rec.kind == HIT_GROUND ? 0 : rec.object;
+}
+
+// adds a hit of the path to its record
+void record_hit(const Scene &scene, const HitRecord &rec, const Hit &hit, const Material &material, PathRecord &record) {
+    record.objects |= object_bit(rec.kind, hit_object(scene, rec));
+    record.materials |= uint64_t(1) << (hit.material % 64);
+    if (material.lobes & (LOBE_REFLECT | LOBE_REFRACT)) record.flags |= PathRecord::BOUNCED;
+    if (has_direct_lighting(material)) record.flags |= PathRecord::LIT;
+}
+
+// Iterative path integrator: instead of always recursing into both the reflected and the refracted ray,
+// every pending ray carries the product of the albedos along its path and is pushed only if it contributes.
+// The hits are shaded with materials, scene.materials or the ones of a variant of render_batch.
+Vec3f integrate(PendingRay *stack, int sp, const Scene &scene, const Material *materials, PathRecord *record = nullptr) {
+    RayCounters &counters = thread_ray_counters();
+    Vec3f color;
+    while (sp) {
+        const PendingRay ray = stack[--sp];
+        HitRecord rec;
+        Hit hit;
+
+        counters.count_ray(ray.depth);
+        if (ray.depth > scene.depth_limit || ray.reflections > scene.reflect_depth || ray.refractions > scene.refract_depth ||
+            !scene_closest_hit(ray.orig, ray.dir, scene, rec, ray.time)) {
+            color = color + background(scene, ray.dir, ray.spread) * ray.weight;
+            continue;
+        }
+        surface_interaction(ray.orig, ray.dir, scene, rec, hit, ray.width + ray.spread * rec.t, ray.time);
+        hit.shadows = ray.depth <= scene.shadow_depth;
+        const Material &material = materials[hit.material];
+        if (record) record_hit(scene, rec, hit, material, *record);
+
+        push_secondary(scene, ray, hit, material, stack, sp);
+        if (has_direct_lighting(material))
+            color = color + direct_lighting(ray.dir, hit, material, scene) * ray.weight;
+    }
+    return color;
+}
+
+Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, const Scene &scene, size_t depth) {
+    PendingRay stack[max_pending];
+    stack[0] = PendingRay{orig, dir, 1.f, depth, 0.f, 0.f, 0.f, 0, 0};
+    return integrate(stack, 1, scene, scene.materials.data());
+}
+
+// Traces a packet of n <= max_packet coherent primary rays: the primary hits and the shadow rays
+// towards each light are computed for all lanes at once, the reflected and refracted paths, which
+// diverge, are continued one ray at a time, then the direct lighting is evaluated material by material.
+void cast_ray_packet(const int n, const Vec3f *orig, const Vec3f *dir, const Scene &scene, Vec3f *colors,
+                     PathRecord *records, AOVSample *samples, const PixelSampler *samplers, const float spread,
+                     const uint8_t *visible, const Material *materials) {
+    if (!materials) materials = scene.materials.data();
+    bool hits[max_packet];
+    HitRecord rec[max_packet];
+    Hit hit[max_packet];
+    float times[max_packet] = {}; // the instant of the shutter each lane sees, when something moves
+    for (int l = 0; l < n; l++) times[l] = samplers && scene.moving() ? samplers[l].get1d(DIM_TIME) : 0.f;
+    {
+        PROFILE_PHASE(PHASE_TRACE);
+        scene_closest_hit_packet(n, orig, dir, scene, hits, rec, visible, times);
+    }
+    PROFILE_COUNT(rays[0], n);
+    for (int l = 0; l < n; l++) {
+        if (!hits[l]) continue;
+        surface_interaction(orig[l], dir[l], scene, rec[l], hit[l], spread * rec[l].t, times[l]);
+        if (samples) {
+            const bool inside = rec[l].kind == HIT_INSTANCE || rec[l].kind == HIT_MESH;
+            samples[l] = AOVSample{rec[l].t, hit[l].N, diffuse_color(scene, hit[l], materials[hit[l].material]),
+                                   Vec3f(rec[l].kind, hit_object(scene, rec[l]), inside ? rec[l].prim : 0)};
+        }
+        if (!records) continue;
+        records[l] = PathRecord();
+        records[l].depth = rec[l].t;
+        record_hit(scene, rec[l], hit[l], materials[hit[l].material], records[l]);
+    }
+    RayCounters &counters = thread_ray_counters();
+    counters.primary += n;
+
+    // sampled lights differ from lane to lane, their shadow rays are traced ray by ray
+    const std::vector<Light> &lights = scene.lights;
+    const bool sampled = scene.samples_lights();
+    ArenaScope scope(thread_arena());
+    char *shadowed = sampled ? nullptr : thread_arena().alloc<char>(lights.size() * n); // [lane][light]
+    if (shadowed) std::fill(shadowed, shadowed + lights.size() * n, 0);
+    for (size_t i = 0; i < lights.size() && !sampled; i++) {
+        if (lights[i].area()) continue; // shade_light traces its own shadow rays
+        PROFILE_PHASE(PHASE_SHADOW);
+        Vec3f shadow_orig[max_packet], light_dir[max_packet];
+        float light_distance[max_packet], light_time[max_packet];
+        int lane[max_packet];
+        int m = 0;
+        for (int l = 0; l < n; l++) {
+            if (!hits[l] || !has_direct_lighting(materials[hit[l].material])) continue;
+            const Vec3f &point = hit[l].point, &N = hit[l].N;
+            light_dir[m] = (lights[i].position - point).normalize();
+            light_distance[m] = (lights[i].position - point).norm();
+            shadow_orig[m] = leave_surface(point, N, light_dir[m]);
+            light_time[m] = times[l];
+            lane[m++] = l;
+        }
+        bool occluded[max_packet];
+        counters.shadow += m;
+        scene_occluded_packet(m, shadow_orig, light_dir, light_distance, scene, occluded, light_time);
+        for (int k = 0; k < m; k++) shadowed[lane[k] * lights.size() + i] = occluded[k];
+    }
+
+    int lit[max_packet], nlit = 0;
+    { // the reflected and refracted paths, traced and shaded ray by ray
+        PROFILE_PHASE(PHASE_SECONDARY);
+        for (int l = 0; l < n; l++) {
+            if (!hits[l]) {
+                colors[l] = background(scene, dir[l], spread);
+                if (records) records[l] = PathRecord();
+                if (samples)
+                    samples[l] = AOVSample{std::numeric_limits<float>::infinity(), Vec3f(0, 0, 0),
+                                           Vec3f(std::min(1.f, colors[l].x), std::min(1.f, colors[l].y), std::min(1.f, colors[l].z)),
+                                           Vec3f(0, 0, 0)};
+                continue;
+            }
+            const Material &material = materials[hit[l].material];
+            PendingRay stack[max_pending];
+            int sp = 0;
+            if (samplers) seed_random(samplers[l].seed(0));
+            push_secondary(scene, PendingRay{orig[l], dir[l], 1.f, 0, 0.f, spread, times[l], 0, 0}, hit[l], material, stack, sp);
+            colors[l] = integrate(stack, sp, scene, materials, records ? &records[l] : nullptr);
+            if (has_direct_lighting(material)) lit[nlit++] = l;
+        }
+    }
+    // the lanes that see the lights are shaded grouped by material
+    PROFILE_PHASE(PHASE_SHADE);
+    std::stable_sort(lit, lit + nlit, [&](int a, int b) { return hit[a].material < hit[b].material; });
+    for (int k = 0; k < nlit; k++) {
+        const int l = lit[k];
+        if (samplers) seed_random(samplers[l].seed(1)); // the lanes are shaded in material order
+        colors[l] = colors[l] + direct_lighting(dir[l], hit[l], materials[hit[l].material], scene,
+                                                sampled ? nullptr : &shadowed[l * lights.size()],
+                                                samplers ? &samplers[l] : nullptr);
+    }
+}
+
+namespace {
+    // position in the pixel (i, j) of its k-th sample, the 0-th one is the center
+    inline void subpixel_offset(const PixelSampler &sampler, const int k, float &jx, float &jy) {
+        if (k) sampler.get2d(DIM_PIXEL, jx, jy);
+        else jx = jy = .5f;
+    }
+
+    // the primary ray of the sample at (x, y), through the point of the lens given by the sampler
+    inline void primary_ray(const ImagePlane &plane, const PixelSampler &sampler, const float x, const float y,
+                            Vec3f &orig, Vec3f &dir) {
+        float u = .5f, v = .5f;
+        if (plane.thin_lens()) sampler.get2d(DIM_LENS, u, v);
+        plane.ray(x, y, u, v, orig, dir);
+    }
+
+    // the running total of a CostMetric for the calling thread, the cost of a pixel is the difference
+    inline double cost_clock(const CostMetric metric) {
+#ifdef SNOWMAN_PROFILE
+        if (metric == COST_TESTS) {
+            const ProfileCounters &c = profile_counters();
+            return double(c.box_tests + c.sphere_tests + c.primitive_tests);
+        }
+#endif
+        (void) metric;
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void store_aovs(AOVs &aovs, const size_t p, const AOVSample &sample, const float cost) {
+        if (aovs.enabled & AOVs::DEPTH) aovs.depth[p] = sample.depth;
+        if (aovs.enabled & AOVs::NORMAL) aovs.normal.set(p, sample.normal);
+        if (aovs.enabled & AOVs::ALBEDO) aovs.albedo.set(p, sample.albedo);
+        if (aovs.enabled & AOVs::ID) aovs.id.set(p, sample.id);
+        if (aovs.enabled & AOVs::COST) aovs.cost[p] = cost;
+    }
+
+    // Traces the sample-th ray of the lattice points of tile for which keep(i, j) holds, see render_lattice.
+    // materials, if set, replace scene.materials as in cast_ray_packet.
+    template<typename Keep, typename Store>
+    void trace_lattice_tile(const Scene &scene, const ImagePlane &plane, const uint8_t *visible, const int width, const Tile &tile,
+                            const int stride, const int sample, Keep keep, Store store, PathRecord *records, AOVs *aovs,
+                            const Material *materials = nullptr) {
+        const bool by_ray = aovs && (aovs->enabled & AOVs::COST);
+        const int packet_width = 8, packet_height = 8; // primary rays are traced in 8x8 packets
+        const int bw = packet_width * stride, bh = packet_height * stride;
+        for (int py = tile.y0; py < tile.y1; py += bh) {
+            for (int px = tile.x0; px < tile.x1; px += bw) {
+                Vec3f orig[max_packet], dir[max_packet], colors[max_packet];
+                float costs[max_packet];
+                PathRecord *paths = records ? thread_arena().alloc<PathRecord>(max_packet) : nullptr; // filled by cast_ray_packet
+                AOVSample *samples = aovs ? thread_arena().alloc<AOVSample>(max_packet) : nullptr;
+                PixelSampler samplers[max_packet];
+                int n = 0;
+                for (int j = py; j < std::min(py + bh, tile.y1); j += stride) {
+                    for (int i = px; i < std::min(px + bw, tile.x1); i += stride) {
+                        if (!keep(i, j)) continue;
+                        float jx, jy;
+                        samplers[n] = PixelSampler(i, j, sample);
+                        subpixel_offset(samplers[n], sample, jx, jy);
+                        primary_ray(plane, samplers[n], i + jx, j + jy, orig[n], dir[n]);
+                        n++;
+                    }
+                }
+                if (!n) continue;
+                if (by_ray) {
+                    for (int k = 0; k < n; k++) {
+                        const double start = cost_clock(aovs->cost_metric);
+                        cast_ray_packet(1, &orig[k], &dir[k], scene, &colors[k], paths ? &paths[k] : nullptr, &samples[k],
+                                        &samplers[k], plane.spread() * stride, visible, materials);
+                        costs[k] = static_cast<float>(cost_clock(aovs->cost_metric) - start);
+                    }
+                } else {
+                    cast_ray_packet(n, orig, dir, scene, colors, paths, samples, samplers, plane.spread() * stride, visible, materials);
+                }
+                n = 0;
+                for (int j = py; j < std::min(py + bh, tile.y1); j += stride) {
+                    for (int i = px; i < std::min(px + bw, tile.x1); i += stride) {
+                        if (!keep(i, j)) continue;
+                        if (records) records[i + j * width] = paths[n];
+                        if (aovs) store_aovs(*aovs, i + j * width, samples[n], by_ray ? costs[n] : 0.f);
+                        store(i, j, colors[n++]);
+                    }
+                }
+            }
+        }
+    }
+
+    // Traces the sample-th ray of every pixel (i, j) of the lattice i % stride == 0, j % stride == 0 of the region
+    // for which keep(i, j) holds (sample 0 through the pixel center), and hands the colors to store(i, j, color).
+    // done(tile) is called by the thread that finished the tile. The corner of the region is on the lattice.
+    // With records (width x height), the paths of the traced pixels are recorded there too, and with aovs
+    // their output variables (resized by the caller). camera, if set, replaces scene.camera.
+    template<typename Keep, typename Store, typename Done>
+    std::vector<ThreadStats> render_lattice(const Scene &scene, const int width, const int height, const Tile &region,
+                                            const int stride, const int sample, Keep keep, Store store, Done done,
+                                            PathRecord *records = nullptr, AOVs *aovs = nullptr, const Camera *camera = nullptr) {
+        std::vector<Tile> tiles = make_tiles(region.x1 - region.x0, region.y1 - region.y0, 16 * stride); // 16x16 lattice points per tile
+        for (size_t t = 0; t < tiles.size(); t++) {
+            tiles[t].x0 += region.x0;
+            tiles[t].x1 += region.x0;
+            tiles[t].y0 += region.y0;
+            tiles[t].y1 += region.y0;
+        }
+        const ImagePlane plane(camera ? *camera : scene.camera, width, height);
+        const std::vector<uint8_t> visible = visible_meshes(scene, plane);
+        return parallel_for_tiles(tiles, [&](const Tile &tile) { // actual rendering loop
+            trace_lattice_tile(local_scene(scene), plane, visible.data(), width, tile, stride, sample, keep, store, records, aovs);
+            done(tile);
+        });
+    }
+}
+
+std::vector<ThreadStats> render(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer,
+                                const std::function<void(const Tile &)> &tile_done) {
+    framebuffer.resize(width * height);
+    return render_crop(scene, width, height, Tile{0, 0, width, height}, framebuffer, tile_done);
+}
+
+std::vector<ThreadStats> render_crop(const Scene &scene, const int width, const int height, const Tile &crop,
+                                     std::vector<Vec3f> &framebuffer, const std::function<void(const Tile &)> &tile_done,
+                                     AOVs *aovs) {
+    PROFILE_SCOPE("render");
+    framebuffer.resize(width * height);
+    // every pixel is rewritten: its page goes to the node of the thread that renders it first
+    if (numa_pinned() && crop.x0 == 0 && crop.y0 == 0 && crop.x1 == width && crop.y1 == height)
+        release_pages(framebuffer.data(), framebuffer.size() * sizeof(Vec3f));
+    if (aovs) aovs->reset(size_t(width) * height);
+    return render_lattice(scene, width, height, crop, 1, 0,
+                          [](int, int) { return true; },
+                          [&](int i, int j, const Vec3f &c) { framebuffer[i + j * width] = c; },
+                          [&](const Tile &tile) { if (tile_done) tile_done(tile); }, nullptr, aovs);
+}
+
+std::vector<ThreadStats> render_recorded(const Scene &scene, const int width, const int height, const std::vector<char> &dirty,
+                                         std::vector<Vec3f> &framebuffer, std::vector<PathRecord> &records) {
+    return render_lattice(scene, width, height, Tile{0, 0, width, height}, 1, 0,
+                          [&](int i, int j) { return dirty[i + j * width] != 0; },
+                          [&](int i, int j, const Vec3f &c) { framebuffer[i + j * width] = c; },
+                          [](const Tile &) {}, records.data());
+}
+
+std::vector<ThreadStats> render_region(const Scene &scene, const int width, const int height, const Tile &region,
+                                       std::vector<Vec3f> &colors) {
+    const int rw = region.x1 - region.x0;
+    colors.resize(rw * (region.y1 - region.y0));
+    return render_lattice(scene, width, height, region, 1, 0,
+                          [](int, int) { return true; },
+                          [&](int i, int j, const Vec3f &c) { colors[(i - region.x0) + (j - region.y0) * rw] = c; },
+                          [](const Tile &) {});
+}
+
+std::vector<ThreadStats> render_view(const Scene &scene, const Camera &camera, const int width, const int height, Vec3f *pixels,
+                                     const std::atomic<bool> *cancel, const std::function<void(const Tile &)> &tile_done,
+                                     size_t *skipped) {
+    std::atomic<size_t> left(0);
+    const std::vector<ThreadStats> stats = render_lattice(scene, width, height, Tile{0, 0, width, height}, 1, 0,
+            [cancel, &left](int, int) {
+                if (!cancel || !cancel->load(std::memory_order_relaxed)) return true;
+                left.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            },
+            [&](int i, int j, const Vec3f &c) { pixels[i + j * width] = c; },
+            [&](const Tile &tile) { if (tile_done) tile_done(tile); }, nullptr, nullptr, &camera);
+    if (skipped) *skipped = left.load();
+    return stats;
+}
+
+namespace {
+    // perceived brightness of the displayed color, overexposed channels count as saturated
+    inline float display_luminance(const Vec3f &c) {
+        return .299f * std::min(1.f, c.x) + .587f * std::min(1.f, c.y) + .114f * std::min(1.f, c.z);
+    }
+}
+
+std::vector<ThreadStats> render_adaptive(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer,
+                                         const int max_samples, const float threshold) {
+    std::vector<ThreadStats> stats = render(scene, width, height, framebuffer);
+    if (max_samples <= 1) return stats;
+
+    // contrast of every pixel against its 4 neighbours in the 1 spp image
+    const std::vector<Vec3f> base(framebuffer);
+    std::vector<Tile> tiles = make_tiles(width, height, 16);
+    const ImagePlane plane(scene.camera, width, height);
+    const std::vector<uint8_t> visible = visible_meshes(scene, plane);
+    std::vector<ThreadStats> refine = parallel_for_tiles(tiles, [&](const Tile &tile) {
+        const Scene &local = local_scene(scene);
+        int pixels[max_packet];
+        int npixels = 0;
+        const int per_packet = std::max(1, max_packet / (max_samples - 1)); // pixels refined per packet
+        auto flush = [&]() {
+            Vec3f orig[max_packet], dir[max_packet], colors[max_packet];
+            PixelSampler samplers[max_packet];
+            int n = 0;
+            for (int p = 0; p < npixels; p++) {
+                for (int k = 1; k < max_samples && n < max_packet; k++) {
+                    float jx, jy;
+                    samplers[n] = PixelSampler(pixels[p] % width, pixels[p] / width, k);
+                    subpixel_offset(samplers[n], k, jx, jy);
+                    primary_ray(plane, samplers[n], pixels[p] % width + jx, pixels[p] / width + jy, orig[n], dir[n]);
+                    n++;
+                }
+            }
+            cast_ray_packet(n, orig, dir, local, colors, nullptr, nullptr, samplers, plane.spread(), visible.data());
+            n = 0;
+            for (int p = 0; p < npixels; p++) {
+                Vec3f sum = base[pixels[p]];
+                int count = 1;
+                for (int k = 1; k < max_samples && n < max_packet; k++, count++) sum = sum + colors[n++];
+                framebuffer[pixels[p]] = sum * (1.f / count);
+            }
+            npixels = 0;
+        };
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                const float l = display_luminance(base[i + j * width]);
+                float contrast = 0;
+                if (i > 0) contrast = std::max(contrast, std::fabs(l - display_luminance(base[i - 1 + j * width])));
+                if (i + 1 < width) contrast = std::max(contrast, std::fabs(l - display_luminance(base[i + 1 + j * width])));
+                if (j > 0) contrast = std::max(contrast, std::fabs(l - display_luminance(base[i + (j - 1) * width])));
+                if (j + 1 < height) contrast = std::max(contrast, std::fabs(l - display_luminance(base[i + (j + 1) * width])));
+                if (contrast <= threshold) continue;
+                pixels[npixels++] = i + j * width;
+                if (npixels == per_packet) flush();
+            }
+        }
+        if (npixels) flush();
+    });
+    merge_thread_stats(stats, refine);
+    return stats;
+}
+
+std::vector<ThreadStats> render_batch(const Scene &scene, const int width, const int height, const std::vector<SceneVariant> &variants,
+                                      const int group, const std::function<void(size_t, const std::vector<Vec3f> &)> &done) {
+    PROFILE_SCOPE("render batch");
+    const std::vector<Tile> tiles = make_tiles(width, height, 16);
+    const size_t g = std::min(variants.size(), size_t(std::max(1, group)));
+    std::vector<std::vector<Material> > slots(g); // the materials of the variants of a group
+    std::vector<std::vector<Vec3f> > framebuffers(g, std::vector<Vec3f>(size_t(width) * height));
+    std::vector<ThreadStats> stats;
+    for (size_t first = 0; first < variants.size(); first += g) {
+        const size_t n = std::min(g, variants.size() - first);
+        std::vector<ImagePlane> planes;
+        std::vector<std::vector<uint8_t> > visible;
+        for (size_t k = 0; k < n; k++) {
+            const SceneVariant &v = variants[first + k];
+            slots[k] = scene.materials;
+            for (size_t m = 0; m < v.materials.size(); m++) slots[k][v.materials[m].first] = v.materials[m].second;
+            planes.push_back(ImagePlane(v.camera, width, height));
+            visible.push_back(visible_meshes(scene, planes.back()));
+        }
+        // the variant of a job is in its rows: the group is rendered as one image of n stacked variants
+        std::vector<Tile> jobs(tiles.size() * n);
+        for (size_t j = 0; j < jobs.size(); j++) {
+            const Tile &t = tiles[j / n];
+            const int dy = static_cast<int>(j % n) * height;
+            jobs[j] = Tile{t.x0, t.y0 + dy, t.x1, t.y1 + dy};
+        }
+        merge_thread_stats(stats, parallel_for_tiles(jobs, [&](const Tile &job) {
+            const size_t k = job.y0 / height;
+            const int dy = static_cast<int>(k) * height;
+            std::vector<Vec3f> &framebuffer = framebuffers[k];
+            trace_lattice_tile(local_scene(scene), planes[k], visible[k].data(), width, Tile{job.x0, job.y0 - dy, job.x1, job.y1 - dy}, 1, 0,
+                               [](int, int) { return true; },
+                               [&](int i, int j, const Vec3f &c) { framebuffer[i + j * width] = c; }, nullptr, nullptr, slots[k].data());
+        }));
+        for (size_t k = 0; k < n; k++) done(first + k, framebuffers[k]);
+    }
+    return stats;
+}
+
+ProgressiveRenderer::ProgressiveRenderer(const Scene &scene, const int width, const int height, const int coarsest,
+                                         const AOVs &outputs, const PixelFormat format)
+        : scene(scene), width(width), height(height), stride(1), npasses(0), covered(false),
+          mean(format), traced(size_t(width) * height, 0), refinements(0), aovs(outputs) {
+    while (stride * 2 <= coarsest) stride *= 2;
+    mean.reset(size_t(width) * height);
+    aovs.enabled &= ~uint32_t(AOVs::COST);
+    aovs.reset(size_t(width) * height);
+}
+
+bool ProgressiveRenderer::previewing() const {
+    return !covered;
+}
+
+std::vector<ThreadStats> ProgressiveRenderer::pass() {
+    std::vector<ThreadStats> stats;
+    if (!covered) {
+        if (npasses > 0) stride /= 2;
+        const int s = stride;
+        // only the lattice points the coarser passes did not already cover
+        const bool first = npasses == 0;
+        stats = render_lattice(scene, width, height, Tile{0, 0, width, height}, s, 0,
+                               [&](int i, int j) { return first || (i % (2 * s)) || (j % (2 * s)); },
+                               [&](int i, int j, const Vec3f &c) { mean.set(i + j * width, c); traced[i + j * width] = 1; },
+                               [](const Tile &) {}, nullptr, aovs.enabled ? &aovs : nullptr);
+        covered = stride == 1;
+    } else {
+        // refinement: one more sample per pixel, at the subpixel offset of its own sampler
+        // the albedo is averaged over the samples like the colors, a denoiser divides one by the other
+        AOVs sample = AOVs();
+        sample.enabled = aovs.enabled & AOVs::ALBEDO;
+        sample.reset(size_t(width) * height);
+        const int n = samples();
+        const float weight = 1.f / (n + 1);
+        stats = render_lattice(scene, width, height, Tile{0, 0, width, height}, 1, n,
+                               [](int, int) { return true; },
+                               [&](int i, int j, const Vec3f &c) {
+                                   const size_t p = i + j * width;
+                                   const Vec3f m = mean[p];
+                                   mean.set(p, m + (c - m) * weight);
+                               },
+                               [](const Tile &) {}, nullptr, sample.enabled ? &sample : nullptr);
+        refinements++;
+        for (size_t p = 0; p < sample.albedo.size(); p++)
+            aovs.albedo.set(p, aovs.albedo[p] + (sample.albedo[p] - aovs.albedo[p]) * weight);
+    }
+    npasses++;
+    return stats;
+}
+
+size_t ProgressiveRenderer::next_pass_pixels() const {
+    auto lattice_points = [&](const int s) { return size_t((width + s - 1) / s) * ((height + s - 1) / s); };
+    if (covered) return size_t(width) * height;
+    if (npasses == 0) return lattice_points(stride);
+    return lattice_points(stride / 2) - lattice_points(stride);
+}
+
+int ProgressiveRenderer::samples() const {
+    return covered ? 1 + refinements : 0;
+}
+
+void ProgressiveRenderer::resolve(std::vector<Vec3f> &framebuffer) const {
+    framebuffer.resize(width * height);
+    const int s = stride;
+#pragma omp parallel for
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            int p = i + j * width;
+            if (!traced[p]) p = (i - i % s) + (j - j % s) * width; // not traced yet, take the preview sample
+            framebuffer[i + j * width] = mean[p];
+        }
+    }
+}
+
+BudgetResult render_budget(Scene &scene, const int width, const int height, const double budget_ms, std::vector<Vec3f> &framebuffer) {
+    typedef std::chrono::steady_clock Clock;
+    blue_noise(0, 0); // built once per process, it would inflate the cost of the probe
+    const Clock::time_point start = Clock::now();
+    auto elapsed = [&]() { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+    const size_t deepest = scene.depth_limit, npixels = size_t(width) * height;
+    BudgetResult result = BudgetResult();
+
+    // runs a pass of renderer at depth, returns its cost per traced pixel; the image is only resolved at the end
+    const ProgressiveRenderer *best = nullptr;
+    auto timed_pass = [&](ProgressiveRenderer &renderer, const size_t depth) {
+        const size_t pixels = renderer.next_pass_pixels();
+        const Clock::time_point pass_start = Clock::now();
+        scene.depth_limit = depth;
+        merge_thread_stats(result.stats, renderer.pass());
+        best = &renderer;
+        result.depth = depth;
+        return std::chrono::duration<double, std::milli>(Clock::now() - pass_start).count() / pixels;
+    };
+
+    // the shallow probe is the image returned if nothing else fits, it is traced whatever the budget
+    const int probe_stride = 16;
+    std::unique_ptr<ProgressiveRenderer> shallow(new ProgressiveRenderer(scene, width, height, probe_stride)), deep;
+    const double reserve = elapsed(); // filling the full resolution buffers, about what resolving the image takes
+    const double shallow_cost = timed_pass(*shallow, 1);
+    double deep_cost = shallow_cost;
+    if (deepest > 1 && elapsed() + 2 * shallow_cost * shallow->next_pass_pixels() + 2 * reserve <= budget_ms) {
+        deep.reset(new ProgressiveRenderer(scene, width, height, probe_stride));
+        deep_cost = std::max(deep_cost, timed_pass(*deep, deepest)); // the first pass also warms the caches up
+    }
+
+    const float margin = 1.25f; // the cost per pixel changes from one pass to the next, the samples land elsewhere
+    // the deepest limit whose full resolution fits, the probed pixels are traced again at the finer lattice
+    size_t depth = deep ? deepest : 1;
+    auto cost = [&](const size_t d) {
+        return deepest > 1 ? shallow_cost + (deep_cost - shallow_cost) * (d - 1) / (deepest - 1) : shallow_cost;
+    };
+    while (depth > 1 && elapsed() + double(margin) * cost(depth) * npixels + 2 * reserve > budget_ms) depth--;
+
+    std::unique_ptr<ProgressiveRenderer> between;
+    ProgressiveRenderer *renderer = depth == 1 ? shallow.get() : depth == deepest ? deep.get() : nullptr;
+    if (!renderer) {
+        between.reset(new ProgressiveRenderer(scene, width, height, probe_stride / 2));
+        renderer = between.get();
+    }
+    double pixel_cost = cost(depth);
+    while (elapsed() + double(margin) * pixel_cost * renderer->next_pass_pixels() + reserve <= budget_ms) pixel_cost = timed_pass(*renderer, depth);
+
+    best->resolve(framebuffer);
+    result.stride = best->lattice();
+    result.samples = best->samples();
+    scene.depth_limit = deepest;
+    result.ms = elapsed();
+    return result;
+}
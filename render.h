@@ -0,0 +1,242 @@
+#ifndef __RENDER_H__
+#define __RENDER_H__
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include "geometry.h"
+#include "scene.h"
+#include "scheduler.h"
+#include "profile.h"
+#include "sampler.h"
+#include "pixel_buffer.h"
+
+// Rays traced since the last reset_ray_counters(), by type. Every thread increments its own copy.
+struct RayCounters {
+    uint64_t primary, secondary, shadow;
+
+    void count_ray(size_t depth) {
+        if (depth) secondary++;
+        else primary++;
+        PROFILE_COUNT(rays[depth < size_t(profile_depths) ? depth : profile_depths - 1], 1);
+    }
+    RayCounters &operator+=(const RayCounters &o);
+};
+
+RayCounters &thread_ray_counters(); // counters of the calling thread
+RayCounters total_ray_counters();   // sum over all the threads
+void reset_ray_counters();
+
+Vec3f reflect(const Vec3f &I, const Vec3f &N);
+Vec3f refract(const Vec3f &I, const Vec3f &N, const float eta_t, const float eta_i = 1.f);
+
+// Building blocks of the integrators, shared by cast_ray and the wavefront mode (wavefront.h).
+float random_float(); // uniform in [0, 1), one xorshift stream per thread
+// Restarts the stream of the calling thread. The renderers seed it per pixel sample (PixelSampler::seed) or
+// per tile before they draw from it, so that an image does not depend on the number of threads nor on
+// which thread traced what: renders are bit-identical at any thread count on the same machine and ISA (the
+// SSE, AVX2-FMA, AVX-512 and NEON kernels picked at runtime round differently).
+void seed_random(uint32_t seed);
+
+// The rays are cones (Amanatides): their footprint, width + spread * distance from orig, selects the
+// levels of detail of the envmap and the image textures.
+struct PendingRay {
+    Vec3f orig, dir;
+    float weight; // product of the albedos along the path
+    size_t depth;
+    float width, spread; // of the cone at orig, spread in radians
+    float time;          // in [0, 1) over the shutter, of the primary ray of the path
+    uint8_t reflections, refractions; // bounces of each kind so far, counted against Scene::reflect_depth and refract_depth
+};
+
+// Origin of a ray that leaves the surface at point towards dir (Waechter and Binder, "A Fast and Robust
+// Method for Avoiding Self-Intersection", 2019): the point is moved along the normal, on the side of dir, by
+// a fixed number of ulps of each coordinate, so that the offset grows with the rounding error of the
+// hit point instead of being a fixed distance, too small for large scenes and too large for small objects.
+Vec3f leave_surface(const Vec3f &point, const Vec3f &N, const Vec3f &dir);
+
+// Pushes onto stack[sp++] the reflected and refracted continuations of a hit that contribute (at most 2).
+// With Scene::single_branch, a hit that has both only pushes one, picked in proportion to its weight and
+// carrying the sum of the two: a path through glass is one ray per bounce instead of a tree of 2^depth.
+void push_secondary(const Scene &scene, const PendingRay &ray, const Hit &hit, const Material &material,
+                    PendingRay *stack, int &sp);
+bool has_direct_lighting(const Material &material);
+// Diffuse + specular contribution of the lights. `shadowed` holds one flag per light when the shadow
+// rays were already traced (packet mode), otherwise they are traced here. With many lights, a few of
+// them are picked from the light tree and weighted by the inverse of their probability.
+// The light samples come from sampler if set.
+Vec3f direct_lighting(const Vec3f &dir, const Hit &hit, const Material &material, const Scene &scene,
+                      const char *shadowed = nullptr, const PixelSampler *sampler = nullptr);
+// Image based lighting of the diffuse lobe, included in direct_lighting: Scene::envmap_samples directions
+// drawn from the luminance of the envmap (EnvironmentMap::sample_direction), each with its shadow ray,
+// weighted by cos / (pi pdf). Zero without an envmap or samples. The samples come from sampler if set.
+Vec3f envmap_lighting(const Hit &hit, const Material &material, const Scene &scene, const PixelSampler *sampler = nullptr);
+// The diffuse lobe lit by Scene::irradiance, included in direct_lighting too; zero without a cache.
+Vec3f indirect_lighting(const Hit &hit, const Material &material, const Scene &scene);
+Vec3f background(const Scene &scene, const Vec3f &dir, float spread = 0); // seen by a cone spread radians wide
+
+// What the path of a pixel went through, for the incremental re-rendering of render_cache.h.
+// Objects and materials are folded into 64 bit masks: a collision only costs an extra re-trace.
+struct PathRecord {
+    enum {
+        LIT = 1,    // direct lighting was evaluated somewhere on the path
+        BOUNCED = 2 // a hit had reflected or refracted continuations
+    };
+    uint64_t objects;   // object_bit() of every surface hit
+    uint64_t materials; // bit m % 64 of every material shaded
+    float depth;        // distance to the primary hit, infinity for the sky
+    uint32_t flags;
+
+    PathRecord() : objects(0), materials(0), depth(std::numeric_limits<float>::infinity()), flags(0) {}
+};
+
+// kind is a HitKind, index the sphere (in Scene::spheres), primitive, instance or mesh
+inline uint64_t object_bit(const int kind, const int index) {
+    return uint64_t(1) << ((static_cast<uint32_t>(index) * 2654435761u + static_cast<uint32_t>(kind) * 40503u) >> 26);
+}
+
+// the index that goes with rec.kind in object_bit(): sphere in Scene::spheres, primitive, instance or mesh, 0 for the ground
+int hit_object(const Scene &scene, const HitRecord &rec);
+
+// What the output variables keep of the primary hit of a ray.
+struct AOVSample {
+    float depth;  // distance to the primary hit, infinity for the sky
+    Vec3f normal; // at the primary hit, 0 for the sky
+    Vec3f albedo; // diffuse color of the primary hit once textured, the background clamped to [0, 1] for the sky
+    Vec3f id;     // HitKind, hit_object() and the lane or triangle inside the instance or mesh; 0 for the sky
+};
+
+Vec3f cast_ray(const Vec3f &orig, const Vec3f &dir, const Scene &scene, size_t depth = 0);
+
+// Traces a packet of n <= max_packet coherent primary rays. With records, also fills in the path of every ray,
+// with samples, what the output variables need of its primary hit. With samplers (one per ray), the light
+// samples of the primary hits come from the sampler of their pixel, otherwise from random_float(). spread is
+// the angle of the primary ray cones, ImagePlane::spread() times the distance between the pixels traced.
+// visible, from visible_meshes() for the image plane of the rays, culls the meshes out of view. materials, if set,
+// are shaded instead of scene.materials (as many, by the same indices): those of a variant of render_batch.
+void cast_ray_packet(const int n, const Vec3f *orig, const Vec3f *dir, const Scene &scene, Vec3f *colors,
+                     PathRecord *records = nullptr, AOVSample *samples = nullptr, const PixelSampler *samplers = nullptr,
+                     float spread = 0, const uint8_t *visible = nullptr, const Material *materials = nullptr);
+
+// Renders the scene into framebuffer (resized to width x height) and returns the per-thread statistics.
+// tile_done, if set, is called on every tile as soon as its pixels are final (from the rendering thread).
+std::vector<ThreadStats> render(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer,
+                                const std::function<void(const Tile &)> &tile_done = std::function<void(const Tile &)>());
+
+enum CostMetric {
+    COST_TIME, // nanoseconds spent tracing the pixel
+    COST_TESTS // ray-box and ray-primitive tests of all the rays of the pixel, from the profiler counters (cmake -DPROFILE=ON)
+};
+
+// Arbitrary output variables of render_crop, taken from the rays that make the colors: compositing and
+// denoising get them all for the cost of one render. The enabled ones are resized to width x height, the
+// pixels outside the crop window are 0; the fields of AOVSample say what the others hold.
+struct AOVs {
+    enum {
+        DEPTH = 1,
+        NORMAL = 2,
+        ALBEDO = 4,
+        ID = 8,
+        COST = 16 // what each pixel cost, to see which ones the acceleration structures make expensive: the
+                  // pixels are then traced one ray at a time instead of in packets, same colors but slower
+    };
+    uint32_t enabled;
+    CostMetric cost_metric;
+    std::vector<float> depth, cost;
+    PixelBuffer normal, albedo, id; // in their own formats, kept by reset(); normals are signed, ids integers
+
+    void reset(size_t npixels); // the enabled ones to npixels zeros, the others emptied
+};
+
+// Crop window: renders only the pixels of crop into framebuffer, which already holds a width x height
+// image (a previous render, or black); the pixels outside crop are kept, tile_done sees the tiles of crop.
+std::vector<ThreadStats> render_crop(const Scene &scene, const int width, const int height, const Tile &crop,
+                                     std::vector<Vec3f> &framebuffer,
+                                     const std::function<void(const Tile &)> &tile_done = std::function<void(const Tile &)>(),
+                                     AOVs *aovs = nullptr);
+
+// Re-traces the pixels p for which dirty[p] is set, writing their colors to framebuffer and their
+// paths to records (both already width x height); the other pixels are left as they are.
+std::vector<ThreadStats> render_recorded(const Scene &scene, const int width, const int height, const std::vector<char> &dirty,
+                                         std::vector<Vec3f> &framebuffer, std::vector<PathRecord> &records);
+
+// Same pixels as render(), only those of region: colors gets its (x1 - x0) x (y1 - y0) pixels row by row.
+std::vector<ThreadStats> render_region(const Scene &scene, const int width, const int height, const Tile &region,
+                                       std::vector<Vec3f> &colors);
+
+// The pixels of render() seen by camera instead of scene.camera, written to pixels (width x height, row by
+// row, owned by the caller): renders of one scene from several cameras can run at once on different threads.
+// Once *cancel is set the remaining pixels are skipped and keep what they held; skipped, if set, gets their count.
+std::vector<ThreadStats> render_view(const Scene &scene, const Camera &camera, int width, int height, Vec3f *pixels,
+                                     const std::atomic<bool> *cancel = nullptr,
+                                     const std::function<void(const Tile &)> &tile_done = std::function<void(const Tile &)>(),
+                                     size_t *skipped = nullptr);
+
+// Adaptive antialiasing: render() at 1 spp, then the pixels whose luminance differs by more than
+// threshold from one of their 4 neighbours get max_samples - 1 more samples spread over the pixel.
+std::vector<ThreadStats> render_adaptive(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer,
+                                         const int max_samples = 8, const float threshold = .25f);
+
+// Progressive rendering: the first passes trace previews on a coarse lattice (1/8, 1/4, 1/2 of the
+// resolution by default, each pass only tracing the new lattice points), then the full resolution;
+// every later pass adds one jittered sample per pixel to the accumulated estimate.
+// The enabled output variables (not the cost) come from the pixel centers traced by the previews,
+// except the albedo which is averaged over all the samples.
+class ProgressiveRenderer {
+public:
+    // the estimate is accumulated in format, the AOVs keep the formats of the buffers of aovs
+    ProgressiveRenderer(const Scene &scene, const int width, const int height, const int coarsest = 8,
+                        const AOVs &aovs = AOVs(), PixelFormat format = PIXELS_FLOAT);
+
+    std::vector<ThreadStats> pass();
+    bool previewing() const; // the full resolution is not covered yet
+    int samples() const;     // samples per pixel once the previews are done, 0 before
+    int passes() const { return npasses; }
+    int lattice() const { return stride; } // of the last preview, 1 once the previews are done
+    size_t next_pass_pixels() const;       // traced by the next pass
+
+    // current estimate, preview pixels are replicated over their lattice cell
+    void resolve(std::vector<Vec3f> &framebuffer) const;
+    const AOVs &outputs() const { return aovs; } // complete once the previews are done
+
+
+private:
+    const Scene &scene;
+    const int width, height;
+    int stride, npasses; // stride of the last preview lattice
+    bool covered;        // every pixel has at least one sample
+    // The running mean of every pixel rather than its sum, so that the compact formats keep their range;
+    // they stop refining once a sample moves the mean by less than half a step (after some 2000
+    // samples in half, 500 in RGB9E5, for a noise of the size of the pixel).
+    PixelBuffer mean;
+    std::vector<uint8_t> traced; // the pixels sampled at least once, all of them once covered
+    int refinements;             // passes at full resolution, each one more sample per pixel
+    AOVs aovs;
+};
+
+// Renders variants of scene (same geometry, their own camera and materials) group at a time: the tiles of
+// all the variants of a group are scheduled together on the OpenMP team, tile t of every variant one after
+// the other so that they share the same part of the BVH in the caches, and the team only waits for the
+// slowest tile once per group. The scene is built once and shared by the variants: each one only has its
+// image plane and its copy of the materials table, which cast_ray_packet shades with instead of
+// scene.materials. done(v, framebuffer) is called on the calling thread as soon as the image of variant v is complete.
+std::vector<ThreadStats> render_batch(const Scene &scene, int width, int height, const std::vector<SceneVariant> &variants,
+                                      int group, const std::function<void(size_t, const std::vector<Vec3f> &)> &done);
+
+struct BudgetResult {
+    size_t depth;  // depth limit of the image
+    int stride;    // the image has one sample per stride x stride pixels, 1 at full resolution
+    int samples;   // per pixel at full resolution
+    double ms;
+    std::vector<ThreadStats> stats;
+};
+
+// Renders within about budget_ms milliseconds whatever the scene, for previews with a deadline. Two probes
+// at 1/256 of the resolution, with the depth limit at 1 then at scene.depth_limit, give the cost of a pixel;
+// the deepest limit for which the full resolution fits in the rest of the budget is kept (the lowest if none
+// does, between the probes the cost is interpolated), then progressive passes run at that depth as long as
+// the cost of the last one says that the next one ends before the deadline. framebuffer is the best image
+// traced: the probe if no pass could fit, else the latest pass. scene.depth_limit is restored on return.
+BudgetResult render_budget(Scene &scene, int width, int height, double budget_ms, std::vector<Vec3f> &framebuffer);
+
+#endif //__RENDER_H__
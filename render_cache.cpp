@@ -0,0 +1,220 @@
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include "render_cache.h"
+#include "mapped_file.h"
+
+namespace {
+    const char cache_magic[8] = {'S', 'N', 'O', 'W', 'R', 'C', 'H', '5'};
+
+    struct CacheHeader {
+        char magic[8];
+        int32_t width, height;
+        Camera camera;
+        uint32_t settings_bytes, nmaterials, nspheres, nprimitives, nlights;
+    };
+
+    // the arrays follow the settings string, each on a 64 byte boundary like the sections of the scene cache
+    size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+
+    template<typename T> bool write_array(FILE *f, size_t &pos, const std::vector<T> &v) {
+        const char zeros[64] = {0};
+        const size_t padding = align64(pos) - pos;
+        pos += padding + v.size() * sizeof(T);
+        return (!padding || fwrite(zeros, 1, padding, f) == padding) && (v.empty() || fwrite(v.data(), sizeof(T), v.size(), f) == v.size());
+    }
+
+    template<typename T> bool read_array(const MappedFile &file, size_t &pos, std::vector<T> &v, size_t n) {
+        pos = align64(pos);
+        if (pos + n * sizeof(T) > file.size()) return false;
+        const T *first = reinterpret_cast<const T *>(file.data() + pos);
+        v.assign(first, first + n);
+        pos += n * sizeof(T);
+        return true;
+    }
+
+    inline bool same(const Vec3f &a, const Vec3f &b) { return a.x == b.x && a.y == b.y && a.z == b.z; }
+
+    bool same_camera(const Camera &a, const Camera &b) {
+        return same(a.position, b.position) && same(a.right, b.right) && same(a.up, b.up) && same(a.forward, b.forward) && a.fov == b.fov &&
+               a.aperture == b.aperture && a.focus == b.focus;
+    }
+
+    bool same_material(const Material &a, const Material &b) {
+        return a.refractive_index == b.refractive_index && a.albedo.x == b.albedo.x && a.albedo.y == b.albedo.y &&
+               a.albedo.z == b.albedo.z && a.albedo.w == b.albedo.w && same(a.diffuse_color, b.diffuse_color) &&
+               a.specular_exponent == b.specular_exponent;
+    }
+
+    bool same_shape(const Primitive &a, const Primitive &b) {
+        return a.type == b.type && same(a.a, b.a) && same(a.b, b.b) && same(a.u, b.u) && same(a.v, b.v) && a.radius == b.radius;
+    }
+
+    bool same_shape(const Sphere &a, const Sphere &b) { return same(a.center, b.center) && a.radius == b.radius; }
+
+    bool same_light(const Light &a, const Light &b) {
+        return same(a.position, b.position) && a.intensity == b.intensity && a.shape == b.shape && a.samples == b.samples &&
+               a.radius == b.radius && same(a.u, b.u) && same(a.v, b.v);
+    }
+
+    // the old and new shapes of the spheres and primitives whose geometry changed
+    struct MovedShapes {
+        std::vector<Sphere> spheres;
+        std::vector<Primitive> primitives;
+
+        bool empty() const { return spheres.empty() && primitives.empty(); }
+
+        // some shape is hit closer than tmax
+        bool hit(const Vec3f &orig, const Vec3f &dir, const float tmax) const {
+            float t;
+            for (size_t i = 0; i < spheres.size(); i++)
+                if (spheres[i].ray_intersect(orig, dir, t) && t < tmax) return true;
+            for (size_t i = 0; i < primitives.size(); i++)
+                if (primitives[i].ray_intersect(orig, dir, t) && t < tmax) return true;
+            return false;
+        }
+    };
+}
+
+RenderCache::RenderCache() : width(0), height(0), valid(false), nretraced(0) {}
+
+bool RenderCache::supports(const Scene &scene) {
+    return scene.instances.empty() && scene.meshes.empty();
+}
+
+bool RenderCache::load(const std::string &filename, const int w, const int h, const std::string &s) {
+    width = w;
+    height = h;
+    settings = s;
+    valid = false;
+    MappedFile file;
+    CacheHeader header;
+    if (!file.open(filename) || file.size() < sizeof(header)) return false;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, cache_magic, sizeof(cache_magic)) || header.width != w || header.height != h ||
+        header.settings_bytes != s.size() || sizeof(header) + s.size() > file.size() ||
+        s.compare(0, s.size(), file.data() + sizeof(header), s.size()))
+        return false;
+    size_t pos = sizeof(header) + s.size();
+    const size_t npixels = size_t(w) * h;
+    valid = read_array(file, pos, materials, header.nmaterials) && read_array(file, pos, spheres, header.nspheres) &&
+            read_array(file, pos, primitives, header.nprimitives) && read_array(file, pos, lights, header.nlights) &&
+            read_array(file, pos, framebuffer, npixels) && read_array(file, pos, records, npixels);
+    camera = header.camera;
+    return valid;
+}
+
+bool RenderCache::save(const std::string &filename) const {
+    if (!valid) return false;
+    CacheHeader header = CacheHeader();
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.width = width;
+    header.height = height;
+    header.camera = camera;
+    header.settings_bytes = static_cast<uint32_t>(settings.size());
+    header.nmaterials = static_cast<uint32_t>(materials.size());
+    header.nspheres = static_cast<uint32_t>(spheres.size());
+    header.nprimitives = static_cast<uint32_t>(primitives.size());
+    header.nlights = static_cast<uint32_t>(lights.size());
+
+    // written next to the final name and renamed, like the scene cache
+    const std::string tmp = filename + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    size_t pos = sizeof(header) + settings.size();
+    bool ok = f && fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(settings.data(), 1, settings.size(), f) == settings.size() &&
+              write_array(f, pos, materials) && write_array(f, pos, spheres) && write_array(f, pos, primitives) &&
+              write_array(f, pos, lights) && write_array(f, pos, framebuffer) && write_array(f, pos, records);
+    if (f && fclose(f)) ok = false;
+    if (!ok || rename(tmp.c_str(), filename.c_str())) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::vector<char> RenderCache::invalidate(const Scene &scene) const {
+    const size_t npixels = size_t(width) * height;
+    if (!valid || !supports(scene) || !same_camera(camera, scene.camera) || scene.materials.size() < materials.size() ||
+        scene.spheres.size() < spheres.size() || scene.primitives.size() < primitives.size())
+        return std::vector<char>(npixels, 1);
+
+    // what changed, as the masks of PathRecord
+    uint64_t material_bits = 0, object_bits = 0;
+    for (size_t m = 0; m < materials.size(); m++)
+        if (!same_material(materials[m], scene.materials[m])) material_bits |= uint64_t(1) << (m % 64);
+    MovedShapes moved;
+    for (size_t i = 0; i < scene.spheres.size(); i++) {
+        const Sphere &s = scene.spheres[i];
+        if (i < spheres.size() && same_shape(spheres[i], s)) {
+            if (spheres[i].material != s.material) object_bits |= object_bit(HIT_SPHERE, static_cast<int>(i));
+            continue;
+        }
+        if (i < spheres.size()) moved.spheres.push_back(spheres[i]);
+        moved.spheres.push_back(s);
+        object_bits |= object_bit(HIT_SPHERE, static_cast<int>(i));
+    }
+    for (size_t i = 0; i < scene.primitives.size(); i++) {
+        const Primitive &p = scene.primitives[i];
+        if (i < primitives.size() && same_shape(primitives[i], p)) {
+            if (primitives[i].material != p.material) object_bits |= object_bit(HIT_PRIMITIVE, static_cast<int>(i));
+            continue;
+        }
+        if (i < primitives.size()) moved.primitives.push_back(primitives[i]);
+        moved.primitives.push_back(p);
+        object_bits |= object_bit(HIT_PRIMITIVE, static_cast<int>(i));
+    }
+    bool lights_changed = scene.lights.size() != lights.size();
+    for (size_t l = 0; l < lights.size() && !lights_changed; l++)
+        lights_changed = !same_light(lights[l], scene.lights[l]);
+    // with the light tree, testing every shadow ray of every pixel would cost more than the render, and the
+    // shadow rays of area lights and of the envmap samples go to random points
+    const bool test_shadows = scene.lights.size() <= Scene::many_lights && !scene.area_lights &&
+                              !(scene.envmap && scene.envmap_samples > 0);
+
+    std::vector<char> dirty(npixels, 0);
+    const ImagePlane plane(scene.camera, width, height);
+#pragma omp parallel for schedule(dynamic, 8)
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            const PathRecord &r = records[i + j * width];
+            bool d = (r.materials & material_bits) || (r.objects & object_bits) || (lights_changed && (r.flags & PathRecord::LIT));
+            if (!d && !moved.empty()) {
+                Vec3f orig, dir;
+                plane.ray(i + .5f, j + .5f, orig, dir);
+                d = (r.flags & PathRecord::BOUNCED) || moved.hit(orig, dir, r.depth);
+                if (!d && (r.flags & PathRecord::LIT)) {
+                    d = !test_shadows;
+                    const Vec3f point = orig + dir * r.depth;
+                    for (size_t l = 0; l < scene.lights.size() && !d; l++) {
+                        const Vec3f to_light = scene.lights[l].position - point;
+                        const float distance = to_light.norm();
+                        d = moved.hit(point, to_light * (1.f / distance), distance);
+                    }
+                }
+            }
+            dirty[i + j * width] = d;
+        }
+    }
+    return dirty;
+}
+
+std::vector<ThreadStats> RenderCache::render(const Scene &scene, const int w, const int h, std::vector<Vec3f> &fb) {
+    if (w != width || h != height) valid = false;
+    width = w;
+    height = h;
+    const std::vector<char> dirty = invalidate(scene);
+    nretraced = 0;
+    for (size_t p = 0; p < dirty.size(); p++) nretraced += dirty[p];
+    framebuffer.resize(size_t(w) * h);
+    records.resize(size_t(w) * h);
+    std::vector<ThreadStats> stats = render_recorded(scene, w, h, dirty, framebuffer, records);
+
+    camera = scene.camera;
+    materials = scene.materials;
+    spheres = scene.spheres;
+    primitives = scene.primitives;
+    lights = scene.lights;
+    valid = supports(scene);
+    fb = framebuffer;
+    return stats;
+}
@@ -0,0 +1,50 @@
+#ifndef __RENDER_CACHE_H__
+#define __RENDER_CACHE_H__
+#include <vector>
+#include <string>
+#include "scene.h"
+#include "render.h"
+
+// Incremental re-rendering for look-dev: a cache file keeps the last image, the scene it was rendered from
+// and the PathRecord of every pixel. The next render compares the scene with the cached one and only
+// re-traces the pixels an edit can have changed:
+//   - a material: the pixels whose path shaded it;
+//   - a light: the pixels whose path was lit;
+//   - the material of a sphere or primitive: the pixels whose path hit it;
+//   - its geometry, or a new sphere or primitive: those pixels, the primary rays and the shadow rays of the
+//     primary hits that meet its old or new shape, and every path that bounced (reflections are not tracked).
+// A new camera, image size or settings (ground, envmap, light sampling...), or fewer spheres, primitives or
+// materials, re-render everything. Scenes with instances or meshes are not cached.
+class RenderCache {
+public:
+    RenderCache();
+
+    static bool supports(const Scene &scene);
+
+    // False if filename is missing, unreadable, or was made for another image size or other settings;
+    // the next render is then a full one. settings stands for what the scene arrays do not hold.
+    bool load(const std::string &filename, const int width, const int height, const std::string &settings);
+    bool save(const std::string &filename) const;
+
+    // Brings the cached image up to date with scene and copies it to framebuffer.
+    std::vector<ThreadStats> render(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer);
+    size_t retraced() const { return nretraced; } // pixels traced by the last render
+
+private:
+    int width, height;
+    std::string settings;
+    bool valid; // the arrays below hold a complete render
+    Camera camera;
+    std::vector<Material> materials;
+    std::vector<Sphere> spheres;
+    std::vector<Primitive> primitives;
+    std::vector<Light> lights;
+    std::vector<Vec3f> framebuffer;
+    std::vector<PathRecord> records;
+    size_t nretraced;
+
+    // pixels to re-trace for scene, all of them when the cache does not apply
+    std::vector<char> invalidate(const Scene &scene) const;
+};
+
+#endif //__RENDER_CACHE_H__
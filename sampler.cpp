@@ -0,0 +1,161 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "sampler.h"
+
+namespace {
+    inline uint32_t reverse_bits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        return ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    }
+
+    // a permutation of the integers whose high bits only depend on the higher bits, on reversed bits
+    inline uint32_t laine_karras_permutation(uint32_t x, const uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    inline uint32_t nested_uniform_scramble(const uint32_t x, const uint32_t seed) {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+
+    inline uint32_t hash(uint32_t x) { // lowbias32
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    // the first two dimensions of the Sobol sequence, as 32 bit fractions
+    inline uint32_t sobol0(const uint32_t index) {
+        return reverse_bits(index);
+    }
+
+    inline uint32_t sobol1(uint32_t index) {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+            if (index & 1) result ^= v;
+        return result;
+    }
+
+    inline float to_float(const uint32_t x) {
+        return (x >> 8) * (1.f / 16777216.f);
+    }
+
+    const int mask_size = 64;
+
+    // Ulichney's void and cluster: a toroidal Gaussian energy tells the tightest cluster (the 1 with the
+    // highest energy) and the largest void (the 0 with the lowest); the ranks are the order in which the
+    // texels are removed from the initial pattern, then added to it until the mask is full.
+    std::vector<float> build_blue_noise() {
+        const int n = mask_size * mask_size;
+        const float sigma = 1.5f;
+        std::vector<float> gaussian(n); // by toroidal offset
+        for (int dy = 0; dy < mask_size; dy++) {
+            for (int dx = 0; dx < mask_size; dx++) {
+                const int ox = std::min(dx, mask_size - dx), oy = std::min(dy, mask_size - dy);
+                gaussian[dx + dy * mask_size] = std::exp(-(ox * ox + oy * oy) / (2 * sigma * sigma));
+            }
+        }
+        auto toggle = [&](std::vector<float> &energy, const int p, const float sign) {
+            const int px = p % mask_size, py = p / mask_size;
+            for (int y = 0; y < mask_size; y++) {
+                const float *g = &gaussian[((y - py + mask_size) % mask_size) * mask_size];
+                float *e = &energy[y * mask_size];
+                for (int x = 0; x < mask_size; x++) e[x] += sign * g[(x - px + mask_size) % mask_size];
+            }
+        };
+        auto extreme = [&](const std::vector<float> &energy, const std::vector<char> &pattern, const char value, const bool highest) {
+            int best = -1;
+            for (int p = 0; p < n; p++)
+                if (pattern[p] == value && (best < 0 || (highest ? energy[p] > energy[best] : energy[p] < energy[best]))) best = p;
+            return best;
+        };
+
+        // initial pattern: a tenth of the texels, then clusters moved to voids until it is stable
+        std::vector<char> pattern(n, 0);
+        std::vector<float> energy(n, 0.f);
+        uint32_t state = 1;
+        for (int k = 0; k < n / 10;) {
+            const int p = hash(state++) % n;
+            if (pattern[p]) continue;
+            pattern[p] = 1;
+            toggle(energy, p, 1);
+            k++;
+        }
+        for (;;) {
+            const int cluster = extreme(energy, pattern, 1, true);
+            pattern[cluster] = 0;
+            toggle(energy, cluster, -1);
+            const int hole = extreme(energy, pattern, 0, false);
+            pattern[cluster] = 1;
+            if (hole == cluster) {
+                toggle(energy, cluster, 1);
+                break;
+            }
+            pattern[hole] = 1;
+            pattern[cluster] = 0;
+            toggle(energy, hole, 1);
+        }
+
+        std::vector<float> rank(n);
+        const int ones = static_cast<int>(std::count(pattern.begin(), pattern.end(), 1));
+        std::vector<char> removed(pattern);
+        std::vector<float> removed_energy(energy);
+        for (int r = ones - 1; r >= 0; r--) {
+            const int cluster = extreme(removed_energy, removed, 1, true);
+            removed[cluster] = 0;
+            toggle(removed_energy, cluster, -1);
+            rank[cluster] = float(r);
+        }
+        for (int r = ones; r < n; r++) {
+            const int hole = extreme(energy, pattern, 0, false);
+            pattern[hole] = 1;
+            toggle(energy, hole, 1);
+            rank[hole] = float(r);
+        }
+        for (int p = 0; p < n; p++) rank[p] = (rank[p] + .5f) / n;
+        return rank;
+    }
+
+    // toroidal shift of the mask for a dimension, so that the dimensions of a pixel are not correlated
+    inline float rotation(const int x, const int y, const int dim) {
+        const uint32_t h = hash(0x9e3779b9u * (dim + 1));
+        return blue_noise(x + static_cast<int>(h & 63), y + static_cast<int>((h >> 6) & 63));
+    }
+
+    inline float wrap(const float u) {
+        return u >= 1.f ? u - 1.f : u;
+    }
+}
+
+float blue_noise(const int x, const int y) {
+    static const std::vector<float> mask = build_blue_noise();
+    return mask[(x & (mask_size - 1)) + (y & (mask_size - 1)) * mask_size];
+}
+
+float PixelSampler::get1d(const int dim) const {
+    const uint32_t seed = hash(dim);
+    const uint32_t i = nested_uniform_scramble(index, seed);
+    return wrap(to_float(nested_uniform_scramble(sobol0(i), hash(seed))) + rotation(x, y, dim));
+}
+
+void PixelSampler::get2d(const int dim, float &u, float &v) const {
+    const uint32_t seed = hash(dim);
+    const uint32_t i = nested_uniform_scramble(index, seed);
+    u = wrap(to_float(nested_uniform_scramble(sobol0(i), hash(seed ^ 0x5bd1e995u))) + rotation(x, y, dim));
+    v = wrap(to_float(nested_uniform_scramble(sobol1(i), hash(seed ^ 0x1b873593u))) + rotation(x, y, dim + 1));
+}
+
+uint32_t PixelSampler::seed(const uint32_t stream) const {
+    return hash(hash(hash(hash(stream) ^ index) ^ static_cast<uint32_t>(y)) ^ static_cast<uint32_t>(x));
+}
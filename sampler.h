@@ -0,0 +1,37 @@
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+#include <cstdint>
+
+// Dimensions of the samples of a pixel. 2D dimensions take two consecutive indices.
+enum SampleDimension {
+    DIM_PIXEL = 0, // 2D, position in the pixel
+    DIM_LENS = 2,  // 2D, position on the lens
+    DIM_TIME = 4,
+    DIM_LIGHT = 5  // one per light sample of the primary hit, then two per envmap sample
+};
+
+// Owen-scrambled Sobol points (Burley, "Practical Hash-based Owen Scrambling", 2020): every pair of
+// dimensions is the 2D Sobol sequence with its own index shuffle and scramble, so that the dimensions
+// stay decorrelated, and every prefix of 2^k samples of a pixel is stratified. The pixels share the
+// sequence, each offset (Cranley-Patterson rotation) by a 64x64 blue-noise mask shifted per dimension:
+// at low sample counts the error is spread as blue noise over the image instead of white noise.
+class PixelSampler {
+public:
+    PixelSampler() : x(0), y(0), index(0) {}
+    PixelSampler(int x, int y, uint32_t index) : x(x), y(y), index(index) {}
+
+    float get1d(int dim) const;                 // in [0, 1)
+    void get2d(int dim, float &u, float &v) const;
+    // seed of the random stream of the sample (see seed_random in render.h), one per stream: depends on the
+    // pixel and the sample index only, not on the thread nor the packet that traces it
+    uint32_t seed(uint32_t stream) const;
+
+private:
+    int x, y;
+    uint32_t index; // of the sample in the pixel
+};
+
+// Rank of the texel (x, y) of the blue-noise mask (void and cluster, built on first use), in [0, 1).
+float blue_noise(int x, int y);
+
+#endif //__SAMPLER_H__
@@ -0,0 +1,670 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <map>
+#include "scene.h"
+
+void build_sphere_bvh(const std::vector<Sphere> &spheres, BVH &bvh, SphereSoA &soa, const BVHBuilder builder) {
+    std::vector<AABB> bounds(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++)
+        bounds[i] = spheres[i].bbox();
+    bvh.build(bounds, 8, builder);
+    soa.clear();
+    for (size_t i = 0; i < bvh.indices.size(); i++) {
+        const Sphere &s = spheres[bvh.indices[i]];
+        soa.push_back(s.center, s.radius, s.material, bvh.indices[i]);
+    }
+    soa.finalize();
+}
+
+void build_sphere_grid(const std::vector<Sphere> &spheres, SphereGrid &grid, SphereSoA &soa) {
+    std::vector<Vec3f> centers(spheres.size());
+    std::vector<float> radii(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) {
+        centers[i] = spheres[i].center;
+        radii[i] = spheres[i].radius;
+    }
+    grid.build(centers, radii);
+    soa.clear();
+    for (size_t i = 0; i < grid.indices.size(); i++) {
+        const Sphere &s = spheres[grid.indices[i]];
+        soa.push_back(s.center, s.radius, s.material, grid.indices[i]);
+    }
+    soa.finalize();
+}
+
+namespace {
+    void build_accel(const std::vector<Sphere> &spheres, const SphereAccel accel, const BVHBuilder builder, BVH &bvh,
+                     SphereGrid &grid, QBVH &qbvh, SphereSoA &soa) {
+        grid = SphereGrid();
+        qbvh = QBVH();
+        if (accel == ACCEL_GRID) {
+            bvh = BVH();
+            build_sphere_grid(spheres, grid, soa);
+            return;
+        }
+        build_sphere_bvh(spheres, bvh, soa, builder);
+        if (accel == ACCEL_QBVH) { // the leaves are lane ranges of soa, the binary BVH is no longer needed
+            qbvh.build(bvh);
+            bvh = BVH();
+        }
+    }
+
+    // the leaves of the BVH or the cells of the grid that the ray meets, with the contract of BVH::intersect_leaves
+    template<typename F> bool intersect_spheres(const SphereAccel accel, const BVH &bvh, const SphereGrid &grid, const QBVH &qbvh,
+                                                const Vec3f &orig, const Vec3f &dir, float &tmax, F intersect_leaf) {
+        switch (accel) {
+        case ACCEL_GRID: return grid.intersect_cells(orig, dir, tmax, intersect_leaf);
+        case ACCEL_QBVH: return qbvh.intersect_leaves(orig, dir, tmax, intersect_leaf);
+        default: return bvh.intersect_leaves(orig, dir, tmax, intersect_leaf);
+        }
+    }
+
+    template<typename F> bool occluded_spheres(const SphereAccel accel, const BVH &bvh, const SphereGrid &grid, const QBVH &qbvh,
+                                               const Vec3f &orig, const Vec3f &dir, const float tmax, F occluded_leaf) {
+        switch (accel) {
+        case ACCEL_GRID: return grid.occluded_cells(orig, dir, tmax, occluded_leaf);
+        case ACCEL_QBVH: return qbvh.occluded_leaves(orig, dir, tmax, occluded_leaf);
+        default: return bvh.occluded_leaves(orig, dir, tmax, occluded_leaf);
+        }
+    }
+}
+
+void SphereGroup::build(const BVHBuilder builder) {
+    build_accel(spheres, accel, builder, bvh, grid, qbvh, soa);
+    bounds = AABB();
+    for (size_t i = 0; i < spheres.size(); i++) bounds.expand(spheres[i].bbox());
+}
+
+void Scene::build() {
+    PROFILE_SCOPE("scene build");
+    build_spheres();
+    std::vector<AABB> bounds(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++)
+        bounds[i] = primitives[i].bbox();
+    primitive_bvh.build(bounds, 4, bvh_builder);
+    for (size_t i = 0; i < objects.size(); i++) objects[i].build(bvh_builder);
+    build_instances();
+    build_lights();
+}
+
+Light Light::sphere(const Vec3f &center, const float radius, const float intensity, const int samples) {
+    Light light(center, intensity);
+    light.shape = SPHERE;
+    light.radius = radius;
+    light.samples = std::max(1, samples);
+    return light;
+}
+
+Light Light::rect(const Vec3f &center, const Vec3f &u, const Vec3f &v, const float intensity, const int samples) {
+    Light light(center, intensity);
+    light.shape = RECT;
+    light.u = u;
+    light.v = v;
+    light.samples = std::max(1, samples);
+    return light;
+}
+
+void Light::strata(int &nx, int &ny) const {
+    nx = std::max(1, static_cast<int>(std::sqrt(float(samples))));
+    while (samples % nx) nx--; // the largest divisor under the square root, every stratum the same area
+    ny = samples / nx;
+}
+
+Vec3f Light::sample(const Vec3f &point, const int s, const float a, const float b, const bool fast) const {
+    if (shape == POINT) return position;
+    int nx, ny;
+    strata(nx, ny);
+    const float x = 2 * ((s % nx) + a) / nx - 1, y = 2 * ((s / nx) + b) / ny - 1; // in [-1, 1]^2
+    if (shape == RECT) return position + u * x + v * y;
+
+    // Shirley's concentric map of the square onto the disk facing the point
+    float r = x, phi = 0;
+    if (x == 0 && y == 0) r = 0;
+    else if (std::fabs(x) > std::fabs(y)) phi = float(M_PI / 4) * (y / x);
+    else {
+        r = y;
+        phi = float(M_PI / 2) - float(M_PI / 4) * (x / y);
+    }
+    const Vec3f w = (position - point).normalize();
+    const Vec3f t = (std::fabs(w.x) > .9f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0));
+    const Vec3f e1 = cross(w, t).normalize(), e2 = cross(w, e1);
+    float sine, cosine;
+    if (fast) fast_sincos(phi, sine, cosine);
+    else {
+        sine = std::sin(phi);
+        cosine = std::cos(phi);
+    }
+    return position + (e1 * cosine + e2 * sine) * (r * radius);
+}
+
+void Scene::build_lights() {
+    area_lights = std::find_if(lights.begin(), lights.end(), [](const Light &l) { return l.area(); }) != lights.end();
+    light_soa.build(lights);
+    if (lights.size() > many_lights) light_tree.build(lights);
+    else light_tree.clear();
+}
+
+namespace {
+    // the world box of the 8 transformed corners of b
+    void expand_transformed(AABB &box, const AABB &b, const Transform &xf) {
+        for (int k = 0; k < 8; k++)
+            box.expand(xf.to_world_point(Vec3f(k & 1 ? b.max.x : b.min.x, k & 2 ? b.max.y : b.min.y, k & 4 ? b.max.z : b.min.z)));
+    }
+
+    // World bounds of the object box b of inst over the times [t0, t1]: the boxes at 9 steps, grown by half the
+    // longest move of a corner from a step to the next, by which a corner strays at most off the chord.
+    AABB instance_bounds(const Instance &inst, const AABB &b, const float t0, const float t1) {
+        AABB box;
+        if (!inst.moving) {
+            expand_transformed(box, b, inst.xf);
+            return box;
+        }
+        const int steps = 8;
+        float stray = 0;
+        Vec3f previous[8];
+        for (int s = 0; s <= steps; s++) {
+            const Transform xf = Transform::lerp(inst.xf, inst.xf_end, t0 + (t1 - t0) * s / steps);
+            expand_transformed(box, b, xf);
+            for (int k = 0; k < 8; k++) {
+                const Vec3f corner = xf.to_world_point(Vec3f(k & 1 ? b.max.x : b.min.x, k & 2 ? b.max.y : b.min.y, k & 4 ? b.max.z : b.min.z));
+                if (s) stray = std::max(stray, (corner - previous[k]).norm() * .5f);
+                previous[k] = corner;
+            }
+        }
+        box.min = box.min - Vec3f(stray, stray, stray);
+        box.max = box.max + Vec3f(stray, stray, stray);
+        return box;
+    }
+}
+
+void Scene::build_instances() {
+    std::vector<AABB> bounds(instances.size());
+    bool motion = false;
+    for (size_t i = 0; i < instances.size(); i++) {
+        const int o = instances[i].object;
+        AABB b = objects[o].bounds;
+        if (size_t(o) < object_proxies.size()) b.expand(object_proxies[o].bounds); // may be traced instead
+        bounds[i] = instance_bounds(instances[i], b, 0, 1);
+        motion = motion || instances[i].moving;
+    }
+    instance_bvh.build(bounds, 2, bvh_builder);
+    instance_slices.clear();
+    if (!motion) return;
+    // a ray only tests the instances that its time slice can meet, a fast object does not blur a whole tree
+    instance_slices.resize(motion_slices);
+    for (int s = 0; s < motion_slices; s++) {
+        for (size_t i = 0; i < instances.size(); i++) {
+            const int o = instances[i].object;
+            AABB b = objects[o].bounds;
+            if (size_t(o) < object_proxies.size()) b.expand(object_proxies[o].bounds);
+            bounds[i] = instance_bounds(instances[i], b, float(s) / motion_slices, float(s + 1) / motion_slices);
+        }
+        instance_slices[s].build(bounds, 2, bvh_builder);
+    }
+}
+
+std::vector<Sphere> simplified_spheres(const std::vector<Sphere> &spheres) {
+    AABB box;
+    for (size_t i = 0; i < spheres.size(); i++) box.expand(spheres[i].bbox());
+    const Vec3f extent = box.max - box.min;
+    const float size = std::max(extent.x, std::max(extent.y, extent.z));
+    const float cell = size / 6;
+    struct Cluster {
+        Vec3f moment; // sum of the centers weighted by the volumes
+        float volume, largest;
+        uint16_t material;
+    };
+    std::vector<Sphere> kept;
+    std::map<std::pair<int, uint16_t>, Cluster> clusters; // by cell and material
+    for (size_t i = 0; i < spheres.size(); i++) {
+        const Sphere &s = spheres[i];
+        if (s.radius >= size / 20) {
+            kept.push_back(s);
+            continue;
+        }
+        int key = 0;
+        for (size_t k = 0; k < 3; k++) key = key * 8 + std::min(6, static_cast<int>((s.center[k] - box.min[k]) / cell));
+        const float volume = s.radius * s.radius * s.radius;
+        Cluster &c = clusters.insert(std::make_pair(std::make_pair(key, s.material), Cluster{Vec3f(0, 0, 0), 0, 0, s.material})).first->second;
+        c.moment = c.moment + s.center * volume;
+        c.volume += volume;
+        c.largest = std::max(c.largest, s.radius);
+    }
+    if (kept.size() + clusters.size() >= spheres.size()) return std::vector<Sphere>();
+    for (std::map<std::pair<int, uint16_t>, Cluster>::const_iterator it = clusters.begin(); it != clusters.end(); ++it)
+        kept.push_back(Sphere(it->second.moment * (1.f / it->second.volume), std::cbrt(it->second.volume), it->second.material));
+    return kept;
+}
+
+void Scene::build_lod(const float angle) {
+    PROFILE_SCOPE("lod build");
+    lod_angle = angle;
+    object_proxies.clear();
+    mesh_proxies.clear();
+    if (angle > 0) {
+        object_proxies.resize(objects.size());
+        for (size_t o = 0; o < objects.size(); o++) {
+            object_proxies[o].spheres = simplified_spheres(objects[o].spheres);
+            if (object_proxies[o].spheres.empty()) continue;
+            object_proxies[o].accel = objects[o].accel;
+            object_proxies[o].build(bvh_builder);
+        }
+        for (size_t m = 0; m < meshes.size(); m++) {
+            // no proxy for the textured meshes, the proxies have no texture coordinates
+            mesh_proxies.push_back(meshes[m].has_texcoords() ? Model(std::vector<Vec3f>(), std::vector<Vec3i>())
+                                                             : meshes[m].simplified(64));
+            if (mesh_proxies[m].nfaces() >= meshes[m].nfaces()) mesh_proxies[m] = Model(std::vector<Vec3f>(), std::vector<Vec3i>());
+        }
+    }
+    build_instances();
+}
+
+const SphereGroup &Scene::object_of(const Instance &inst) const {
+    const SphereGroup &g = objects[inst.object];
+    if (lod_angle <= 0 || size_t(inst.object) >= object_proxies.size() || object_proxies[inst.object].spheres.empty()) return g;
+    const Vec3f center = inst.xf.to_world_point((g.bounds.min + g.bounds.max) * .5f);
+    const Vec3f radius = (g.bounds.max - g.bounds.min) * (.5f * inst.xf.scale), to_camera = center - camera.position;
+    return radius * radius < lod_angle * lod_angle * (to_camera * to_camera) ? object_proxies[inst.object] : g;
+}
+
+const Model &Scene::mesh_of(const size_t m) const {
+    if (lod_angle <= 0 || m >= mesh_proxies.size() || mesh_proxies[m].nfaces() == 0) return meshes[m];
+    const AABB &b = meshes[m].bounds();
+    const Vec3f radius = (b.max - b.min) * .5f, to_camera = (b.min + b.max) * .5f - camera.position;
+    return radius * radius < lod_angle * lod_angle * (to_camera * to_camera) ? mesh_proxies[m] : meshes[m];
+}
+
+void Scene::build_spheres() {
+    build_accel(spheres, sphere_accel, bvh_builder, sphere_bvh, sphere_grid, sphere_qbvh, sphere_soa);
+}
+
+void Scene::refit() {
+    if (sphere_accel != ACCEL_BVH || bvh_builder == BVH_LBVH) { // no binary nodes to refit, or as fast to build
+        build_spheres();
+        return;
+    }
+    std::vector<AABB> bounds(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++)
+        bounds[i] = spheres[i].bbox();
+    sphere_bvh.refit(bounds);
+    for (size_t i = 0; i < sphere_soa.size(); i++) {
+        const Sphere &s = spheres[sphere_soa.id[i]];
+        sphere_soa.update(i, s.center, s.radius);
+    }
+}
+
+bool checkerboard_distance(const Vec3f &orig, const Vec3f &dir, const float tmax, float &d) {
+    // the rays going up from above the board, or down from below, and those along it stop before the division
+    const float height = orig.y + 4; // the checkerboard plane has equation y = -4
+    if (height * dir.y >= 0 || fabs(dir.y) <= 1e-3) return false;
+    d = -height / dir.y;
+    if (d >= tmax) return false; // behind a closer hit, or the shadow ray ends first
+    const float x = orig.x + dir.x * d, z = orig.z + dir.z * d;
+    return fabs(x) < 10 && z < -10 && z > -30;
+}
+
+namespace {
+    // Closest instanced sphere closer than rec.t: the ray goes to object space, where distances are
+    // divided by the scale of the instance.
+    void intersect_instances(const Vec3f &orig, const Vec3f &dir, const Scene &scene, HitRecord &rec, const float time) {
+        if (scene.instances.empty()) return;
+        const SphereKernel kernel = sphere_kernel();
+        scene.instances_at(time).intersect(orig, dir, rec.t, [&](int i, float &tmax) {
+            const Instance &inst = scene.instances[i];
+            const SphereGroup &g = scene.object_of(inst);
+            Transform moved;
+            const Transform &xf = inst.at(time, moved);
+            const Vec3f o = xf.to_object_point(orig), d = xf.to_object_dir(dir);
+            float t = tmax / xf.scale;
+            int closest = -1;
+            intersect_spheres(g.accel, g.bvh, g.grid, g.qbvh, o, d, t, [&](int offset, int count, float &t_max) {
+                PROFILE_COUNT(sphere_tests, count);
+                int lane = kernel(g.soa, offset, count, o, d, t_max);
+                if (lane < 0) return false;
+                closest = offset + lane;
+                return true;
+            });
+            if (closest < 0) return false;
+            tmax = t * xf.scale;
+            rec.prim = closest;
+            rec.object = i;
+            rec.kind = HIT_INSTANCE;
+            return true;
+        });
+    }
+
+    bool occluded_primitives(const Vec3f &orig, const Vec3f &dir, const float tmax, const Scene &scene) {
+        return scene.primitive_bvh.occluded_leaves(orig, dir, tmax, [&](int offset, int count, float t_max) {
+            for (int k = 0; k < count; k++) {
+                float t;
+                PROFILE_COUNT(primitive_tests, 1);
+                if (scene.primitives[scene.primitive_bvh.indices[offset + k]].ray_intersect(orig, dir, t) && t < t_max) return true;
+            }
+            return false;
+        });
+    }
+
+    bool occluded_instances(const Vec3f &orig, const Vec3f &dir, const float tmax, const Scene &scene, const float time) {
+        if (scene.instances.empty()) return false;
+        const SphereKernel kernel = sphere_kernel();
+        const BVH &bvh = scene.instances_at(time);
+        return bvh.occluded_leaves(orig, dir, tmax, [&](int offset, int count, float t_max) {
+            for (int k = 0; k < count; k++) {
+                const Instance &inst = scene.instances[bvh.indices[offset + k]];
+                const SphereGroup &g = scene.object_of(inst);
+                Transform moved;
+                const Transform &xf = inst.at(time, moved);
+                const Vec3f o = xf.to_object_point(orig), d = xf.to_object_dir(dir);
+                if (occluded_spheres(g.accel, g.bvh, g.grid, g.qbvh, o, d, t_max / xf.scale, [&](int first, int n, float t) {
+                    PROFILE_COUNT(sphere_tests, n);
+                    return kernel(g.soa, first, n, o, d, t) >= 0;
+                })) return true;
+            }
+            return false;
+        });
+    }
+}
+
+bool scene_closest_hit(const Vec3f &orig, const Vec3f &dir, const Scene &scene, HitRecord &rec, const float time) {
+    rec = HitRecord();
+    const SphereKernel kernel = sphere_kernel();
+    intersect_spheres(scene.sphere_accel, scene.sphere_bvh, scene.sphere_grid, scene.sphere_qbvh, orig, dir, rec.t, [&](int offset, int count, float &tmax) {
+        PROFILE_COUNT(sphere_tests, count);
+        int lane = kernel(scene.sphere_soa, offset, count, orig, dir, tmax);
+        if (lane < 0) return false;
+        rec.prim = offset + lane;
+        rec.kind = HIT_SPHERE;
+        return true;
+    });
+    scene.primitive_bvh.intersect(orig, dir, rec.t, [&](int i, float &tmax) {
+        float t;
+        PROFILE_COUNT(primitive_tests, 1);
+        if (!scene.primitives[i].ray_intersect(orig, dir, t) || t >= tmax) return false;
+        tmax = t;
+        rec.prim = i;
+        rec.kind = HIT_PRIMITIVE;
+        return true;
+    });
+    intersect_instances(orig, dir, scene, rec, time);
+    const Vec3f inv_dir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+    for (size_t m = 0; m < scene.meshes.size(); m++) {
+        if (!scene.meshes[m].bounds().ray_intersect(orig, inv_dir, rec.t)) continue;
+        if (scene.mesh_of(m).ray_intersect(orig, dir, rec.t, rec.prim)) {
+            rec.object = static_cast<int>(m);
+            rec.kind = HIT_MESH;
+        }
+    }
+    float d;
+    if (checkerboard_distance(orig, dir, rec.t, d)) {
+        rec.t = d;
+        rec.kind = HIT_GROUND;
+    }
+    return rec.t < 1000;
+}
+
+void surface_interaction(const Vec3f &orig, const Vec3f &dir, const Scene &scene, const HitRecord &rec, Hit &hit,
+                         const float cone_width, const float time) {
+    hit.point = orig + dir * rec.t;
+    hit.time = time;
+    hit.shadows = true;
+    hit.uv = Vec2f();
+    hit.image = -1;
+    hit.footprint = 0;
+    hit.curvature = 0;
+    switch (rec.kind) {
+    case HIT_SPHERE: {
+        const SphereSoA &soa = scene.sphere_soa;
+        const Vec3f center(soa.cx[rec.prim], soa.cy[rec.prim], soa.cz[rec.prim]);
+        hit.N = (hit.point - center).normalize();
+        // projected back on the sphere: the rounding error of t is gone, see leave_surface
+        hit.point = center + hit.N * (1.f / soa.inv_r[rec.prim]);
+        hit.material = soa.mat[rec.prim];
+        hit.curvature = soa.inv_r[rec.prim];
+        break;
+    }
+    case HIT_PRIMITIVE: {
+        const Primitive &p = scene.primitives[rec.prim];
+        // intersected again from just before the hit, where t is 64 times smaller and so is its rounding error
+        const Vec3f start = orig + dir * (rec.t * (63.f / 64));
+        float t;
+        if (p.ray_intersect(start, dir, t)) hit.point = start + dir * t;
+        hit.N = p.normal(hit.point);
+        hit.material = p.material;
+        break;
+    }
+    case HIT_INSTANCE: { // the normal is computed in object space, where the sphere is
+        const Instance &inst = scene.instances[rec.object];
+        const SphereSoA &soa = scene.object_of(inst).soa;
+        Transform moved;
+        const Transform &xf = inst.at(time, moved);
+        const Vec3f o = xf.to_object_point(orig), d = xf.to_object_dir(dir);
+        const Vec3f p = o + d * (rec.t / xf.scale);
+        const Vec3f center(soa.cx[rec.prim], soa.cy[rec.prim], soa.cz[rec.prim]);
+        const Vec3f n = (p - center).normalize();
+        hit.N = xf.to_world_dir(n);
+        hit.point = xf.to_world_point(center + n * (1.f / soa.inv_r[rec.prim]));
+        hit.material = soa.mat[rec.prim];
+        hit.curvature = soa.inv_r[rec.prim] / xf.scale;
+        break;
+    }
+    case HIT_MESH: {
+        const Model &mesh = scene.mesh_of(rec.object);
+        hit.N = mesh.normal(rec.prim);
+        hit.uv = mesh.barycentric(rec.prim, hit.point);
+        // from the vertices, without the rounding error of t
+        const Vec3f &v0 = mesh.point(mesh.vert(rec.prim, 0));
+        hit.point = v0 + (mesh.point(mesh.vert(rec.prim, 1)) - v0) * hit.uv.x + (mesh.point(mesh.vert(rec.prim, 2)) - v0) * hit.uv.y;
+        hit.material = scene.mesh_materials[rec.object];
+        if (size_t(rec.object) < scene.mesh_images.size() && scene.mesh_images[rec.object] >= 0 && mesh.has_texcoords()) {
+            hit.image = scene.mesh_images[rec.object];
+            hit.uv = mesh.texcoord(rec.prim, hit.uv);
+            // the footprint is stretched along the surface at grazing angles
+            const float cosine = std::max(.1f, std::fabs(hit.N * dir));
+            hit.footprint = cone_width * mesh.texel_scale(rec.prim) / cosine;
+        }
+        break;
+    }
+    default: // the checkerboard
+        hit.N = Vec3f(0, 1, 0);
+        hit.material = Scene::ground;
+        break;
+    }
+    resolve_material(scene, hit);
+}
+
+bool scene_intersect(const Vec3f &orig, const Vec3f &dir, const Scene &scene, Hit &hit) {
+    HitRecord rec;
+    if (!scene_closest_hit(orig, dir, scene, rec)) return false;
+    surface_interaction(orig, dir, scene, rec, hit);
+    return true;
+}
+
+namespace {
+    bool any_occluder(const Vec3f &orig, const Vec3f &dir, const float tmax, const Scene &scene, const float time) {
+        float d;
+        if (checkerboard_distance(orig, dir, tmax, d)) return true;
+        const SphereKernel kernel = sphere_kernel();
+        if (occluded_spheres(scene.sphere_accel, scene.sphere_bvh, scene.sphere_grid, scene.sphere_qbvh, orig, dir, tmax, [&](int offset, int count, float t_max) {
+            PROFILE_COUNT(sphere_tests, count);
+            return kernel(scene.sphere_soa, offset, count, orig, dir, t_max) >= 0;
+        })) return true;
+        if (occluded_primitives(orig, dir, tmax, scene)) return true;
+        if (occluded_instances(orig, dir, tmax, scene, time)) return true;
+        const Vec3f inv_dir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        for (size_t m = 0; m < scene.meshes.size(); m++)
+            if (scene.meshes[m].bounds().ray_intersect(orig, inv_dir, tmax) && scene.mesh_of(m).occluded(orig, dir, tmax)) return true;
+        return false;
+    }
+}
+
+bool scene_occluded(const Vec3f &orig, const Vec3f &dir, const float tmax, const Scene &scene, const float time) {
+    const bool occluded = any_occluder(orig, dir, tmax, scene, time);
+    PROFILE_COUNT(shadow_rays, 1);
+    PROFILE_COUNT(shadow_occluded, occluded);
+    return occluded;
+}
+
+std::vector<uint8_t> visible_meshes(const Scene &scene, const ImagePlane &plane) {
+    std::vector<uint8_t> visible(scene.meshes.size());
+    for (size_t m = 0; m < scene.meshes.size(); m++)
+        visible[m] = plane.sees(scene.meshes[m].bounds().min, scene.meshes[m].bounds().max);
+    return visible;
+}
+
+namespace {
+    // the lanes whose ray meets the box before their tmax, the early reject of a whole mesh
+    uint64_t box_lanes(const AABB &box, const int n, const Vec3f *orig, const Vec3f *dir, const float *tmax) {
+        uint64_t lanes = 0;
+        for (int l = 0; l < n; l++)
+            if (box.ray_intersect(orig[l], Vec3f(1.f / dir[l].x, 1.f / dir[l].y, 1.f / dir[l].z), tmax[l])) lanes |= uint64_t(1) << l;
+        return lanes;
+    }
+}
+
+void scene_closest_hit_packet(const int n, const Vec3f *orig, const Vec3f *dir, const Scene &scene, bool *hits, HitRecord *rec,
+                              const uint8_t *visible, const float *times) {
+    float dist[max_packet];
+    for (int l = 0; l < n; l++) {
+        rec[l] = HitRecord();
+        dist[l] = rec[l].t;
+    }
+    const SphereKernel kernel = sphere_kernel();
+    if (scene.sphere_accel != ACCEL_BVH) { // the rays walk their own cells or nodes
+        for (int l = 0; l < n; l++) {
+            intersect_spheres(scene.sphere_accel, scene.sphere_bvh, scene.sphere_grid, scene.sphere_qbvh, orig[l], dir[l], dist[l],
+                              [&](int offset, int count, float &tmax) {
+                PROFILE_COUNT(sphere_tests, count);
+                int lane = kernel(scene.sphere_soa, offset, count, orig[l], dir[l], tmax);
+                if (lane < 0) return false;
+                rec[l].prim = offset + lane;
+                rec[l].kind = HIT_SPHERE;
+                return true;
+            });
+        }
+    }
+    scene.sphere_bvh.intersect_packet(n, orig, dir, dist, [&](int offset, int count, uint64_t lanes) {
+        for (; lanes; lanes &= lanes - 1) {
+            int l = lowest_lane(lanes);
+            PROFILE_COUNT(sphere_tests, count);
+            int lane = kernel(scene.sphere_soa, offset, count, orig[l], dir[l], dist[l]);
+            if (lane < 0) continue;
+            rec[l].prim = offset + lane;
+            rec[l].kind = HIT_SPHERE;
+        }
+    });
+    scene.primitive_bvh.intersect_packet(n, orig, dir, dist, [&](int offset, int count, uint64_t lanes) {
+        for (; lanes; lanes &= lanes - 1) {
+            int l = lowest_lane(lanes);
+            for (int k = 0; k < count; k++) {
+                const int i = scene.primitive_bvh.indices[offset + k];
+                float t;
+                PROFILE_COUNT(primitive_tests, 1);
+                if (scene.primitives[i].ray_intersect(orig[l], dir[l], t) && t < dist[l]) {
+                    dist[l] = t;
+                    rec[l].prim = i;
+                    rec[l].kind = HIT_PRIMITIVE;
+                }
+            }
+        }
+    });
+    for (int l = 0; l < n; l++) rec[l].t = dist[l];
+    if (!scene.instances.empty()) // instances are traversed ray by ray
+        for (int l = 0; l < n; l++) intersect_instances(orig[l], dir[l], scene, rec[l], times ? times[l] : 0);
+    for (int l = 0; l < n; l++) dist[l] = rec[l].t;
+
+    for (size_t m = 0; m < scene.meshes.size(); m++) {
+        if ((visible && !visible[m]) || !box_lanes(scene.meshes[m].bounds(), n, orig, dir, dist)) continue;
+        int fi[max_packet];
+        uint64_t lanes = scene.mesh_of(m).ray_intersect_packet(n, orig, dir, dist, fi);
+        for (; lanes; lanes &= lanes - 1) {
+            int l = lowest_lane(lanes);
+            rec[l].prim = fi[l];
+            rec[l].object = static_cast<int>(m);
+            rec[l].kind = HIT_MESH;
+        }
+    }
+
+    for (int l = 0; l < n; l++) {
+        float d;
+        rec[l].t = dist[l];
+        if (checkerboard_distance(orig[l], dir[l], rec[l].t, d)) {
+            rec[l].t = d;
+            rec[l].kind = HIT_GROUND;
+        }
+        hits[l] = rec[l].t < 1000;
+    }
+}
+
+void scene_intersect_packet(const int n, const Vec3f *orig, const Vec3f *dir, const Scene &scene, bool *hits, Hit *hit) {
+    HitRecord rec[max_packet];
+    scene_closest_hit_packet(n, orig, dir, scene, hits, rec);
+    for (int l = 0; l < n; l++)
+        if (hits[l]) surface_interaction(orig[l], dir[l], scene, rec[l], hit[l]);
+}
+
+// Blocked lanes get a negative tmax so that they drop out of the rest of the traversal.
+void scene_occluded_packet(const int n, const Vec3f *orig, const Vec3f *dir, float *tmax, const Scene &scene, bool *occluded,
+                           const float *times) {
+    for (int l = 0; l < n; l++) occluded[l] = false;
+    const SphereKernel kernel = sphere_kernel();
+    if (scene.sphere_accel != ACCEL_BVH) {
+        for (int l = 0; l < n; l++) {
+            if (occluded_spheres(scene.sphere_accel, scene.sphere_bvh, scene.sphere_grid, scene.sphere_qbvh, orig[l], dir[l], tmax[l],
+                                 [&](int offset, int count, float t_max) {
+                PROFILE_COUNT(sphere_tests, count);
+                return kernel(scene.sphere_soa, offset, count, orig[l], dir[l], t_max) >= 0;
+            })) {
+                occluded[l] = true;
+                tmax[l] = -1;
+            }
+        }
+    }
+    scene.sphere_bvh.intersect_packet(n, orig, dir, tmax, [&](int offset, int count, uint64_t lanes) {
+        for (; lanes; lanes &= lanes - 1) {
+            int l = lowest_lane(lanes);
+            PROFILE_COUNT(sphere_tests, count);
+            if (kernel(scene.sphere_soa, offset, count, orig[l], dir[l], tmax[l]) >= 0) {
+                occluded[l] = true;
+                tmax[l] = -1;
+            }
+        }
+    });
+    scene.primitive_bvh.intersect_packet(n, orig, dir, tmax, [&](int offset, int count, uint64_t lanes) {
+        for (; lanes; lanes &= lanes - 1) {
+            int l = lowest_lane(lanes);
+            for (int k = 0; k < count; k++) {
+                float t;
+                PROFILE_COUNT(primitive_tests, 1);
+                if (scene.primitives[scene.primitive_bvh.indices[offset + k]].ray_intersect(orig[l], dir[l], t) && t < tmax[l]) {
+                    occluded[l] = true;
+                    tmax[l] = -1;
+                    break;
+                }
+            }
+        }
+    });
+    for (int l = 0; l < n && !scene.instances.empty(); l++) {
+        if (!occluded[l] && occluded_instances(orig[l], dir[l], tmax[l], scene, times ? times[l] : 0)) {
+            occluded[l] = true;
+            tmax[l] = -1;
+        }
+    }
+    for (size_t m = 0; m < scene.meshes.size(); m++) {
+        if (!box_lanes(scene.meshes[m].bounds(), n, orig, dir, tmax)) continue;
+        int fi[max_packet];
+        uint64_t lanes = scene.mesh_of(m).ray_intersect_packet(n, orig, dir, tmax, fi);
+        for (; lanes; lanes &= lanes - 1) {
+            int l = lowest_lane(lanes);
+            occluded[l] = true;
+            tmax[l] = -1;
+        }
+    }
+    for (int l = 0; l < n; l++) {
+        float d;
+        if (!occluded[l] && checkerboard_distance(orig[l], dir[l], tmax[l], d)) occluded[l] = true;
+        PROFILE_COUNT(shadow_occluded, occluded[l]);
+    }
+    PROFILE_COUNT(shadow_rays, n);
+}
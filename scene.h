@@ -0,0 +1,338 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+#include <cassert>
+#include <vector>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <limits>
+#include "geometry.h"
+#include "model.h"
+#include "bvh.h"
+#include "grid.h"
+#include "qbvh.h"
+#include "sphere_soa.h"
+#include "envmap.h"
+#include "image_texture.h"
+#include "camera.h"
+#include "transform.h"
+#include "texture.h"
+#include "primitive.h"
+#include "light_tree.h"
+#include "light_soa.h"
+
+// Point light, or area light seen through `samples` shadow rays towards stratified points of its surface.
+// Lights do not fall off with distance: an area light is as bright as a point light of the same intensity.
+struct Light {
+    enum Shape {
+        POINT,
+        SPHERE, // seen from a shading point as the disk facing it
+        RECT    // two-sided
+    };
+
+    Light(const Vec3f &p, const float i) : position(p), intensity(i), shape(POINT), samples(1), radius(0), u(), v() {}
+
+    static Light sphere(const Vec3f &center, const float radius, const float intensity, const int samples);
+    static Light rect(const Vec3f &center, const Vec3f &u, const Vec3f &v, const float intensity, const int samples); // u, v: half edges
+
+    bool area() const { return shape != POINT; }
+
+    // The samples are the cells of an nx x ny grid over the light (nx * ny == samples).
+    void strata(int &nx, int &ny) const;
+    // point of the stratum s seen from point, (a, b) in [0, 1)^2 placing it in the stratum; the position of a point light.
+    // fast places the points of the spheres with fast_sincos.
+    Vec3f sample(const Vec3f &point, const int s, const float a, const float b, bool fast = false) const;
+
+    Vec3f position; // center of the area lights
+    float intensity;
+    int32_t shape, samples;
+    float radius;
+    Vec3f u, v;
+};
+
+// The terms of a material whose albedo is not zero, so that shading only evaluates those (render.cpp).
+enum MaterialLobe {
+    LOBE_DIFFUSE = 1,
+    LOBE_SPECULAR = 2,
+    LOBE_REFLECT = 4,
+    LOBE_REFRACT = 8
+};
+
+struct Material {
+    Material(const float r, const Vec4f &a, const Vec3f &color, const float spec) : refractive_index(r), albedo(a),
+                                                                                    diffuse_color(color),
+                                                                                    specular_exponent(spec),
+                                                                                    lobes(lobes_of(a)) {}
+
+    Material() : refractive_index(1), albedo(1, 0, 0, 0), diffuse_color(), specular_exponent(), lobes(LOBE_DIFFUSE) {}
+
+    float refractive_index;
+    Vec4f albedo;
+    Vec3f diffuse_color;
+    float specular_exponent;
+    unsigned lobes; // MaterialLobe flags, derived from albedo by the constructors
+
+    static unsigned lobes_of(const Vec4f &a) {
+        return (a[0] > 0 ? LOBE_DIFFUSE : 0) | (a[1] > 0 ? LOBE_SPECULAR : 0) | (a[2] > 0 ? LOBE_REFLECT : 0) |
+               (a[3] > 0 ? LOBE_REFRACT : 0);
+    }
+};
+
+struct Sphere {
+    Vec3f center;
+    float radius;
+    uint16_t material; // index in Scene::materials
+
+    Sphere(const Vec3f &c, const float r, const uint16_t m) : center(c), radius(r), material(m) {}
+
+    bool ray_intersect(const Vec3f &orig, const Vec3f &dir, float &t0) const {
+        Vec3f L = center - orig;
+        float tca = L * dir;
+        float d2 = L * L - tca * tca;
+        const float r2 = radius * radius;
+        if (d2 > r2) return false;
+        float thc = sqrtf(r2 - d2);
+        t0 = tca - thc;
+        float t1 = tca + thc;
+        if (t0 < 0) t0 = t1;
+        if (t0 < 0) return false;
+        return true;
+    }
+
+    AABB bbox() const {
+        return AABB(center - Vec3f(radius, radius, radius), center + Vec3f(radius, radius, radius));
+    }
+};
+
+// Acceleration structure of a set of spheres: the BVH, the uniform grid (grid.h) for many spheres of
+// about the same size, faster to build and often to trace, or the BVH collapsed into 4-wide quantized
+// nodes (qbvh.h), half its memory for the scenes whose nodes outgrow the caches. The SoA lanes
+// follow the leaves or the cells.
+enum SphereAccel {
+    ACCEL_BVH, ACCEL_GRID, ACCEL_QBVH
+};
+
+// Geometry shared by all its instances: spheres with their own accelerator and SoA lanes, in object space.
+struct SphereGroup {
+    std::vector<Sphere> spheres;
+    SphereAccel accel;
+    BVH bvh;         // empty unless accel is ACCEL_BVH
+    SphereGrid grid; // empty unless accel is ACCEL_GRID
+    QBVH qbvh;       // empty unless accel is ACCEL_QBVH
+    SphereSoA soa;
+    AABB bounds;
+
+    SphereGroup() : accel(ACCEL_BVH) {}
+
+    size_t bytes() const { // of the spheres, their accelerator and their lanes
+        return spheres.capacity() * sizeof(Sphere) + bvh.bytes() + grid.bytes() + qbvh.bytes() + soa.bytes();
+    }
+
+    void build(BVHBuilder builder = BVH_BINNED);
+};
+
+// A placement of an object; a moving instance goes from xf at the opening of the shutter (time 0) to
+// xf_end at its closing (time 1), see Transform::lerp.
+struct Instance {
+    Transform xf;
+    int object; // index in Scene::objects
+    bool moving;
+    Transform xf_end;
+
+    Instance() : object(0), moving(false) {}
+
+    // the transform at time, in scratch if the instance moves
+    const Transform &at(const float time, Transform &scratch) const {
+        if (!moving) return xf;
+        scratch = Transform::lerp(xf, xf_end, time);
+        return scratch;
+    }
+};
+
+// builds bvh over the spheres and fills soa in its leaf order
+void build_sphere_bvh(const std::vector<Sphere> &spheres, BVH &bvh, SphereSoA &soa, BVHBuilder builder = BVH_BINNED);
+// builds grid over the spheres and fills soa in its cell order, a lane per sphere and cell
+void build_sphere_grid(const std::vector<Sphere> &spheres, SphereGrid &grid, SphereSoA &soa);
+// Proxy of a set of spheres for the distant views: the spheres smaller than a twentieth of the set are
+// merged, by material and by cells of a sixth of the set, into one sphere of their total volume at
+// their center of mass; the larger spheres stay. Empty if that merges nothing.
+std::vector<Sphere> simplified_spheres(const std::vector<Sphere> &spheres);
+
+enum HitKind {
+    HIT_NONE, HIT_SPHERE, HIT_PRIMITIVE, HIT_INSTANCE, HIT_MESH, HIT_GROUND
+};
+
+// What the traversal keeps of the closest hit so far: no point, normal or material is computed until
+// the hit is final. prim is the lane in Scene::sphere_soa (spheres), the index in Scene::primitives,
+// the lane in the object's SoA (instances) or the triangle (meshes); object is the instance or the mesh.
+struct HitRecord {
+    float t;
+    int prim, object;
+    int kind; // HitKind
+
+    HitRecord() : t(std::numeric_limits<float>::max()), prim(-1), object(-1), kind(HIT_NONE) {}
+};
+
+// Surface interaction of the final hit: the material is only referenced, shading reads it from Scene::materials.
+// uv holds the texture coordinates of the hit on a textured mesh, the barycentric coordinates on other triangles.
+struct Hit {
+    Vec3f point, N;
+    Vec2f uv;
+    uint16_t material;
+    int image;       // in Scene::images, multiplies the diffuse color at uv; -1 if none
+    float footprint; // width of the texture filter at uv, in texture units
+    float curvature; // 1 / radius on the spheres, 0 on the flat surfaces, widens the reflected ray cones
+    float time;      // of the ray, in [0, 1) over the shutter: the shadow and secondary rays leave at the same time
+    bool shadows;    // its lights trace shadow rays, false past Scene::shadow_depth where they are all taken as visible
+};
+
+const size_t max_depth = 4; // deepest bounce of the integrators, Scene::depth_limit may lower it
+
+class SceneReplicas;
+class IrradianceCache;
+
+struct Scene {
+    static const uint16_t checker_white = 0, checker_black = 1; // materials of the checkerboard cells
+    static const uint16_t textured = 0x8000;                      // flags Hit::material as an index in surfaces
+    static const uint16_t ground = textured | 0;                  // the checkerboard plane
+    static const size_t many_lights = 16; // above that, shading samples the lights instead of looping over them
+    static const int motion_slices = 4;   // instance BVHs over the shutter, each bounding the motion in its quarter
+
+    std::vector<Material> materials;
+    std::vector<TexturedSurface> surfaces; // surfaces[0] is the checkerboard
+    std::vector<Sphere> spheres;
+    std::vector<Primitive> primitives; // rects, boxes, cylinders and cones
+    std::vector<Model> meshes;
+    std::vector<uint16_t> mesh_materials; // one per mesh
+    std::vector<ImageTexture> images;     // textures of the meshes with texture coordinates
+    std::vector<int> mesh_images;         // in images, by mesh; meshes past the end are not textured
+    std::vector<Light> lights;
+    SphereAccel sphere_accel; // of the spheres above, set before build()
+    BVHBuilder bvh_builder;   // of all the BVHs of the scene, set before build()
+    BVH sphere_bvh;           // empty unless sphere_accel is ACCEL_BVH
+    SphereGrid sphere_grid;   // empty unless sphere_accel is ACCEL_GRID
+    QBVH sphere_qbvh;         // empty unless sphere_accel is ACCEL_QBVH
+    SphereSoA sphere_soa;     // sphere geometry in BVH leaf order or sphere_grid cell order
+    BVH primitive_bvh;    // over all the primitives, whatever their type
+    std::vector<SphereGroup> objects;  // instanced geometry, stored once
+    std::vector<Instance> instances;   // placements of the objects
+    BVH instance_bvh;                  // over the world bounds of the instances, over the whole shutter
+    std::vector<BVH> instance_slices;  // by time slice of the shutter (motion_slices), empty unless an instance moves
+    float lod_angle;                      // objects and meshes that look smaller use their proxy, see build_lod()
+    std::vector<SphereGroup> object_proxies; // by object, no spheres for the objects without a proxy
+    std::vector<Model> mesh_proxies;         // by mesh
+    LightTree light_tree;              // only built when there are more than many_lights lights
+    int light_samples;                 // lights sampled per shading point with the tree, 0 loops over all of them
+    LightSoA light_soa;                // the lights again, for fast_shading
+    bool fast_shading;                 // batched light vectors, fast pow and fast_sincos, see light_soa.h for the error bounds
+    bool area_lights;                  // some light is not a point, set by build_lights()
+    bool single_branch;                // a path continues into one of its reflected and refracted rays, see push_secondary
+    size_t depth_limit;                // at most max_depth, the deeper rays see the background
+    size_t reflect_depth, refract_depth; // reflections and refractions along a path, the rays past them see the background too
+    size_t shadow_depth;               // deepest bounce whose hits trace shadow rays, 0: the primary hits only
+    const EnvironmentMap *envmap; // background, owned by the caller
+    int envmap_samples;           // directions of the envmap sampled per diffuse shading point, 0: only seen by the misses
+    const SceneReplicas *replicas; // copies on the other NUMA nodes, owned by the caller, see numa.h
+    const IrradianceCache *irradiance; // indirect diffuse lighting, owned by the caller, see irradiance_cache.h
+    Camera camera;
+
+    Scene() : sphere_accel(ACCEL_BVH), bvh_builder(BVH_BINNED), lod_angle(0), light_samples(1), fast_shading(false), area_lights(false), single_branch(false), depth_limit(max_depth),
+              reflect_depth(max_depth), refract_depth(max_depth), shadow_depth(max_depth),
+              envmap(nullptr), envmap_samples(0), replicas(nullptr), irradiance(nullptr) {
+        materials.push_back(Material(1, Vec4f(1, 0, 0, 0), Vec3f(1.0, 1.0, 1.0), 0));
+        materials.push_back(Material(1, Vec4f(1, 0, 0, 0), Vec3f(0.0, 0.0, 0.0), 0));
+        surfaces.push_back(TexturedSurface::builtin("rings", checker_white, checker_black));
+    }
+
+    uint16_t add_material(const Material &m) { // at most 0x8000 materials, see textured
+        assert(materials.size() < textured);
+        materials.push_back(m);
+        return static_cast<uint16_t>(materials.size() - 1);
+    }
+
+    // Compiles the scene once the sphere and primitive lists are complete, before rendering: the BVHs
+    // and the SoA arrays with the quantities the kernels need precomputed (squared and inverse radii).
+    void build();
+    // After the spheres moved or changed radius, but none was added or removed. With the LBVH builder
+    // the BVH is built again instead, which costs little more and does not degrade from frame to frame.
+    void refit();
+    // the accelerator of the spheres alone, after sphere_accel changed
+    void build_spheres();
+    // after instances were added or moved, the objects themselves are unchanged
+    void build_instances();
+    // after the lights changed, called by build()
+    void build_lights();
+    // Levels of detail, after build() and once the meshes are loaded: simplified proxies of the objects
+    // (simplified_spheres()) and of the meshes (Model::simplified()), traced instead of them by every ray
+    // when the radius of their bounding sphere over its distance to the camera is below angle, so that
+    // a distant object looks the same to all rays. angle 0 drops the proxies.
+    void build_lod(float angle);
+    // the geometry traced and shaded for the instance and for the mesh m
+    const SphereGroup &object_of(const Instance &inst) const;
+    const Model &mesh_of(size_t m) const;
+    bool moving() const { return !instance_slices.empty(); }
+    // the BVH of the instances for the rays at time
+    const BVH &instances_at(const float time) const {
+        return instance_slices.empty() ? instance_bvh
+             : instance_slices[std::max(0, std::min(motion_slices - 1, static_cast<int>(time * motion_slices)))];
+    }
+
+    bool samples_lights() const { return light_samples > 0 && !light_tree.empty(); }
+};
+
+// A scene that only differs from another by its camera and some of its materials, see render_batch.
+struct SceneVariant {
+    std::string output; // image file
+    Camera camera;
+    std::vector<std::pair<uint16_t, Material> > materials; // replacements, by index in Scene::materials
+};
+
+const int max_packet = 64; // widest ray packet
+
+// the checkerboard plane y = -4, bounded to |x| < 10 and -30 < z < -10
+bool checkerboard_distance(const Vec3f &orig, const Vec3f &dir, const float tmax, float &d);
+
+// Evaluates the texture of a textured surface, once per final hit.
+inline void resolve_material(const Scene &scene, Hit &hit) {
+    if (hit.material & Scene::textured) hit.material = scene.surfaces[hit.material & ~Scene::textured].resolve(hit.point);
+}
+
+// The diffuse color of the material at the hit, times its image texture if any.
+inline Vec3f diffuse_color(const Scene &scene, const Hit &hit, const Material &material) {
+    if (hit.image < 0) return material.diffuse_color;
+    const ImageTexture &image = scene.images[hit.image];
+    const Vec3f t = image.sample(hit.uv.x, hit.uv.y, image.lod(hit.footprint));
+    return Vec3f(material.diffuse_color.x * t.x, material.diffuse_color.y * t.y, material.diffuse_color.z * t.z);
+}
+
+// Closest hit as a compact record, returns false if nothing is hit closer than 1000.
+// time, in [0, 1) over the shutter, places the moving instances.
+bool scene_closest_hit(const Vec3f &orig, const Vec3f &dir, const Scene &scene, HitRecord &rec, float time = 0);
+// Second stage, once per final hit: point, normal, texture coordinates and (textured) material.
+// cone_width is the width of the ray footprint at the hit, for the level of detail of the image textures;
+// time is that of scene_closest_hit.
+void surface_interaction(const Vec3f &orig, const Vec3f &dir, const Scene &scene, const HitRecord &rec, Hit &hit,
+                         float cone_width = 0, float time = 0);
+
+// both stages, returns false if nothing is hit closer than 1000
+bool scene_intersect(const Vec3f &orig, const Vec3f &dir, const Scene &scene, Hit &hit);
+
+// Shadow query: is there anything between orig and orig + dir * tmax? Returns at the first blocker found,
+// without normals, materials or the checkerboard pattern.
+bool scene_occluded(const Vec3f &orig, const Vec3f &dir, const float tmax, const Scene &scene, float time = 0);
+
+// 1 for the meshes whose box is in the view of plane, 0 for those no primary ray through it can hit
+std::vector<uint8_t> visible_meshes(const Scene &scene, const ImagePlane &plane);
+
+// Packet versions for n <= max_packet rays: the rays share the BVH traversals
+// and only the lanes whose rays reach a leaf are tested against its primitives.
+// With visible (from visible_meshes(), for primary rays), the meshes out of view are skipped.
+// times holds the time of every lane, all at 0 without.
+void scene_closest_hit_packet(const int n, const Vec3f *orig, const Vec3f *dir, const Scene &scene, bool *hits, HitRecord *rec,
+                              const uint8_t *visible = nullptr, const float *times = nullptr);
+void scene_intersect_packet(const int n, const Vec3f *orig, const Vec3f *dir, const Scene &scene, bool *hits, Hit *hit);
+// lane l is blocked if something lies closer than tmax[l]; tmax is clobbered
+void scene_occluded_packet(const int n, const Vec3f *orig, const Vec3f *dir, float *tmax, const Scene &scene, bool *occluded,
+                           const float *times = nullptr);
+
+#endif //__SCENE_H__
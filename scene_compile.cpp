@@ -0,0 +1,156 @@
+#include <map>
+#include <vector>
+#include <algorithm>
+#include "scene_compile.h"
+#include "bvh.h"
+
+namespace {
+    // 10 bits of x, y and z interleaved
+    uint32_t expand_bits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    uint32_t morton3(const Vec3f &p, const AABB &box) {
+        uint32_t code = 0;
+        for (size_t k = 0; k < 3; k++) {
+            const float extent = box.max[k] - box.min[k];
+            const float u = extent > 0 ? (p[k] - box.min[k]) / extent : 0.f;
+            code |= expand_bits(static_cast<uint32_t>(std::max(0.f, std::min(1023.f, u * 1024.f)))) << (2 - k);
+        }
+        return code;
+    }
+
+    // sorts items along the Morton curve of center(item), stable so that equal codes keep their order
+    template<typename T, typename Center> void sort_spatially(std::vector<T> &items, Center center) {
+        AABB box;
+        for (size_t i = 0; i < items.size(); i++) box.expand(center(items[i]));
+        std::vector<std::pair<uint32_t, size_t> > keyed(items.size());
+        for (size_t i = 0; i < items.size(); i++) keyed[i] = std::make_pair(morton3(center(items[i]), box), i);
+        std::stable_sort(keyed.begin(), keyed.end(),
+                         [](const std::pair<uint32_t, size_t> &a, const std::pair<uint32_t, size_t> &b) { return a.first < b.first; });
+        std::vector<T> sorted;
+        sorted.reserve(items.size());
+        for (size_t i = 0; i < keyed.size(); i++) sorted.push_back(items[keyed[i].second]);
+        items.swap(sorted);
+    }
+
+    bool inside(const AABB &inner, const AABB &outer) {
+        return inner.min.x >= outer.min.x && inner.min.y >= outer.min.y && inner.min.z >= outer.min.z &&
+               inner.max.x <= outer.max.x && inner.max.y <= outer.max.y && inner.max.z <= outer.max.z;
+    }
+
+    // The spheres that are not wholly inside an opaque one. A BVH over the spheres leads every sphere to the
+    // leaves whose boxes contain its own box; of two equal spheres the first one is kept.
+    void drop_contained(const Scene &scene, std::vector<Sphere> &spheres) {
+        const size_t n = spheres.size();
+        if (n < 2) return;
+        std::vector<AABB> bounds(n);
+        for (size_t i = 0; i < n; i++) {
+            const Vec3f r(spheres[i].radius, spheres[i].radius, spheres[i].radius);
+            bounds[i] = AABB(spheres[i].center - r, spheres[i].center + r);
+        }
+        BVH bvh;
+        bvh.build(bounds, 4, BVH_BINNED);
+        std::vector<uint8_t> hidden(n, 0);
+#pragma omp parallel for schedule(dynamic, 256)
+        for (long b = 0; b < static_cast<long>(n); b++) {
+            const Sphere &inner = spheres[b];
+            int stack[bvh_stack_size], sp = 0, cur = 0;
+            for (;;) {
+                const BVHNode &node = bvh.nodes[cur];
+                if (inside(bounds[b], node.bounds)) {
+                    if (!node.count) { // both children may contain the box
+                        if (sp < bvh_stack_size) stack[sp++] = node.offset;
+                        cur++;
+                        continue;
+                    }
+                    for (int k = 0; k < node.count && !hidden[b]; k++) {
+                        const int a = bvh.indices[node.offset + k];
+                        const Sphere &outer = spheres[a];
+                        if (a == b || (outer.material & Scene::textured)) continue; // a texture may pick glass
+                        if (scene.materials[outer.material].lobes & LOBE_REFRACT) continue;
+                        const float d = (inner.center - outer.center).norm();
+                        if (d + inner.radius > outer.radius) continue;
+                        if (d == 0 && inner.radius == outer.radius && a > b) continue; // equal spheres, the later one goes
+                        hidden[b] = 1;
+                    }
+                }
+                if (hidden[b] || !sp) break;
+                cur = stack[--sp];
+            }
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < n; i++)
+            if (!hidden[i]) spheres[kept++] = spheres[i];
+        spheres.erase(spheres.begin() + kept, spheres.end());
+    }
+
+    uint16_t remap(const std::vector<uint16_t> &to, const uint16_t material) {
+        if (material & Scene::textured) return material; // an index in Scene::surfaces
+        return material < to.size() ? to[material] : material;
+    }
+}
+
+CompileStats compile_scene(Scene &scene) {
+    CompileStats stats = CompileStats();
+    size_t spheres = scene.spheres.size();
+    for (size_t o = 0; o < scene.objects.size(); o++) spheres += scene.objects[o].spheres.size();
+    stats.spheres_before = spheres;
+    stats.materials_before = scene.materials.size();
+    stats.bytes_before = spheres * sizeof(Sphere) + scene.primitives.size() * sizeof(Primitive) +
+                         scene.materials.size() * sizeof(Material);
+
+    // the checkerboard materials stay where the surfaces expect them, the others are merged by value
+    std::vector<uint16_t> to(scene.materials.size());
+    std::vector<Material> materials;
+    std::map<std::vector<float>, uint16_t> seen;
+    for (size_t m = 0; m < scene.materials.size(); m++) {
+        const Material &mat = scene.materials[m];
+        if (m <= Scene::checker_black) {
+            to[m] = static_cast<uint16_t>(materials.size());
+            materials.push_back(mat);
+            continue;
+        }
+        const float values[] = {mat.refractive_index, mat.albedo[0], mat.albedo[1], mat.albedo[2], mat.albedo[3],
+                                mat.diffuse_color.x, mat.diffuse_color.y, mat.diffuse_color.z, mat.specular_exponent};
+        const std::vector<float> key(values, values + sizeof(values) / sizeof(values[0]));
+        const std::map<std::vector<float>, uint16_t>::const_iterator found = seen.find(key);
+        if (found != seen.end()) {
+            to[m] = found->second;
+            continue;
+        }
+        to[m] = static_cast<uint16_t>(materials.size());
+        seen[key] = to[m];
+        materials.push_back(mat);
+    }
+    scene.materials.swap(materials);
+    for (size_t i = 0; i < scene.spheres.size(); i++) scene.spheres[i].material = remap(to, scene.spheres[i].material);
+    for (size_t o = 0; o < scene.objects.size(); o++)
+        for (size_t i = 0; i < scene.objects[o].spheres.size(); i++)
+            scene.objects[o].spheres[i].material = remap(to, scene.objects[o].spheres[i].material);
+    for (size_t i = 0; i < scene.primitives.size(); i++) scene.primitives[i].material = remap(to, scene.primitives[i].material);
+    for (size_t m = 0; m < scene.mesh_materials.size(); m++) scene.mesh_materials[m] = remap(to, scene.mesh_materials[m]);
+    for (size_t s = 0; s < scene.surfaces.size(); s++) {
+        scene.surfaces[s].material_a = remap(to, scene.surfaces[s].material_a);
+        scene.surfaces[s].material_b = remap(to, scene.surfaces[s].material_b);
+    }
+
+    drop_contained(scene, scene.spheres);
+    for (size_t o = 0; o < scene.objects.size(); o++) drop_contained(scene, scene.objects[o].spheres);
+    auto sphere_center = [](const Sphere &s) { return s.center; };
+    sort_spatially(scene.spheres, sphere_center);
+    for (size_t o = 0; o < scene.objects.size(); o++) sort_spatially(scene.objects[o].spheres, sphere_center);
+    sort_spatially(scene.primitives, [](const Primitive &p) { return p.bbox().centroid(); });
+
+    spheres = scene.spheres.size();
+    for (size_t o = 0; o < scene.objects.size(); o++) spheres += scene.objects[o].spheres.size();
+    stats.spheres_after = spheres;
+    stats.materials_after = scene.materials.size();
+    stats.bytes_after = spheres * sizeof(Sphere) + scene.primitives.size() * sizeof(Primitive) +
+                        scene.materials.size() * sizeof(Material);
+    return stats;
+}
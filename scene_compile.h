@@ -0,0 +1,24 @@
+#ifndef __SCENE_COMPILE_H__
+#define __SCENE_COMPILE_H__
+#include <cstddef>
+#include "scene.h"
+
+// What compile_scene() removed, for the log.
+struct CompileStats {
+    size_t spheres_before, spheres_after;     // of the scene and of its objects
+    size_t materials_before, materials_after;
+    size_t bytes_before, bytes_after;         // of the sphere, primitive and material arrays
+};
+
+// Scene compile, before Scene::build(), on the lists as the scenes generate them:
+//  - drops the spheres wholly inside an opaque sphere (no refraction), which no ray can reach: the
+//    duplicates of the loops that build a shape out of overlapping spheres, a sphere given twice;
+//  - merges the identical materials and renumbers the references of the spheres, the primitives, the
+//    meshes and the textured surfaces, so that the shading touches fewer distinct materials;
+//  - sorts the spheres and the primitives along a Morton curve of their centers, so that the BVH leaves
+//    and the arrays read by the traversal and the shading follow space.
+// The images are the same; the indices of the spheres, primitives and materials change (--dump-scene,
+// the ID AOV, the variants of render_batch).
+CompileStats compile_scene(Scene &scene);
+
+#endif //__SCENE_COMPILE_H__
@@ -0,0 +1,486 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <map>
+#include <sys/stat.h>
+#include "scene_io.h"
+#include "mapped_file.h"
+#include "profile.h"
+
+namespace {
+    std::string directory_of(const std::string &filename) {
+        const size_t slash = filename.find_last_of("/\\");
+        return slash == std::string::npos ? std::string() : filename.substr(0, slash + 1);
+    }
+
+    bool file_stamp(const std::string &filename, uint64_t &size, int64_t &mtime) {
+        struct stat st;
+        if (stat(filename.c_str(), &st)) return false;
+        size = static_cast<uint64_t>(st.st_size);
+        mtime = static_cast<int64_t>(st.st_mtime);
+        return true;
+    }
+
+    // the rest of a camera statement, with the same checks as --fov and --camera; false leaves c half read
+    bool parse_camera(std::istringstream &iss, Camera &c) {
+        Vec3f target;
+        float fov;
+        if (!(iss >> c.position.x >> c.position.y >> c.position.z >> target.x >> target.y >> target.z >> fov) ||
+            !(fov > 0 && fov < 180)) return false;
+        for (size_t k = 0; k < 3; k++)
+            if (!std::isfinite(c.position[k]) || !std::isfinite(target[k])) return false;
+        if ((target - c.position).norm() == 0) return false;
+        c.fov = fov * float(M_PI) / 180.f;
+        c.look_at(target);
+        return true;
+    }
+
+    const char camera_usage[] = "camera px py pz tx ty tz fov (fov in ]0, 180[, the target away from the position)";
+
+    // Parses the text and fills the scene, the meshes are loaded but nothing is built. name prefixes
+    // the error messages, relative mesh paths start from dir.
+    bool parse_scene(std::istream &in, const std::string &name, const std::string &dir, Scene &scene,
+                     std::vector<std::string> &mesh_files, std::string &error) {
+        std::map<std::string, uint16_t> materials;
+        std::string line;
+        for (int lineno = 1; std::getline(in, line); lineno++) {
+            const size_t hash = line.find('#');
+            if (hash != std::string::npos) line.erase(hash);
+            std::istringstream iss(line);
+            std::string keyword;
+            if (!(iss >> keyword)) continue;
+            std::ostringstream where;
+            where << name << ":" << lineno << ": ";
+            if (keyword == "camera") {
+                if (!parse_camera(iss, scene.camera)) {
+                    error = where.str() + camera_usage;
+                    return false;
+                }
+            } else if (keyword == "material") {
+                std::string name;
+                float ior, spec;
+                Vec4f a;
+                Vec3f color;
+                if (!(iss >> name >> ior >> a.x >> a.y >> a.z >> a.w >> color.x >> color.y >> color.z >> spec)) {
+                    error = where.str() + "material name ior a0 a1 a2 a3 r g b specular";
+                    return false;
+                }
+                if (scene.materials.size() >= Scene::textured) { // the larger indices name textured surfaces
+                    error = where.str() + "too many materials";
+                    return false;
+                }
+                materials[name] = scene.add_material(Material(ior, a, color, spec));
+            } else if (keyword == "sphere" || keyword == "mesh") {
+                Vec3f center;
+                float radius = 0;
+                std::string path, material;
+                if (keyword == "sphere" ? !(iss >> center.x >> center.y >> center.z >> radius >> material) || !(radius > 0)
+                                        : !(iss >> path >> material)) {
+                    error = where.str() + (keyword == "sphere" ? "sphere x y z radius material (radius > 0)" : "mesh file.obj material");
+                    return false;
+                }
+                std::map<std::string, uint16_t>::const_iterator m = materials.find(material);
+                if (m == materials.end()) {
+                    error = where.str() + "unknown material " + material;
+                    return false;
+                }
+                if (keyword == "sphere") {
+                    scene.spheres.push_back(Sphere(center, radius, m->second));
+                } else {
+                    if (path.empty() || path[0] != '/') path = dir + path;
+                    scene.meshes.push_back(Model(path.c_str()));
+                    if (!scene.meshes.back().ok()) {
+                        error = where.str() + "can not load " + path;
+                        return false;
+                    }
+                    scene.mesh_materials.push_back(m->second);
+                    mesh_files.push_back(path);
+                }
+            } else if (keyword == "rect" || keyword == "box" || keyword == "cylinder" || keyword == "cone") {
+                Vec3f a, b, c;
+                float radius = 0;
+                std::string material;
+                bool ok;
+                if (keyword == "rect") ok = !!(iss >> a.x >> a.y >> a.z >> b.x >> b.y >> b.z >> c.x >> c.y >> c.z >> material);
+                else if (keyword == "box") ok = !!(iss >> a.x >> a.y >> a.z >> b.x >> b.y >> b.z >> material);
+                else ok = !!(iss >> a.x >> a.y >> a.z >> b.x >> b.y >> b.z >> radius >> material);
+                if (!ok || (keyword != "box" && keyword != "rect" && (radius <= 0 || (b - a) * (b - a) == 0))) {
+                    error = where.str() + (keyword == "rect" ? "rect cx cy cz ux uy uz vx vy vz material"
+                                         : keyword == "box" ? "box x0 y0 z0 x1 y1 z1 material"
+                                         : keyword + " x0 y0 z0 x1 y1 z1 radius material");
+                    return false;
+                }
+                std::map<std::string, uint16_t>::const_iterator m = materials.find(material);
+                if (m == materials.end()) {
+                    error = where.str() + "unknown material " + material;
+                    return false;
+                }
+                if (keyword == "rect") scene.primitives.push_back(Primitive::rect(a, b, c, m->second));
+                else if (keyword == "box") scene.primitives.push_back(Primitive::box(a, b, m->second));
+                else if (keyword == "cylinder") scene.primitives.push_back(Primitive::cylinder(a, b, radius, m->second));
+                else scene.primitives.push_back(Primitive::cone(a, b, radius, m->second));
+            } else if (keyword == "light") {
+                Vec3f p;
+                float intensity;
+                if (!(iss >> p.x >> p.y >> p.z >> intensity)) {
+                    error = where.str() + "light x y z intensity";
+                    return false;
+                }
+                scene.lights.push_back(Light(p, intensity));
+            } else if (keyword == "sphere_light") {
+                Vec3f p;
+                float radius, intensity;
+                int samples;
+                if (!(iss >> p.x >> p.y >> p.z >> radius >> intensity >> samples) || radius <= 0 || samples < 1) {
+                    error = where.str() + "sphere_light x y z radius intensity samples";
+                    return false;
+                }
+                scene.lights.push_back(Light::sphere(p, radius, intensity, samples));
+            } else if (keyword == "rect_light") {
+                Vec3f p, u, v;
+                float intensity;
+                int samples;
+                if (!(iss >> p.x >> p.y >> p.z >> u.x >> u.y >> u.z >> v.x >> v.y >> v.z >> intensity >> samples) || samples < 1) {
+                    error = where.str() + "rect_light x y z ux uy uz vx vy vz intensity samples (u, v: half edges)";
+                    return false;
+                }
+                scene.lights.push_back(Light::rect(p, u, v, intensity, samples));
+            } else {
+                error = where.str() + "unknown statement " + keyword;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parse_scene(const std::string &filename, Scene &scene, std::vector<std::string> &mesh_files, std::string &error) {
+        std::ifstream in(filename.c_str());
+        if (!in) {
+            error = "can not open " + filename;
+            return false;
+        }
+        return parse_scene(in, filename, directory_of(filename), scene, mesh_files, error);
+    }
+
+    void appendf(std::string &out, const char *format, ...) {
+        char line[512];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        out += line;
+    }
+
+    // Cache layout: the header then one section per array, every section starts on a 64 byte boundary.
+    const char cache_magic[8] = {'S', 'N', 'O', 'W', 'S', 'C', 'N', '5'};
+
+    struct CacheHeader {
+        char magic[8];
+        uint64_t source_size;
+        int64_t source_mtime;
+        Camera camera;
+        uint32_t nmaterials, nspheres, nlights, nmeshes;
+        uint32_t nnodes, nindices, nsoa, nlanes; // nlanes includes the SoA padding
+        uint32_t mesh_files_bytes;               // the mesh paths, '\0' separated
+        uint32_t nprimitives, nprimitive_nodes, nprimitive_indices;
+    };
+
+    size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+
+    class CacheWriter {
+    public:
+        explicit CacheWriter(FILE *f) : f(f), pos(0), ok(f != nullptr) {}
+
+        void write(const void *data, size_t bytes) {
+            if (ok && bytes) ok = fwrite(data, 1, bytes, f) == bytes;
+            pos += bytes;
+        }
+
+        template<typename T> void section(const std::vector<T> &v) {
+            const char zeros[64] = {0};
+            write(zeros, align64(pos) - pos);
+            if (!v.empty()) write(v.data(), v.size() * sizeof(T));
+        }
+
+        FILE *f;
+        size_t pos;
+        bool ok;
+    };
+
+    class CacheReader {
+    public:
+        CacheReader(const char *data, size_t size) : data(data), size(size), pos(0), ok(true) {}
+
+        template<typename T> void section(std::vector<T> &v, size_t n) {
+            pos = align64(pos);
+            if (pos + n * sizeof(T) > size) {
+                ok = false;
+                return;
+            }
+            const T *first = reinterpret_cast<const T *>(data + pos);
+            v.assign(first, first + n);
+            pos += n * sizeof(T);
+        }
+
+        const char *data;
+        size_t size, pos;
+        bool ok;
+    };
+
+    bool save_cache(const std::string &filename, const Scene &scene, const std::vector<std::string> &mesh_files,
+                    uint64_t source_size, int64_t source_mtime) {
+        std::vector<char> paths;
+        for (size_t i = 0; i < mesh_files.size(); i++)
+            paths.insert(paths.end(), mesh_files[i].c_str(), mesh_files[i].c_str() + mesh_files[i].size() + 1);
+
+        CacheHeader h = CacheHeader(); // zeroed, padding included: the header is written as is
+        memcpy(h.magic, cache_magic, sizeof(cache_magic));
+        h.source_size = source_size;
+        h.source_mtime = source_mtime;
+        h.camera = scene.camera;
+        h.nmaterials = static_cast<uint32_t>(scene.materials.size());
+        h.nspheres = static_cast<uint32_t>(scene.spheres.size());
+        h.nlights = static_cast<uint32_t>(scene.lights.size());
+        h.nmeshes = static_cast<uint32_t>(scene.meshes.size());
+        h.nnodes = static_cast<uint32_t>(scene.sphere_bvh.nodes.size());
+        h.nindices = static_cast<uint32_t>(scene.sphere_bvh.indices.size());
+        h.nsoa = static_cast<uint32_t>(scene.sphere_soa.size());
+        h.nlanes = static_cast<uint32_t>(scene.sphere_soa.cx.size());
+        h.mesh_files_bytes = static_cast<uint32_t>(paths.size());
+        h.nprimitives = static_cast<uint32_t>(scene.primitives.size());
+        h.nprimitive_nodes = static_cast<uint32_t>(scene.primitive_bvh.nodes.size());
+        h.nprimitive_indices = static_cast<uint32_t>(scene.primitive_bvh.indices.size());
+
+        // written next to the final name and renamed, a concurrent reader never sees a partial cache
+        const std::string tmp = filename + ".tmp";
+        CacheWriter w(fopen(tmp.c_str(), "wb"));
+        w.write(&h, sizeof(h));
+        w.section(scene.materials);
+        w.section(scene.spheres);
+        w.section(scene.lights);
+        w.section(scene.mesh_materials);
+        w.section(paths);
+        w.section(scene.sphere_bvh.nodes);
+        w.section(scene.sphere_bvh.indices);
+        const SphereSoA &s = scene.sphere_soa;
+        w.section(s.cx);
+        w.section(s.cy);
+        w.section(s.cz);
+        w.section(s.r2);
+        w.section(s.inv_r);
+        w.section(s.mat);
+        w.section(s.id);
+        w.section(scene.primitives);
+        w.section(scene.primitive_bvh.nodes);
+        w.section(scene.primitive_bvh.indices);
+        if (w.f && fclose(w.f)) w.ok = false;
+        if (!w.ok || rename(tmp.c_str(), filename.c_str())) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool read_cache(const char *data, size_t size, uint64_t source_size, int64_t source_mtime, Scene &scene) {
+        CacheHeader h;
+        if (size < sizeof(h)) return false;
+        memcpy(&h, data, sizeof(h));
+        if (memcmp(h.magic, cache_magic, sizeof(cache_magic)) || h.source_size != source_size || h.source_mtime != source_mtime)
+            return false;
+
+        CacheReader r(data, size);
+        r.pos = sizeof(h);
+        std::vector<char> paths;
+        r.section(scene.materials, h.nmaterials);
+        r.section(scene.spheres, h.nspheres);
+        r.section(scene.lights, h.nlights);
+        r.section(scene.mesh_materials, h.nmeshes);
+        r.section(paths, h.mesh_files_bytes);
+        r.section(scene.sphere_bvh.nodes, h.nnodes);
+        r.section(scene.sphere_bvh.indices, h.nindices);
+        SphereSoA &s = scene.sphere_soa;
+        r.section(s.cx, h.nlanes);
+        r.section(s.cy, h.nlanes);
+        r.section(s.cz, h.nlanes);
+        r.section(s.r2, h.nlanes);
+        r.section(s.inv_r, h.nsoa);
+        r.section(s.mat, h.nsoa);
+        r.section(s.id, h.nsoa);
+        r.section(scene.primitives, h.nprimitives);
+        r.section(scene.primitive_bvh.nodes, h.nprimitive_nodes);
+        r.section(scene.primitive_bvh.indices, h.nprimitive_indices);
+        if (!r.ok) return false;
+        scene.camera = h.camera;
+
+        scene.meshes.clear();
+        for (size_t p = 0; p < paths.size(); p += strlen(&paths[p]) + 1) {
+            scene.meshes.push_back(Model(&paths[p]));
+            if (!scene.meshes.back().ok()) return false; // parsed again, which reports it
+        }
+        return scene.meshes.size() == h.nmeshes;
+    }
+
+    bool load_cache(const std::string &filename, uint64_t source_size, int64_t source_mtime, Scene &scene) {
+        MappedFile file;
+        return file.open(filename) && read_cache(file.data(), file.size(), source_size, source_mtime, scene);
+    }
+}
+
+bool load_scene_text(const std::string &filename, Scene &scene, std::string &error) {
+    std::vector<std::string> mesh_files;
+    return parse_scene(filename, scene, mesh_files, error);
+}
+
+bool parse_scene_text(const std::string &text, Scene &scene, std::string &error) {
+    std::istringstream in(text);
+    std::vector<std::string> mesh_files;
+    return parse_scene(in, "scene", "", scene, mesh_files, error);
+}
+
+bool load_variants(const std::string &filename, const Scene &scene, std::vector<SceneVariant> &variants, std::string &error) {
+    std::ifstream in(filename.c_str());
+    if (!in) {
+        error = "can not open " + filename;
+        return false;
+    }
+    std::string line;
+    for (int lineno = 1; std::getline(in, line); lineno++) {
+        const size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::istringstream iss(line);
+        std::string keyword;
+        if (!(iss >> keyword)) continue;
+        std::ostringstream where;
+        where << filename << ":" << lineno << ": ";
+        if (keyword == "variant") {
+            SceneVariant v;
+            if (!(iss >> v.output)) {
+                error = where.str() + "variant output";
+                return false;
+            }
+            v.camera = scene.camera;
+            variants.push_back(v);
+            continue;
+        }
+        if (variants.empty()) {
+            error = where.str() + keyword + " before the first variant";
+            return false;
+        }
+        SceneVariant &v = variants.back();
+        if (keyword == "camera") {
+            if (!parse_camera(iss, v.camera)) {
+                error = where.str() + camera_usage;
+                return false;
+            }
+        } else if (keyword == "material" || keyword == "color") {
+            std::string name;
+            unsigned index = 0;
+            char tail;
+            if (!(iss >> name) || sscanf(name.c_str(), "m%u%c", &index, &tail) != 1 || index < 2 || index >= scene.materials.size()) {
+                error = where.str() + "unknown material " + name + " (m2 .. m" + std::to_string(scene.materials.size() - 1) + ")";
+                return false;
+            }
+            Material m = scene.materials[index];
+            for (size_t k = 0; k < v.materials.size(); k++)
+                if (v.materials[k].first == index) m = v.materials[k].second; // a color after a material statement
+            const bool ok = keyword == "color" ? bool(iss >> m.diffuse_color.x >> m.diffuse_color.y >> m.diffuse_color.z)
+                                               : bool(iss >> m.refractive_index >> m.albedo.x >> m.albedo.y >> m.albedo.z >> m.albedo.w >>
+                                                      m.diffuse_color.x >> m.diffuse_color.y >> m.diffuse_color.z >> m.specular_exponent);
+            if (!ok) {
+                error = where.str() + (keyword == "color" ? "color mI r g b" : "material mI ior a0 a1 a2 a3 r g b specular");
+                return false;
+            }
+            m.lobes = Material::lobes_of(m.albedo); // a diffuse material may become a mirror or glass
+            v.materials.push_back(std::make_pair(static_cast<uint16_t>(index), m));
+        } else {
+            error = where.str() + "unknown statement " + keyword;
+            return false;
+        }
+    }
+    if (variants.empty()) {
+        error = filename + ": no variant";
+        return false;
+    }
+    return true;
+}
+
+std::string scene_text(const Scene &scene) {
+    std::string text;
+    const Camera &c = scene.camera;
+    const Vec3f target = c.position + c.forward;
+    appendf(text, "camera %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n", c.position.x, c.position.y, c.position.z,
+            target.x, target.y, target.z, c.fov * 180. / M_PI);
+    for (size_t i = 2; i < scene.materials.size(); i++) { // 0 and 1 belong to the checkerboard
+        const Material &m = scene.materials[i];
+        appendf(text, "material m%d %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n", int(i), m.refractive_index,
+                m.albedo.x, m.albedo.y, m.albedo.z, m.albedo.w, m.diffuse_color.x, m.diffuse_color.y, m.diffuse_color.z,
+                m.specular_exponent);
+    }
+    for (size_t i = 0; i < scene.spheres.size(); i++) {
+        const Sphere &s = scene.spheres[i];
+        appendf(text, "sphere %.9g %.9g %.9g %.9g m%d\n", s.center.x, s.center.y, s.center.z, s.radius, int(s.material));
+    }
+    for (size_t i = 0; i < scene.primitives.size(); i++) {
+        const Primitive &p = scene.primitives[i];
+        if (p.type == PRIMITIVE_RECT)
+            appendf(text, "rect %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g m%d\n", p.a.x, p.a.y, p.a.z, p.u.x, p.u.y, p.u.z,
+                    p.v.x, p.v.y, p.v.z, int(p.material));
+        else if (p.type == PRIMITIVE_BOX)
+            appendf(text, "box %.9g %.9g %.9g %.9g %.9g %.9g m%d\n", p.a.x, p.a.y, p.a.z, p.b.x, p.b.y, p.b.z, int(p.material));
+        else
+            appendf(text, "%s %.9g %.9g %.9g %.9g %.9g %.9g %.9g m%d\n", p.type == PRIMITIVE_CYLINDER ? "cylinder" : "cone",
+                    p.a.x, p.a.y, p.a.z, p.b.x, p.b.y, p.b.z, p.radius, int(p.material));
+    }
+    for (size_t i = 0; i < scene.lights.size(); i++) {
+        const Light &l = scene.lights[i];
+        if (l.shape == Light::SPHERE)
+            appendf(text, "sphere_light %.9g %.9g %.9g %.9g %.9g %d\n", l.position.x, l.position.y, l.position.z, l.radius,
+                    l.intensity, int(l.samples));
+        else if (l.shape == Light::RECT)
+            appendf(text, "rect_light %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %d\n", l.position.x, l.position.y,
+                    l.position.z, l.u.x, l.u.y, l.u.z, l.v.x, l.v.y, l.v.z, l.intensity, int(l.samples));
+        else
+            appendf(text, "light %.9g %.9g %.9g %.9g\n", l.position.x, l.position.y, l.position.z, l.intensity);
+    }
+    return text;
+}
+
+bool save_scene_text(const std::string &filename, const Scene &scene) {
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f) return false;
+    const std::string text = scene_text(scene);
+    const bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    return fclose(f) == 0 && ok;
+}
+
+bool load_scene(const std::string &filename, Scene &scene, std::string &error) {
+    PROFILE_SCOPE("scene load");
+    uint64_t size;
+    int64_t mtime;
+    if (!file_stamp(filename, size, mtime)) {
+        error = "can not open " + filename;
+        return false;
+    }
+    const EnvironmentMap *envmap = scene.envmap;
+    scene = Scene();
+    scene.envmap = envmap;
+    const std::string cache = filename + ".cache";
+    if (load_cache(cache, size, mtime, scene)) {
+        scene.build_lights(); // cheap, not worth a section of the cache
+        return true;
+    }
+
+    scene = Scene();
+    scene.envmap = envmap;
+    std::vector<std::string> mesh_files;
+    if (!parse_scene(filename, scene, mesh_files, error)) return false;
+    scene.build();
+    if (!save_cache(cache, scene, mesh_files, size, mtime))
+        std::cerr << "# can not write the scene cache " << cache << std::endl;
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef __SCENE_IO_H__
+#define __SCENE_IO_H__
+#include <string>
+#include "scene.h"
+
+// Text scene description, one statement per line, '#' starts a comment:
+//   camera px py pz tx ty tz fov        position, target, vertical field of view in degrees
+//   material name ior a0 a1 a2 a3 r g b specular
+//   sphere x y z radius material
+//   rect cx cy cz ux uy uz vx vy vz material   center and the two half edges, perpendicular
+//   box x0 y0 z0 x1 y1 z1 material            two opposite corners, axis aligned
+//   cylinder x0 y0 z0 x1 y1 z1 radius material centers of the two caps
+//   cone x0 y0 z0 x1 y1 z1 radius material    center of the base, then the apex
+//   light x y z intensity
+//   mesh file.obj material              path relative to the scene file
+// The checkerboard is always there, with its own two materials.
+bool load_scene_text(const std::string &filename, Scene &scene, std::string &error);
+
+// Writes the spheres, primitives, materials, lights and camera of the scene (not its meshes) in the text format.
+bool save_scene_text(const std::string &filename, const Scene &scene);
+
+// The same text as a string, and the parser reading it back: mesh paths are taken as they are.
+std::string scene_text(const Scene &scene);
+bool parse_scene_text(const std::string &text, Scene &scene, std::string &error);
+
+// Variants of scene for render_batch, one per variant statement; the statements after it change that variant:
+//   variant output.jpg                  a new variant, with the camera and the materials of the scene
+//   camera px py pz tx ty tz fov
+//   material mI ior a0 a1 a2 a3 r g b specular   replaces material I (the numbering of --dump-scene)
+//   color mI r g b                      replaces the diffuse color of material I only
+bool load_variants(const std::string &filename, const Scene &scene, std::vector<SceneVariant> &variants, std::string &error);
+
+// Loads filename, going through the binary cache filename + ".cache": the parsed scene together with
+// its sphere BVH, SoA arrays and primitive BVH, mapped in memory so that each array is a single copy. The cache is
+// rebuilt when it is missing or older than the text file. The scene is ready to render.
+bool load_scene(const std::string &filename, Scene &scene, std::string &error);
+
+#endif //__SCENE_IO_H__
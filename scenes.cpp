@@ -0,0 +1,245 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "scenes.h"
+
+// Fonction lerp pour les flottants
+float lerp(float a, float b, float t) {
+    return a + t * (b - a);
+}
+
+// Fonction lerp pour les vecteurs
+Vec3f lerp(const Vec3f &a, const Vec3f &b, float t) {
+    return Vec3f(lerp(a.x, b.x, t),
+                lerp(a.y, b.y, t),
+                lerp(a.z, b.z, t));
+}
+
+namespace {
+    uint32_t lcg(uint32_t &state) { // deterministic across platforms, unlike rand()
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    }
+
+    float uniform(uint32_t &state, float lo, float hi) {
+        return lo + (hi - lo) * (lcg(state) * (1.f / 16777216.f));
+    }
+
+    void snowman_lights(Scene &scene) {
+        //affichages des lumieres
+        std::vector<Light> &lights = scene.lights;
+        lights.push_back(Light(Vec3f(-20, 20, 20), 1.5));
+        lights.push_back(Light(Vec3f(30, 50, -25), 1.8));
+        lights.push_back(Light(Vec3f(30, 20, 30), 1.7));
+    }
+}
+
+void add_snowman(Scene &scene, std::vector<Sphere> &spheres, std::vector<Primitive> *primitives) {
+    //affichage des spheres represent le corps du snowman
+    const uint16_t snow_body = scene.add_material(Material(1.0, Vec4f(0.75, 0.1, 0.0, 0.0), Vec3f(1.0, 1.0, 1.0), 50.));
+
+    //affichage du corps
+    spheres.push_back(Sphere(Vec3f(0, 2.4, -16), 1.3, snow_body));
+    spheres.push_back(Sphere(Vec3f(0, 0, -16), 1.5, snow_body));
+    spheres.push_back(Sphere(Vec3f(0, -2, -16), 1.7, snow_body));
+
+    //affichage des yeux
+    const uint16_t snow_eyes = scene.add_material(Material(1.0, Vec4f(0.75, 0.1, 0.0, 0.0), Vec3f(0.0, 0.0, 0.0), 50.));
+    spheres.push_back(Sphere(Vec3f(-0.45, 3, -15), 0.2, snow_eyes));
+    spheres.push_back(Sphere(Vec3f(0.45, 3, -15), 0.2, snow_eyes));
+
+    //affichage des boutons sur le ventre
+    const uint16_t snow_button = scene.add_material(Material(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.8, 0.0, 0.0), 50.));
+    spheres.push_back(Sphere(Vec3f(0, 1, -15), 0.2, snow_button));
+    spheres.push_back(Sphere(Vec3f(0, 0.5, -14.65), 0.2, snow_button));
+    spheres.push_back(Sphere(Vec3f(0, 0, -14.6), 0.2, snow_button));
+
+    
+    // façon 1
+    // Define the material for the orange nose
+   // Material snow_nose(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(1.0, 0.5, 0.0), 10.);
+    // Add the nose to the snowman
+    //spheres.push_back(Sphere(Vec3f(0, 2.6, -14.7), 0.3, snow_nose));
+
+    // le nez pointé et decaler 
+    const uint16_t snow_nose = scene.add_material(Material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(1.0, 0.5, 0.0), 10.));
+    Vec3f nose_tip_position = Vec3f(0, 2.6, -14.7); // La pointe du nez est plus proche de la caméra
+    float nose_length = 1; // Longueur du nez
+    float nose_base_radius = 0.2; // Rayon à la base
+    int nose_pieces = 6; // Nombre de sphères pour former le nez
+
+    if (primitives) { // un vrai cone, de la base enfoncee dans la tete jusqu'a la pointe decalee
+        primitives->push_back(Primitive::cone(nose_tip_position - Vec3f(0, 0, 0.2), nose_tip_position + Vec3f(0.2, 0, nose_length),
+                                              nose_base_radius, snow_nose));
+        nose_pieces = 0;
+    }
+    for (int i = 0; i < nose_pieces; i++) {
+        float progress = (float)i / (nose_pieces - 1);
+        float radius = lerp(nose_base_radius, 0.05, progress); // Lerp est une fonction linéaire pour interpoler entre deux valeurs
+        Vec3f position = lerp(nose_tip_position, nose_tip_position + Vec3f(0, 0, nose_length), progress); // La position s'éloigne de la pointe
+        if (progress > 0.5) { // decaler apres la moitié du nez
+        float offset_progress = (progress - 0.5f) * 2.0f; // 0 au milieu, jusqu'à 1 à la pointe
+        position.x += offset_progress * 0.2; // Decaler de plus en plus vers la pointe
+        }
+
+
+        spheres.push_back(Sphere(position, radius, snow_nose));
+    }
+
+
+    const uint16_t stick_material = scene.add_material(Material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.35, 0.16, 0.08), 10.)); 
+    Vec3f left_arm_start = Vec3f(-1.5, 0.5, -16); // Point de départ du bras gauche
+    Vec3f left_branch = Vec3f(-1.5, 0.27, -16);
+    Vec3f right_arm_start = Vec3f(1.5, 0.5, -16); // Point de départ du bras droit
+    Vec3f right_branch = Vec3f(1.5, 0.27, -16);
+    float arm_radius = 0.08; // Rayon des sphères pour les bras
+
+    // Créer le bras gauche
+    for (int i = 0; i < 20; i++) {
+        if(i > 10){
+
+            Vec3f arm_position = left_branch + Vec3f(-0.06 * i, 0.06 * i, 0);
+            spheres.push_back(Sphere(arm_position, arm_radius, stick_material));
+        }
+        Vec3f arm_position = left_arm_start + Vec3f(-0.06 * i, 0.03 * i, 0); // Chaque sphère est decalé un peu plus loin et un peu plus haut
+        spheres.push_back(Sphere(arm_position, arm_radius, stick_material));
+    }
+
+    // Créer le bras droit
+    for (int i = 0; i < 20; i++) {
+        if(i > 10){
+            
+            Vec3f arm_position = right_branch + Vec3f(0.06 * i, 0.06 * i, 0); 
+            spheres.push_back(Sphere(arm_position, arm_radius, stick_material));
+        }
+        Vec3f arm_position = right_arm_start + Vec3f(0.06 * i, 0.03 * i, 0); // Chaque sphère est decalé un peu plus loin et un peu plus haut
+        spheres.push_back(Sphere(arm_position, arm_radius, stick_material));
+    }
+
+
+
+    const uint16_t mouth_material = scene.add_material(Material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.0, 0.0, 0.0), 10.)); 
+    Vec3f mouth_center = Vec3f(0.25, 2.3, -13); //  le centre de la bouche sur le visage
+    float mouth_width = 0.6; 
+    float mouth_radius = 0.05; 
+    int mouth_pieces = 9; 
+
+    
+    for (int i = 0; i < mouth_pieces; ++i) {
+        float x_offset = lerp(-mouth_width / 2, mouth_width / 2, static_cast<float>(i) / (mouth_pieces - 1));
+        float y_offset = -sqrt(mouth_width * mouth_width / 4 - x_offset * x_offset) / 2;
+        Vec3f sphere_position = mouth_center + Vec3f(x_offset, y_offset, 0);
+        spheres.push_back(Sphere(sphere_position, mouth_radius, mouth_material));
+    }
+}
+
+void build_snowman(Scene &scene) {
+    add_snowman(scene, scene.spheres);
+    snowman_lights(scene);
+}
+
+void build_dressed_snowman(Scene &scene) {
+    add_snowman(scene, scene.spheres, &scene.primitives);
+    const uint16_t hat = scene.add_material(Material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.05, 0.05, 0.05), 10.));
+    scene.primitives.push_back(Primitive::cylinder(Vec3f(0, 3.55, -16), Vec3f(0, 3.65, -16), 1.1, hat)); // le bord
+    scene.primitives.push_back(Primitive::cylinder(Vec3f(0, 3.6, -16), Vec3f(0, 4.6, -16), 0.75, hat));  // le haut
+    const uint16_t gift = scene.add_material(Material(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.8, 0.0, 0.0), 50.));
+    scene.primitives.push_back(Primitive::box(Vec3f(2, -4, -14.5), Vec3f(3, -3, -13.5), gift));
+    snowman_lights(scene);
+}
+
+void build_snowman_crowd(Scene &scene, int count, uint32_t seed) {
+    scene.objects.push_back(SphereGroup());
+    add_snowman(scene, scene.objects.back().spheres);
+    const int object = static_cast<int>(scene.objects.size() - 1);
+
+    // a square grid behind the checkerboard, every snowman turned and scaled around its base
+    const Vec3f base(0, -3.7, -16);
+    const int side = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(count))));
+    const float spacing = 5;
+    uint32_t state = seed;
+    for (int i = 0; i < count; i++) {
+        Instance inst;
+        inst.object = object;
+        const Vec3f offset((i % side - (side - 1) * .5f) * spacing, 0, -(i / side) * spacing);
+        inst.xf = Transform::around_y(base, uniform(state, -1, 1), uniform(state, .7, 1.2), offset);
+        scene.instances.push_back(inst);
+    }
+    snowman_lights(scene);
+}
+
+void add_light_field(Scene &scene, int count, uint32_t seed) {
+    uint32_t state = seed;
+    const float intensity = 5.f / std::max(1, count); // as bright as the three snowman lights together
+    for (int i = 0; i < count; i++)
+        scene.lights.push_back(Light(Vec3f(uniform(state, -40, 40), uniform(state, 1, 30), uniform(state, -80, 10)), intensity));
+}
+
+void animate_snowman(Scene &scene, const std::vector<Sphere> &rest, float t) {
+    const Vec3f neck(0, 1.2, -16);
+    const float angle = .15f * sinf(2 * float(M_PI) * t), c = cosf(angle), s = sinf(angle);
+    for (size_t i = 0; i < rest.size() && i < scene.spheres.size(); i++) {
+        if (rest[i].center.y < 2) continue; // the head, the eyes, the nose and the mouth
+        const Vec3f d = rest[i].center - neck;
+        scene.spheres[i].center = neck + Vec3f(c * d.x - s * d.y, s * d.x + c * d.y, d.z); // rotation around z
+    }
+}
+
+int instance_snowman_head(Scene &scene) {
+    SphereGroup head;
+    std::vector<Sphere> body;
+    for (size_t i = 0; i < scene.spheres.size(); i++)
+        (scene.spheres[i].center.y < 2 ? body : head.spheres).push_back(scene.spheres[i]);
+    scene.spheres.swap(body);
+    scene.objects.push_back(head);
+    Instance inst;
+    inst.object = static_cast<int>(scene.objects.size() - 1);
+    scene.instances.push_back(inst);
+    return static_cast<int>(scene.instances.size() - 1);
+}
+
+Transform snowman_head_sway(float t) {
+    return Transform::around_z(Vec3f(0, 1.2, -16), .15f * sinf(2 * float(M_PI) * t));
+}
+
+void build_sphere_field(Scene &scene, int count, uint32_t seed) {
+    const uint16_t palette[] = {
+        scene.add_material(Material(1.0, Vec4f(0.75, 0.1, 0.0, 0.0), Vec3f(1.0, 1.0, 1.0), 50.)),
+        scene.add_material(Material(1.0, Vec4f(0.6, 0.3, 0.1, 0.0), Vec3f(0.8, 0.0, 0.0), 50.)),
+        scene.add_material(Material(1.0, Vec4f(0.9, 0.1, 0.0, 0.0), Vec3f(0.35, 0.16, 0.08), 10.)),
+        scene.add_material(Material(1.5, Vec4f(0.0, 0.5, 0.1, 0.8), Vec3f(0.6, 0.7, 0.8), 125.)),
+        scene.add_material(Material(1.0, Vec4f(0.0, 10.0, 0.8, 0.0), Vec3f(1.0, 1.0, 1.0), 1425.)),
+    };
+    uint32_t state = seed;
+    for (int i = 0; i < count; i++) {
+        Vec3f center(uniform(state, -9.5, 9.5), uniform(state, -3.9, 6), uniform(state, -29.5, -10.5));
+        float radius = uniform(state, 0.03, 0.15);
+        scene.spheres.push_back(Sphere(center, radius, palette[lcg(state) % 5]));
+    }
+    snowman_lights(scene);
+}
+
+Model make_torus(const Vec3f &center, float major_radius, float minor_radius, int rings, int sides) {
+    std::vector<Vec3f> verts;
+    std::vector<Vec3i> faces;
+    verts.reserve(rings * sides);
+    faces.reserve(2 * rings * sides);
+    for (int i = 0; i < rings; i++) {
+        const float u = 2 * float(M_PI) * i / rings;
+        for (int j = 0; j < sides; j++) {
+            const float v = 2 * float(M_PI) * j / sides;
+            const float r = major_radius + minor_radius * cosf(v);
+            verts.push_back(center + Vec3f(r * cosf(u), minor_radius * sinf(v), r * sinf(u)));
+        }
+    }
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < sides; j++) {
+            int a = i * sides + j, b = ((i + 1) % rings) * sides + j;
+            int c = ((i + 1) % rings) * sides + (j + 1) % sides, d = i * sides + (j + 1) % sides;
+            faces.push_back(Vec3i(a, b, c));
+            faces.push_back(Vec3i(a, c, d));
+        }
+    }
+    return Model(verts, faces);
+}
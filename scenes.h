@@ -0,0 +1,41 @@
+#ifndef __SCENES_H__
+#define __SCENES_H__
+#include <cstdint>
+#include "scene.h"
+#include "model.h"
+
+float lerp(float a, float b, float t);
+Vec3f lerp(const Vec3f &a, const Vec3f &b, float t);
+
+// the snowman on the checkerboard, with its three lights
+void build_snowman(Scene &scene);
+
+// The spheres of the snowman are appended to `spheres` (the scene's or an object's), its materials to the scene.
+// With `primitives`, the nose is a cone appended there instead of a row of spheres.
+void add_snowman(Scene &scene, std::vector<Sphere> &spheres, std::vector<Primitive> *primitives = nullptr);
+
+// the snowman with a cone for a nose, a top hat made of two cylinders and a box at its feet
+void build_dressed_snowman(Scene &scene);
+
+// `count` instances of a single snowman object on a grid, randomly turned and scaled
+void build_snowman_crowd(Scene &scene, int count, uint32_t seed = 1);
+
+// `count` point lights scattered over and around the crowd, their intensities summing to 5
+void add_light_field(Scene &scene, int count, uint32_t seed = 1);
+
+// Sways the head of the snowman (the spheres above the neck) from side to side, t in [0, 1] is one
+// period. rest holds the spheres as build_snowman made them; call scene.refit() afterwards.
+void animate_snowman(Scene &scene, const std::vector<Sphere> &rest, float t);
+// For motion blur: moves the head of the snowman out of scene.spheres into an object of its own, placed
+// by an identity instance whose index is returned; call scene.build() afterwards.
+int instance_snowman_head(Scene &scene);
+// the placement of that head at t, the same sway as animate_snowman
+Transform snowman_head_sway(float t);
+
+// `count` small random spheres above the checkerboard, same lights as the snowman
+void build_sphere_field(Scene &scene, int count, uint32_t seed = 1);
+
+// tessellated torus lying in the xz plane, 2 * rings * sides triangles
+Model make_torus(const Vec3f &center, float major_radius, float minor_radius, int rings, int sides);
+
+#endif //__SCENES_H__
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include "scheduler.h"
+
+namespace {
+    uint32_t part1by1(uint32_t x) { // interleave the lower 16 bits of x with zeros
+        x &= 0x0000ffff;
+        x = (x ^ (x << 8)) & 0x00ff00ff;
+        x = (x ^ (x << 4)) & 0x0f0f0f0f;
+        x = (x ^ (x << 2)) & 0x33333333;
+        x = (x ^ (x << 1)) & 0x55555555;
+        return x;
+    }
+
+    uint32_t morton2(uint32_t x, uint32_t y) {
+        return part1by1(x) | (part1by1(y) << 1);
+    }
+
+    inline uint64_t pack(uint32_t begin, uint32_t end) {
+        return (static_cast<uint64_t>(begin) << 32) | end;
+    }
+}
+
+std::vector<Tile> make_tiles(int width, int height, int tile_size) {
+    tile_size = std::max(1, tile_size);
+    const int nx = (width + tile_size - 1) / tile_size;
+    const int ny = (height + tile_size - 1) / tile_size;
+    std::vector<std::pair<uint32_t, Tile> > keyed;
+    keyed.reserve(nx * ny);
+    for (int ty = 0; ty < ny; ty++) {
+        for (int tx = 0; tx < nx; tx++) {
+            Tile t = {tx * tile_size, ty * tile_size,
+                      std::min(width, (tx + 1) * tile_size), std::min(height, (ty + 1) * tile_size)};
+            keyed.push_back(std::make_pair(morton2(tx, ty), t));
+        }
+    }
+    std::sort(keyed.begin(), keyed.end(),
+              [](const std::pair<uint32_t, Tile> &a, const std::pair<uint32_t, Tile> &b) { return a.first < b.first; });
+    std::vector<Tile> tiles(keyed.size());
+    for (size_t i = 0; i < keyed.size(); i++) tiles[i] = keyed[i].second;
+    return tiles;
+}
+
+TileScheduler::TileScheduler(size_t ntiles, int nthreads) : queues(std::max(1, nthreads)) {
+    const size_t n = queues.size();
+    for (size_t t = 0; t < n; t++) {
+        uint32_t begin = static_cast<uint32_t>(ntiles * t / n);
+        uint32_t end = static_cast<uint32_t>(ntiles * (t + 1) / n);
+        queues[t].range.store(pack(begin, end), std::memory_order_relaxed);
+    }
+}
+
+bool TileScheduler::pop_front(Queue &q, size_t &tile) {
+    uint64_t r = q.range.load(std::memory_order_relaxed);
+    for (;;) {
+        uint32_t begin = static_cast<uint32_t>(r >> 32), end = static_cast<uint32_t>(r);
+        if (begin >= end) return false;
+        if (q.range.compare_exchange_weak(r, pack(begin + 1, end), std::memory_order_acq_rel)) {
+            tile = begin;
+            return true;
+        }
+    }
+}
+
+bool TileScheduler::pop_back(Queue &q, size_t &tile) {
+    uint64_t r = q.range.load(std::memory_order_relaxed);
+    for (;;) {
+        uint32_t begin = static_cast<uint32_t>(r >> 32), end = static_cast<uint32_t>(r);
+        if (begin >= end) return false;
+        if (q.range.compare_exchange_weak(r, pack(begin, end - 1), std::memory_order_acq_rel)) {
+            tile = end - 1;
+            return true;
+        }
+    }
+}
+
+bool TileScheduler::next(int thread, size_t &tile, bool &stolen) {
+    stolen = false;
+    if (pop_front(queues[thread], tile)) return true;
+    const int n = nthreads();
+    for (int k = 1; k < n; k++) { // victims are visited starting with the neighbour
+        if (pop_back(queues[(thread + k) % n], tile)) {
+            stolen = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void merge_thread_stats(std::vector<ThreadStats> &stats, const std::vector<ThreadStats> &more) {
+    if (stats.size() < more.size()) stats.resize(more.size(), ThreadStats{0, 0, 0, 0, 0, 0});
+    for (size_t t = 0; t < more.size(); t++) {
+        stats[t].busy_ms += more[t].busy_ms;
+        stats[t].tiles += more[t].tiles;
+        stats[t].stolen += more[t].stolen;
+        stats[t].arena_bytes += more[t].arena_bytes;
+        stats[t].arena_peak = std::max(stats[t].arena_peak, more[t].arena_peak);
+        stats[t].arena_blocks += more[t].arena_blocks;
+    }
+}
+
+void print_thread_stats(const std::vector<ThreadStats> &stats) {
+    double total = 0, longest = 0;
+    for (size_t t = 0; t < stats.size(); t++) {
+        std::cerr << "# thread " << t << ": " << stats[t].tiles << " tiles (" << stats[t].stolen << " stolen), busy "
+                  << stats[t].busy_ms << " ms, arena " << (stats[t].tiles ? stats[t].arena_bytes / stats[t].tiles : 0)
+                  << " bytes per tile (peak " << stats[t].arena_peak << "), " << stats[t].arena_blocks << " heap blocks" << std::endl;
+        total += stats[t].busy_ms;
+        longest = std::max(longest, stats[t].busy_ms);
+    }
+    if (longest > 0)
+        std::cerr << "# load balance: " << 100. * total / (longest * stats.size()) << "%" << std::endl;
+}
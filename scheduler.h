@@ -0,0 +1,97 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <iostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "arena.h"
+#include "profile.h"
+
+struct Tile {
+    int x0, y0, x1, y1; // pixel range [x0,x1) x [y0,y1)
+};
+
+// Splits the image in tile_size x tile_size tiles sorted along a Morton (Z-order) curve,
+// so that consecutive tiles of one thread are spatially close.
+std::vector<Tile> make_tiles(int width, int height, int tile_size);
+
+struct ThreadStats {
+    double busy_ms;
+    int tiles;
+    int stolen;
+    uint64_t arena_bytes;  // transient bytes taken from the thread arena, over all the tiles
+    size_t arena_peak;     // most of them in one tile
+    uint64_t arena_blocks; // heap allocations of the arena during the run
+};
+
+// Each thread owns a contiguous range of tiles; it pops from the front of its own range and,
+// once empty, steals single tiles from the back of the other ranges. A range is one atomic
+// word packing [begin, end), so pops and steals are lock-free.
+class TileScheduler {
+public:
+    TileScheduler(size_t ntiles, int nthreads);
+
+    bool next(int thread, size_t &tile, bool &stolen);
+
+    int nthreads() const { return static_cast<int>(queues.size()); }
+
+private:
+    struct Queue {
+        std::atomic<uint64_t> range;
+        char pad[64 - sizeof(std::atomic<uint64_t>)]; // one cache line each, no false sharing between owners
+    };
+    std::vector<Queue> queues;
+
+    bool pop_front(Queue &q, size_t &tile);
+    bool pop_back(Queue &q, size_t &tile);
+};
+
+void print_thread_stats(const std::vector<ThreadStats> &stats);
+// adds the statistics of another run of the same team
+void merge_thread_stats(std::vector<ThreadStats> &stats, const std::vector<ThreadStats> &more);
+
+// Calls f(tile) for every tile from all the threads of an OpenMP team. The arena of the thread is reset after each tile.
+template<typename F>
+std::vector<ThreadStats> parallel_for_tiles(const std::vector<Tile> &tiles, F f) {
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    TileScheduler scheduler(tiles.size(), nthreads);
+    std::vector<ThreadStats> stats(nthreads, ThreadStats{0, 0, 0, 0, 0, 0});
+
+#pragma omp parallel num_threads(nthreads)
+    {
+#ifdef _OPENMP
+        const int t = omp_get_thread_num();
+#else
+        const int t = 0;
+#endif
+        size_t tile;
+        bool stolen;
+        Arena &arena = thread_arena();
+        const uint64_t blocks = arena.blocks_allocated();
+        while (scheduler.next(t, tile, stolen)) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            {
+                PROFILE_SCOPE("tile");
+                f(tiles[tile]);
+            }
+            stats[t].busy_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            stats[t].tiles++;
+            stats[t].stolen += stolen;
+            stats[t].arena_bytes += arena.allocated();
+            stats[t].arena_peak = std::max(stats[t].arena_peak, arena.allocated());
+            arena.reset();
+        }
+        stats[t].arena_blocks = arena.blocks_allocated() - blocks;
+    }
+    return stats;
+}
+
+#endif //__SCHEDULER_H__
@@ -0,0 +1,453 @@
+#include <map>
+#include <cmath>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <future>
+#include <thread>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "server.h"
+#include "render.h"
+#include "image_writer.h"
+
+namespace {
+    typedef std::chrono::steady_clock Clock;
+
+    const size_t max_request = 16 * 1024; // bytes of request line and headers
+    const int max_side = 8192;            // pixels of an image side
+    const int max_spp = 4096;
+    const double max_budget_ms = 60 * 1000; // of a budget render, longer requests are clamped to it
+    const int max_connections = 256;        // handled at once, one thread each; the next ones get a 503
+    const int socket_timeout_s = 30;        // a client that sends or reads nothing for that long is dropped
+    const double view_frame_ms = 30; // of passes per frame of the viewer, more when a single pass takes longer
+
+    struct Request {
+        std::string method, path;
+        std::map<std::string, std::string> query;
+    };
+
+    int hex_digit(const char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    std::string url_decode(const std::string &s) {
+        std::string out;
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] == '+') out.push_back(' ');
+            else if (s[i] == '%' && i + 2 < s.size() && hex_digit(s[i + 1]) >= 0 && hex_digit(s[i + 2]) >= 0) {
+                out.push_back(static_cast<char>(hex_digit(s[i + 1]) * 16 + hex_digit(s[i + 2])));
+                i += 2;
+            } else out.push_back(s[i]);
+        }
+        return out;
+    }
+
+    // the request line and the headers, the headers themselves are not needed
+    bool read_request(const int fd, Request &request) {
+        std::string head;
+        char buffer[4096];
+        while (head.find("\r\n\r\n") == std::string::npos && head.find("\n\n") == std::string::npos) {
+            if (head.size() > max_request) return false;
+            const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            head.append(buffer, static_cast<size_t>(n));
+        }
+        std::istringstream line(head.substr(0, head.find_first_of("\r\n")));
+        std::string target, version;
+        if (!(line >> request.method >> target >> version) || version.compare(0, 5, "HTTP/")) return false;
+        const size_t mark = target.find('?');
+        request.path = url_decode(target.substr(0, mark));
+        if (mark == std::string::npos) return true;
+        std::istringstream query(target.substr(mark + 1));
+        std::string pair;
+        while (std::getline(query, pair, '&')) {
+            const size_t eq = pair.find('=');
+            if (eq != std::string::npos) request.query[url_decode(pair.substr(0, eq))] = url_decode(pair.substr(eq + 1));
+        }
+        return true;
+    }
+
+    bool send_all(const int fd, const char *p, size_t size) {
+        while (size) {
+            const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void respond(const int fd, const int status, const char *reason, const char *content_type, const std::vector<char> &body,
+                 const std::string &headers = std::string()) {
+        std::ostringstream head;
+        head << "HTTP/1.0 " << status << " " << reason << "\r\nContent-Type: " << content_type << "\r\nContent-Length: "
+             << body.size() << "\r\nConnection: close\r\n" << headers << "\r\n";
+        const std::string h = head.str();
+        if (send_all(fd, h.data(), h.size())) send_all(fd, body.data(), body.size());
+    }
+
+    void respond_text(const int fd, const int status, const char *reason, const std::string &text,
+                      const char *content_type = "text/plain") {
+        respond(fd, status, reason, content_type, std::vector<char>(text.begin(), text.end()));
+    }
+
+    const char *content_type(const ImageFormat format) {
+        switch (format) {
+            case FORMAT_JPG: return "image/jpeg";
+            case FORMAT_PNG: return "image/png";
+            case FORMAT_PPM: return "image/x-portable-pixmap";
+            default: return "application/octet-stream";
+        }
+    }
+
+    bool same_camera(const Camera &a, const Camera &b) {
+        return (a.position - b.position).norm() == 0 && (a.forward - b.forward).norm() == 0 && (a.up - b.up).norm() == 0 &&
+               a.fov == b.fov;
+    }
+
+    // The page of GET /view: drag to orbit around the target, wheel to move closer. It fetches the next
+    // frame as soon as the last one arrived, with the camera of the moment, so the frame rate follows the
+    // cost of a frame and an unchanged camera refines the image.
+    std::string view_page(const std::string &scene, const int width, const int height, const Vec3f &eye, const Vec3f &target) {
+        std::ostringstream page;
+        page << "<!doctype html>\n<title>snowman: " << scene << "</title>\n"
+             << "<body style=\"margin:0;background:#222;color:#ccc;font:12px monospace\">\n"
+             << "<img id=\"view\" width=\"" << width << "\" height=\"" << height << "\" style=\"display:block;cursor:move\">\n"
+             << "<div id=\"info\" style=\"padding:4px\"></div>\n<script>\n"
+             << "const scene = \"" << scene << "\", width = " << width << ", height = " << height << ";\n"
+             << "const target = [" << target.x << ", " << target.y << ", " << target.z << "];\n"
+             << "const eye = [" << eye.x << ", " << eye.y << ", " << eye.z << "];\n"
+             << R"js(const d = eye.map((e, i) => e - target[i]);
+let r = Math.max(1e-3, Math.hypot(d[0], d[1], d[2])), yaw = Math.atan2(d[0], d[2]), pitch = Math.asin(d[1] / r);
+let drag = null, frames = 0, since = performance.now();
+const img = document.getElementById("view"), info = document.getElementById("info");
+img.onmousedown = e => { drag = [e.clientX, e.clientY]; e.preventDefault(); };
+window.onmouseup = () => { drag = null; };
+window.onmousemove = e => {
+    if (!drag) return;
+    yaw -= (e.clientX - drag[0]) * .01;
+    pitch = Math.max(-1.5, Math.min(1.5, pitch + (e.clientY - drag[1]) * .01));
+    drag = [e.clientX, e.clientY];
+};
+img.onwheel = e => { r *= Math.exp(e.deltaY * .001); e.preventDefault(); };
+function camera() {
+    const p = [target[0] + r * Math.cos(pitch) * Math.sin(yaw), target[1] + r * Math.sin(pitch),
+               target[2] + r * Math.cos(pitch) * Math.cos(yaw)];
+    return p.concat(target).map(v => v.toFixed(4)).join(",");
+}
+async function run() {
+    for (;;) {
+        const response = await fetch("/frame?scene=" + scene + "&width=" + width + "&height=" + height + "&camera=" + camera());
+        if (!response.ok) { info.textContent = await response.text(); return; }
+        const url = URL.createObjectURL(await response.blob());
+        img.onload = () => URL.revokeObjectURL(url);
+        img.src = url;
+        frames++;
+        const now = performance.now();
+        if (now - since > 1000) {
+            info.textContent = (frames * 1000 / (now - since)).toFixed(1) + " fps, " + response.headers.get("X-Samples") +
+                               ", " + response.headers.get("X-Render-Ms") + " ms per frame";
+            frames = 0;
+            since = now;
+        }
+    }
+}
+run();
+</script>
+)js";
+        return page.str();
+    }
+
+    bool parse_int(const std::string &s, int lo, int hi, int &value) {
+        char *end = nullptr;
+        const long v = strtol(s.c_str(), &end, 10);
+        if (s.empty() || *end || v < lo || v > hi) return false;
+        value = static_cast<int>(v);
+        return true;
+    }
+}
+
+struct RenderServer::Job {
+    ServedScene *scene;
+    Camera camera;
+    int width, height, spp;
+    double budget_ms;
+    ImageFormat format;
+    ToneMap tonemap;
+
+    std::vector<char> image;
+    bool ok, view; // view: a frame of the interactive view
+    std::string samples; // of the view frame
+    double queued_ms, render_ms;
+    Clock::time_point submitted;
+    std::promise<void> finished;
+};
+
+RenderServer::RenderServer(const ServerSettings &settings) : settings(settings), running(0), done(0), connections(0) {}
+
+void RenderServer::add_scene(const std::string &id, Scene &scene) {
+    std::unique_ptr<ServedScene> s(new ServedScene());
+    s->id = id;
+    s->scene = &scene;
+    s->home = scene.camera;
+    s->view_width = s->view_height = 0;
+    scenes.push_back(std::move(s));
+}
+
+bool RenderServer::serve(std::string &error) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error = strerror(errno);
+        return false;
+    }
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(static_cast<uint16_t>(settings.port));
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(fd, 64)) {
+        error = "port " + std::to_string(settings.port) + ": " + strerror(errno);
+        close(fd);
+        return false;
+    }
+    // the threads live as long as the process, serve() does not return from here on
+    for (int r = 0; r < std::max(1, settings.renderers); r++) std::thread(&RenderServer::render_jobs, this).detach();
+    std::cerr << "# server: listening on port " << settings.port << ", " << scenes.size() << " scenes, "
+              << std::max(1, settings.renderers) << " renderers" << std::endl;
+    for (;;) {
+        const int connection = accept(fd, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                std::cerr << "# server: " << strerror(errno) << std::endl;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100)); // out of descriptors, until some are closed
+            }
+            continue;
+        }
+        setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        timeval timeout;
+        timeout.tv_sec = socket_timeout_s;
+        timeout.tv_usec = 0;
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (++connections > max_connections) { // answered from here, without a thread
+            respond_text(connection, 503, "Service Unavailable", "too many connections\n");
+            close(connection);
+            connections--;
+            continue;
+        }
+        std::thread([this, connection]() {
+            handle(connection);
+            close(connection);
+            connections--;
+        }).detach();
+    }
+}
+
+void RenderServer::handle(const int fd) {
+    Request request;
+    if (!read_request(fd, request)) {
+        respond_text(fd, 400, "Bad Request", "malformed request\n");
+        return;
+    }
+    if (request.method != "GET") {
+        respond_text(fd, 405, "Method Not Allowed", "only GET\n");
+        return;
+    }
+    if (request.path == "/scenes") {
+        std::string json = "[";
+        for (size_t s = 0; s < scenes.size(); s++) json += (s ? ", \"" : "\"") + scenes[s]->id + "\"";
+        respond_text(fd, 200, "OK", json + "]\n", "application/json");
+        return;
+    }
+    if (request.path == "/status") {
+        std::ostringstream json;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            json << "{\"queued\": " << queue.size() << ", \"rendering\": " << running << ", \"done\": " << done << "}\n";
+        }
+        respond_text(fd, 200, "OK", json.str(), "application/json");
+        return;
+    }
+    if (request.path != "/render" && request.path != "/view" && request.path != "/frame") {
+        respond_text(fd, 404, "Not Found", "unknown path " + request.path + "\n");
+        return;
+    }
+
+    std::map<std::string, std::string> &q = request.query;
+    std::shared_ptr<Job> job(new Job());
+    job->scene = nullptr;
+    const std::string id = q.count("scene") ? q["scene"] : scenes.empty() ? std::string() : scenes[0]->id;
+    for (size_t s = 0; s < scenes.size(); s++)
+        if (scenes[s]->id == id) job->scene = scenes[s].get();
+    if (!job->scene) {
+        respond_text(fd, 404, "Not Found", "unknown scene " + id + "\n");
+        return;
+    }
+    job->camera = job->scene->home;
+    job->width = 1500;
+    job->height = 900;
+    job->spp = 1;
+    job->budget_ms = 0;
+    job->format = FORMAT_JPG;
+    job->tonemap = settings.tonemap;
+    job->view = request.path == "/frame";
+    if (request.path != "/render") { // a window-sized default, the view renders all the time
+        job->width = 750;
+        job->height = 450;
+    }
+    std::string bad;
+    if (q.count("width") && !parse_int(q["width"], 1, max_side, job->width)) bad = "width";
+    if (q.count("height") && !parse_int(q["height"], 1, max_side, job->height)) bad = "height";
+    if (q.count("spp") && !parse_int(q["spp"], 1, max_spp, job->spp)) bad = "spp";
+    if (q.count("budget")) {
+        job->budget_ms = atof(q["budget"].c_str());
+        if (!(job->budget_ms > 0) || !std::isfinite(job->budget_ms)) bad = "budget";
+        job->budget_ms = std::min(job->budget_ms, max_budget_ms);
+    }
+    if (q.count("format") && !image_format("." + q["format"], job->format)) bad = "format";
+    if (q.count("tonemap") && !parse_tonemap(q["tonemap"].c_str(), job->tonemap)) bad = "tonemap";
+    if (q.count("fov")) {
+        const float fov = static_cast<float>(atof(q["fov"].c_str()));
+        if (!(fov > 0 && fov < 180)) bad = "fov"; // nan included
+        job->camera.fov = fov * M_PI / 180;
+    }
+    if (q.count("camera")) {
+        Vec3f position, target;
+        if (sscanf(q["camera"].c_str(), "%f,%f,%f,%f,%f,%f", &position.x, &position.y, &position.z, &target.x, &target.y,
+                   &target.z) != 6 || !std::isfinite((target - position).norm()) || (target - position).norm() == 0) {
+            bad = "camera"; // sscanf takes nan and inf, and a target at the position leaves no axes
+        } else {
+            job->camera.position = position;
+            job->camera.look_at(target);
+        }
+    }
+    Vec3f target;
+    if (q.count("target") && (sscanf(q["target"].c_str(), "%f,%f,%f", &target.x, &target.y, &target.z) != 3 ||
+                              !std::isfinite(target.norm()))) bad = "target";
+    if (job->view && (job->spp > 1 || job->budget_ms > 0 || job->format != FORMAT_JPG)) bad = "spp, budget or format of a frame";
+    if (!bad.empty()) {
+        respond_text(fd, 400, "Bad Request", "bad parameter " + bad + "\n");
+        return;
+    }
+    if (request.path == "/view") {
+        const Camera &c = job->camera;
+        if (!q.count("target")) { // what the center of the image shows, the scene is only read
+            Hit hit;
+            target = scene_intersect(c.position, c.forward, *job->scene->scene, hit) ? hit.point : c.position + c.forward * 10;
+        }
+        respond_text(fd, 200, "OK", view_page(job->scene->id, job->width, job->height, c.position, target), "text/html");
+        return;
+    }
+
+    std::future<void> finished = job->finished.get_future();
+    job->submitted = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queue.size() >= settings.max_queue) {
+            respond_text(fd, 503, "Service Unavailable", "too many jobs waiting\n");
+            return;
+        }
+        queue.push_back(job);
+    }
+    queued.notify_one();
+    finished.wait();
+    if (!job->ok) {
+        respond_text(fd, 500, "Internal Server Error", "can not encode the image\n");
+        return;
+    }
+    std::ostringstream headers;
+    headers << "X-Queue-Ms: " << job->queued_ms << "\r\nX-Render-Ms: " << job->render_ms << "\r\n";
+    if (job->view) headers << "X-Samples: " << job->samples << "\r\nCache-Control: no-store\r\n";
+    respond(fd, 200, "OK", content_type(job->format), job->image, headers.str());
+}
+
+void RenderServer::render_jobs() {
+    for (;;) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [this]() { return !queue.empty(); });
+            job = queue.front();
+            queue.pop_front();
+            running++;
+        }
+        run(*job);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+            done++;
+        }
+        job->finished.set_value();
+    }
+}
+
+void RenderServer::run(Job &job) {
+    std::vector<Vec3f> framebuffer;
+    std::string quality;
+    Clock::time_point start;
+    {
+        std::lock_guard<std::mutex> lock(job.scene->mutex);
+        start = Clock::now();
+        Scene &scene = *job.scene->scene;
+        scene.camera = job.camera;
+        if (job.view) {
+            run_view(job, framebuffer, quality);
+        } else if (job.budget_ms > 0) {
+            const BudgetResult budget = render_budget(scene, job.width, job.height, job.budget_ms, framebuffer);
+            quality = "depth " + std::to_string(budget.depth) + ", 1/" + std::to_string(budget.stride) + " resolution, " +
+                      std::to_string(budget.samples) + " spp";
+        } else if (job.spp > 1) {
+            ProgressiveRenderer renderer(scene, job.width, job.height);
+            while (renderer.previewing() || renderer.samples() < job.spp) renderer.pass();
+            renderer.resolve(framebuffer);
+            quality = std::to_string(job.spp) + " spp";
+        } else {
+            render(scene, job.width, job.height, framebuffer);
+            quality = "1 spp";
+        }
+    }
+    std::vector<unsigned char> rgb;
+    if (job.format != FORMAT_PFM) tonemap(framebuffer, rgb, job.tonemap);
+    job.ok = encode_image(job.format, job.width, job.height, rgb.data(), framebuffer.data(), job.image);
+    job.queued_ms = std::chrono::duration<double, std::milli>(start - job.submitted).count();
+    job.render_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    if (job.view && quality.empty()) return; // the view refining, not worth a line per frame
+    std::cerr << "# server: " << job.scene->id << " " << job.width << "x" << job.height << ", " << quality << ", "
+              << job.queued_ms << " ms queued, " << job.render_ms << " ms" << std::endl;
+}
+
+// Renders passes of the view of the scene, under the lock of the scene, and resolves it into framebuffer.
+// quality is set when the view starts again.
+void RenderServer::run_view(Job &job, std::vector<Vec3f> &framebuffer, std::string &quality) {
+    ServedScene &served = *job.scene;
+    if (!served.view || !same_camera(served.view_camera, job.camera) || served.view_width != job.width ||
+        served.view_height != job.height) {
+        served.view.reset(new ProgressiveRenderer(*served.scene, job.width, job.height));
+        served.view_camera = job.camera;
+        served.view_width = job.width;
+        served.view_height = job.height;
+        quality = "view restarted";
+    }
+    ProgressiveRenderer &view = *served.view;
+    const Clock::time_point start = Clock::now();
+    do view.pass(); // a moving camera gets the coarsest preview alone, the fastest frame
+    while (quality.empty() && std::chrono::duration<double, std::milli>(Clock::now() - start).count() < view_frame_ms);
+    job.samples = view.previewing() ? "1/" + std::to_string(view.lattice()) + " preview" : std::to_string(view.samples()) + " spp";
+    view.resolve(framebuffer);
+}
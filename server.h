@@ -0,0 +1,88 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <condition_variable>
+#include "scene.h"
+#include "render.h"
+#include "tonemap.h"
+
+// Render service for previews: a long-running process that keeps the envmap and the compiled scenes in
+// memory and renders images on HTTP requests, so that a request only pays for its own rays.
+//
+//   GET /render?scene=ID&width=W&height=H&camera=px,py,pz,tx,ty,tz&fov=DEG&spp=N&budget=MS&format=F&tonemap=OP
+//       the image in the body. The camera and the field of view default to the scene's, spp to 1 (more
+//       samples are accumulated by the progressive renderer), budget renders with render_budget instead,
+//       format is jpg (default), png, ppm or pfm and tonemap one of the --tonemap operators.
+//   GET /scenes  the scene ids, as JSON
+//   GET /status  the jobs waiting, rendering and done, as JSON
+//   GET /view?scene=ID&width=W&height=H&target=x,y,z
+//       interactive viewer: a page that orbits the camera around target (by default the point that the
+//       center of the image shows) with the mouse, and shows the image of GET /frame as it is refined.
+//   GET /frame?scene=ID&width=W&height=H&camera=px,py,pz,tx,ty,tz&fov=DEG&tonemap=OP
+//       the next JPEG of the view of the scene: its progressive renderer keeps its samples from one frame to
+//       the next while the camera and the size stay the same, and starts again from the coarse previews
+//       when they change. A frame renders passes for some 30 ms, or the one pass that takes longer; the first
+//       frame of a camera only its coarsest preview.
+//
+// Every connection has its own thread, which parses the request, queues a job and waits for its image.
+// The renderer threads take the jobs in order and render each one with a whole OpenMP team, which stays
+// alive from one job to the next. A scene renders one job at a time, as the camera of the job is set in
+// it; with several renderers, jobs on different scenes render at the same time. A request that would
+// have more than max_queue jobs waiting gets a 503.
+
+struct ServerSettings {
+    int port;
+    int renderers;    // jobs rendered at the same time
+    size_t max_queue; // jobs waiting at most
+    ToneMap tonemap;  // unless the request asks for another
+};
+
+class RenderServer {
+public:
+    explicit RenderServer(const ServerSettings &settings);
+
+    // the scene stays the caller's, built and with its envmap set; it must outlive the server
+    void add_scene(const std::string &id, Scene &scene);
+
+    // Listens on the port and serves the requests until the process is killed.
+    // Returns only if the port can not be listened on.
+    bool serve(std::string &error);
+
+private:
+    RenderServer(const RenderServer &);
+    RenderServer &operator=(const RenderServer &);
+
+    struct ServedScene {
+        std::string id;
+        Scene *scene;
+        Camera home;      // the camera of the scene, for the requests without one
+        std::mutex mutex; // held while a job renders the scene
+        // the interactive view, under mutex
+        std::unique_ptr<ProgressiveRenderer> view;
+        Camera view_camera;
+        int view_width, view_height;
+    };
+    struct Job;
+
+    const ServerSettings settings;
+    std::vector<std::unique_ptr<ServedScene> > scenes;
+
+    std::mutex mutex; // the queue and the counters
+    std::condition_variable queued;
+    std::deque<std::shared_ptr<Job> > queue;
+    int running;
+    long long done;
+    std::atomic<int> connections; // handled by their threads now, at most max_connections
+
+    void handle(int fd); // one connection
+    void render_jobs();  // a renderer thread
+    void run(Job &job);
+    void run_view(Job &job, std::vector<Vec3f> &framebuffer, std::string &quality);
+};
+
+#endif //__SERVER_H__
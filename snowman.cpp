@@ -0,0 +1,59 @@
+#include <utility>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "snowman.h"
+#include "render.h"
+#include "scenes.h"
+#include "scene_io.h"
+
+bool SnowmanScene::load(const std::string &name, const std::string &envmap_file, std::string &error) {
+    if (loaded) {
+        error = "the scene is already loaded";
+        return false;
+    }
+    Scene scene; // into scene_ once all is loaded, a failed load leaves nothing behind
+    if (name == "snowman" || name == "dressed") {
+        if (name == "snowman") build_snowman(scene);
+        else build_dressed_snowman(scene);
+        scene.build();
+    } else if (!load_scene(name, scene, error)) return false;
+    if (!envmap_file.empty() && !envmap.load(envmap_file, TEXELS_FLOAT, error)) return false;
+    scene_ = std::move(scene);
+    if (!envmap_file.empty()) scene_.envmap = &envmap;
+    loaded = true;
+    return true;
+}
+
+RenderStatus render_scene(const SnowmanScene &scene, const RenderRequest &request, std::string &error) {
+    if (!scene.ok()) {
+        error = "scene not loaded";
+        return RENDER_INVALID;
+    }
+    if (!request.pixels || request.width <= 0 || request.height <= 0) {
+        error = request.pixels ? "empty image" : "no pixels to render into";
+        return RENDER_INVALID;
+    }
+    const size_t ntiles = make_tiles(request.width, request.height, 16).size(); // those of render_view
+    std::atomic<size_t> done(0);
+    std::function<void(const Tile &)> tile_done;
+    if (request.progress) tile_done = [&](const Tile &) { request.progress(float(++done) / ntiles); };
+
+#ifdef _OPENMP
+    // the team size is an ICV of the calling thread, the other renders keep theirs
+    const int threads = omp_get_max_threads();
+    if (request.threads > 0) omp_set_num_threads(request.threads);
+#endif
+    const Scene &s = scene.scene();
+    size_t skipped = 0;
+    render_view(s, request.camera ? *request.camera : s.camera, request.width, request.height, request.pixels, request.cancel,
+                tile_done, &skipped);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    if (skipped) { // a cancel that came once every pixel was traced leaves a complete image
+        error = "cancelled";
+        return RENDER_CANCELLED;
+    }
+    return RENDER_DONE;
+}
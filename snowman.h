@@ -0,0 +1,65 @@
+#ifndef __SNOWMAN_H__
+#define __SNOWMAN_H__
+#include <atomic>
+#include <string>
+#include <functional>
+#include "geometry.h"
+#include "scene.h"
+#include "envmap.h"
+
+// Embedding API of libsnowman, for the services that render without the command line of projet. A
+// SnowmanScene owns a built scene and its envmap; render_scene() only reads it, so any number of renders of
+// the same scene (or of different ones) may run at once from the threads of the caller, each with its
+// camera, its buffer and its own OpenMP team. Nothing is global besides the per-thread counters and arenas.
+//
+//   SnowmanScene scene;
+//   if (!scene.load("snowman", "envmap.jpg", error)) ...
+//   std::vector<Vec3f> pixels(640 * 480);
+//   RenderRequest request(640, 480, pixels.data());
+//   request.cancel = &stop;                                  // std::atomic<bool>, set from any thread
+//   request.progress = [](float done) { ... };               // from the rendering threads
+//   if (render_scene(scene, request, error) == RENDER_DONE) ...
+class SnowmanScene {
+public:
+    SnowmanScene() : loaded(false) {}
+
+    // name is "snowman", "dressed" (the built-in scenes) or a scene file of scene_io.h; envmap_file, if not
+    // empty, an equirectangular image (8 bits or .hdr) for the background. Returns false with error set,
+    // and if the scene was already loaded.
+    bool load(const std::string &name, const std::string &envmap_file, std::string &error);
+    bool ok() const { return loaded; } // load() succeeded
+
+    // to change the settings (depths, light samples, materials) between the renders, never during one
+    Scene &scene() { return scene_; }
+    const Scene &scene() const { return scene_; }
+
+private:
+    SnowmanScene(const SnowmanScene &);
+    SnowmanScene &operator=(const SnowmanScene &);
+
+    Scene scene_;
+    EnvironmentMap envmap; // scene_.envmap points here
+    bool loaded;
+};
+
+struct RenderRequest {
+    int width, height;
+    Vec3f *pixels;                       // width x height linear colors, row by row, owned by the caller
+    const Camera *camera;                // the scene's if null
+    int threads;                         // of the OpenMP team of the render, 0: all the cores
+    const std::atomic<bool> *cancel;     // polled between the pixels, the render stops soon after it is set
+    std::function<void(float)> progress; // fraction of the image done, called from the rendering threads at once
+
+    RenderRequest(int width, int height, Vec3f *pixels)
+        : width(width), height(height), pixels(pixels), camera(nullptr), threads(0), cancel(nullptr) {}
+};
+
+enum RenderStatus {
+    RENDER_DONE,
+    RENDER_CANCELLED, // the pixels not reached yet keep what they held
+    RENDER_INVALID    // the scene is not loaded, no pixels or an empty image: error says which
+};
+
+RenderStatus render_scene(const SnowmanScene &scene, const RenderRequest &request, std::string &error);
+
+#endif //__SNOWMAN_H__
@@ -0,0 +1,242 @@
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include "sphere_soa.h"
+#include "bvh.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPHERE_SOA_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SPHERE_SOA_NEON
+#include <arm_neon.h>
+#endif
+
+void SphereSoA::clear() {
+    cx.clear();
+    cy.clear();
+    cz.clear();
+    r2.clear();
+    inv_r.clear();
+    mat.clear();
+    id.clear();
+}
+
+void SphereSoA::push_back(const Vec3f &center, float radius, uint16_t material, int sphere_id) {
+    cx.push_back(center.x);
+    cy.push_back(center.y);
+    cz.push_back(center.z);
+    r2.push_back(radius * radius);
+    inv_r.push_back(1.f / radius);
+    mat.push_back(material);
+    id.push_back(sphere_id);
+}
+
+void SphereSoA::update(size_t i, const Vec3f &center, float radius) {
+    cx[i] = center.x;
+    cy[i] = center.y;
+    cz[i] = center.z;
+    r2[i] = radius * radius;
+    inv_r[i] = 1.f / radius;
+}
+
+void SphereSoA::finalize() {
+    const size_t n = id.size();
+    cx.resize(n + padding, 0.f);
+    cy.resize(n + padding, 0.f);
+    cz.resize(n + padding, 0.f);
+    r2.resize(n + padding, -1.f); // never hit, the lanes are masked out anyway
+}
+
+namespace {
+    int kernel_scalar(const SphereSoA &s, int begin, int count, const Vec3f &orig, const Vec3f &dir, float &tmax) {
+        int best = -1;
+        for (int i = begin; i < begin + count; i++) {
+            float lx = s.cx[i] - orig.x, ly = s.cy[i] - orig.y, lz = s.cz[i] - orig.z;
+            float tca = lz * dir.z + ly * dir.y + lx * dir.x;
+            float d2 = lz * lz + ly * ly + lx * lx - tca * tca;
+            if (d2 > s.r2[i]) continue;
+            float thc = sqrtf(s.r2[i] - d2);
+            float t = tca - thc;
+            if (t < 0) t = tca + thc;
+            if (t < 0 || t >= tmax) continue;
+            tmax = t;
+            best = i - begin;
+        }
+        return best;
+    }
+
+    // picks the closest of the lanes flagged in mask, t holds the candidate distances
+    inline void resolve_lanes(unsigned mask, const float *t, int base, int &best, float &tmax) {
+        while (mask) {
+            int lane = lowest_lane(mask);
+            mask &= mask - 1;
+            if (t[lane] < tmax) {
+                tmax = t[lane];
+                best = base + lane;
+            }
+        }
+    }
+
+#ifdef SPHERE_SOA_X86
+    int kernel_sse(const SphereSoA &s, int begin, int count, const Vec3f &orig, const Vec3f &dir, float &tmax) {
+        const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+        const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128i lane_ids = _mm_setr_epi32(0, 1, 2, 3);
+        int best = -1;
+        alignas(16) float t[4];
+        for (int i = 0; i < count; i += 4) {
+            const int k = begin + i;
+            __m128 lx = _mm_sub_ps(_mm_loadu_ps(&s.cx[k]), ox);
+            __m128 ly = _mm_sub_ps(_mm_loadu_ps(&s.cy[k]), oy);
+            __m128 lz = _mm_sub_ps(_mm_loadu_ps(&s.cz[k]), oz);
+            __m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lz, dz), _mm_mul_ps(ly, dy)), _mm_mul_ps(lx, dx));
+            __m128 ll = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lz, lz), _mm_mul_ps(ly, ly)), _mm_mul_ps(lx, lx));
+            __m128 h = _mm_sub_ps(_mm_loadu_ps(&s.r2[k]), _mm_sub_ps(ll, _mm_mul_ps(tca, tca)));
+            __m128 thc = _mm_sqrt_ps(_mm_max_ps(h, zero));
+            __m128 t0 = _mm_sub_ps(tca, thc), t1 = _mm_add_ps(tca, thc);
+            __m128 behind = _mm_cmplt_ps(t0, zero);
+            __m128 tv = _mm_or_ps(_mm_and_ps(behind, t1), _mm_andnot_ps(behind, t0));
+            __m128 valid = _mm_and_ps(_mm_cmpge_ps(h, zero), _mm_cmpge_ps(tv, zero));
+            valid = _mm_and_ps(valid, _mm_cmplt_ps(tv, _mm_set1_ps(tmax)));
+            valid = _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmplt_epi32(lane_ids, _mm_set1_epi32(count - i))));
+            unsigned mask = _mm_movemask_ps(valid);
+            if (!mask) continue;
+            _mm_store_ps(t, tv);
+            resolve_lanes(mask, t, i, best, tmax);
+        }
+        return best;
+    }
+
+    __attribute__((target("avx2,fma")))
+    int kernel_avx2(const SphereSoA &s, int begin, int count, const Vec3f &orig, const Vec3f &dir, float &tmax) {
+        const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+        const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256i lane_ids = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        int best = -1;
+        alignas(32) float t[8];
+        for (int i = 0; i < count; i += 8) {
+            const int k = begin + i;
+            __m256 lx = _mm256_sub_ps(_mm256_loadu_ps(&s.cx[k]), ox);
+            __m256 ly = _mm256_sub_ps(_mm256_loadu_ps(&s.cy[k]), oy);
+            __m256 lz = _mm256_sub_ps(_mm256_loadu_ps(&s.cz[k]), oz);
+            __m256 tca = _mm256_fmadd_ps(lz, dz, _mm256_fmadd_ps(ly, dy, _mm256_mul_ps(lx, dx)));
+            __m256 ll = _mm256_fmadd_ps(lz, lz, _mm256_fmadd_ps(ly, ly, _mm256_mul_ps(lx, lx)));
+            __m256 h = _mm256_sub_ps(_mm256_loadu_ps(&s.r2[k]), _mm256_fnmadd_ps(tca, tca, ll));
+            __m256 thc = _mm256_sqrt_ps(_mm256_max_ps(h, zero));
+            __m256 t0 = _mm256_sub_ps(tca, thc), t1 = _mm256_add_ps(tca, thc);
+            __m256 tv = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+            __m256 valid = _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_GE_OQ), _mm256_cmp_ps(tv, zero, _CMP_GE_OQ));
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(tv, _mm256_set1_ps(tmax), _CMP_LT_OQ));
+            valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(count - i), lane_ids)));
+            unsigned mask = _mm256_movemask_ps(valid);
+            if (!mask) continue;
+            _mm256_store_ps(t, tv);
+            resolve_lanes(mask, t, i, best, tmax);
+        }
+        return best;
+    }
+
+    __attribute__((target("avx512f")))
+    int kernel_avx512(const SphereSoA &s, int begin, int count, const Vec3f &orig, const Vec3f &dir, float &tmax) {
+        const __m512 ox = _mm512_set1_ps(orig.x), oy = _mm512_set1_ps(orig.y), oz = _mm512_set1_ps(orig.z);
+        const __m512 dx = _mm512_set1_ps(dir.x), dy = _mm512_set1_ps(dir.y), dz = _mm512_set1_ps(dir.z);
+        const __m512 zero = _mm512_setzero_ps();
+        int best = -1;
+        alignas(64) float t[16];
+        for (int i = 0; i < count; i += 16) {
+            const int k = begin + i;
+            __mmask16 lanes = count - i >= 16 ? 0xffff : static_cast<__mmask16>((1u << (count - i)) - 1);
+            __m512 lx = _mm512_sub_ps(_mm512_loadu_ps(&s.cx[k]), ox);
+            __m512 ly = _mm512_sub_ps(_mm512_loadu_ps(&s.cy[k]), oy);
+            __m512 lz = _mm512_sub_ps(_mm512_loadu_ps(&s.cz[k]), oz);
+            __m512 tca = _mm512_fmadd_ps(lz, dz, _mm512_fmadd_ps(ly, dy, _mm512_mul_ps(lx, dx)));
+            __m512 ll = _mm512_fmadd_ps(lz, lz, _mm512_fmadd_ps(ly, ly, _mm512_mul_ps(lx, lx)));
+            __m512 h = _mm512_sub_ps(_mm512_loadu_ps(&s.r2[k]), _mm512_fnmadd_ps(tca, tca, ll));
+            // the maskz forms: GCC's _mm512_max_ps and _mm512_sqrt_ps start from _mm512_undefined_ps, which
+            // -Wmaybe-uninitialized reports; with every lane set they are the same instructions
+            __m512 thc = _mm512_maskz_sqrt_ps(0xffff, _mm512_maskz_max_ps(0xffff, h, zero));
+            __m512 t0 = _mm512_sub_ps(tca, thc), t1 = _mm512_add_ps(tca, thc);
+            __m512 tv = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t0, zero, _CMP_LT_OQ), t0, t1);
+            __mmask16 valid = _mm512_mask_cmp_ps_mask(lanes, h, zero, _CMP_GE_OQ);
+            valid = _mm512_mask_cmp_ps_mask(valid, tv, zero, _CMP_GE_OQ);
+            valid = _mm512_mask_cmp_ps_mask(valid, tv, _mm512_set1_ps(tmax), _CMP_LT_OQ);
+            if (!valid) continue;
+            _mm512_store_ps(t, tv);
+            resolve_lanes(valid, t, i, best, tmax);
+        }
+        return best;
+    }
+#endif
+
+#ifdef SPHERE_SOA_NEON
+    int kernel_neon(const SphereSoA &s, int begin, int count, const Vec3f &orig, const Vec3f &dir, float &tmax) {
+        const float32x4_t ox = vdupq_n_f32(orig.x), oy = vdupq_n_f32(orig.y), oz = vdupq_n_f32(orig.z);
+        const float32x4_t dx = vdupq_n_f32(dir.x), dy = vdupq_n_f32(dir.y), dz = vdupq_n_f32(dir.z);
+        const float32x4_t zero = vdupq_n_f32(0.f);
+        const int32_t ids[4] = {0, 1, 2, 3};
+        const int32x4_t lane_ids = vld1q_s32(ids);
+        const uint32x4_t bits = {1, 2, 4, 8};
+        int best = -1;
+        float t[4];
+        for (int i = 0; i < count; i += 4) {
+            const int k = begin + i;
+            float32x4_t lx = vsubq_f32(vld1q_f32(&s.cx[k]), ox);
+            float32x4_t ly = vsubq_f32(vld1q_f32(&s.cy[k]), oy);
+            float32x4_t lz = vsubq_f32(vld1q_f32(&s.cz[k]), oz);
+            float32x4_t tca = vfmaq_f32(vfmaq_f32(vmulq_f32(lx, dx), ly, dy), lz, dz);
+            float32x4_t ll = vfmaq_f32(vfmaq_f32(vmulq_f32(lx, lx), ly, ly), lz, lz);
+            float32x4_t h = vsubq_f32(vld1q_f32(&s.r2[k]), vfmsq_f32(ll, tca, tca));
+            float32x4_t thc = vsqrtq_f32(vmaxq_f32(h, zero));
+            float32x4_t t0 = vsubq_f32(tca, thc), t1 = vaddq_f32(tca, thc);
+            float32x4_t tv = vbslq_f32(vcltq_f32(t0, zero), t1, t0);
+            uint32x4_t valid = vandq_u32(vcgeq_f32(h, zero), vcgeq_f32(tv, zero));
+            valid = vandq_u32(valid, vcltq_f32(tv, vdupq_n_f32(tmax)));
+            valid = vandq_u32(valid, vcltq_s32(lane_ids, vdupq_n_s32(count - i)));
+            unsigned mask = vaddvq_u32(vandq_u32(valid, bits));
+            if (!mask) continue;
+            vst1q_f32(t, tv);
+            resolve_lanes(mask, t, i, best, tmax);
+        }
+        return best;
+    }
+#endif
+
+    struct KernelChoice {
+        SphereKernel kernel;
+        const char *name;
+    };
+
+    KernelChoice select_kernel() {
+        // SPHERE_KERNEL=scalar|sse|avx2 forces a narrower kernel, to compare against the reference loop
+        const char *forced = getenv("SPHERE_KERNEL");
+        std::string want = forced ? forced : "";
+        if (want == "scalar") return KernelChoice{kernel_scalar, "scalar"};
+#ifdef SPHERE_SOA_X86
+        __builtin_cpu_init();
+        bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        if (want == "sse" || !avx2) return KernelChoice{kernel_sse, "sse"};
+        if (want == "avx2" || !__builtin_cpu_supports("avx512f")) return KernelChoice{kernel_avx2, "avx2"};
+        return KernelChoice{kernel_avx512, "avx512"};
+#elif defined(SPHERE_SOA_NEON)
+        return KernelChoice{kernel_neon, "neon"};
+#else
+        return KernelChoice{kernel_scalar, "scalar"};
+#endif
+    }
+
+    const KernelChoice &kernel_choice() {
+        static const KernelChoice choice = select_kernel();
+        return choice;
+    }
+}
+
+SphereKernel sphere_kernel() {
+    return kernel_choice().kernel;
+}
+
+const char *sphere_kernel_name() {
+    return kernel_choice().name;
+}
@@ -0,0 +1,36 @@
+#ifndef __SPHERE_SOA_H__
+#define __SPHERE_SOA_H__
+#include <vector>
+#include <cstdint>
+#include "geometry.h"
+
+// Packed structure-of-arrays copy of the sphere geometry, stored in BVH leaf order so that a
+// leaf is a contiguous lane range. Only what the intersection needs is kept, materials are referenced by index.
+struct SphereSoA {
+    static const int padding = 16; // widest kernel, the arrays can always be read that far past a leaf
+
+    std::vector<float> cx, cy, cz, r2;
+    std::vector<float> inv_r;  // 1 / radius, the normal at a hit is (hit - center) * inv_r
+    std::vector<uint16_t> mat; // index in Scene::materials
+    std::vector<int> id;       // index of the sphere in Scene::spheres
+
+    void clear();
+    void push_back(const Vec3f &center, float radius, uint16_t material, int sphere_id);
+    void finalize(); // pad the arrays, call after the last push_back
+    void update(size_t i, const Vec3f &center, float radius); // moves the sphere of lane i
+    size_t size() const { return id.size(); }
+    size_t bytes() const {
+        return (cx.capacity() + cy.capacity() + cz.capacity() + r2.capacity() + inv_r.capacity()) * sizeof(float) +
+               mat.capacity() * sizeof(uint16_t) + id.capacity() * sizeof(int);
+    }
+};
+
+// Closest intersection among the spheres [begin, begin+count) closer than tmax.
+// Returns the lane of the closest hit and shrinks tmax, or -1.
+typedef int (*SphereKernel)(const SphereSoA &s, int begin, int count, const Vec3f &orig, const Vec3f &dir, float &tmax);
+
+// The best kernel for the host (scalar, SSE, AVX2, AVX-512 or NEON), chosen once at startup.
+SphereKernel sphere_kernel();
+const char *sphere_kernel_name();
+
+#endif //__SPHERE_SOA_H__
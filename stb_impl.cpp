@@ -0,0 +1,26 @@
+// third-party code, its warnings are not ours to fix
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "stb_image_write.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+
+#include "stb_image.h"
+
+#define STB_PERLIN_IMPLEMENTATION
+
+#include "stb_perlin.h"
+
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+
+#include "stb_image_resize.h"
+
+#define STB_DXT_IMPLEMENTATION
+
+#include "stb_dxt.h"
+
+#pragma GCC diagnostic pop
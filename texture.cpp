@@ -0,0 +1,132 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <vector>
+#include <mutex>
+#include "texture.h"
+#include "stb_perlin.h"
+
+namespace {
+    // The 20 lines through the center that cut the circle into the 40 segments of the rings, as the
+    // directions (cos, sin) of their angles in [0, pi): the segment of a point is found by a binary search
+    // on the side of these lines, with one cross product per step instead of an atan2.
+    struct RingSegments {
+        static const int lines = 20;
+        float c[lines], s[lines];
+
+        RingSegments() {
+            for (int k = 0; k < lines; k++) {
+                c[k] = static_cast<float>(cos(k * M_PI / lines));
+                s[k] = static_cast<float>(sin(k * M_PI / lines));
+            }
+        }
+
+        // floor(atan2(z, x) / (pi / 20)) is odd
+        bool odd(const float x, const float z) const {
+            const bool lower = z < 0;
+            const float zu = lower ? -z : z; // mirrored into the upper half, angle in [0, pi]
+            if (zu == 0 && x < 0) return false; // atan2 gives pi, segment 20
+            int k = 0;
+            for (int step = 16; step; step >>= 1) // the last line whose angle is at most that of (x, zu)
+                if (k + step < lines && zu * c[k + step] - x * s[k + step] >= 0) k += step;
+            return lower ? !(k & 1) : (k & 1); // below, the segment is -k - 1
+        }
+    };
+
+    const RingSegments ring_segments;
+
+    // params: center x, y, z and band width
+    float rings(const Vec3f &p, const float *params) {
+        // Ajustez ces valeurs pour modifier la densité et la complexité du motif.
+        Vec3f center(params[0], params[1], params[2]); // centre
+        float pattern_width = params[3]; // Bandes plus étroites pour une alternance plus fréquente
+        Vec3f diff = p - center;
+        float radius = diff.norm(); // Distance du centre
+
+        // Déterminez la couleur de la bague en fonction de la distance et de l'angle
+        bool distance_pattern = static_cast<int>(floor(radius / pattern_width)) % 2;
+        bool angle_pattern = ring_segments.odd(diff.x, diff.z); // Divise le cercle en 40 segments
+
+        //Combinez les motifs pour plus de variété
+        return (distance_pattern ^ angle_pattern) ? 1.f : 0.f; // Opération XOR pour un mélange de motifs intéressant
+    }
+
+    // params: cell size
+    float checker(const Vec3f &p, const float *params) {
+        const int i = static_cast<int>(std::floor(p.x / params[0])), k = static_cast<int>(std::floor(p.z / params[0]));
+        return (i + k) & 1 ? 1.f : 0.f;
+    }
+
+    // params: frequency, octaves (0 for a single one)
+    float perlin(const Vec3f &p, const float *params) {
+        const float f = params[0];
+        const float n = params[1] > 0 ? stb_perlin_fbm_noise3(p.x * f, p.y * f, p.z * f, 2.f, .5f, static_cast<int>(params[1]), 0, 0, 0)
+                                      : stb_perlin_noise3(p.x * f, p.y * f, p.z * f, 0, 0, 0);
+        return n * .5f + .5f;
+    }
+
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::string> names;
+        std::vector<TextureFn> functions;
+
+        Registry() {
+            add("rings", rings);
+            add("checker", checker);
+            add("perlin", perlin);
+        }
+
+        int add(const std::string &name, TextureFn fn) {
+            for (size_t i = 0; i < names.size(); i++) {
+                if (names[i] != name) continue;
+                functions[i] = fn;
+                return static_cast<int>(i);
+            }
+            names.push_back(name);
+            functions.push_back(fn);
+            return static_cast<int>(names.size() - 1);
+        }
+    };
+
+    Registry &registry() {
+        static Registry r;
+        return r;
+    }
+}
+
+int register_texture(const std::string &name, TextureFn fn) {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.add(name, fn);
+}
+
+int find_texture(const std::string &name) {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (size_t i = 0; i < r.names.size(); i++)
+        if (r.names[i] == name) return static_cast<int>(i);
+    return -1;
+}
+
+TextureFn texture_function(int id) { // no lock: textures are registered before rendering
+    return registry().functions[id];
+}
+
+TexturedSurface TexturedSurface::builtin(const std::string &name, uint16_t material_a, uint16_t material_b) {
+    TexturedSurface s;
+    s.texture = find_texture(name);
+    s.material_a = material_a;
+    s.material_b = material_b;
+    for (int i = 0; i < max_texture_params; i++) s.params[i] = 0;
+    if (name == "rings") {
+        s.params[0] = 0;
+        s.params[1] = -4;
+        s.params[2] = -18;
+        s.params[3] = 1;
+    } else if (name == "checker") {
+        s.params[0] = 1;
+    } else if (name == "perlin") {
+        s.params[0] = .7f;
+        s.params[1] = 4;
+    }
+    return s;
+}
@@ -0,0 +1,32 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+#include <string>
+#include <cstdint>
+#include "geometry.h"
+
+// Procedural textures are scalar fields over world space, evaluated once on the final closest hit.
+// params holds max_texture_params values whose meaning is up to the texture.
+const int max_texture_params = 6;
+typedef float (*TextureFn)(const Vec3f &p, const float *params);
+
+// Registers a texture under name and returns its id, an existing name is replaced.
+// Built in: "rings" (the snowman ground), "checker" and "perlin".
+int register_texture(const std::string &name, TextureFn fn);
+int find_texture(const std::string &name); // -1 if unknown
+TextureFn texture_function(int id);
+
+// A surface whose material is picked per point: material_a where the texture is below .5, material_b elsewhere.
+struct TexturedSurface {
+    int texture;
+    float params[max_texture_params];
+    uint16_t material_a, material_b;
+
+    // default parameters of the named built-in texture
+    static TexturedSurface builtin(const std::string &name, uint16_t material_a, uint16_t material_b);
+
+    uint16_t resolve(const Vec3f &p) const {
+        return texture_function(texture)(p, params) < .5f ? material_a : material_b;
+    }
+};
+
+#endif //__TEXTURE_H__
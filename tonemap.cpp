@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <cstring>
+#include "tonemap.h"
+#include "profile.h"
+
+#if defined(__SSE2__)
+#define TONEMAP_SSE
+#include <emmintrin.h>
+#endif
+
+namespace {
+    inline float tonemap_channel(float c, float scale, ToneMap op) {
+        switch (op) {
+            case TONEMAP_NORMALIZE: c = c * scale; break;
+            case TONEMAP_CLAMP: break;
+            case TONEMAP_REINHARD: c = c / (1.f + c); break;
+            case TONEMAP_ACES: c = (c * (2.51f * c + .03f)) / (c * (2.43f * c + .59f) + .14f); break;
+        }
+        return 255 * std::max(0.f, std::min(1.f, c));
+    }
+
+    inline void tonemap_pixel(const Vec3f &c, unsigned char *dst, ToneMap op) {
+        const float max = std::max(c.x, std::max(c.y, c.z));
+        const float scale = max > 1 ? 1.f / max : 1.f;
+        for (size_t j = 0; j < 3; j++) dst[j] = static_cast<unsigned char>(tonemap_channel(c[j], scale, op));
+    }
+
+#ifdef TONEMAP_SSE
+#define TONEMAP_SHUFFLE(i0, i1, i2, i3) _MM_SHUFFLE(i3, i2, i1, i0)
+    inline __m128 tonemap_channel4(__m128 c, __m128 scale, ToneMap op) {
+        const __m128 one = _mm_set1_ps(1.f);
+        switch (op) {
+            case TONEMAP_NORMALIZE: c = _mm_mul_ps(c, scale); break;
+            case TONEMAP_CLAMP: break;
+            case TONEMAP_REINHARD: c = _mm_div_ps(c, _mm_add_ps(one, c)); break;
+            case TONEMAP_ACES: {
+                __m128 num = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), c), _mm_set1_ps(.03f)));
+                __m128 den = _mm_add_ps(_mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), c), _mm_set1_ps(.59f))), _mm_set1_ps(.14f));
+                c = _mm_div_ps(num, den);
+                break;
+            }
+        }
+        return _mm_mul_ps(_mm_set1_ps(255.f), _mm_max_ps(_mm_setzero_ps(), _mm_min_ps(one, c)));
+    }
+
+    // 4 interleaved pixels, the 12 floats are deinterleaved into one register per channel
+    inline void tonemap_pixel4(const Vec3f *src, unsigned char *dst, ToneMap op) {
+        const float *f = &src[0].x;
+        const __m128 a = _mm_loadu_ps(f), b = _mm_loadu_ps(f + 4), c = _mm_loadu_ps(f + 8); // r0g0b0r1 g1b1r2g2 b2r3g3b3
+        const __m128 r = _mm_shuffle_ps(_mm_shuffle_ps(a, b, TONEMAP_SHUFFLE(0, 3, 0, 0)),
+                                        _mm_shuffle_ps(b, c, TONEMAP_SHUFFLE(2, 2, 1, 1)), TONEMAP_SHUFFLE(0, 1, 0, 2));
+        const __m128 g = _mm_shuffle_ps(_mm_shuffle_ps(a, b, TONEMAP_SHUFFLE(1, 1, 0, 0)),
+                                        _mm_shuffle_ps(b, c, TONEMAP_SHUFFLE(3, 3, 2, 2)), TONEMAP_SHUFFLE(0, 2, 0, 2));
+        const __m128 bl = _mm_shuffle_ps(_mm_shuffle_ps(a, b, TONEMAP_SHUFFLE(2, 2, 1, 1)),
+                                         _mm_shuffle_ps(c, c, TONEMAP_SHUFFLE(0, 0, 3, 3)), TONEMAP_SHUFFLE(0, 2, 0, 2));
+        const __m128 one = _mm_set1_ps(1.f);
+        const __m128 max = _mm_max_ps(r, _mm_max_ps(g, bl));
+        const __m128 over = _mm_cmpgt_ps(max, one);
+        const __m128 scale = _mm_or_ps(_mm_and_ps(over, _mm_div_ps(one, max)), _mm_andnot_ps(over, one));
+
+        int32_t q[3][4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(q[0]), _mm_cvttps_epi32(tonemap_channel4(r, scale, op)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(q[1]), _mm_cvttps_epi32(tonemap_channel4(g, scale, op)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(q[2]), _mm_cvttps_epi32(tonemap_channel4(bl, scale, op)));
+        for (int k = 0; k < 4; k++)
+            for (int j = 0; j < 3; j++) dst[k * 3 + j] = static_cast<unsigned char>(q[j][k]);
+    }
+#undef TONEMAP_SHUFFLE
+#endif
+}
+
+bool parse_tonemap(const char *name, ToneMap &op) {
+    static const char *names[] = {"normalize", "clamp", "reinhard", "aces"};
+    for (int i = 0; i < 4; i++) {
+        if (!strcmp(name, names[i])) {
+            op = static_cast<ToneMap>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void tonemap_pixels(const Vec3f *src, unsigned char *dst, size_t n, ToneMap op) {
+    size_t i = 0;
+#ifdef TONEMAP_SSE
+    for (; i + 4 <= n; i += 4) tonemap_pixel4(src + i, dst + i * 3, op);
+#endif
+    for (; i < n; i++) tonemap_pixel(src[i], dst + i * 3, op);
+}
+
+void tonemap_tile(const std::vector<Vec3f> &framebuffer, int width, const Tile &tile, std::vector<unsigned char> &pixmap, ToneMap op) {
+    for (int j = tile.y0; j < tile.y1; j++) {
+        const size_t row = tile.x0 + size_t(j) * width;
+        tonemap_pixels(&framebuffer[row], &pixmap[row * 3], tile.x1 - tile.x0, op);
+    }
+}
+
+void tonemap(const std::vector<Vec3f> &framebuffer, std::vector<unsigned char> &pixmap, ToneMap op) {
+    PROFILE_SCOPE("tonemap");
+    pixmap.resize(framebuffer.size() * 3);
+    const int chunk = 4096; // pixels per work item
+    const int nchunks = static_cast<int>((framebuffer.size() + chunk - 1) / chunk);
+#pragma omp parallel for
+    for (int c = 0; c < nchunks; c++) {
+        const size_t begin = size_t(c) * chunk;
+        const size_t n = std::min(framebuffer.size() - begin, size_t(chunk));
+        tonemap_pixels(&framebuffer[begin], &pixmap[begin * 3], n, op);
+    }
+}
+
+float heatmap(const std::vector<float> &values, std::vector<unsigned char> &pixmap) {
+    static const float palette[][3] = {{0, 0, 0}, {.23f, .04f, .42f}, {.73f, .21f, .33f}, {.98f, .55f, .04f}, {.99f, 1, .64f}};
+    const int nstops = sizeof(palette) / sizeof(palette[0]);
+
+    std::vector<float> sorted;
+    for (size_t i = 0; i < values.size(); i++)
+        if (values[i] > 0) sorted.push_back(values[i]);
+    float top = 0;
+    if (!sorted.empty()) {
+        std::vector<float>::iterator p = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+        std::nth_element(sorted.begin(), p, sorted.end());
+        top = *p;
+    }
+    const float scale = top > 0 ? (nstops - 1) / top : 0;
+
+    pixmap.resize(values.size() * 3);
+    for (size_t i = 0; i < values.size(); i++) {
+        const float x = std::min(float(nstops - 1), std::max(0.f, values[i] * scale));
+        const int k = std::min(nstops - 2, static_cast<int>(x));
+        const float f = x - k;
+        for (int c = 0; c < 3; c++)
+            pixmap[i * 3 + c] = static_cast<unsigned char>(255 * (palette[k][c] + (palette[k + 1][c] - palette[k][c]) * f));
+    }
+    return top;
+}
@@ -0,0 +1,31 @@
+#ifndef __TONEMAP_H__
+#define __TONEMAP_H__
+#include <vector>
+#include "geometry.h"
+#include "scheduler.h"
+
+enum ToneMap {
+    TONEMAP_NORMALIZE, // overexposed pixels are divided by their largest channel (the original behaviour)
+    TONEMAP_CLAMP,     // channels clamped to [0, 1]
+    TONEMAP_REINHARD,  // c / (1 + c)
+    TONEMAP_ACES       // Narkowicz's fit of the ACES filmic curve
+};
+
+// "normalize", "clamp", "reinhard" or "aces"; returns false for an unknown name
+bool parse_tonemap(const char *name, ToneMap &op);
+
+// Tone-maps n pixels and converts them to 8-bit RGB, 4 pixels at a time with SSE when available.
+void tonemap_pixels(const Vec3f *src, unsigned char *dst, size_t n, ToneMap op);
+
+// Only the pixels of the tile, so that it can run as soon as the tile is traced.
+void tonemap_tile(const std::vector<Vec3f> &framebuffer, int width, const Tile &tile, std::vector<unsigned char> &pixmap, ToneMap op);
+
+// The whole image, rows split among the OpenMP threads; pixmap is resized to 3 bytes per pixel.
+void tonemap(const std::vector<Vec3f> &framebuffer, std::vector<unsigned char> &pixmap, ToneMap op = TONEMAP_NORMALIZE);
+
+// False colors for a per-pixel scalar (the cost AOV of render.h): black for 0, then purple, red, orange and
+// pale yellow for the 99th percentile of the non-zero values and above, so that a few outliers do not
+// darken the rest. pixmap is resized to 3 bytes per pixel; returns that percentile.
+float heatmap(const std::vector<float> &values, std::vector<unsigned char> &pixmap);
+
+#endif //__TONEMAP_H__
@@ -0,0 +1,67 @@
+#ifndef __TRANSFORM_H__
+#define __TRANSFORM_H__
+#include <cmath>
+#include "geometry.h"
+
+// Similarity transform: rotation, uniform scale and translation, so that an instanced sphere is
+// still a sphere and the intersection kernels work unchanged in object space.
+struct Transform {
+    Vec3f rotation[3]; // rows of the rotation matrix
+    float scale;
+    Vec3f translation;
+
+    Transform() : scale(1) {
+        rotation[0] = Vec3f(1, 0, 0);
+        rotation[1] = Vec3f(0, 1, 0);
+        rotation[2] = Vec3f(0, 0, 1);
+    }
+
+    // rotation of angle radians around the vertical axis through pivot and scale around pivot, then translation
+    static Transform around_y(const Vec3f &pivot, float angle, float scale, const Vec3f &translation) {
+        Transform xf;
+        const float c = cosf(angle), s = sinf(angle);
+        xf.rotation[0] = Vec3f(c, 0, s);
+        xf.rotation[1] = Vec3f(0, 1, 0);
+        xf.rotation[2] = Vec3f(-s, 0, c);
+        xf.scale = scale;
+        xf.translation = pivot + translation - xf.to_world_dir(pivot) * scale;
+        return xf;
+    }
+
+    // rotation of angle radians around the z axis through pivot
+    static Transform around_z(const Vec3f &pivot, float angle) {
+        Transform xf;
+        const float c = cosf(angle), s = sinf(angle);
+        xf.rotation[0] = Vec3f(c, -s, 0);
+        xf.rotation[1] = Vec3f(s, c, 0);
+        xf.rotation[2] = Vec3f(0, 0, 1);
+        xf.translation = pivot - xf.to_world_dir(pivot);
+        return xf;
+    }
+
+    // In between a and b at t in [0, 1]: the translation and the scale are interpolated linearly and the
+    // rows of the rotation too, orthonormalized again, so that the result is still a similarity.
+    static Transform lerp(const Transform &a, const Transform &b, float t) {
+        Transform xf;
+        const Vec3f r0 = (a.rotation[0] * (1 - t) + b.rotation[0] * t).normalize();
+        Vec3f r1 = a.rotation[1] * (1 - t) + b.rotation[1] * t;
+        r1 = (r1 - r0 * (r1 * r0)).normalize();
+        xf.rotation[0] = r0;
+        xf.rotation[1] = r1;
+        xf.rotation[2] = cross(r0, r1);
+        xf.scale = a.scale * (1 - t) + b.scale * t;
+        xf.translation = a.translation * (1 - t) + b.translation * t;
+        return xf;
+    }
+
+    Vec3f to_world_dir(const Vec3f &d) const {
+        return Vec3f(rotation[0] * d, rotation[1] * d, rotation[2] * d);
+    }
+    Vec3f to_object_dir(const Vec3f &d) const { // transposed rotation
+        return rotation[0] * d.x + rotation[1] * d.y + rotation[2] * d.z;
+    }
+    Vec3f to_world_point(const Vec3f &p) const { return to_world_dir(p) * scale + translation; }
+    Vec3f to_object_point(const Vec3f &p) const { return to_object_dir(p - translation) * (1.f / scale); }
+};
+
+#endif //__TRANSFORM_H__
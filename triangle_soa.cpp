@@ -0,0 +1,184 @@
+#include <cstdlib>
+#include <string>
+#include "triangle_soa.h"
+#include "bvh.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRIANGLE_SOA_X86
+#include <immintrin.h>
+#endif
+
+void TriangleSoA::build(const std::vector<int> &order, const Vec3f *verts, const Vec3i *faces) {
+    const size_t n = order.size();
+    std::vector<float> coords(n + padding, 0.f); // the padding lanes are degenerate, never hit
+    for (size_t v = 0; v < 3; v++) {
+        for (size_t k = 0; k < 3; k++) {
+            for (size_t i = 0; i < n; i++) coords[i] = verts[faces[order[i]][v]][k];
+            std::vector<float> lanes(coords);
+            p[v][k].own(lanes);
+        }
+    }
+    std::vector<int> ids(order);
+    face.own(ids);
+}
+
+bool intersect_triangle(const TriangleRay &ray, const Vec3f &a, const Vec3f &b, const Vec3f &c, float &t) {
+    const Vec3f A = a - ray.orig, B = b - ray.orig, C = c - ray.orig;
+    const float ax = A[ray.kx] - ray.sx * A[ray.kz], ay = A[ray.ky] - ray.sy * A[ray.kz];
+    const float bx = B[ray.kx] - ray.sx * B[ray.kz], by = B[ray.ky] - ray.sy * B[ray.kz];
+    const float cx = C[ray.kx] - ray.sx * C[ray.kz], cy = C[ray.ky] - ray.sy * C[ray.kz];
+    const float u = cx * by - cy * bx, v = ax * cy - ay * cx, w = bx * ay - by * ax;
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+    const float det = u + v + w;
+    if (det == 0) return false; // seen edge on
+    t = (u * A[ray.kz] + v * B[ray.kz] + w * C[ray.kz]) * ray.sz / det;
+    return t > 1e-5f;
+}
+
+namespace {
+    int kernel_scalar(const TriangleSoA &s, int begin, int count, const TriangleRay &ray, float &tmax) {
+        int best = -1;
+        for (int i = begin; i < begin + count; i++) {
+            const Vec3f a(s.p[0][0][i], s.p[0][1][i], s.p[0][2][i]);
+            const Vec3f b(s.p[1][0][i], s.p[1][1][i], s.p[1][2][i]);
+            const Vec3f c(s.p[2][0][i], s.p[2][1][i], s.p[2][2][i]);
+            float t;
+            if (!intersect_triangle(ray, a, b, c, t) || t >= tmax) continue;
+            tmax = t;
+            best = i - begin;
+        }
+        return best;
+    }
+
+    // picks the closest of the lanes flagged in mask, t holds the candidate distances
+    inline void resolve_lanes(unsigned mask, const float *t, int base, int &best, float &tmax) {
+        while (mask) {
+            int lane = lowest_lane(mask);
+            mask &= mask - 1;
+            if (t[lane] < tmax) {
+                tmax = t[lane];
+                best = base + lane;
+            }
+        }
+    }
+
+#ifdef TRIANGLE_SOA_X86
+    // the vertex coordinates along the permuted axes of the ray
+    struct PermutedLanes {
+        const float *x[3], *y[3], *z[3];
+
+        PermutedLanes(const TriangleSoA &s, const TriangleRay &ray) {
+            for (int v = 0; v < 3; v++) {
+                x[v] = s.p[v][ray.kx].data();
+                y[v] = s.p[v][ray.ky].data();
+                z[v] = s.p[v][ray.kz].data();
+            }
+        }
+    };
+
+    int kernel_sse(const TriangleSoA &s, int begin, int count, const TriangleRay &ray, float &tmax) {
+        const PermutedLanes p(s, ray);
+        const __m128 ox = _mm_set1_ps(ray.orig[ray.kx]), oy = _mm_set1_ps(ray.orig[ray.ky]), oz = _mm_set1_ps(ray.orig[ray.kz]);
+        const __m128 sx = _mm_set1_ps(ray.sx), sy = _mm_set1_ps(ray.sy), sz = _mm_set1_ps(ray.sz);
+        const __m128 zero = _mm_setzero_ps(), eps = _mm_set1_ps(1e-5f);
+        const __m128i lane_ids = _mm_setr_epi32(0, 1, 2, 3);
+        int best = -1;
+        alignas(16) float t[4];
+        for (int i = 0; i < count; i += 4) {
+            const int k = begin + i;
+            __m128 x[3], y[3], z[3];
+            for (int v = 0; v < 3; v++) { // sheared vertices, relative to the origin
+                z[v] = _mm_sub_ps(_mm_loadu_ps(p.z[v] + k), oz);
+                x[v] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(p.x[v] + k), ox), _mm_mul_ps(sx, z[v]));
+                y[v] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(p.y[v] + k), oy), _mm_mul_ps(sy, z[v]));
+            }
+            const __m128 u = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+            const __m128 v = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+            const __m128 w = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+            const __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+            const __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+            const __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+            const __m128 num = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, z[0]), _mm_mul_ps(v, z[1])), _mm_mul_ps(w, z[2]));
+            const __m128 tv = _mm_div_ps(_mm_mul_ps(num, sz), det);
+            __m128 valid = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+            valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(tv, eps), _mm_cmplt_ps(tv, _mm_set1_ps(tmax))));
+            valid = _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmplt_epi32(lane_ids, _mm_set1_epi32(count - i))));
+            const unsigned mask = _mm_movemask_ps(valid);
+            if (!mask) continue;
+            _mm_store_ps(t, tv);
+            resolve_lanes(mask, t, i, best, tmax);
+        }
+        return best;
+    }
+
+    // FMA would round the edge functions differently for the two triangles of an edge, plain products here
+    __attribute__((target("avx2")))
+    int kernel_avx2(const TriangleSoA &s, int begin, int count, const TriangleRay &ray, float &tmax) {
+        const PermutedLanes p(s, ray);
+        const __m256 ox = _mm256_set1_ps(ray.orig[ray.kx]), oy = _mm256_set1_ps(ray.orig[ray.ky]), oz = _mm256_set1_ps(ray.orig[ray.kz]);
+        const __m256 sx = _mm256_set1_ps(ray.sx), sy = _mm256_set1_ps(ray.sy), sz = _mm256_set1_ps(ray.sz);
+        const __m256 zero = _mm256_setzero_ps(), eps = _mm256_set1_ps(1e-5f);
+        const __m256i lane_ids = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        int best = -1;
+        alignas(32) float t[8];
+        for (int i = 0; i < count; i += 8) {
+            const int k = begin + i;
+            __m256 x[3], y[3], z[3];
+            for (int v = 0; v < 3; v++) {
+                z[v] = _mm256_sub_ps(_mm256_loadu_ps(p.z[v] + k), oz);
+                x[v] = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(p.x[v] + k), ox), _mm256_mul_ps(sx, z[v]));
+                y[v] = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(p.y[v] + k), oy), _mm256_mul_ps(sy, z[v]));
+            }
+            const __m256 u = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+            const __m256 v = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+            const __m256 w = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+            const __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                                                 _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+            const __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+                                                 _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+            const __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+            const __m256 num = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, z[0]), _mm256_mul_ps(v, z[1])), _mm256_mul_ps(w, z[2]));
+            const __m256 tv = _mm256_div_ps(_mm256_mul_ps(num, sz), det);
+            __m256 valid = _mm256_andnot_ps(_mm256_and_ps(negative, positive), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+            valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(tv, eps, _CMP_GT_OQ), _mm256_cmp_ps(tv, _mm256_set1_ps(tmax), _CMP_LT_OQ)));
+            valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(count - i), lane_ids)));
+            const unsigned mask = _mm256_movemask_ps(valid);
+            if (!mask) continue;
+            _mm256_store_ps(t, tv);
+            resolve_lanes(mask, t, i, best, tmax);
+        }
+        return best;
+    }
+#endif
+
+    struct KernelChoice {
+        TriangleKernel kernel;
+        const char *name;
+    };
+
+    KernelChoice select_kernel() {
+        const char *forced = getenv("TRIANGLE_KERNEL");
+        std::string want = forced ? forced : "";
+        if (want == "scalar") return KernelChoice{kernel_scalar, "scalar"};
+#ifdef TRIANGLE_SOA_X86
+        __builtin_cpu_init();
+        if (want == "sse" || !__builtin_cpu_supports("avx2")) return KernelChoice{kernel_sse, "sse"};
+        return KernelChoice{kernel_avx2, "avx2"};
+#else
+        return KernelChoice{kernel_scalar, "scalar"};
+#endif
+    }
+
+    const KernelChoice &kernel_choice() {
+        static const KernelChoice choice = select_kernel();
+        return choice;
+    }
+}
+
+TriangleKernel triangle_kernel() {
+    return kernel_choice().kernel;
+}
+
+const char *triangle_kernel_name() {
+    return kernel_choice().name;
+}
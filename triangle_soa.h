@@ -0,0 +1,56 @@
+#ifndef __TRIANGLE_SOA_H__
+#define __TRIANGLE_SOA_H__
+#include <vector>
+#include <cmath>
+#include "geometry.h"
+#include "mapped_file.h"
+
+// Triangle vertices as structure of arrays in BVH leaf order, as SphereSoA: a leaf of the mesh BVH is a
+// lane range that a kernel tests in one pass. The arrays are owned, or mapped from the mesh cache.
+struct TriangleSoA {
+    static const int padding = 8; // widest kernel
+
+    MappedArray<float> p[3][3]; // [vertex][axis]
+    MappedArray<int> face;      // index of the triangle in the model
+
+    // fills the lanes with the triangles in the order of `order`, faces indexing verts
+    void build(const std::vector<int> &order, const Vec3f *verts, const Vec3i *faces);
+    size_t size() const { return face.size(); }
+    size_t bytes() const { return 9 * p[0][0].size() * sizeof(float) + face.size() * sizeof(int); } // owned or mapped
+};
+
+// A ray prepared for the watertight test of Woop, Benthin and Wald (2013): the axes are permuted so that
+// z is the largest component of the direction, and the vertices are sheared so that the ray is the z axis.
+// The edge functions of neighbouring triangles then use the same products for their shared edge, so that
+// no ray passes between them.
+struct TriangleRay {
+    Vec3f orig;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    TriangleRay() : kx(0), ky(1), kz(2), sx(0), sy(0), sz(1) {}
+    TriangleRay(const Vec3f &o, const Vec3f &dir) : orig(o) {
+        const float ax = std::fabs(dir.x), ay = std::fabs(dir.y), az = std::fabs(dir.z);
+        kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (dir[kz] < 0) std::swap(kx, ky); // keeps the winding
+        sx = dir[kx] / dir[kz];
+        sy = dir[ky] / dir[kz];
+        sz = 1.f / dir[kz];
+    }
+};
+
+// Closest hit among the triangles [begin, begin+count) farther than 1e-5 and closer than tmax.
+// Returns the lane of the closest hit and shrinks tmax, or -1. Both facings are hit.
+typedef int (*TriangleKernel)(const TriangleSoA &s, int begin, int count, const TriangleRay &ray, float &tmax);
+
+// The best kernel for the host (scalar, SSE or AVX2), chosen once at startup; TRIANGLE_KERNEL=scalar|sse
+// forces a narrower one.
+TriangleKernel triangle_kernel();
+const char *triangle_kernel_name();
+
+// the scalar test of one triangle, the reference of the kernels
+bool intersect_triangle(const TriangleRay &ray, const Vec3f &a, const Vec3f &b, const Vec3f &c, float &t);
+
+#endif //__TRIANGLE_SOA_H__
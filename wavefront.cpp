@@ -0,0 +1,296 @@
+#include <cmath>
+#include <algorithm>
+#include "wavefront.h"
+#include "numa.h"
+
+namespace {
+    const int wave_tile = 32;         // a wave starts with the 32x32 primary rays of a tile
+    const size_t shadow_batch = 4096; // shadow rays queued before they are traced
+    const int min_packet = 8;         // shorter runs of rays with the same sort key are traced one by one
+
+    // rays waiting for the extend stage, cones as PendingRay
+    struct RayQueue {
+        std::vector<float> ox, oy, oz, dx, dy, dz, weight, width, spread;
+        std::vector<int> pixel, depth; // pixel inside the tile
+
+        size_t size() const { return pixel.size(); }
+        Vec3f orig(const size_t i) const { return Vec3f(ox[i], oy[i], oz[i]); }
+        Vec3f dir(const size_t i) const { return Vec3f(dx[i], dy[i], dz[i]); }
+
+        void push(const Vec3f &o, const Vec3f &d, const float w, const float cone_width, const float cone_spread, const int p, const int dp) {
+            ox.push_back(o.x); oy.push_back(o.y); oz.push_back(o.z);
+            dx.push_back(d.x); dy.push_back(d.y); dz.push_back(d.z);
+            weight.push_back(w);
+            width.push_back(cone_width);
+            spread.push_back(cone_spread);
+            pixel.push_back(p);
+            depth.push_back(dp);
+        }
+
+        void clear() {
+            ox.clear(); oy.clear(); oz.clear();
+            dx.clear(); dy.clear(); dz.clear();
+            weight.clear();
+            width.clear();
+            spread.clear();
+            pixel.clear();
+            depth.clear();
+        }
+    };
+
+    // shadow rays, with what they add to their pixel when nothing blocks them
+    struct ShadowQueue {
+        std::vector<float> ox, oy, oz, dx, dy, dz, tmax, r, g, b;
+        std::vector<int> pixel, light;
+
+        size_t size() const { return pixel.size(); }
+
+        void push(const Vec3f &o, const Vec3f &d, const float t, const Vec3f &c, const int p, const int l) {
+            ox.push_back(o.x); oy.push_back(o.y); oz.push_back(o.z);
+            dx.push_back(d.x); dy.push_back(d.y); dz.push_back(d.z);
+            tmax.push_back(t);
+            r.push_back(c.x); g.push_back(c.y); b.push_back(c.z);
+            pixel.push_back(p);
+            light.push_back(l);
+        }
+
+        void clear() {
+            ox.clear(); oy.clear(); oz.clear();
+            dx.clear(); dy.clear(); dz.clear();
+            tmax.clear();
+            r.clear(); g.clear(); b.clear();
+            pixel.clear();
+            light.clear();
+        }
+    };
+
+    // The queues of one thread, reused from tile to tile.
+    struct Wave {
+        RayQueue rays, next;
+        ShadowQueue shadows;
+        std::vector<HitRecord> rec;
+        std::vector<Hit> hit;
+        std::vector<int> key, order; // sort keys of the extend or shade stage, queue indices in their order
+        std::vector<int> shadow_order;
+        std::vector<Vec3f> color;    // radiance gathered by the pixels of the tile
+    };
+
+    // 3 bits per direction component, the sign being the highest: rays with the same key visit the BVH nodes in the same order
+    inline int direction_key(const float dx, const float dy, const float dz) {
+        const int qx = std::max(0, std::min(7, static_cast<int>((dx + 1) * 4)));
+        const int qy = std::max(0, std::min(7, static_cast<int>((dy + 1) * 4)));
+        const int qz = std::max(0, std::min(7, static_cast<int>((dz + 1) * 4)));
+        return qx << 6 | qy << 3 | qz;
+    }
+
+    // order = 0 .. n-1 sorted by key, stable so that the rays of one key stay in pixel order
+    void sort_order(const std::vector<int> &key, const size_t n, std::vector<int> &order) {
+        order.resize(n);
+        for (size_t i = 0; i < n; i++) order[i] = static_cast<int>(i);
+        std::stable_sort(order.begin(), order.end(), [&key](int a, int b) { return key[a] < key[b]; });
+    }
+
+    // Calls trace(first, m) on the runs of order that share a key, cut in pieces of at most max_packet.
+    template<typename Trace>
+    void for_each_run(const std::vector<int> &key, const std::vector<int> &order, Trace trace) {
+        for (size_t begin = 0; begin < order.size();) {
+            size_t end = begin + 1;
+            while (end < order.size() && end - begin < static_cast<size_t>(max_packet) && key[order[end]] == key[order[begin]]) end++;
+            trace(&order[begin], static_cast<int>(end - begin));
+            begin = end;
+        }
+    }
+
+    // Shadow stage: traces the queued shadow rays light by light, the rays of a light in packets,
+    // and adds the contributions of the ones that get through.
+    void trace_shadows(Wave &w, const Scene &scene) {
+        ShadowQueue &q = w.shadows;
+        const size_t n = q.size();
+        if (!n) return;
+        PROFILE_PHASE(PHASE_SHADOW);
+        thread_ray_counters().shadow += n;
+        sort_order(q.light, n, w.shadow_order);
+        for_each_run(q.light, w.shadow_order, [&](const int *index, const int m) {
+            Vec3f orig[max_packet], dir[max_packet];
+            float tmax[max_packet];
+            bool occluded[max_packet];
+            for (int k = 0; k < m; k++) {
+                const int i = index[k];
+                orig[k] = Vec3f(q.ox[i], q.oy[i], q.oz[i]);
+                dir[k] = Vec3f(q.dx[i], q.dy[i], q.dz[i]);
+                tmax[k] = q.tmax[i];
+            }
+            if (m < min_packet) {
+                for (int k = 0; k < m; k++) occluded[k] = scene_occluded(orig[k], dir[k], tmax[k], scene);
+            } else {
+                scene_occluded_packet(m, orig, dir, tmax, scene, occluded);
+            }
+            for (int k = 0; k < m; k++) {
+                if (occluded[k]) continue;
+                const int i = index[k];
+                w.color[q.pixel[i]] = w.color[q.pixel[i]] + Vec3f(q.r[i], q.g[i], q.b[i]);
+            }
+        });
+        q.clear();
+    }
+
+    // Extend stage: sorts the rays by direction and finds their closest hits, in packets for the runs of rays
+    // going the same way. Rays deeper than the depth limit are counted but not traced, they see the background like in cast_ray.
+    void extend(Wave &w, const Scene &scene) {
+        PROFILE_PHASE(PHASE_TRACE);
+        const RayQueue &q = w.rays;
+        const size_t n = q.size();
+        RayCounters &counters = thread_ray_counters();
+        w.key.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            counters.count_ray(q.depth[i]);
+            w.key[i] = q.depth[i] > static_cast<int>(scene.depth_limit) ? -1 : direction_key(q.dx[i], q.dy[i], q.dz[i]);
+        }
+        sort_order(w.key, n, w.order);
+        w.rec.assign(n, HitRecord());
+
+        for_each_run(w.key, w.order, [&](const int *index, const int m) {
+            if (w.key[index[0]] < 0) return;
+            if (m < min_packet) {
+                for (int k = 0; k < m; k++) {
+                    const int i = index[k];
+                    if (!scene_closest_hit(q.orig(i), q.dir(i), scene, w.rec[i])) w.rec[i] = HitRecord();
+                }
+                return;
+            }
+            Vec3f orig[max_packet], dir[max_packet];
+            bool hits[max_packet];
+            HitRecord rec[max_packet];
+            for (int k = 0; k < m; k++) {
+                orig[k] = q.orig(index[k]);
+                dir[k] = q.dir(index[k]);
+            }
+            scene_closest_hit_packet(m, orig, dir, scene, hits, rec);
+            for (int k = 0; k < m; k++)
+                if (hits[k]) w.rec[index[k]] = rec[k];
+        });
+    }
+
+    // queues the shadow ray towards a point of light l, carrying the unshadowed contribution of the light times weight
+    void queue_light_sample(Wave &w, const Scene &scene, const int l, const Vec3f &position, const float weight, const Vec3f &dir,
+                            const Hit &hit, const Material &material, const int pixel) {
+        const Light &light = scene.lights[l];
+        const Vec3f &point = hit.point, &N = hit.N;
+        const Vec3f to_light = position - point;
+        const Vec3f light_dir = scene.fast_shading ? fast_normalized(to_light) : normalized(to_light);
+        const float cosine = light_dir * N;
+        const float intensity = light.intensity * weight;
+        const float lobe = std::max(0.f, -reflect(-light_dir, N) * dir);
+        const float diffuse = material.lobes & LOBE_DIFFUSE ? intensity * std::max(0.f, cosine) : 0.f;
+        const float specular = !(material.lobes & LOBE_SPECULAR) ? 0.f
+                               : (scene.fast_shading ? fast_pow(lobe, material.specular_exponent)
+                                                     : powf(lobe, material.specular_exponent)) * intensity;
+        if (diffuse <= 0 && specular <= 0) return; // nothing for the shadow ray to decide
+        const Vec3f contribution = diffuse_color(scene, hit, material) * diffuse * material.albedo[0] + Vec3f(1., 1., 1.) * specular * material.albedo[1];
+        const Vec3f shadow_orig = leave_surface(point, N, light_dir);
+        w.shadows.push(shadow_orig, light_dir, to_light.norm(), contribution, pixel, l);
+        if (w.shadows.size() >= shadow_batch) trace_shadows(w, scene);
+    }
+
+    // queues the shadow rays towards light l, one per stratum of an area light (the batched shadow rays
+    // leave no room for the corner probes of shade_light)
+    void queue_light(Wave &w, const Scene &scene, const int l, const float weight, const Vec3f &dir, const Hit &hit,
+                     const Material &material, const int pixel) {
+        const Light &light = scene.lights[l];
+        for (int s = 0; s < light.samples; s++) {
+            const Vec3f position = light.area() ? light.sample(hit.point, s, random_float(), random_float(), scene.fast_shading) : light.position;
+            queue_light_sample(w, scene, l, position, weight / light.samples, dir, hit, material, pixel);
+        }
+    }
+
+    // Shade stage: the misses add the background, the hits are grouped by material, then queue their
+    // continuations in w.next and their shadow rays, with the same light sampling as direct_lighting.
+    void shade(Wave &w, const Scene &scene) {
+        PROFILE_PHASE(PHASE_SHADE); // paused while the shadow batches are traced
+        const RayQueue &q = w.rays;
+        const size_t n = q.size();
+        w.hit.resize(n);
+        w.key.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            const Vec3f dir = q.dir(i);
+            if (w.rec[i].kind == HIT_NONE) {
+                w.color[q.pixel[i]] = w.color[q.pixel[i]] + background(scene, dir, q.spread[i]) * q.weight[i];
+                w.key[i] = -1;
+                continue;
+            }
+            surface_interaction(q.orig(i), dir, scene, w.rec[i], w.hit[i], q.width[i] + q.spread[i] * w.rec[i].t);
+            w.key[i] = w.hit[i].material;
+        }
+        sort_order(w.key, n, w.order);
+
+        const size_t nlights = scene.lights.size();
+        const bool sampled = scene.samples_lights();
+        for (size_t k = 0; k < n; k++) {
+            const int i = w.order[k];
+            if (w.key[i] < 0) continue;
+            const Hit &hit = w.hit[i];
+            const Material &material = scene.materials[hit.material];
+            const Vec3f dir = q.dir(i);
+            PendingRay continuations[2];
+            int sp = 0;
+            push_secondary(scene, PendingRay{q.orig(i), dir, q.weight[i], static_cast<size_t>(q.depth[i]), q.width[i], q.spread[i], 0.f, 0, 0},
+                           hit, material, continuations, sp);
+            for (int c = 0; c < sp; c++) {
+                const PendingRay &r = continuations[c];
+                w.next.push(r.orig, r.dir, r.weight, r.width, r.spread, q.pixel[i], q.depth[i] + 1);
+            }
+            if (!has_direct_lighting(material)) continue;
+            // the envmap samples trace their shadow rays here, one by one
+            w.color[q.pixel[i]] = w.color[q.pixel[i]] + envmap_lighting(hit, material, scene) * q.weight[i];
+            if (sampled) {
+                for (int s = 0; s < scene.light_samples; s++) {
+                    float pdf;
+                    const int l = scene.light_tree.sample(hit.point, hit.N, random_float(), pdf);
+                    queue_light(w, scene, l, q.weight[i] / (pdf * scene.light_samples), dir, hit, material, q.pixel[i]);
+                }
+            } else {
+                for (size_t l = 0; l < nlights; l++)
+                    queue_light(w, scene, static_cast<int>(l), q.weight[i], dir, hit, material, q.pixel[i]);
+            }
+        }
+        trace_shadows(w, scene);
+    }
+}
+
+std::vector<ThreadStats> render_wavefront(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer,
+                                          const std::function<void(const Tile &)> &tile_done) {
+    PROFILE_SCOPE("render wavefront");
+    framebuffer.resize(width * height);
+    if (numa_pinned()) release_pages(framebuffer.data(), framebuffer.size() * sizeof(Vec3f)); // placed by the tiles
+    std::vector<Tile> tiles = make_tiles(width, height, wave_tile);
+    const ImagePlane plane(scene.camera, width, height);
+    return parallel_for_tiles(tiles, [&](const Tile &tile) {
+        static thread_local Wave w;
+        const int tw = tile.x1 - tile.x0;
+        seed_random(PixelSampler(tile.x0, tile.y0, 0).seed(2)); // the rays of a tile are in the same order on any thread
+        w.color.assign(tw * (tile.y1 - tile.y0), Vec3f());
+
+        // generate: the camera rays in pixel order
+        w.rays.clear();
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                Vec3f orig, dir;
+                plane.ray(i + .5f, j + .5f, orig, dir);
+                w.rays.push(orig, dir, 1.f, 0.f, plane.spread(), (i - tile.x0) + (j - tile.y0) * tw, 0);
+            }
+        }
+        // the wave stops once no path continues
+        const Scene &local = local_scene(scene);
+        while (w.rays.size()) {
+            w.next.clear();
+            extend(w, local);
+            shade(w, local);
+            std::swap(w.rays, w.next);
+        }
+
+        for (int j = tile.y0; j < tile.y1; j++)
+            for (int i = tile.x0; i < tile.x1; i++)
+                framebuffer[i + j * width] = w.color[(i - tile.x0) + (j - tile.y0) * tw];
+        if (tile_done) tile_done(tile);
+    });
+}
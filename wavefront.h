@@ -0,0 +1,17 @@
+#ifndef __WAVEFRONT_H__
+#define __WAVEFRONT_H__
+#include <vector>
+#include <functional>
+#include "render.h"
+
+// Wavefront path tracer, an alternative to render() that computes the same estimate. Instead of following
+// each path to its end one pixel after the other, every ray of a tile goes through one stage at a time:
+// generate (camera rays), extend (closest hits), shade (continuations and shadow rays) and shadow
+// (occlusion), each stage reading and filling structure-of-arrays queues. Between the stages, the rays are
+// sorted by direction before their closest hits, the hits by material before shading and the shadow rays
+// by light, so that every stage runs over coherent batches: packet traversals, one material at a time.
+// Scene::fast_shading also applies, with fast_normalized and fast_pow on every light.
+std::vector<ThreadStats> render_wavefront(const Scene &scene, const int width, const int height, std::vector<Vec3f> &framebuffer,
+                                          const std::function<void(const Tile &)> &tile_done = std::function<void(const Tile &)>());
+
+#endif //__WAVEFRONT_H__